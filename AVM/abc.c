@@ -0,0 +1,35 @@
+#include "abc.h"
+
+unsigned char abcResultKinds[4] = ABC_RESULT_KINDS;
+
+int abc_encode(abc_instruction *out, unsigned opcode, unsigned implied, const unsigned kinds[3], const unsigned vals[3]) {
+    unsigned k, result = 0;
+    for (k = 0; k < 3; k++) if (vals[k] > 0xFFFF) return 0;
+    // a nibble of 15 in both places would read as ABC_WIDE
+    if (kinds[1] >= 15 || kinds[2] >= 15) return 0;
+    if (implied == ABC_VARIABLE) {
+        for (result = 0; result < 4 && abcResultKinds[result] != kinds[0]; result++);
+        if (result == 4) return 0;
+    }
+    else if (kinds[0] != implied) return 0;
+    out->opcode = opcode | result << ABC_RESULT_SHIFT;
+    out->kinds = kinds[1] | kinds[2] << 4;
+    out->result = vals[0];
+    out->arg1 = vals[1];
+    out->arg2 = vals[2];
+    return 1;
+}
+
+void abc_encode_wide(abc_instruction *out, unsigned opcode, unsigned index, abc_wide *wide, const unsigned kinds[3], const unsigned vals[3]) {
+    unsigned k;
+    for (k = 0; k < 3; k++) {
+        wide->kinds[k] = kinds[k];
+        wide->vals[k] = vals[k];
+    }
+    wide->unused = 0;
+    out->opcode = opcode;
+    out->kinds = ABC_WIDE;
+    out->result = 0;
+    out->arg1 = index & 0xFFFF;
+    out->arg2 = index >> 16;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+/*
+ * Layout of a mapped .abc binary, shared by the writer and the reader.
+ * Every section starts at an 8-byte aligned offset from the start of the
+ * file, so the VM can map the file and use the string blob, the numbers, the
+ * code and the line table where they lie instead of copying them:
+ *
+ *   header | string offsets | numbers | userfuncs | libfuncs | code | wide | lines | string blob
+ *
+ * All strings (constants, then function names) are NUL terminated in one
+ * blob and referred to by their offset in it. Version 1 binaries start with
+ * MAGICNUMBER and are still read field by field. Version 2 had no wide
+ * section and 28-byte instructions; its tables are copied out of the file and
+ * its code packed as it is read.
+ *
+ * Instructions take 8 bytes. The low 6 bits of the opcode byte are the
+ * opcode, the top 2 the kind of a variable result (global, formal, local,
+ * retval); jumps have a label and funcenter/funcexit a userfunc as result,
+ * which is implied. The next byte holds the kinds of arg1 and arg2, then
+ * come three 16-bit operand values. An instruction with a larger value or a
+ * result of another kind has ABC_WIDE as its kinds byte and its operands in
+ * a 16-byte abc_wide entry, at index arg1 | arg2 << 16.
+ */
+
+#define ABC_MAGIC_V2 0x32636261		// "abc2"
+#define ABC_VERSION 3
+#define ABC_VERSION_V2 2
+#define ABC_ALIGN(n) (((n) + 7u) & ~7u)
+
+typedef struct abc_header {
+	unsigned magic;
+	unsigned version;
+	unsigned fileSize;
+	unsigned globals;		// GlobalProgrammVarOffset
+	unsigned totalStrings;
+	unsigned strings;		// unsigned[totalStrings], blob offsets
+	unsigned totalNumbers;
+	unsigned numbers;		// double[totalNumbers]
+	unsigned totalUserFuncs;
+	unsigned userFuncs;		// abc_userfunc[totalUserFuncs]
+	unsigned totalLibFuncs;
+	unsigned libFuncs;		// unsigned[totalLibFuncs], blob offsets
+	unsigned codeSize;
+	unsigned instrSize;		// sizeof(abc_instruction)
+	unsigned code;
+	unsigned totalWide;
+	unsigned wide;			// abc_wide[totalWide]
+	unsigned lines;			// unsigned[codeSize], source line of each instruction
+	unsigned blob;
+	unsigned blobSize;
+} abc_header;
+
+// the header of version 2, without totalWide and wide
+typedef struct abc_header_v2 {
+	unsigned magic;
+	unsigned version;
+	unsigned fileSize;
+	unsigned globals;
+	unsigned totalStrings;
+	unsigned strings;
+	unsigned totalNumbers;
+	unsigned numbers;
+	unsigned totalUserFuncs;
+	unsigned userFuncs;
+	unsigned totalLibFuncs;
+	unsigned libFuncs;
+	unsigned codeSize;
+	unsigned instrSize;		// sizeof(abc_instruction_v2)
+	unsigned code;
+	unsigned lines;
+	unsigned blob;
+	unsigned blobSize;
+} abc_header_v2;
+
+typedef struct abc_userfunc {
+	unsigned address;		// of the funcenter, as the VM uses it
+	unsigned localSize;
+	unsigned id;			// blob offset of the name
+} abc_userfunc;
+
+#define ABC_OPCODE_BITS 63
+#define ABC_RESULT_SHIFT 6
+#define ABC_WIDE 0xFF
+
+typedef struct abc_instruction {
+	unsigned char opcode;		// opcode | result kind << ABC_RESULT_SHIFT
+	unsigned char kinds;		// arg1 kind | arg2 kind << 4, or ABC_WIDE
+	unsigned short result;
+	unsigned short arg1;
+	unsigned short arg2;
+} abc_instruction;
+
+typedef struct abc_wide {
+	unsigned char kinds[3];		// result, arg1, arg2
+	unsigned char unused;
+	unsigned vals[3];
+} abc_wide;
+
+// a version 2 instruction, the opcode and the (kind, value) of result, arg1 and arg2
+typedef struct abc_instruction_v2 {
+	unsigned opcode;
+	unsigned operands[3][2];
+} abc_instruction_v2;
+
+// the kinds of a variable result by its 2 opcode bits: global_a, formal_a, local_a and retval_a
+#define ABC_RESULT_KINDS { 1, 2, 3, 10 }
+// what the writer and the VM pass as the implied result kind of opcodes whose result is a variable
+#define ABC_VARIABLE 0xFF
+
+// packs an instruction whose result kind is implied (or ABC_VARIABLE), 0 when it needs the wide form
+int abc_encode(abc_instruction *out, unsigned opcode, unsigned implied, const unsigned kinds[3], const unsigned vals[3]);
+// the wide form, with the operands in *wide which is entry index of the wide section
+void abc_encode_wide(abc_instruction *out, unsigned opcode, unsigned index, abc_wide *wide, const unsigned kinds[3], const unsigned vals[3]);
@@ -0,0 +1,353 @@
+#include <math.h>
+#include "avm.h"
+#include "reader.h"
+
+/*
+ * Ahead-of-time translation of a .abc binary to C:
+ *
+ *   ./abc2c prog.abc [prog.c]
+ *   gcc -fcommon -IAVM prog.c libavm.a -lm -o prog
+ *
+ * The binary is read with the reader of the VM and checked by its verifier.
+ * Every user function becomes a C function and the program code outside of
+ * them becomes abc_main(); instructions turn into calls to the runtime of
+ * avm_exec (libavm.a) and jumps into gotos, so there is no dispatch loop.
+ * Number-only instructions the verifier kept are written out as plain C
+ * arithmetic and comparisons on the stack cells. The constant tables and the
+ * code are emitted as well, the runtime still reads operands through them.
+ */
+
+FILE *out;
+// the binary being translated
+avm_program *program;
+
+char *opcodeNames[] = {
+    "assign", "add", "sub", "mul", "div", "mod", "uminus", "and", "or", "not",
+    "jeq", "jne", "jle", "jge", "jlt", "jgt", "jump", "call", "pusharg",
+    "funcenter", "funcexit", "newtable", "tablegetelem", "tablesetelem", "nop",
+    "add_nn", "sub_nn", "mul_nn", "div_nn", "mod_nn",
+    "jeq_nn", "jne_nn", "jle_nn", "jge_nn", "jlt_nn", "jgt_nn", "yield"
+};
+
+char *typedOperators[] = { "+", "-", "*", "/", "%", "==", "!=", "<=", ">=", "<", ">" };
+
+void emit_string(char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if (*s == '\n') fprintf(out, "\\n");
+        else if (*s == '\t') fprintf(out, "\\t");
+        else if ((unsigned char) *s < ' ' || (unsigned char) *s >= 127) fprintf(out, "\\%03o", (unsigned char) *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// an offset table into stringBlob
+void emit_offsets(char *name, unsigned *offsets, unsigned total) {
+    unsigned i;
+    fprintf(out, "unsigned %s[] = {", name);
+    for (i = 0; i < total; i++) fprintf(out, "%s%s%u", i ? "," : "", i % 16 ? " " : "\n    ", offsets[i]);
+    fprintf(out, "%s};\n\n", total ? "\n" : " 0 ");
+}
+
+void emit_tables(void) {
+    unsigned i;
+    struct instruction *instr;
+
+    // one literal per string, the compiler adds the NUL after the last
+    fprintf(out, "char abc_blob[] =");
+    for (i = 0; i < program->totalBlobSize; i += strlen(program->stringBlob + i) + 1) {
+        fprintf(out, "\n    ");
+        emit_string(program->stringBlob + i);
+        if (i + strlen(program->stringBlob + i) + 1 < program->totalBlobSize) fprintf(out, " \"\\0\"");
+    }
+    fprintf(out, "%s;\n\n", program->totalBlobSize ? "" : " \"\"");
+    emit_offsets("abc_strings", program->stringConsts, program->totalStringConsts);
+    emit_offsets("abc_libfuncs", program->namedLibFuncs, program->totalNamedLibFuncs);
+
+    fprintf(out, "double abc_numbers[] = {");
+    for (i = 0; i < program->totalNumConsts; i++) fprintf(out, "%s\n    %a", i ? "," : "", program->numConsts[i]);
+    fprintf(out, "%s};\n\n", program->totalNumConsts ? "\n" : " 0 ");
+
+    fprintf(out, "struct userfunc abc_userfuncs[] = {");
+    for (i = 0; i < program->totalUserFuncs; i++)
+        fprintf(out, "%s\n    { %u, %u, %u }", i ? "," : "", program->userFuncs[i].address, program->userFuncs[i].localSize, program->userFuncs[i].id);
+    fprintf(out, "%s};\n\n", program->totalUserFuncs ? "\n" : " { 0, 0, 0 } ");
+
+    fprintf(out, "struct instruction abc_code[] = {");
+    for (i = 0; i < program->codeSize; i++) {
+        instr = program->code + i;
+        fprintf(out, "%s\n    { %u, %u, %u, %u, %u }", i ? "," : "", instr->opcode, instr->kinds,
+            instr->result, instr->arg1, instr->arg2);
+    }
+    fprintf(out, "%s};\n\n", program->codeSize ? "\n" : " { 0 } ");
+
+    fprintf(out, "struct wide_operands abc_wideops[] = {");
+    for (i = 0; i < program->totalWide; i++)
+        fprintf(out, "%s\n    { { %u, %u, %u }, 0, { %u, %u, %u } }", i ? "," : "", program->codeWide[i].kinds[0], program->codeWide[i].kinds[1],
+            program->codeWide[i].kinds[2], program->codeWide[i].vals[0], program->codeWide[i].vals[1], program->codeWide[i].vals[2]);
+    fprintf(out, "%s};\n\n", program->totalWide ? "\n" : " { { 0 } } ");
+    emit_offsets("abc_lines", program->codeLines, program->codeSize);
+}
+
+// the memcell an operand names, as a C lvalue
+void emit_cell(struct vmarg *arg) {
+    switch (arg->type) {
+        case global_a:  fprintf(out, "vm->stack[AVM_STACKSIZE - 1 - %u]", arg->val); break;
+        case local_a:   fprintf(out, "vm->stack[vm->topsp - %u]", arg->val); break;
+        case formal_a:  fprintf(out, "vm->stack[vm->topsp + AVM_STACKENV_SIZE + 1 + %u]", arg->val); break;
+        case retval_a:  fprintf(out, "vm->retval"); break;
+        default:        assert(0);
+    }
+}
+
+int is_cell(struct vmarg *arg) {
+    return arg->type == global_a || arg->type == local_a || arg->type == formal_a || arg->type == retval_a;
+}
+
+void emit_number(struct vmarg *arg) {
+    if (arg->type != number_a) {
+        emit_cell(arg);
+        fprintf(out, ".data.numVal");
+    }
+    else if (isfinite(program->numConsts[arg->val])) fprintf(out, "%a", program->numConsts[arg->val]);
+    else fprintf(out, "abc_numbers[%u]", arg->val);
+}
+
+void emit_goto(unsigned target) {
+    if (target == program->codeSize) fprintf(out, "goto abc_end;");
+    else fprintf(out, "goto L%u;", target);
+}
+
+void emit_instruction(unsigned i) {
+    enum vmopcode op = AVM_OPCODE(program->code + i);
+    struct vmarg result = avm_operand(program, program->code + i, AVM_RESULT), arg1 = avm_operand(program, program->code + i, AVM_ARG1), arg2 = avm_operand(program, program->code + i, AVM_ARG2);
+
+    fprintf(out, "    /* %u: %s */ ", i, opcodeNames[op]);
+    switch (op) {
+        case add_nn_v:
+        case sub_nn_v:
+        case mul_nn_v:
+        case div_nn_v:
+        case mod_nn_v:
+            fprintf(out, "{ double v = ");
+            if (op == mod_nn_v) fprintf(out, "(unsigned) (");
+            emit_number(&arg1);
+            fprintf(out, op == mod_nn_v ? ") %% (unsigned) (" : " %s ", typedOperators[op - add_nn_v]);
+            emit_number(&arg2);
+            fprintf(out, op == mod_nn_v ? "); " : "; ");
+            fprintf(out, "avm_memcell *lv = &");
+            emit_cell(&result);
+            fprintf(out, "; if (lv->type != number_m) avm_memcellclear(lv); lv->type = number_m; lv->data.numVal = v; }\n");
+            return;
+        case jeq_nn_v:
+        case jne_nn_v:
+        case jle_nn_v:
+        case jge_nn_v:
+        case jlt_nn_v:
+        case jgt_nn_v:
+            fprintf(out, "if (");
+            emit_number(&arg1);
+            fprintf(out, " %s ", typedOperators[5 + op - jeq_nn_v]);
+            emit_number(&arg2);
+            fprintf(out, ") ");
+            emit_goto(result.val);
+            fprintf(out, "\n");
+            return;
+        case jump_v:
+            emit_goto(result.val);
+            fprintf(out, "\n");
+            return;
+        case jeq_v:
+        case jne_v:
+        case jle_v:
+        case jge_v:
+        case jlt_v:
+        case jgt_v:
+            // the runtime moves pc to the target when the condition holds
+            fprintf(out, "vm->pc = %u; execute_%s(vm, abc_code + %u); if (vm->executionFinished) return; if (vm->pc != %u) ",
+                i, opcodeNames[op], i, i);
+            emit_goto(result.val);
+            fprintf(out, "\n");
+            return;
+        case assign_v:
+            if (is_cell(&arg1) && is_cell(&result)) {
+                fprintf(out, "avm_assign(vm, &");
+                emit_cell(&result);
+                fprintf(out, ", &");
+                emit_cell(&arg1);
+                fprintf(out, ");\n");
+            }
+            else fprintf(out, "execute_assign(vm, abc_code + %u);\n", i);
+            return;
+        case call_v:
+            // pc is left on the funcenter of a user function, a library function has already returned to i + 1
+            fprintf(out, "vm->pc = %u; execute_call(vm, abc_code + %u); if (vm->executionFinished) return; "
+                "if (vm->pc != %u) abc_call(vm->pc); if (vm->executionFinished) return;\n", i, i, i + 1);
+            return;
+        case funcexit_v:
+            fprintf(out, "execute_funcexit(vm, abc_code + %u); return;\n", i);
+            return;
+        case nop_v:
+            fprintf(out, ";\n");
+            return;
+        default:
+            fprintf(out, "vm->pc = %u; execute_%s(vm, abc_code + %u); if (vm->executionFinished) return;\n", i, opcodeNames[op], i);
+            return;
+    }
+}
+
+/*
+ * A function owns the instructions from its funcenter to its funcexit except
+ * those of the functions defined inside it, owner[i] is the funcenter of the
+ * function of instruction i and codeSize for the code of abc_main. end[i] is
+ * the funcexit closing the funcenter at i.
+ */
+unsigned *owner;
+unsigned *end;
+unsigned char *target;
+
+void emit_region(unsigned first, unsigned last, unsigned self) {
+    unsigned i;
+    for (i = first; i < last; i++) {
+        if (owner[i] != self) continue;
+        if (target[i]) fprintf(out, "L%u:\n", i);
+        emit_instruction(i);
+    }
+    if (self == program->codeSize) fprintf(out, "abc_end:\n    return;\n");
+}
+
+// a jump into another function cannot be a goto
+int check_jumps(unsigned first, unsigned last, unsigned self) {
+    unsigned i;
+    enum vmopcode op;
+    for (i = first; i < last; i++) {
+        if (owner[i] != self) continue;
+        op = AVM_OPCODE(program->code + i);
+        if (op != jump_v && !(op >= jeq_v && op <= jgt_v) && !(op >= jeq_nn_v && op <= jgt_nn_v)) continue;
+        if (avm_label(program, program->code + i) == program->codeSize && self == program->codeSize) continue;
+        if (avm_label(program, program->code + i) >= program->codeSize || owner[avm_label(program, program->code + i)] != self) {
+            fprintf(stderr, "abc2c: instruction %u jumps out of its function\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int translate(char *name, char *outName) {
+    unsigned *stackOf, depth = 0, i, f;
+    enum vmopcode op;
+
+    end = (unsigned *) calloc(program->codeSize + 1, sizeof(unsigned));
+    owner = (unsigned *) malloc(sizeof(unsigned) * (program->codeSize + 1));
+    stackOf = (unsigned *) malloc(sizeof(unsigned) * (program->codeSize + 1));
+    target = (unsigned char *) calloc(program->codeSize + 1, 1);
+    for (i = 0; i < program->codeSize; i++) {
+        if (AVM_OPCODE(program->code + i) == funcenter_v) stackOf[depth++] = i;
+        owner[i] = depth ? stackOf[depth - 1] : program->codeSize;
+        if (AVM_OPCODE(program->code + i) == funcexit_v) {
+            if (!depth) {
+                fprintf(stderr, "abc2c: funcexit without funcenter at %u\n", i);
+                return 0;
+            }
+            end[stackOf[--depth]] = i;
+        }
+        op = AVM_OPCODE(program->code + i);
+        if (op == jump_v || (op >= jeq_v && op <= jgt_v) || (op >= jeq_nn_v && op <= jgt_nn_v)) target[avm_label(program, program->code + i)] = 1;
+    }
+    if (depth) {
+        fprintf(stderr, "abc2c: funcenter without funcexit at %u\n", stackOf[depth - 1]);
+        return 0;
+    }
+    // a coroutine runs where the dispatch loop of avm_exec jumps, not as a C call
+    for (i = 0; i < program->codeSize; i++)
+        if (AVM_OPCODE(program->code + i) == yield_v) {
+            fprintf(stderr, "abc2c: yield at %u, coroutines need avm_exec\n", i);
+            return 0;
+        }
+    for (i = 0; i < program->totalNamedLibFuncs; i++)
+        if (!strcmp(libfuncs_getused(program, i), "resume")) {
+            fprintf(stderr, "abc2c: resume() is called, coroutines need avm_exec\n");
+            return 0;
+        }
+    if (!check_jumps(0, program->codeSize, program->codeSize)) return 0;
+    for (i = 0; i < program->codeSize; i++)
+        if (AVM_OPCODE(program->code + i) == funcenter_v && !check_jumps(i, end[i] + 1, i)) return 0;
+
+    if (!(out = fopen(outName, "w"))) {
+        fprintf(stderr, "abc2c: cannot write %s\n", outName);
+        return 0;
+    }
+    fprintf(out, "/* generated by abc2c from %s */\n#include \"avm.h\"\n\n", name);
+    emit_tables();
+    fprintf(out, "avm_state *vm;\n\n");
+    for (i = 0; i < program->codeSize; i++) if (AVM_OPCODE(program->code + i) == funcenter_v) fprintf(out, "void abc_f%u(void);\n", i);
+
+    fprintf(out, "\n// user functions by the address of their funcenter\nvoid abc_call(unsigned address) {\n    switch (address) {\n");
+    for (f = 0; f < program->totalUserFuncs; f++) {
+        i = program->userFuncs[f].address;
+        if (i < program->codeSize && AVM_OPCODE(program->code + i) == funcenter_v) fprintf(out, "        case %u: abc_f%u(); return;\n", i, i);
+    }
+    fprintf(out, "        default: avm_error(vm, \"no function at %%u\", address);\n    }\n}\n");
+
+    for (i = 0; i < program->codeSize; i++) {
+        if (AVM_OPCODE(program->code + i) != funcenter_v) continue;
+        fprintf(out, "\nvoid abc_f%u(void) {\n", i);
+        emit_region(i, end[i] + 1, i);
+        fprintf(out, "}\n");
+    }
+    fprintf(out, "\nvoid abc_main(void) {\n");
+    emit_region(0, program->codeSize, program->codeSize);
+    fprintf(out, "}\n");
+
+    fprintf(out, "\nint main(void) {\n");
+    fprintf(out, "    avm_program program = { 0 };\n");
+    fprintf(out, "    program.stringBlob = abc_blob;\n    program.totalBlobSize = %u;\n", program->totalBlobSize);
+    fprintf(out, "    program.stringConsts = abc_strings;\n    program.totalStringConsts = %u;\n", program->totalStringConsts);
+    fprintf(out, "    program.numConsts = abc_numbers;\n    program.totalNumConsts = %u;\n", program->totalNumConsts);
+    fprintf(out, "    program.userFuncs = abc_userfuncs;\n    program.totalUserFuncs = %u;\n", program->totalUserFuncs);
+    fprintf(out, "    program.namedLibFuncs = abc_libfuncs;\n    program.totalNamedLibFuncs = %u;\n", program->totalNamedLibFuncs);
+    fprintf(out, "    program.code = abc_code;\n    program.codeLines = abc_lines;\n    program.codeSize = %u;\n", program->codeSize);
+    fprintf(out, "    program.codeWide = abc_wideops;\n    program.totalWide = %u;\n", program->totalWide);
+    fprintf(out, "    program.globals = %u;\n", program->globals);
+    fprintf(out, "    vm = avm_create(&program);\n    abc_main();\n");
+    // the callbacks of the I/O event loop run interpreted once the program ends
+    fprintf(out, "    vm->pc = %u;\n    avm_run(vm);\n", program->codeSize);
+    fprintf(out, "    if (vm->warnings) printf(\"\\n\\033[0;32mExecutable '%%s' returned with %%u warning(s)!\\033[0m\\n\\n\", ");
+    emit_string(name);
+    fprintf(out, ", vm->warnings);\n    else printf(\"\\n\\033[0;32mExecutable '%%s' returned succesfully!\\033[0m\\n\\n\", ");
+    emit_string(name);
+    fprintf(out, ");\n    return 0;\n}\n");
+    fclose(out);
+
+    free(end);
+    free(owner);
+    free(stackOf);
+    free(target);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    char *outName;
+    size_t n;
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: abc2c <binary.abc> [<output.c>]\n");
+        return 1;
+    }
+    if (!(program = avm_load(argv[1]))) {
+        fprintf(stderr, "\033[0;31mabc2c: cannot load %s\033[0m\n", argv[1]);
+        return 1;
+    }
+    if (argc == 3) outName = argv[2];
+    else {
+        n = strlen(argv[1]);
+        outName = (char *) malloc(n + 3);
+        strcpy(outName, argv[1]);
+        if (n > 4 && !strcmp(outName + n - 4, ".abc")) outName[n - 4] = '\0';
+        strcat(outName, ".c");
+    }
+    if (!translate(argv[1], outName)) return 1;
+    printf("abc2c: %s -> %s (%u instructions, %u functions)\n", argv[1], outName, program->codeSize, program->totalUserFuncs);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "avm.h"
+#include "reader.h"
+#include "cache.h"
+#include "../compiler.h"
+
+/*
+ * Compiles and runs source files in one process, without `out` and without
+ * writing a binary:
+ *
+ *   ./alpha run [-O] [--no-cache] prog.asc...
+ *   ./alpha stats
+ *
+ * The compiler is linked in (libalphac.a) and hands the VM the image a mapped
+ * .abc would hold. Images are kept in the binary cache, $ALPHA_CACHE or
+ * ~/.cache/alpha, and on a hit the cached binary is mapped instead of
+ * compiling. The files are run one after the other, each in a VM of its own.
+ * stats prints the hits and misses counted so far by alpha and `out --cache`.
+ */
+
+// the default cache directory, with its parent created if needed
+char *alpha_cache_dir(void) {
+    char *home = getenv("HOME"), path[4096];
+    if (getenv(ABC_CACHE_ENV)) return abc_cache_dir(NULL);
+    if (!home) return NULL;
+    snprintf(path, sizeof(path), "%s/.cache", home);
+    mkdir(path, 0777);
+    snprintf(path, sizeof(path), "%s/.cache/alpha", home);
+    return abc_cache_dir(path);
+}
+
+// alpha_compile with the listing discarded and what the compiler wrote to
+// stderr only shown when it failed
+char *alpha_compile_quiet(char *source, unsigned *size) {
+    int out = dup(STDOUT_FILENO), err = dup(STDERR_FILENO), fd, c;
+    FILE *log = tmpfile();
+    char *image;
+    fflush(stdout);
+    fflush(stderr);
+    if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+    if (log) dup2(fileno(log), STDERR_FILENO);
+    image = alpha_compile(source, size);
+    fflush(stdout);
+    fflush(stderr);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    close(out);
+    close(err);
+    if (log) {
+        if (!image) {
+            rewind(log);
+            while ((c = fgetc(log)) != EOF) fputc(c, stderr);
+        }
+        fclose(log);
+    }
+    return image;
+}
+
+int alpha_stats(void) {
+    abc_cache_stats stats;
+    char *dir = alpha_cache_dir();
+    if (!dir) {
+        fprintf(stderr, "alpha: no cache directory\n");
+        return 1;
+    }
+    abc_cache_stats_read(dir, &stats);
+    printf("%s: %lu hits, %lu misses\n", dir, stats.hits, stats.misses);
+    return 0;
+}
+
+// compiles source, or maps it from the cache in dir when dir is not NULL, and runs it
+int alpha_run(char *dir, char *source) {
+    char key[ABC_CACHE_KEYLEN + 1], flags[64], *entry = NULL, *image = NULL;
+    unsigned size;
+    int ok = 0;
+    avm_program *program;
+    avm_state *vm;
+    snprintf(flags, sizeof(flags), ABC_CACHE_FLAGS, optimize_flag, (unsigned) ABC_VERSION);
+    // the compiler is part of this executable
+    if (dir && !abc_cache_key(key, source, "/proc/self/exe", flags, NULL)) {
+        fprintf(stderr, "alpha: cannot read %s\n", source);
+        return 1;
+    }
+    if (dir && !access(entry = abc_cache_entry(dir, key), R_OK)) {
+        abc_cache_count(dir, 1);
+        program = avm_load(entry);
+    }
+    else if (!(image = alpha_compile_quiet(source, &size))) {
+        free(entry);
+        return 1;
+    }
+    else {
+        if (dir && abc_cache_store_image(dir, key, image, size)) abc_cache_count(dir, 0);
+        program = avm_loadimage(image, size);
+    }
+    if (program) {
+        // a runtime error has been reported and does not fail the file
+        vm = avm_create(program);
+        avm_run(vm);
+        avm_destroy(vm);
+        avm_unload(program);
+        ok = 1;
+    }
+    else fprintf(stderr,"\033[0;31mError initializing AVM\033[0m\n");
+    free(image);
+    free(entry);
+    return !ok;
+}
+
+int main(int argc, char *argv[]) {
+    char *dir = NULL;
+    int i = 2, cache = 1, status = 0;
+    if (argc == 2 && !strcmp(argv[1], "stats")) return alpha_stats();
+    if (argc < 3 || strcmp(argv[1], "run")) {
+        fprintf(stderr, "Usage: alpha run [-O] [--no-cache] <file.asc>...\n       alpha stats\n");
+        return 1;
+    }
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-O")) optimize_flag = 1;
+        else if (!strcmp(argv[i], "--no-cache")) cache = 0;
+        else {
+            fprintf(stderr, "alpha: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (cache && !(dir = alpha_cache_dir())) fprintf(stderr, "alpha: no cache directory, compiling every file\n");
+    // a file that does not compile or load is reported and the others still run
+    for (; i < argc; i++)
+        if (alpha_run(dir, argv[i])) status = 1;
+    return status;
+}
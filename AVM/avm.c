@@ -3,6 +3,8 @@
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <sys/resource.h>
 
 char *typeStrings[] = {
     "number",
@@ -12,49 +14,55 @@ char *typeStrings[] = {
     "userfunc",
     "libfunc",
     "nil",
-    "undef"
+    "undef",
+    "coroutine"
 };
 
-void avm_error(char *format, ...) {
+void avm_error(avm_state *vm, char *format, ...) {
     va_list args;
     va_start(args, format);
-    fprintf(stdout,"\033[0;31mAVM:ERROR: ");
-    vfprintf(stdout, format, args);
-    fprintf(stdout,"\033[0m\n");
+    FILE *out = vm ? vm->out : stdout;
+    fprintf(out,"\033[0;31mAVM:ERROR: ");
+    vfprintf(out, format, args);
+    fprintf(out,"\033[0m\n");
     va_end(args);
-    executionFinished = 1;
+    if (vm) {
+        vm->executionFinished = 1;
+        vm->errors++;
+    }
 }
 
-void avm_warning(char *format, ...) {
+void avm_warning(avm_state *vm, char *format, ...) {
     va_list args;
     va_start(args, format);
-    fprintf(stdout,"\033[0;33mAVM:WARNING: ");
-    vfprintf(stdout, format, args);
-    fprintf(stdout,"\033[0m\n");
+    FILE *out = vm ? vm->out : stdout;
+    fprintf(out,"\033[0;33mAVM:WARNING: ");
+    vfprintf(out, format, args);
+    fprintf(out,"\033[0m\n");
     va_end(args);
-    warnings++;
+    if (vm) vm->warnings++;
 }
 // ---------------------------------------------------------------------------
 // DYNAMIC ARRAYS
 // ---------------------------------------------------------------------------
 
-avm_memcell *avm_translate_operand (struct vmarg *arg, struct avm_memcell *reg) {
+avm_memcell *avm_translate_operand (avm_state *vm, struct vmarg *arg, struct avm_memcell *reg) {
     switch (arg->type) {
         // VARIABLES
         // enviroment function!
-        case global_a:  return &stack[AVM_STACKSIZE-1-arg->val];
-        case local_a:   return &stack[topsp-arg->val];
-        case formal_a:  return &stack[topsp+AVM_STACKENV_SIZE+1+arg->val];
+        case global_a:  return &vm->stack[AVM_STACKSIZE-1-arg->val];
+        case local_a:   return &vm->stack[vm->topsp-arg->val];
+        case formal_a:  return &vm->stack[vm->topsp+AVM_STACKENV_SIZE+1+arg->val];
         
-        case retval_a:  return &retval;
+        case retval_a:  return &vm->retval;
         // CONSTANTS
         case number_a:
             reg->type = number_m;
-            reg->data.numVal = consts_getnumber(arg->val);
+            reg->data.numVal = consts_getnumber(vm->program, arg->val);
             return reg;
         case string_a:
             reg->type = string_m;
-            reg->data.strVal = consts_getstring(arg->val);
+            reg->data.strVal = consts_getstring(vm->program, arg->val);
             return reg;
         case bool_a:
             reg->type = bool_m;
@@ -66,48 +74,124 @@ avm_memcell *avm_translate_operand (struct vmarg *arg, struct avm_memcell *reg)
         //  FUNCTIONS
         case userfunc_a:
             reg->type = userfunc_m;
-            reg->data.funcVal = userFuncs[arg->val].address;
+            reg->data.funcVal = vm->program->userFuncs[arg->val].address;
             return reg;
         case libfunc_a:
             reg->type = libfunc_m;
-            reg->data.libfuncVal = libfuncs_getused(arg->val);
+            reg->data.libfuncVal = libfuncs_getused(vm->program, arg->val);
             return reg;
         default: 
             assert(0);
     }
 }
 
+unsigned char resultKinds[4] = ABC_RESULT_KINDS;
+
+unsigned avm_implied_result (enum vmopcode op) {
+    switch (op) {
+        case jeq_v:
+        case jne_v:
+        case jle_v:
+        case jge_v:
+        case jlt_v:
+        case jgt_v:
+        case jeq_nn_v:
+        case jne_nn_v:
+        case jle_nn_v:
+        case jge_nn_v:
+        case jlt_nn_v:
+        case jgt_nn_v:
+        case jump_v:
+        // no result
+        case call_v:
+        case pusharg_v:
+        case newtable_v:
+        case yield_v:
+        case nop_v:         return label_a;
+        case funcenter_v:
+        case funcexit_v:    return userfunc_a;
+        default:            return ABC_VARIABLE;
+    }
+}
+
+struct vmarg avm_operand (avm_program *p, struct instruction *instr, unsigned which) {
+    struct vmarg arg;
+    struct wide_operands *w;
+    if (instr->kinds == ABC_WIDE) {
+        w = p->codeWide + (instr->arg1 | (unsigned) instr->arg2 << 16);
+        arg.type = (enum vmarg_t) w->kinds[which];
+        arg.val = w->vals[which];
+        return arg;
+    }
+    switch (which) {
+        case AVM_RESULT:
+            arg.type = (enum vmarg_t) avm_implied_result(AVM_OPCODE(instr));
+            if (arg.type == ABC_VARIABLE) arg.type = (enum vmarg_t) resultKinds[instr->opcode >> ABC_RESULT_SHIFT];
+            arg.val = instr->result;
+            break;
+        case AVM_ARG1:
+            arg.type = (enum vmarg_t) (instr->kinds & 15);
+            arg.val = instr->arg1;
+            break;
+        default:
+            arg.type = (enum vmarg_t) (instr->kinds >> 4);
+            arg.val = instr->arg2;
+            break;
+    }
+    return arg;
+}
+
+avm_memcell *avm_translate (avm_state *vm, struct instruction *instr, unsigned which, struct avm_memcell *reg) {
+    struct vmarg arg = avm_operand(vm->program, instr, which);
+    return avm_translate_operand(vm, &arg, reg);
+}
+
+unsigned avm_label (avm_program *p, struct instruction *instr) {
+    if (instr->kinds == ABC_WIDE) return p->codeWide[instr->arg1 | (unsigned) instr->arg2 << 16].vals[AVM_RESULT];
+    return instr->result;
+}
+
+void avm_encode (avm_program *p, unsigned i, enum vmopcode op, struct vmarg *result, struct vmarg *arg1, struct vmarg *arg2) {
+    unsigned kinds[3] = { result->type, arg1->type, arg2->type }, vals[3] = { result->val, arg1->val, arg2->val };
+    if (abc_encode((abc_instruction *) (p->code + i), op, avm_implied_result(op), kinds, vals)) return;
+    // the capacity doubles from 64, so it is full when totalWide is 0 or such a power of two
+    if (!p->totalWide || (p->totalWide >= 64 && !(p->totalWide & (p->totalWide - 1))))
+        p->codeWide = (struct wide_operands *) realloc(p->codeWide, sizeof(struct wide_operands) * (p->totalWide ? 2 * p->totalWide : 64));
+    abc_encode_wide((abc_instruction *) (p->code + i), op, p->totalWide, (abc_wide *) (p->codeWide + p->totalWide), kinds, vals);
+    p->totalWide++;
+}
+
 
 // ---------------------------------------------------------------------------
 // DISPATCHER
 // ---------------------------------------------------------------------------
-extern void execute_assign (struct instruction*);
-extern void execute_add (struct instruction*);
-extern void execute_sub (struct instruction*);
-extern void execute_mul (struct instruction*);
-extern void execute_div (struct instruction*);
-extern void execute_mod (struct instruction*);
-extern void execute_uminus (struct instruction*);
-extern void execute_and (struct instruction*);
-extern void execute_or (struct instruction*);
-extern void execute_not (struct instruction*);
-extern void execute_jeq (struct instruction*);
-extern void execute_jne (struct instruction*);
-extern void execute_jle (struct instruction*);
-extern void execute_jge (struct instruction*);
-extern void execute_jlt (struct instruction*);
-extern void execute_jgt (struct instruction*);
-extern void execute_jump (struct instruction*);
-extern void execute_call (struct instruction*);
-extern void execute_pusharg (struct instruction*);
-extern void execute_funcenter (struct instruction*);
-extern void execute_funcexit (struct instruction*);
-extern void execute_newtable (struct instruction*);
-extern void execute_tablegetelem (struct instruction*);
-extern void execute_tablesetelem (struct instruction*);
-extern void execute_nop (struct instruction*);
-
-typedef void (*execute_func_t)(struct instruction *);
+extern void execute_assign (avm_state *, struct instruction*);
+extern void execute_add (avm_state *, struct instruction*);
+extern void execute_sub (avm_state *, struct instruction*);
+extern void execute_mul (avm_state *, struct instruction*);
+extern void execute_div (avm_state *, struct instruction*);
+extern void execute_mod (avm_state *, struct instruction*);
+extern void execute_uminus (avm_state *, struct instruction*);
+extern void execute_and (avm_state *, struct instruction*);
+extern void execute_or (avm_state *, struct instruction*);
+extern void execute_not (avm_state *, struct instruction*);
+extern void execute_jeq (avm_state *, struct instruction*);
+extern void execute_jne (avm_state *, struct instruction*);
+extern void execute_jle (avm_state *, struct instruction*);
+extern void execute_jge (avm_state *, struct instruction*);
+extern void execute_jlt (avm_state *, struct instruction*);
+extern void execute_jgt (avm_state *, struct instruction*);
+extern void execute_jump (avm_state *, struct instruction*);
+extern void execute_call (avm_state *, struct instruction*);
+extern void execute_pusharg (avm_state *, struct instruction*);
+extern void execute_funcenter (avm_state *, struct instruction*);
+extern void execute_funcexit (avm_state *, struct instruction*);
+extern void execute_newtable (avm_state *, struct instruction*);
+extern void execute_tablegetelem (avm_state *, struct instruction*);
+extern void execute_tablesetelem (avm_state *, struct instruction*);
+extern void execute_nop (avm_state *, struct instruction*);
+
+typedef void (*execute_func_t)(avm_state *, struct instruction *);
 
 execute_func_t executeFuncs[] = {
     execute_assign,
@@ -134,24 +218,43 @@ execute_func_t executeFuncs[] = {
     execute_newtable,
     execute_tablegetelem,
     execute_tablesetelem,
-    execute_nop
+    execute_nop,
+    execute_add_nn,
+    execute_sub_nn,
+    execute_mul_nn,
+    execute_div_nn,
+    execute_mod_nn,
+    execute_jeq_nn,
+    execute_jne_nn,
+    execute_jle_nn,
+    execute_jge_nn,
+    execute_jlt_nn,
+    execute_jgt_nn,
+    execute_yield
 };
 
-void execution_cycle (void) {
-    if (executionFinished) return;
-    if (pc == AVM_ENDING_PC) {
-        executionFinished = 1;
+void execution_cycle (avm_state *vm) {
+    if (vm->executionFinished) return;
+    if (vm->pc >= AVM_ENDING_PC(vm)) {
+        if (vm->pc == AVM_COROUTINE_PC(vm) && vm->running) avm_coroutinereturned(vm);
+        else if (vm->pc == AVM_ENDING_PC(vm) && avm_eventspending(vm)) avm_eventsrun(vm);
+        else vm->executionFinished = 1;
         return;
     }
-    assert(pc < AVM_ENDING_PC);
-    struct instruction *instr = code + pc;
-    assert(instr->opcode >=0 && instr->opcode <= AVM_MAX_INSTRUCTIONS);
-    if (instr->srcLine) currLine = instr->srcLine; // DEAL WITH SCRLINE IN READER
-    unsigned oldPC = pc;
+    assert(vm->pc < AVM_ENDING_PC(vm));
+    struct instruction *instr = vm->program->code + vm->pc;
+    assert(AVM_OPCODE(instr) <= AVM_MAX_INSTRUCTIONS);
+    unsigned oldPC = vm->pc;
 
     // printf("\033[0;33mExec PC:%u  TOP:%u OP:%u\033[0m\n",pc,top,instr->opcode); 
-    (*executeFuncs[instr->opcode])(instr);
-    if (pc == oldPC) ++pc;
+    if (vm->profile) avm_profile_before(vm, instr);
+    if (vm->counters) avm_counters_before(vm, instr);
+    if (vm->opprofile) avm_opprofile_before(vm, instr);
+    (*executeFuncs[AVM_OPCODE(instr)])(vm, instr);
+    if (vm->opprofile) avm_opprofile_after(vm, instr);
+    if (vm->profile) avm_profile_after(vm, instr, oldPC);
+    // funcexit and yield always set pc, a call right before it returns to the funcexit itself
+    if (vm->pc == oldPC && AVM_OPCODE(instr) != funcexit_v && AVM_OPCODE(instr) != yield_v) ++vm->pc;
     // print_stack();
     
 }
@@ -168,6 +271,11 @@ extern void memclear_table (struct avm_memcell *m) {
     assert(m->data.tableVal);
     avm_tabledecrefcounter(m->data.tableVal);
 }
+
+extern void memclear_coroutine (struct avm_memcell *m) {
+    assert(m->data.coroutineVal);
+    avm_coroutinedecref(m->data.coroutineVal);
+}
 memclear_func_t memclearFuncs[] = {
     0, // NUMBER
     memclear_string,
@@ -176,7 +284,8 @@ memclear_func_t memclearFuncs[] = {
     0, // USERFUNC
     0, // LIBFUNC
     0, // NIL
-    0  // UNDEF
+    0, // UNDEF
+    memclear_coroutine
 };
 
 void avm_memcellclear(struct avm_memcell *m) {
@@ -188,94 +297,94 @@ void avm_memcellclear(struct avm_memcell *m) {
 }
 
 // extern void avm_callsaveenvironment(void);
-void avm_callsaveenvironment (void) {
-    avm_push_envvalue(totalActuals);
-    avm_push_envvalue(pc+1);
-    avm_push_envvalue(top + totalActuals + 2);
-    avm_push_envvalue(topsp);
+void avm_callsaveenvironment (avm_state *vm) {
+    avm_push_envvalue(vm, vm->totalActuals);
+    avm_push_envvalue(vm, vm->pc+1);
+    avm_push_envvalue(vm, vm->top + vm->totalActuals + 2);
+    avm_push_envvalue(vm, vm->topsp);
 }
 
 
-void avm_dec_top(void) {
-    if (!top) {
+void avm_dec_top(avm_state *vm) {
+    if (!vm->top) {
         // STACK OVERFLOW
-        avm_error("Stack Overflow!");
-        executionFinished = 1;
+        avm_error(vm, "Stack Overflow!");
+        vm->executionFinished = 1;
         return;
     }
-    top--;
+    vm->top--;
 }
 
-void avm_push_envvalue(unsigned val) {
-    stack[top].type = number_m;
-    stack[top].data.numVal = val;
-    avm_dec_top();
+void avm_push_envvalue(avm_state *vm, unsigned val) {
+    vm->stack[vm->top].type = number_m;
+    vm->stack[vm->top].data.numVal = val;
+    avm_dec_top(vm);
 }
 
-struct userfunc *avm_getfuncinfo(unsigned address) {
-    return &userFuncs[code[address].result.val];
+struct userfunc *avm_getfuncinfo(avm_program *p, unsigned address) {
+    return &p->userFuncs[avm_operand(p, p->code + address, AVM_RESULT).val];
 }
 
-unsigned avm_get_envvalue(unsigned i) {
-    assert(stack[i].type == number_m);
-    unsigned val = (unsigned) stack[i].data.numVal;
-    assert(stack[i].data.numVal == ((double) val));
+unsigned avm_get_envvalue(avm_state *vm, unsigned i) {
+    assert(vm->stack[i].type == number_m);
+    unsigned val = (unsigned) vm->stack[i].data.numVal;
+    assert(vm->stack[i].data.numVal == ((double) val));
     return val;
 }
 
-library_func_t avm_getlibraryfunc(char *id){
+library_func_t avm_getlibraryfunc(avm_state *vm, char *id){
     unsigned i;
-    for (i=0; i<totalNamedLibFuncs; i++) if (!strcmp(id, namedLibFuncs[i])) break;
-    if (i == totalNamedLibFuncs) avm_error("Libfunc '%s' not found!\n", id);
-    return library_func_t_addresses[i];
+    for (i=0; i<vm->program->totalNamedLibFuncs; i++) if (!strcmp(id, libfuncs_getused(vm->program, i))) break;
+    if (i == vm->program->totalNamedLibFuncs) avm_error(vm, "Libfunc '%s' not found!\n", id);
+    return vm->libFuncs[i];
 }
 
 // extern void avm_calllibfunc(char *funcName);
-void avm_calllibfunc(char *id) {
-    library_func_t f = avm_getlibraryfunc(id);
-    if (!f) avm_error("Unsupported lib func '%s' called!", id);
-    topsp = top;
-    totalActuals = 0;
-    (*f)();
-    if (!executionFinished) execute_funcexit((struct instruction *) 0);
+void avm_calllibfunc(avm_state *vm, char *id) {
+    library_func_t f = avm_getlibraryfunc(vm, id);
+    if (!f) avm_error(vm, "Unsupported lib func '%s' called!", id);
+    vm->topsp = vm->top;
+    vm->totalActuals = 0;
+    (*f)(vm);
+    if (!vm->executionFinished) execute_funcexit(vm, (struct instruction *) 0);
 }
 
 
-unsigned avm_totalactuals(void) {
-    return avm_get_envvalue(topsp + AVM_NUMACTUALS_OFFSET);
+unsigned avm_totalactuals(avm_state *vm) {
+    return avm_get_envvalue(vm, vm->topsp + AVM_NUMACTUALS_OFFSET);
 }
 
-struct avm_memcell *avm_getactual(unsigned i) {
-    assert(i < avm_totalactuals());
-    return &stack[topsp + AVM_STACKENV_SIZE + 1 + i];
+struct avm_memcell *avm_getactual(avm_state *vm, unsigned i) {
+    assert(i < avm_totalactuals(vm));
+    return &vm->stack[vm->topsp + AVM_STACKENV_SIZE + 1 + i];
 }
 
-void avm_registerlibfunc(char *id, library_func_t addr){
+void avm_registerlibfunc(avm_state *vm, char *id, library_func_t addr){
     unsigned i;
-    for (i=0; i<totalNamedLibFuncs; i++) if (!strcmp(id, namedLibFuncs[i])) break;
-    if (i == totalNamedLibFuncs) return;
-    library_func_t_addresses[i] = addr;
+    for (i=0; i<vm->program->totalNamedLibFuncs; i++) if (!strcmp(id, libfuncs_getused(vm->program, i))) break;
+    if (i == vm->program->totalNamedLibFuncs) return;
+    vm->libFuncs[i] = addr;
 }
 
 
 // ------------------- STRINGS
 
-char *number_tostring(struct avm_memcell *x){
+char *number_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == number_m);
     char *s = (char *) malloc(sizeof(char) * 100);
     sprintf(s, "%f", x->data.numVal);
     return s;
 }
-char *string_tostring(struct avm_memcell *x){
+char *string_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == string_m);
     return strdup(x->data.strVal);
 }
-char *bool_tostring(struct avm_memcell *x){
+char *bool_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == bool_m);
     if (x->data.boolVal) return strdup("true");
     return strdup("false");
 }
-char *table_tostring(struct avm_memcell *x){
+char *table_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == table_m);
     struct avm_table_bucket *bucket;
     char *buff = (char *) malloc(128), *key, *value;
@@ -284,8 +393,8 @@ char *table_tostring(struct avm_memcell *x){
     for (i = 0; i<AVM_TABLE_HASHSIZE; i++) {
         bucket = x->data.tableVal->numIndexed[i];
         while (bucket) {
-            key = avm_tostring(&bucket->key);
-            value = avm_tostring(&bucket->value);
+            key = avm_tostring(vm, &bucket->key);
+            value = avm_tostring(vm, &bucket->value);
             pair_size = strlen(key) + strlen(value) + 5;
             while (curr_buff_filled_size + pair_size + 2 > curr_buff_size) {
                 buff = realloc(buff, 2*curr_buff_size); 
@@ -299,8 +408,8 @@ char *table_tostring(struct avm_memcell *x){
         }
         bucket = x->data.tableVal->strIndexed[i];
         while (bucket) {
-            key = avm_tostring(&bucket->key);
-            value = avm_tostring(&bucket->value);
+            key = avm_tostring(vm, &bucket->key);
+            value = avm_tostring(vm, &bucket->value);
             pair_size = strlen(key) + strlen(value) + 7;
             while (curr_buff_filled_size + pair_size + 2 > curr_buff_size) {
                 buff = realloc(buff, 2*curr_buff_size);
@@ -314,8 +423,8 @@ char *table_tostring(struct avm_memcell *x){
         }
         bucket = x->data.tableVal->boolIndexed[i];
         while (bucket) {
-            key = avm_tostring(&bucket->key);
-            value = avm_tostring(&bucket->value);
+            key = avm_tostring(vm, &bucket->key);
+            value = avm_tostring(vm, &bucket->value);
             pair_size = strlen(key) + strlen(value) + 5;
             while (curr_buff_filled_size + pair_size + 2 > curr_buff_size) {
                 buff = realloc(buff, 2*curr_buff_size);
@@ -329,8 +438,8 @@ char *table_tostring(struct avm_memcell *x){
         }
         bucket = x->data.tableVal->ufncIndexed[i];
         while (bucket) {
-            key = avm_tostring(&bucket->key);
-            value = avm_tostring(&bucket->value);
+            key = avm_tostring(vm, &bucket->key);
+            value = avm_tostring(vm, &bucket->value);
             pair_size = strlen(key) + strlen(value) + 5;
             while (curr_buff_filled_size + pair_size + 2 > curr_buff_size) {
                 buff = realloc(buff, 2*curr_buff_size);
@@ -344,8 +453,8 @@ char *table_tostring(struct avm_memcell *x){
         }
         bucket = x->data.tableVal->lfncIndexed[i];
         while (bucket) {
-            key = avm_tostring(&bucket->key);
-            value = avm_tostring(&bucket->value);
+            key = avm_tostring(vm, &bucket->key);
+            value = avm_tostring(vm, &bucket->value);
             pair_size = strlen(key) + strlen(value) + 5;
             while (curr_buff_filled_size + pair_size + 2 > curr_buff_size) {
                 buff = realloc(buff, 2*curr_buff_size);
@@ -361,27 +470,34 @@ char *table_tostring(struct avm_memcell *x){
     sprintf(buff + curr_buff_filled_size-2, "\0\0");
     return buff;
 }
-char *userfunc_tostring(struct avm_memcell *x){
+char *userfunc_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == userfunc_m);
-    struct userfunc* f = avm_getfuncinfo(x->data.funcVal);
+    struct userfunc* f = avm_getfuncinfo(vm->program, x->data.funcVal);
     unsigned address = f->address;
-    unsigned n = strlen(f->id) + 50; // 29 = 26 for static + 13 for uint + \0
+    unsigned n = strlen(avm_funcname(vm->program, f)) + 50; // 29 = 26 for static + 13 for uint + \0
     char *s = (char *) malloc(sizeof(char) * n);
-    sprintf(s, "userfunction: %s , address: %u", f->id, f->address);
+    sprintf(s, "userfunction: %s , address: %u", avm_funcname(vm->program, f), f->address);
     return s;
 }
-char *libfunc_tostring(struct avm_memcell *x){
+char *libfunc_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == libfunc_m);
     return strdup(x->data.libfuncVal);
 }
-char *nil_tostring(struct avm_memcell *x){
+char *nil_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == nil_m);
     return strdup("nil");
 }
-char *undef_tostring(struct avm_memcell *x){
+char *undef_tostring(avm_state *vm, struct avm_memcell *x){
     assert(x->type == undef_m);
     return strdup("undef");
 }
+char *coroutine_tostring(avm_state *vm, struct avm_memcell *x){
+    assert(x->type == coroutine_m);
+    struct userfunc* f = avm_getfuncinfo(vm->program, x->data.coroutineVal->func);
+    char *s = (char *) malloc(strlen(avm_funcname(vm->program, f)) + 16);
+    sprintf(s, "coroutine: %s", avm_funcname(vm->program, f));
+    return s;
+}
 
 tostring_func_t tostringFuncs[] = {
     number_tostring,
@@ -391,12 +507,13 @@ tostring_func_t tostringFuncs[] = {
     userfunc_tostring,
     libfunc_tostring,
     nil_tostring,
-    undef_tostring
+    undef_tostring,
+    coroutine_tostring
 };
 
-char *avm_tostring(struct avm_memcell *m) {
-    assert(m->type >= 0 && m->type <= 7);
-    return (*tostringFuncs[m->type])(m);
+char *avm_tostring(avm_state *vm, struct avm_memcell *m) {
+    assert(m->type >= 0 && m->type <= coroutine_m);
+    return (*tostringFuncs[m->type])(vm, m);
 }
 
 
@@ -412,6 +529,7 @@ unsigned char userfunc_tobool (struct avm_memcell *m) {return 1;}
 unsigned char libfunc_tobool (struct avm_memcell *m) {return 1;}
 unsigned char nil_tobool (struct avm_memcell *m) {return 0;}
 unsigned char undef_tobool (struct avm_memcell *m) {assert(0);return 0;}
+unsigned char coroutine_tobool (struct avm_memcell *m) {return 1;}
 
 tobool_func_t toboolFuncs[] = {
     number_tobool,
@@ -421,11 +539,12 @@ tobool_func_t toboolFuncs[] = {
     userfunc_tobool,
     libfunc_tobool,
     nil_tobool,
-    undef_tobool
+    undef_tobool,
+    coroutine_tobool
 };
 
 unsigned char avm_tobool(struct avm_memcell *m) {
-    assert(m->type >= 0 && m->type < 7);
+    assert(m->type >= 0 && m->type <= coroutine_m && m->type != undef_m);
     return (*toboolFuncs[m->type])(m);
 }
 
@@ -437,95 +556,217 @@ unsigned char avm_tobool(struct avm_memcell *m) {
 // AVM
 // ---------------------------------------------------------------------------
 
+// abc2c executables link the runtime without this driver (-DAVM_RUNTIME)
+#ifndef AVM_RUNTIME
 int main(int argc, char *argv[]) {
+    int loadOnly = 0, timeRun = 0, counters = 0, vmstats = 0;
+    char *profileFileName = NULL, *opprofileFileName = NULL, *sampleFileName = NULL;
+    unsigned sampleHz = 1000;
+    int i;
+    struct timespec start, end, ran;
+    struct rusage usage;
+    avm_program *program;
+    avm_state *vm;
     // display_instr();
-    if (argc != 2) avm_error("Error getting binary from argument %s",argv[1]);
-    bin_file_name = strdup(argv[1]);
-    avm_initialize();
-    while(!executionFinished) execution_cycle();
-    if (warnings) printf("\n\033[0;32mExecutable '%s' returned with %u warning(s)!\033[0m\n\n",  argv[1], warnings);
-    else printf("\n\033[0;32mExecutable '%s' returned succesfully!\033[0m\n\n",  argv[1]);
+    if (argc >= 2 && !strcmp(argv[1], "--batch")) return avm_batch(argc - 1, argv + 1);
+    for (i = 1; i + 1 < argc; i++) {
+        if (!strcmp(argv[i], "--load-only")) loadOnly = 1;
+        else if (!strcmp(argv[i], "--time")) timeRun = 1;
+        else if (!strcmp(argv[i], "--counters")) counters |= 1;
+        else if (!strcmp(argv[i], "--counters-functions")) counters |= 2;
+        else if (!strcmp(argv[i], "--vmstats")) vmstats = 1;
+        else if (i + 2 == argc) break;
+        else if (!strcmp(argv[i], "--profile")) profileFileName = argv[++i];
+        else if (!strcmp(argv[i], "--profile-opcodes")) opprofileFileName = argv[++i];
+        else if (!strcmp(argv[i], "--sample")) sampleFileName = argv[++i];
+        else if (!strcmp(argv[i], "--sample-hz")) sampleHz = (unsigned) atoi(argv[++i]);
+        else break;
+    }
+    if (i + 1 != argc || !sampleHz) {
+        avm_error(NULL, "Usage: avm_exec [--load-only] [--time] [--profile <file>] [--profile-opcodes <file.json>] [--sample <file.folded> [--sample-hz <n>]]\n                [--counters [--counters-functions]] [--vmstats] <binary>\n       avm_exec --batch <manifest> [--jobs <n>] [--out <dir>]");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!(program = avm_load(argv[i]))) {
+        fprintf(stderr,"\033[0;31mError initializing AVM\033[0m\n");
+        return EXIT_FAILURE;
+    }
+    vm = avm_create(program);
+    // loading, verifying and setting up the runtime, for timing large binaries
+    if (loadOnly) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "%s: %u instructions loaded in %.3f ms\n", argv[i], program->codeSize,
+            (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        return 0;
+    }
+    if (profileFileName) avm_profile_init(vm);
+    if (opprofileFileName) avm_opprofile_init(vm);
+    if (sampleFileName && !avm_sample_start(vm, sampleHz)) {
+        fprintf(stderr, "avm_exec: cannot set up the SIGPROF timer, not sampling\n");
+        sampleFileName = NULL;
+    }
+    if (counters) avm_counters_init(vm, counters & 2);
+    clock_gettime(CLOCK_MONOTONIC, &ran);
+    avm_run(vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    avm_counters_stop(vm);
+    if (sampleFileName) avm_sample_stop(vm);
+    if (profileFileName) avm_profile_write(vm, profileFileName);
+    if (opprofileFileName) avm_opprofile_write(vm, opprofileFileName);
+    if (sampleFileName) avm_sample_write(vm, sampleFileName);
+    avm_counters_report(vm, stderr);
+    // what bench/run.sh reads
+    if (timeRun) {
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(stderr, "time: loaded in %.3f ms, ran in %.3f ms, peak rss %ld KB\n",
+            (ran.tv_sec - start.tv_sec) * 1e3 + (ran.tv_nsec - start.tv_nsec) / 1e6,
+            (end.tv_sec - ran.tv_sec) * 1e3 + (end.tv_nsec - ran.tv_nsec) / 1e6, usage.ru_maxrss);
+    }
+    if (vmstats) avm_heapstats_dump(vm, stderr);
+    if (vm->warnings) printf("\n\033[0;32mExecutable '%s' returned with %u warning(s)!\033[0m\n\n",  argv[i], vm->warnings);
+    else printf("\n\033[0;32mExecutable '%s' returned succesfully!\033[0m\n\n",  argv[i]);
+    avm_destroy(vm);
+    avm_unload(program);
     return 0;
 }
+#endif
+
+avm_state *avm_create(avm_program *program) {
+    avm_state *vm = (avm_state *) calloc(1, sizeof(avm_state));
+    vm->program = program;
+    vm->warnings = program->warnings;
+    vm->out = stdout;
+    vm->in = stdin;
+    avm_initruntime(vm);
+    return vm;
+}
 
-void avm_initialize (void) {
-    warnings = 0;
-    GlobalProgrammVarOffset = 0;
-    if (!avmbinaryfile()) {
-        fprintf(stderr,"\033[0;31mError initializing AVM\033[0m\n");
-        exit(EXIT_FAILURE);
-        return ;
-    }
-    avm_initstack();
-    avm_register_libfuncs();
-    top = N - GlobalProgrammVarOffset;
+int avm_run(avm_state *vm) {
+    while(!vm->executionFinished) execution_cycle(vm);
+    return !vm->errors;
 }
 
-void avm_initstack(){
+// the strings held by variables and every table are released; ax, bx and cx may point
+// into the constants and are left alone
+void avm_destroy(avm_state *vm) {
+    avm_tasksrelease(vm);
+    for (unsigned i = vm->top + 1; i < AVM_STACKSIZE; i++)
+        if (vm->stack[i].type == string_m) free(vm->stack[i].data.strVal);
+    if (vm->retval.type == string_m) free(vm->retval.data.strVal);
+    avm_tablesrelease(vm);
+    avm_coroutinesrelease(vm);
+    avm_eventsrelease(vm);
+    free(vm->libFuncs);
+    free(vm->profile);
+    free(vm->opprofile);
+    avm_countersrelease(vm);
+    free(vm);
+}
+
+// stack and library functions, once the constant tables and the code are in place;
+// also restarts a VM that already ran
+void avm_initruntime (avm_state *vm) {
+    avm_initstack(vm);
+    AVM_WIPEOUT(vm->ax);
+    AVM_WIPEOUT(vm->bx);
+    AVM_WIPEOUT(vm->cx);
+    AVM_WIPEOUT(vm->retval);
+    free(vm->libFuncs);
+    avm_register_libfuncs(vm);
+    vm->top = N - vm->program->globals;
+    vm->topsp = 0;
+    vm->pc = 0;
+    vm->totalActuals = 0;
+    vm->running = NULL;
+    vm->executionFinished = 0;
+}
+
+void avm_initstack(avm_state *vm){
     for(unsigned i = 0 ; i<AVM_STACKSIZE ; ++i){
-        AVM_WIPEOUT(stack[i]);
-        stack[i].type = undef_m;
+        AVM_WIPEOUT(vm->stack[i]);
+        vm->stack[i].type = undef_m;
     }
 }
 
 // ------------------- CONSTS
 
-char *consts_getstring(unsigned index) {
-    return stringConsts[index];
+char *consts_getstring(avm_program *p, unsigned index) {
+    return p->stringBlob + p->stringConsts[index];
+}
+double consts_getnumber(avm_program *p, unsigned index) {
+    return p->numConsts[index];
 }
-double consts_getnumber(unsigned index) {
-    return numConsts[index];
+
+char *libfuncs_getused(avm_program *p, unsigned index) {
+    return p->stringBlob + p->namedLibFuncs[index];
 }
 
-char *libfuncs_getused(unsigned index) {
-    return namedLibFuncs[index];
+char *avm_funcname(avm_program *p, struct userfunc *f) {
+    return p->stringBlob + f->id;
 }
 
 // ------------------- LIBS
-void avm_register_libfuncs() {
-    library_func_t_addresses = (library_func_t *) malloc(sizeof(library_func_t) * totalNamedLibFuncs);
-    avm_registerlibfunc("print", libfunc_print);
-    avm_registerlibfunc("input", libfunc_input);
-    avm_registerlibfunc("objectmemberkeys", libfunc_objectmemberkeys);
-    avm_registerlibfunc("objecttotalmembers", libfunc_objecttotalmembers);
-    avm_registerlibfunc("objectcopy", libfunc_objectcopy);
-    avm_registerlibfunc("totalarguments", libfunc_totalarguments);
-    avm_registerlibfunc("argument", libfunc_argument);
-    avm_registerlibfunc("typeof", libfunc_typeof);
-    avm_registerlibfunc("strtonum", libfunc_strtonum);
-    avm_registerlibfunc("sqrt", libfunc_sqrt);
-    avm_registerlibfunc("cos", libfunc_cos);
-    avm_registerlibfunc("sin", libfunc_sin);
-}
-
-void libfunc_print(void) {
-    unsigned n = avm_totalactuals();
+void avm_register_libfuncs(avm_state *vm) {
+    vm->libFuncs = (library_func_t *) malloc(sizeof(library_func_t) * vm->program->totalNamedLibFuncs);
+    avm_registerlibfunc(vm, "print", libfunc_print);
+    avm_registerlibfunc(vm, "input", libfunc_input);
+    avm_registerlibfunc(vm, "objectmemberkeys", libfunc_objectmemberkeys);
+    avm_registerlibfunc(vm, "objecttotalmembers", libfunc_objecttotalmembers);
+    avm_registerlibfunc(vm, "objectcopy", libfunc_objectcopy);
+    avm_registerlibfunc(vm, "totalarguments", libfunc_totalarguments);
+    avm_registerlibfunc(vm, "argument", libfunc_argument);
+    avm_registerlibfunc(vm, "typeof", libfunc_typeof);
+    avm_registerlibfunc(vm, "strtonum", libfunc_strtonum);
+    avm_registerlibfunc(vm, "sqrt", libfunc_sqrt);
+    avm_registerlibfunc(vm, "cos", libfunc_cos);
+    avm_registerlibfunc(vm, "sin", libfunc_sin);
+    avm_registerlibfunc(vm, "spawn", libfunc_spawn);
+    avm_registerlibfunc(vm, "join", libfunc_join);
+    avm_registerlibfunc(vm, "parallel_map", libfunc_parallel_map);
+    avm_registerlibfunc(vm, "parallel_reduce", libfunc_parallel_reduce);
+    avm_registerlibfunc(vm, "coroutine", libfunc_coroutine);
+    avm_registerlibfunc(vm, "resume", libfunc_resume);
+    avm_registerlibfunc(vm, "coroutinestatus", libfunc_coroutinestatus);
+    avm_registerlibfunc(vm, "ioopen", libfunc_ioopen);
+    avm_registerlibfunc(vm, "iopipe", libfunc_iopipe);
+    avm_registerlibfunc(vm, "iolisten", libfunc_iolisten);
+    avm_registerlibfunc(vm, "ioconnect", libfunc_ioconnect);
+    avm_registerlibfunc(vm, "ioaccept", libfunc_ioaccept);
+    avm_registerlibfunc(vm, "ioread", libfunc_ioread);
+    avm_registerlibfunc(vm, "iowrite", libfunc_iowrite);
+    avm_registerlibfunc(vm, "ioclose", libfunc_ioclose);
+    avm_registerlibfunc(vm, "ioresult", libfunc_ioresult);
+    avm_registerlibfunc(vm, "vmstats", libfunc_vmstats);
+}
+
+void libfunc_print(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     char *s;
     for (unsigned i = 0; i<n; i++) {
-        s = avm_tostring(avm_getactual(i));
-        printf("%s", s);
+        s = avm_tostring(vm, avm_getactual(vm, i));
+        fputs(s, vm->out);
         free(s);
     }
     //printf("\n");
 }
 
-void libfunc_input(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_input(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n) {
-        avm_warning("'input()': no argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'input()': no argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
     unsigned chunk = 128, current_size = chunk;
     char *buff = (char *) malloc(chunk);
     if(buff == NULL) {
-        avm_warning("'input()': unable to allocate memory!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'input()': unable to allocate memory!", n);
+        vm->retval.type = nil_m;
         return;
     }
     int c = EOF;
     unsigned int i =0;
-    while (( c = getchar() ) != '\n' && c != EOF) {
+    while (( c = getc(vm->in) ) != '\n' && c != EOF) {
         buff[i++]=(char)c;
         if (i == current_size) {
             current_size = i + chunk;
@@ -533,82 +774,82 @@ void libfunc_input(void) {
         }
     }
     buff[i] = '\0';
-    avm_memcellclear(&retval);
+    avm_memcellclear(&vm->retval);
 
     // string = between double quotes
     if (buff[0] == '"' && buff[strlen(buff)] == '"') {
-        retval.type = string_m;
-        retval.data.strVal = buff;
+        vm->retval.type = string_m;
+        vm->retval.data.strVal = buff;
         return;
     }
 
     // number = can be translated to number
     double number = atof(buff);
     if (number) {
-        retval.type = number_m;
-        retval.data.numVal = number;
+        vm->retval.type = number_m;
+        vm->retval.data.numVal = number;
         return;
     }
 
     // boolean = contains false/true
     if (strstr(buff, "false")) {
-        retval.type = bool_m;
-        retval.data.boolVal = 0;
+        vm->retval.type = bool_m;
+        vm->retval.data.boolVal = 0;
         return;
     }
     if (strstr(buff, "true")) {
-        retval.type = bool_m;
-        retval.data.boolVal = 1;
+        vm->retval.type = bool_m;
+        vm->retval.data.boolVal = 1;
         return;
     }
 
     // nil = contains nil
     if (strstr(buff, "nil")) {
-        retval.type = nil_m;
+        vm->retval.type = nil_m;
         return;
     }
 
     char *tmp;
-    for (unsigned i = 0; i<totalNamedLibFuncs; i++) {
-        tmp = namedLibFuncs[i];
+    for (unsigned i = 0; i<vm->program->totalNamedLibFuncs; i++) {
+        tmp = libfuncs_getused(vm->program, i);
         if (!strcmp(tmp, buff)) {
-            retval.type = libfunc_m;
-            retval.data.libfuncVal = buff;
+            vm->retval.type = libfunc_m;
+            vm->retval.data.libfuncVal = buff;
             return;
         }
     }
 
-    for (unsigned i = 0; i<totalUserFuncs; i++) {
-        tmp = userFuncs[i].id;
+    for (unsigned i = 0; i<vm->program->totalUserFuncs; i++) {
+        tmp = avm_funcname(vm->program, &vm->program->userFuncs[i]);
         if (!strcmp(tmp, buff)) {
-            retval.type = userfunc_m;
-            retval.data.funcVal = userFuncs[i].address;
+            vm->retval.type = userfunc_m;
+            vm->retval.data.funcVal = vm->program->userFuncs[i].address;
             return;
         }
     }
 
     // string
-    retval.type = string_m;
-    retval.data.strVal = buff;
+    vm->retval.type = string_m;
+    vm->retval.data.strVal = buff;
     return;
 }
 
-void libfunc_objectmemberkeys(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_objectmemberkeys(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'objectmemberkeys()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'objectmemberkeys()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != table_m) {
-        avm_warning("'objectmemberkeys()': table argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'objectmemberkeys()': table argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = table_m;
-    retval.data.tableVal = avm_tablenew();
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = table_m;
+    vm->retval.data.tableVal = avm_tablenew(vm);
     unsigned i = 0;
     struct avm_memcell index;
     index.type = number_m;
@@ -617,167 +858,172 @@ void libfunc_objectmemberkeys(void) {
     for (int i=0; i<AVM_TABLE_HASHSIZE; i++) {
         bucket = actual->data.tableVal->numIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &index, &bucket->key);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &index, &bucket->key);
             index.data.numVal++;
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->strIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &index, &bucket->key);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &index, &bucket->key);
             index.data.numVal++;
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->boolIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &index, &bucket->key);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &index, &bucket->key);
             index.data.numVal++;
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->ufncIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &index, &bucket->key);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &index, &bucket->key);
             index.data.numVal++;
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->lfncIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &index, &bucket->key);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &index, &bucket->key);
             index.data.numVal++;
             bucket = bucket->next;
         }
     }
 }
 
-void libfunc_objecttotalmembers(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_objecttotalmembers(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'objecttotalmembers()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'objecttotalmembers()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != table_m) {
-        avm_warning("'objecttotalmembers()': table argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'objecttotalmembers()': table argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = number_m;
-    retval.data.numVal = (double)actual->data.tableVal->total;
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = (double)actual->data.tableVal->total;
     return;
 }
 
-void libfunc_objectcopy(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_objectcopy(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'objectcopy()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'objectcopy()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != table_m) {
-        avm_warning("'objectcopy()': table argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'objectcopy()': table argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     } 
-    avm_memcellclear(&retval);
-    retval.type = table_m;
-    retval.data.tableVal = avm_tablenew();
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = table_m;
+    vm->retval.data.tableVal = avm_tablenew(vm);
     struct avm_table_bucket *bucket;
     for (int i=0; i<AVM_TABLE_HASHSIZE; i++) {
         bucket = actual->data.tableVal->numIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &bucket->key, &bucket->value);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &bucket->key, &bucket->value);
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->strIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &bucket->key, &bucket->value);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &bucket->key, &bucket->value);
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->boolIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &bucket->key, &bucket->value);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &bucket->key, &bucket->value);
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->ufncIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &bucket->key, &bucket->value);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &bucket->key, &bucket->value);
             bucket = bucket->next;
         }
         bucket = actual->data.tableVal->lfncIndexed[i];
         while (bucket) {
-            avm_tablesetelem(retval.data.tableVal, &bucket->key, &bucket->value);
+            avm_tablesetelem(vm, vm->retval.data.tableVal, &bucket->key, &bucket->value);
             bucket = bucket->next;
         }
     }
 }
 
-void libfunc_totalarguments(void) {
-    unsigned p_topsp = avm_get_envvalue(topsp + AVM_SAVEDTOPSP_OFFSET);
+void libfunc_totalarguments(avm_state *vm) {
+    unsigned p_topsp = avm_get_envvalue(vm, vm->topsp + AVM_SAVEDTOPSP_OFFSET);
     if (!p_topsp) {
-        avm_warning("'totalarguments()': call outside a function!");
-        retval.type = nil_m;
+        avm_warning(vm, "'totalarguments()': call outside a function!");
+        vm->retval.type = nil_m;
         return;
     }
-    unsigned n = avm_totalactuals();
+    unsigned n = avm_totalactuals(vm);
     if (n) {
-        avm_warning("'totalarguments()': no argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'totalarguments()': no argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = number_m;
-    retval.data.numVal = avm_get_envvalue(p_topsp + AVM_NUMACTUALS_OFFSET);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = avm_get_envvalue(vm, p_topsp + AVM_NUMACTUALS_OFFSET);
     return;
 }
 
-void libfunc_argument(void) {
-    unsigned p_topsp = avm_get_envvalue(topsp + AVM_SAVEDTOPSP_OFFSET);
+void libfunc_argument(avm_state *vm) {
+    unsigned p_topsp = avm_get_envvalue(vm, vm->topsp + AVM_SAVEDTOPSP_OFFSET);
     if (!p_topsp) {
-        avm_warning("'argument()': call outside of function!");
-        retval.type = nil_m;
+        avm_warning(vm, "'argument()': call outside of function!");
+        vm->retval.type = nil_m;
         return;
     }
-    unsigned n = avm_totalactuals();
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'argument()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'argument()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != number_m) {
-        avm_warning("'argument()': number argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'argument()': number argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     } 
-    avm_memcellclear(&retval);
-    unsigned actuals = avm_get_envvalue(p_topsp + AVM_NUMACTUALS_OFFSET);
+    avm_memcellclear(&vm->retval);
+    unsigned actuals = avm_get_envvalue(vm, p_topsp + AVM_NUMACTUALS_OFFSET);
     if (actuals <= (unsigned)actual->data.numVal)  {
-        avm_warning("'argument()': surrounding function has only %u arguments, not %u!", actuals, (unsigned)actual->data.numVal+1);
-        retval.type = nil_m;
+        avm_warning(vm, "'argument()': surrounding function has only %u arguments, not %u!", actuals, (unsigned)actual->data.numVal+1);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcell m = stack[p_topsp + AVM_STACKENV_SIZE + 1 + (unsigned)actual->data.numVal];
-    retval.type = m.type;
+    avm_memcell m = vm->stack[p_topsp + AVM_STACKENV_SIZE + 1 + (unsigned)actual->data.numVal];
+    vm->retval.type = m.type;
     switch (m.type) {
         case number_m:
-            retval.data.numVal = m.data.numVal;
+            vm->retval.data.numVal = m.data.numVal;
             break;
         case string_m:
-            retval.data.strVal = strdup(m.data.strVal);
+            vm->retval.data.strVal = strdup(m.data.strVal);
             break;
         case bool_m:
-            retval.data.boolVal = m.data.boolVal;
+            vm->retval.data.boolVal = m.data.boolVal;
             break;
         case userfunc_m:
-            retval.data.funcVal = m.data.funcVal;
+            vm->retval.data.funcVal = m.data.funcVal;
             break;
         case libfunc_m:
-            retval.data.libfuncVal = strdup(m.data.libfuncVal);
+            vm->retval.data.libfuncVal = strdup(m.data.libfuncVal);
             break;
         case table_m:
-            retval.data.tableVal = m.data.tableVal;
+            vm->retval.data.tableVal = m.data.tableVal;
+            avm_tableincrefcounter(vm->retval.data.tableVal);
+            break;
+        case coroutine_m:
+            vm->retval.data.coroutineVal = m.data.coroutineVal;
+            avm_coroutineincref(vm->retval.data.coroutineVal);
             break;
         case nil_m:
         case undef_m:
@@ -786,238 +1032,103 @@ void libfunc_argument(void) {
     return;
 }
 
-void libfunc_typeof(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_typeof(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'typeof()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'typeof()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = string_m;
-    retval.data.strVal = strdup(typeStrings[avm_getactual(0)->type]);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = string_m;
+    vm->retval.data.strVal = strdup(typeStrings[avm_getactual(vm, 0)->type]);
 }
 
-void libfunc_strtonum(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_strtonum(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'strtonum()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'strtonum()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != string_m) {
-        avm_warning("'strtonum()': string argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'strtonum()': string argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = number_m;
-    retval.data.numVal = atof(actual->data.strVal);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = atof(actual->data.strVal);
     return;
 }
 
-void libfunc_sqrt(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_sqrt(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'sqrt()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'sqrt()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != number_m) {
-        avm_warning("'sqrt()': number argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'sqrt()': number argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = number_m;
-    retval.data.numVal = sqrt(actual->data.numVal);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = sqrt(actual->data.numVal);
 }
 
-void libfunc_cos(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_cos(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'cos()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'cos()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != number_m) {
-        avm_warning("'cos()': number argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'cos()': number argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = number_m;
-    retval.data.numVal = cos(actual->data.numVal);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = cos(actual->data.numVal);
 }
 
-void libfunc_sin(void) {
-    unsigned n = avm_totalactuals();
+void libfunc_sin(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
     if (n!=1) {
-        avm_warning("'sin()': one argument (not %d) expected!", n);
-        retval.type = nil_m;
+        avm_warning(vm, "'sin()': one argument (not %d) expected!", n);
+        vm->retval.type = nil_m;
         return;
     }
-    struct avm_memcell *actual = avm_getactual(0);
+    struct avm_memcell *actual = avm_getactual(vm, 0);
     if (actual->type != number_m) {
-        avm_warning("'sin()': number argument (not %s) expected!", typeStrings[actual->type]);
-        retval.type = nil_m;
+        avm_warning(vm, "'sin()': number argument (not %s) expected!", typeStrings[actual->type]);
+        vm->retval.type = nil_m;
         return;
     }
-    avm_memcellclear(&retval);
-    retval.type = number_m;
-    retval.data.numVal = sin(actual->data.numVal);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = sin(actual->data.numVal);
 }
 
 // ------------------- DISPLAY
 
-void print_stack() {
+void print_stack(avm_state *vm) {
     
     int i = AVM_STACKSIZE;
     printf("====== STACK ====== \n");
     
     while (--i) {
 
-        printf("Cell:%d type:%d", i , stack[i].type);
+        printf("Cell:%d type:%d", i , vm->stack[i].type);
         printf("\n");
         if (i == 4080) break;
     }
 
 }
-
-void use_instr_result(struct vmarg result){
-    struct userfunc* f1= NULL;
-    if(result.type == userfunc_a){
-            f1 = &userFuncs[result.val];
-    }
-    switch (result.type) {
-            case empty_a:break;
-            case label_a:
-                printf("00_%u ", result.val);
-                break;
-            case global_a:
-                printf("01_%u ", result.val);
-                break;
-            case formal_a:
-                printf("02_%u ", result.val);
-                break;
-            case local_a:
-                printf("03_%u ", result.val);
-                break;
-            case number_a:
-                printf("04_%u_[%f] ", result.val,numConsts[result.val]);
-                break;
-            case string_a:
-                 printf("05_%u_[\"%s\"] ", result.val,stringConsts[result.val]);
-                break;
-            case bool_a:
-                printf("06_%u ", result.val);
-                break;
-            case nil_a:
-                printf("07_nill");
-                break;
-            case userfunc_a:
-                printf("08_%u_[%s] ", result.val,(f1->id));
-                break;
-            case libfunc_a:
-                printf("09_%u_[%s] ", result.val,namedLibFuncs[result.val]);
-                break;
-            case retval_a:
-                printf("10_(retval) ", result.val);
-                break;
-            default:
-                assert(0);
-        }
-}
-
-void use_instr_arg1(struct vmarg arg1){
-    struct userfunc* f2= NULL;
-    if(arg1.type == userfunc_a){
-            f2 = &userFuncs[arg1.val];
-    }
-    switch (arg1.type) {
-            case empty_a:break;
-            case label_a:
-                printf("00_%u ", arg1.val);
-                break;
-            case global_a:
-                printf("01_%u ", arg1.val);
-                break;
-            case formal_a:
-                printf("02_%u ", arg1.val);
-                break;
-            case local_a:
-                printf("03_%u ", arg1.val);
-                break;
-            case number_a:
-                printf("04_%u_[%f] ", arg1.val, numConsts[arg1.val]);
-                break;
-            case string_a:
-                 printf("05_%u_[\"%s\"] ", arg1.val, stringConsts[arg1.val]);
-                break;
-            case bool_a:
-                printf("06_%u ", arg1.val);
-                break;
-            case nil_a:
-                printf("07_nill");
-                break;
-            case userfunc_a:
-                printf("08_%u_[%s] ", arg1.val, f2->id);
-                break;
-            case libfunc_a:
-                printf("09_%u_[%s] ", arg1.val, namedLibFuncs[arg1.val]);
-                break;
-            case retval_a:
-                printf("10_(retval) ", arg1.val);
-                break;
-            default:
-                assert(0);
-        }
-}
-
-void use_instr_arg2( struct vmarg arg2){
-    struct userfunc* f3= NULL;
-    if(arg2.type == userfunc_a){
-            f3 = &userFuncs[arg2.val];
-    }
-    switch (arg2.type) {
-            case empty_a:break;
-            case label_a:
-                printf("00_%u ", arg2.val);
-                break;
-            case global_a:
-                printf("01_%u ", arg2.val);
-                break;
-            case formal_a:
-                printf("02_%u ", arg2.val);
-                break;
-            case local_a:
-                printf("03_%u ", arg2.val);
-                break;
-            case number_a:
-                printf("04_%u_[%f] ", arg2.val, numConsts[arg2.val]);
-                break;
-            case string_a:
-                 printf("05_%u_[\"%s\"] ", arg2.val, stringConsts[arg2.val]);
-                break;
-            case bool_a:
-                printf("06_%u ", arg2.val);
-                break;
-            case nil_a:
-                printf("07_nill");
-                break;
-            case userfunc_a:
-                printf("08_%u_[%s] ", arg2.val, (f3->id));
-                break;
-            case libfunc_a:
-                printf("09_%u_[%s] ", arg2.val, namedLibFuncs[arg2.val]);
-                break;
-            case retval_a:
-                printf("10_(retval) ", arg2.val);
-                break;
-            default:
-                assert(0);
-        }
-}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include "abc.h"
 
 
 #define AVM_STACKSIZE 4096
@@ -10,54 +11,85 @@
 #define AVM_STACKENV_SIZE 4
 #define AVM_WIPEOUT(m) memset(&(m), 0, sizeof(m))
 #define AVM_TABLE_HASHSIZE 211
-#define AVM_MAX_INSTRUCTIONS (unsigned) nop_v
+#define AVM_MAX_INSTRUCTIONS (unsigned) yield_v
 #define AVM_NUMACTUALS_OFFSET   +4
 #define AVM_SAVEDPC_OFFSET      +3
 #define AVM_SAVEDTOP_OFFSET     +2
 #define AVM_SAVEDTOPSP_OFFSET   +1
 
-unsigned warnings;
-unsigned char executionFinished ;
-unsigned pc;
-unsigned currLine;
-unsigned codeSize;
-#define AVM_ENDING_PC codeSize
-struct instruction *code ;
-unsigned totalActuals;
-unsigned GlobalProgrammVarOffset;
-
-char *typeStrings[8];
-void execute_arithmetic (struct instruction *);
-
-void execute_assign (struct instruction*);
-void execute_add (struct instruction*);
-void execute_sub (struct instruction*);
-void execute_mul (struct instruction*);
-void execute_div (struct instruction*);
-void execute_div (struct instruction*);
-void execute_mod (struct instruction*);
-void execute_mod (struct instruction*);
-void execute_uminus (struct instruction*);
-void execute_and (struct instruction*);
-void execute_and (struct instruction*);
-void execute_or (struct instruction*);
-void execute_not (struct instruction*);
-void execute_jeq (struct instruction*);
-void execute_jne (struct instruction*);
-void execute_jle (struct instruction*);
-void execute_jge (struct instruction*);
-void execute_jge (struct instruction*);
-void execute_jlt (struct instruction*);
-void execute_jgt (struct instruction*);
-void execute_jump (struct instruction*);
-void execute_call (struct instruction*);
-void execute_pusharg (struct instruction*);
-void execute_funcenter (struct instruction*);
-void execute_funcexit (struct instruction*);
-void execute_newtable (struct instruction*);
-void execute_tablegetelem (struct instruction*);
-void execute_tablesetelem (struct instruction*);
-void execute_nop (struct instruction*);
+typedef struct avm_state avm_state;
+typedef struct avm_program avm_program;
+struct instruction;
+
+char *typeStrings[9];
+void execute_arithmetic (avm_state *, struct instruction *);
+
+void execute_assign (avm_state *, struct instruction*);
+void execute_add (avm_state *, struct instruction*);
+void execute_sub (avm_state *, struct instruction*);
+void execute_mul (avm_state *, struct instruction*);
+void execute_div (avm_state *, struct instruction*);
+void execute_mod (avm_state *, struct instruction*);
+void execute_uminus (avm_state *, struct instruction*);
+void execute_and (avm_state *, struct instruction*);
+void execute_or (avm_state *, struct instruction*);
+void execute_not (avm_state *, struct instruction*);
+void execute_jeq (avm_state *, struct instruction*);
+void execute_jne (avm_state *, struct instruction*);
+void execute_jle (avm_state *, struct instruction*);
+void execute_jge (avm_state *, struct instruction*);
+void execute_jlt (avm_state *, struct instruction*);
+void execute_jgt (avm_state *, struct instruction*);
+void execute_jump (avm_state *, struct instruction*);
+void execute_call (avm_state *, struct instruction*);
+void execute_pusharg (avm_state *, struct instruction*);
+void execute_funcenter (avm_state *, struct instruction*);
+void execute_funcexit (avm_state *, struct instruction*);
+void execute_newtable (avm_state *, struct instruction*);
+void execute_tablegetelem (avm_state *, struct instruction*);
+void execute_tablesetelem (avm_state *, struct instruction*);
+void execute_nop (avm_state *, struct instruction*);
+void execute_add_nn (avm_state *, struct instruction*);
+void execute_sub_nn (avm_state *, struct instruction*);
+void execute_mul_nn (avm_state *, struct instruction*);
+void execute_div_nn (avm_state *, struct instruction*);
+void execute_mod_nn (avm_state *, struct instruction*);
+void execute_jeq_nn (avm_state *, struct instruction*);
+void execute_jne_nn (avm_state *, struct instruction*);
+void execute_jle_nn (avm_state *, struct instruction*);
+void execute_jge_nn (avm_state *, struct instruction*);
+void execute_jlt_nn (avm_state *, struct instruction*);
+void execute_jgt_nn (avm_state *, struct instruction*);
+void execute_yield (avm_state *, struct instruction*);
+
+// checks the typed opcodes against the types it can prove, 0 when the binary must not run;
+// *downgraded is how many typed instructions were turned back into checked ones
+int avm_verify(avm_program *, unsigned *downgraded);
+
+// --profile <file>: per-instruction counts, branch, type and call-target histograms
+void avm_profile_init(avm_state *);
+void avm_profile_before(avm_state *, struct instruction *);
+void avm_profile_after(avm_state *, struct instruction *, unsigned oldPC);
+int avm_profile_write(avm_state *, char *path);
+// --profile-opcodes <file>: per-opcode counts and time, operand kinds and n-grams, AVM/opprofile.c
+void avm_opprofile_init(avm_state *);
+void avm_opprofile_before(avm_state *, struct instruction *);
+void avm_opprofile_after(avm_state *, struct instruction *);
+int avm_opprofile_write(avm_state *, char *path);
+// --counters [--counters-functions]: perf_event_open counters around the run and per user function, AVM/counters.c
+int avm_counters_init(avm_state *, int functions);
+void avm_counters_before(avm_state *, struct instruction *);
+void avm_counters_stop(avm_state *);
+void avm_counters_report(avm_state *, FILE *);
+void avm_counters_json(avm_state *, FILE *);
+void avm_countersrelease(avm_state *);
+// --sample <file>: SIGPROF sampling of the Alpha call stack into folded stacks, AVM/sample.c
+int avm_sample_start(avm_state *, unsigned hz);
+void avm_sample_stop(avm_state *);
+int avm_sample_write(avm_state *, char *path);
+
+// --batch <manifest>: the binaries of the manifest run on a pool of threads
+int avm_batch(int argc, char *argv[]);
 
 
 enum vmopcode {
@@ -85,7 +117,21 @@ enum vmopcode {
     newtable_v,
     tablegetelem_v,
     tablesetelem_v,
-    nop_v
+    nop_v,
+    // operands proven numbers by the compiler and the verifier
+    add_nn_v,
+    sub_nn_v,
+    mul_nn_v,
+    div_nn_v,
+    mod_nn_v,
+    jeq_nn_v,
+    jne_nn_v,
+    jle_nn_v,
+    jge_nn_v,
+    jlt_nn_v,
+    jgt_nn_v,
+    // suspends the running coroutine, AVM/coroutine.c
+    yield_v
 };
 
 typedef enum vmarg_t {
@@ -111,7 +157,8 @@ typedef enum avm_memcell_t {
     userfunc_m,
     libfunc_m,
     nil_m,
-    undef_m
+    undef_m,
+    coroutine_m
 }avm_memcell_t;
 
 
@@ -120,18 +167,33 @@ struct vmarg {
     unsigned val;
 };
 
+// laid out as abc_instruction (see abc.h), operands are read with avm_operand and avm_translate
 struct instruction {
-    enum vmopcode opcode;
-    struct vmarg result;
-    struct vmarg arg1;
-    struct vmarg arg2;
-    unsigned srcLine;
+    unsigned char opcode;		// enum vmopcode | result kind << ABC_RESULT_SHIFT
+    unsigned char kinds;		// arg1 kind | arg2 kind << 4, ABC_WIDE when the operands are in codeWide
+    unsigned short result;
+    unsigned short arg1;
+    unsigned short arg2;
 };
 
+// laid out as abc_wide
+struct wide_operands {
+    unsigned char kinds[3];
+    unsigned char unused;
+    unsigned vals[3];
+};
+
+#define AVM_RESULT 0
+#define AVM_ARG1 1
+#define AVM_ARG2 2
+#define AVM_OPCODE(instr) ((enum vmopcode) ((instr)->opcode & ABC_OPCODE_BITS))
+#define AVM_SETOPCODE(instr, op) ((instr)->opcode = ((instr)->opcode & ~ABC_OPCODE_BITS) | (op))
+
+// laid out as abc_userfunc, so a mapped binary is used as it is
 struct userfunc {
     unsigned address;
     unsigned localSize;
-    char *id;
+    unsigned id;			// offset of the name in stringBlob
 };
 
 typedef struct avm_memcell  {
@@ -143,6 +205,7 @@ typedef struct avm_memcell  {
         struct avm_table *tableVal;
         unsigned funcVal;
         char *libfuncVal;
+        struct avm_coroutine *coroutineVal;
     } data;
 } avm_memcell;
 
@@ -152,9 +215,23 @@ struct avm_table_bucket {
     struct avm_table_bucket *next;
 };
 
+// what the tables of a VM hold, kept by exec_table.c and task.c, shown by vmstats() and --vmstats, AVM/heapstats.c
+struct avm_heapstats {
+    unsigned long tables, tablesPeak, tablesCreated;
+    unsigned long buckets, bucketsPeak;
+    // bytes of the live tables, their buckets and the strings of the keys and the values
+    unsigned long long tableBytes, bucketBytes, keyBytes, valueBytes;
+    unsigned long long bytesPeak;
+};
+
 // LECTURE 13 SLIDE 25 BONUS TO IMPLEMENT
 struct avm_table {
     unsigned refCounter;
+    struct avm_heapstats *stats;        // of the VM that made it
+    unsigned char reached;              // while heapstats looks for tables only cycles keep alive
+    // in the list of every table of the VM, which avm_destroy frees whatever their counts
+    struct avm_table *next;
+    struct avm_table **prev;
     struct avm_table_bucket *strIndexed[AVM_TABLE_HASHSIZE];
     struct avm_table_bucket *numIndexed[AVM_TABLE_HASHSIZE];
     struct avm_table_bucket *ufncIndexed[AVM_TABLE_HASHSIZE]; // BONUS
@@ -163,87 +240,220 @@ struct avm_table {
     unsigned total;
 };
 
-avm_memcell ax, bx, cx, retval, stack[AVM_STACKSIZE];
-unsigned top, topsp;
-// ------------------- GLOBALS
-unsigned totalStringConsts;
-char **stringConsts;
-char *consts_getstring(unsigned);
+#define AVM_COROUTINE_CREATED   0
+#define AVM_COROUTINE_SUSPENDED 1
+#define AVM_COROUTINE_RUNNING   2
+#define AVM_COROUTINE_DEAD      3
+
+// what coroutine() returns, AVM/coroutine.c; its cells are on the stack while it runs
+struct avm_coroutine {
+    unsigned refCounter;
+    // in the list of every coroutine of the VM, released with it like the tables
+    struct avm_coroutine *next;
+    struct avm_coroutine **prev;
+    unsigned char status;
+    unsigned func;                      // address of the function it runs
+    // the arguments until it first runs, then the cells from top + 1 to anchor as they were when it yielded
+    avm_memcell *segment;
+    unsigned size;
+    unsigned capacity;
+    unsigned pc;                        // after the yield
+    unsigned top, topsp;
+    unsigned base;                      // topsp of the function it runs
+    unsigned anchor;                    // top of the resume() frame it runs below
+    // where resume() returns to
+    unsigned resumerPC, resumerTop, resumerTopsp;
+    struct avm_coroutine *resumer;      // the coroutine that called resume(), NULL for the program
+};
+
+typedef void (*library_func_t)(avm_state *);
 
-unsigned totalNumConsts;
-double *numConsts;
-double consts_getnumber(unsigned);
+// a loaded binary; read-only once verified, so any number of VMs can run it at the same time
+struct avm_program {
+	// every string of the binary, NUL terminated; the string and libfunc tables hold offsets into it
+	char *stringBlob;
+	unsigned totalBlobSize;
+	unsigned totalStringConsts;
+	unsigned *stringConsts;
+	unsigned totalNumConsts;
+	double *numConsts;
+	unsigned totalUserFuncs;
+	struct userfunc *userFuncs;
+	unsigned totalNamedLibFuncs;
+	unsigned *namedLibFuncs;
+	unsigned codeSize;
+	struct instruction *code;
+	unsigned *codeLines;		// source line of each instruction, only looked at to report it
+	unsigned totalWide;
+	struct wide_operands *codeWide;	// operands of the instructions that do not fit in 16 bits
+	unsigned globals;		// GlobalProgrammVarOffset
+	unsigned warnings;		// raised while loading, every VM running it starts with them
+	// what the tables point into: a mapping of the file, an image the caller owns, or
+	// nothing when they were copied out of a version 1 binary
+	char *image;
+	size_t imageSize;
+	int mapped;
+};
+
+// one VM running a program: everything execution changes
+struct avm_state {
+	avm_program *program;
+	avm_memcell ax, bx, cx, retval, stack[AVM_STACKSIZE];
+	unsigned top, topsp;
+	unsigned pc;
+	unsigned totalActuals;
+	unsigned char executionFinished;
+	unsigned warnings;
+	unsigned errors;
+	library_func_t *libFuncs;		// by the index of the name in namedLibFuncs
+	struct avm_profile_entry *profile;	// NULL unless profiling
+	struct avm_opprofile *opprofile;	// NULL unless profiling opcodes
+	struct avm_counters *counters;		// NULL unless hardware counters are open
+	struct avm_table *tables;		// every table not yet destroyed
+	struct avm_coroutine *coroutines;	// every coroutine not yet destroyed
+	struct avm_coroutine *running;		// the innermost coroutine running, NULL in the program
+	struct avm_events *events;		// the I/O event loop, NULL until an io library function needs it
+	struct avm_task **handles;		// spawn() tasks not joined yet by handle - 1, NULL once joined
+	unsigned totalHandles, handlesSize;
+	struct avm_heapstats heap;
+	FILE *out;			// print(), errors and warnings; stdout unless the caller sets it
+	FILE *in;			// input(); stdin unless the caller sets it
+};
 
-unsigned totalUserFuncs;
-struct userfunc *userFuncs;
-struct userfunc userFuncs_get(unsigned);
+#define AVM_ENDING_PC(vm) ((vm)->program->codeSize)
+// where the function of a coroutine returns to, past the end of the code
+#define AVM_COROUTINE_PC(vm) ((vm)->program->codeSize + 1)
+// where an I/O callback returns to, AVM/event.c
+#define AVM_CALLBACK_PC(vm) ((vm)->program->codeSize + 2)
 
-unsigned totalNamedLibFuncs;
-char **namedLibFuncs;
-char *libfuncs_getused(unsigned);
+// ------------------- INSTANCES
+// reads and verifies a binary, NULL when it cannot run
+avm_program *avm_load(char *path);
+// a binary image already in memory, such as alpha_compile returns; it must stay allocated
+// and writable until avm_unload, since the tables point into it
+avm_program *avm_loadimage(char *image, size_t size);
+void avm_unload(avm_program *);
+// a VM with a cleared stack at the start of the program
+avm_state *avm_create(avm_program *);
+// runs to the end of the program, 0 when it stopped on an error
+int avm_run(avm_state *);
+void avm_destroy(avm_state *);
+
+// ------------------- GLOBALS
+char *consts_getstring(avm_program *, unsigned);
+double consts_getnumber(avm_program *, unsigned);
+char *avm_funcname(avm_program *, struct userfunc *);
+char *libfuncs_getused(avm_program *, unsigned);
 // ===========================================================================
-avm_memcell *avm_translate_operand (struct vmarg *, struct avm_memcell *) ;
-unsigned hsh(struct avm_memcell * index );
-struct avm_memcell *avm_tablegetelem (struct avm_table *, struct avm_memcell *);
-void avm_tablesetelem (struct avm_table *, struct avm_memcell *, struct avm_memcell *);
-void avm_tableremoveindex(struct avm_table *, struct avm_memcell *);
+avm_memcell *avm_translate_operand (avm_state *, struct vmarg *, struct avm_memcell *) ;
+// result, arg1 or arg2 of an instruction
+struct vmarg avm_operand (avm_program *, struct instruction *, unsigned which);
+avm_memcell *avm_translate (avm_state *, struct instruction *, unsigned which, struct avm_memcell *);
+// the target of a jump
+unsigned avm_label (avm_program *, struct instruction *);
+// kind of the result of an opcode when it is not a variable, ABC_VARIABLE otherwise
+unsigned avm_implied_result (enum vmopcode);
+// packs an instruction into code[i], appending to codeWide when it does not fit
+void avm_encode (avm_program *, unsigned i, enum vmopcode, struct vmarg *result, struct vmarg *arg1, struct vmarg *arg2);
+unsigned hsh(avm_state *, struct avm_memcell * index );
+struct avm_memcell *avm_tablegetelem (avm_state *, struct avm_table *, struct avm_memcell *);
+void avm_tablesetelem (avm_state *, struct avm_table *, struct avm_memcell *, struct avm_memcell *);
+void avm_tablecopycell(struct avm_memcell *, struct avm_memcell *);
+void avm_tableremoveindex(avm_state *, struct avm_table *, struct avm_memcell *);
 void avm_tableincrefcounter(struct avm_table *t);
 void avm_tabledecrefcounter(struct avm_table *t);
 void avm_tablebucketsinit(struct avm_table_bucket **);
-struct avm_table *avm_tablenew(void);
-void avm_tablebucketsdestroy(struct avm_table_bucket **);
+struct avm_table *avm_tablenew(avm_state *);
+void avm_tablesrelease(avm_state *);
+void avm_tablebucketsdestroy(struct avm_heapstats *, struct avm_table_bucket **);
 void avm_tabledestroy(struct avm_table *t);
-void avm_tableincrefcounter(struct avm_table *) ;
-void avm_tabledecrefcounter(struct avm_table *) ;
-void avm_tablebucketsinit(struct avm_table_bucket **) ;
-struct avm_table *avm_tablenew(void);
-void avm_tablebucketsdestroy(struct avm_table_bucket **) ;
-void avm_tabledestroy(struct avm_table *) ;
-void execution_cycle (void) ;
+void execution_cycle (avm_state *) ;
 // ---------------------------------------------------------------------------
 // INSTRUCTION IMPLEMENTATION
 // ---------------------------------------------------------------------------
-void avm_assign (struct avm_memcell *, struct avm_memcell *);
+void avm_assign (avm_state *, struct avm_memcell *, struct avm_memcell *);
 typedef void (*memclear_func_t)(struct avm_memcell *);
-void avm_memcellclear(struct avm_memcell *) ;;
-// extern void avm_callsaveenvironment(void);
-void avm_callsaveenvironment (void);
-void avm_dec_top(void) ;
-void avm_push_envvalue(unsigned) ;
-void avm_callsaveenvironment(void);;
-unsigned avm_get_envvalue(unsigned) ;
-typedef void (*library_func_t)(void);
-library_func_t avm_getlibraryfunc(char *);
-struct userfunc *avm_getfuncinfo(unsigned address);
-void avm_calllibfunc(char *);
-unsigned avm_totalactuals(void) ;
-struct avm_memcell *avm_getactual(unsigned) ;
-void avm_registerlibfunc(char *, library_func_t);
+void avm_memcellclear(struct avm_memcell *) ;
+void avm_callsaveenvironment (avm_state *);
+void avm_dec_top(avm_state *) ;
+void avm_push_envvalue(avm_state *, unsigned) ;
+unsigned avm_get_envvalue(avm_state *, unsigned) ;
+library_func_t avm_getlibraryfunc(avm_state *, char *);
+struct userfunc *avm_getfuncinfo(avm_program *, unsigned address);
+void avm_calllibfunc(avm_state *, char *);
+unsigned avm_totalactuals(avm_state *) ;
+struct avm_memcell *avm_getactual(avm_state *, unsigned) ;
+void avm_registerlibfunc(avm_state *, char *, library_func_t);
 // ------------------- STRINGS
-typedef char *(*tostring_func_t)(struct avm_memcell *);
-// extern char *avm_tostring(struct avm_memcell *);
-char *avm_tostring(struct avm_memcell *);
+typedef char *(*tostring_func_t)(avm_state *, struct avm_memcell *);
+char *avm_tostring(avm_state *, struct avm_memcell *);
 // ------------------- BOOLEAN
 typedef unsigned char (*tobool_func_t)(struct avm_memcell *);
 unsigned char avm_tobool(struct avm_memcell *) ;
 // ------------------- AVM
-void avm_initialize (void) ;
-void avm_initstack();
-void avm_error(char *format, ...);
-void avm_warning(char *format, ...);
+void avm_initruntime (avm_state *) ;
+void avm_initstack(avm_state *);
+// vm is NULL for errors and warnings while loading
+void avm_error(avm_state *vm, char *format, ...);
+void avm_warning(avm_state *vm, char *format, ...);
 // ------------------- LIBS
-library_func_t *library_func_t_addresses;
-
-void avm_register_libfuncs();
-void libfunc_print(void);
-void libfunc_input(void);
-void libfunc_objectmemberkeys(void);
-void libfunc_objecttotalmembers(void);
-void libfunc_objectcopy(void);
-void libfunc_totalarguments(void);
-void libfunc_argument(void);
-void libfunc_typeof(void);
-void libfunc_strtonum(void);
-void libfunc_sqrt(void);
-void libfunc_cos(void);
-void libfunc_sin(void);
+void avm_register_libfuncs(avm_state *);
+void libfunc_print(avm_state *);
+void libfunc_input(avm_state *);
+void libfunc_objectmemberkeys(avm_state *);
+void libfunc_objecttotalmembers(avm_state *);
+void libfunc_objectcopy(avm_state *);
+void libfunc_totalarguments(avm_state *);
+void libfunc_argument(avm_state *);
+void libfunc_typeof(avm_state *);
+void libfunc_strtonum(avm_state *);
+void libfunc_sqrt(avm_state *);
+void libfunc_cos(avm_state *);
+void libfunc_sin(avm_state *);
+// spawn(f, args...) and join(handle), AVM/task.c
+void libfunc_spawn(avm_state *);
+void libfunc_join(avm_state *);
+// waits for the tasks spawned and not joined, before the VM and its program go
+void avm_tasksrelease(avm_state *);
+// parallel_map(table, f) and parallel_reduce(table, f, init), AVM/task.c
+void libfunc_parallel_map(avm_state *);
+void libfunc_parallel_reduce(avm_state *);
+// coroutine(f, args...), resume(co) and coroutinestatus(co), AVM/coroutine.c
+void libfunc_coroutine(avm_state *);
+void libfunc_resume(avm_state *);
+void libfunc_coroutinestatus(avm_state *);
+// ------------------- HEAP STATISTICS
+void avm_heapstats_table(struct avm_heapstats *, int delta);
+// a bucket with the strings of its key and value, or just the string of a value
+void avm_heapstats_bucket(struct avm_heapstats *, struct avm_table_bucket *, int delta);
+void avm_heapstats_value(struct avm_heapstats *, struct avm_memcell *, int delta);
+// --vmstats: the counters, the chain lengths and the tables only cycles keep alive
+void avm_heapstats_dump(avm_state *, FILE *);
+// ------------------- COROUTINES
+void avm_coroutineincref(struct avm_coroutine *);
+void avm_coroutinedecref(struct avm_coroutine *);
+// frees every coroutine without following what their cells reference, like avm_tablesrelease
+void avm_coroutinesrelease(avm_state *);
+// suspends the running coroutine with the value, the resume() that ran it returns it
+void avm_coroutineyield(avm_state *, avm_memcell *);
+// the function of the running coroutine returned to AVM_COROUTINE_PC
+void avm_coroutinereturned(avm_state *);
+// ioopen(path, mode), iopipe(), iolisten(path), ioconnect(path), ioaccept(fd, cb), ioread(fd, cb),
+// iowrite(fd, data[, cb]), ioclose(fd) and ioresult(), AVM/event.c
+void libfunc_ioopen(avm_state *);
+void libfunc_iopipe(avm_state *);
+void libfunc_iolisten(avm_state *);
+void libfunc_ioconnect(avm_state *);
+void libfunc_ioaccept(avm_state *);
+void libfunc_ioread(avm_state *);
+void libfunc_iowrite(avm_state *);
+void libfunc_ioclose(avm_state *);
+void libfunc_ioresult(avm_state *);
+// vmstats(), AVM/heapstats.c
+void libfunc_vmstats(avm_state *);
+// ------------------- EVENTS
+// runs the callbacks of the event loop until nothing is armed, at the end of the program
+void avm_eventsrun(avm_state *);
+unsigned avm_eventspending(avm_state *);
+// closes the descriptors the io library functions opened and frees the loop
+void avm_eventsrelease(avm_state *);
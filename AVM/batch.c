@@ -0,0 +1,238 @@
+#include "avm.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+ * Runs many binaries in one process on a fixed pool of threads:
+ *
+ *   ./avm_exec --batch jobs.txt [--jobs 8] [--out results]
+ *
+ * A manifest line is `<binary> [<input file>]`, blank lines and lines starting
+ * with # are skipped. Every distinct binary is loaded and verified once, before
+ * the workers start, and the jobs running it share the avm_program; each job
+ * gets a VM of its own, reading input() from its input file (nothing when
+ * there is none) and printing into a buffer. With --out the output of job n is
+ * written to <dir>/<n>.out and only a line per job is printed, without it the
+ * outputs follow those lines in manifest order. The throughput and latency
+ * summary goes to stderr. --jobs defaults to the number of online processors.
+ */
+
+typedef struct batch_program {
+    char *path;
+    avm_program *program;           // NULL when it did not load
+    struct batch_program *next;     // in its hash chain
+} batch_program;
+
+typedef struct batch_job {
+    char *path;
+    char *input;                    // NULL for no input
+    batch_program *binary;
+    int ran;
+    int ok;
+    unsigned warnings;
+    double ms;                      // from avm_create to avm_destroy
+    char *output;                   // the captured stdout, unless written to the --out directory
+    size_t outputSize;
+} batch_job;
+
+#define BATCH_HASHSIZE 1024
+
+batch_job *batchJobs;
+unsigned totalBatchJobs;
+// the next job a worker takes
+unsigned nextBatchJob;
+pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+char *batchOutDir;
+
+double batch_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+unsigned batch_hash(char *s) {
+    unsigned h = 5381;
+    for (; *s; s++) h = h * 33 + (unsigned char) *s;
+    return h % BATCH_HASHSIZE;
+}
+
+// the manifest as jobs, 0 when it cannot be read
+int batch_read_manifest(char *path) {
+    char line[8192], *binary, *input;
+    unsigned capacity = 64;
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    batchJobs = (batch_job *) malloc(sizeof(batch_job) * capacity);
+    while (fgets(line, sizeof(line), f)) {
+        if (!(binary = strtok(line, " \t\r\n")) || binary[0] == '#') continue;
+        input = strtok(NULL, " \t\r\n");
+        if (totalBatchJobs == capacity) batchJobs = (batch_job *) realloc(batchJobs, sizeof(batch_job) * (capacity *= 2));
+        memset(batchJobs + totalBatchJobs, 0, sizeof(batch_job));
+        batchJobs[totalBatchJobs].path = strdup(binary);
+        batchJobs[totalBatchJobs].input = input ? strdup(input) : NULL;
+        totalBatchJobs++;
+    }
+    fclose(f);
+    return 1;
+}
+
+// loads every distinct binary once; loading is not thread safe and is done before the workers start
+void batch_load(batch_program **table) {
+    batch_program *b;
+    unsigned h;
+    for (unsigned i = 0; i < totalBatchJobs; i++) {
+        h = batch_hash(batchJobs[i].path);
+        for (b = table[h]; b && strcmp(b->path, batchJobs[i].path); b = b->next);
+        if (!b) {
+            b = (batch_program *) malloc(sizeof(batch_program));
+            b->path = batchJobs[i].path;
+            b->program = avm_load(b->path);
+            if (!b->program) fprintf(stderr, "\033[0;31mavm_exec: cannot load %s\033[0m\n", b->path);
+            b->next = table[h];
+            table[h] = b;
+        }
+        batchJobs[i].binary = b;
+    }
+}
+
+void batch_run(unsigned n) {
+    batch_job *job = batchJobs + n;
+    struct timespec start, end;
+    char path[4096];
+    FILE *out, *in = NULL;
+    avm_state *vm;
+    if (!job->binary->program) return;
+    if (job->input && !(in = fopen(job->input, "r"))) {
+        fprintf(stderr, "\033[0;31mavm_exec: cannot read %s\033[0m\n", job->input);
+        return;
+    }
+    if (batchOutDir) {
+        snprintf(path, sizeof(path), "%s/%u.out", batchOutDir, n);
+        out = fopen(path, "w");
+    }
+    else out = open_memstream(&job->output, &job->outputSize);
+    if (!out) {
+        fprintf(stderr, "\033[0;31mavm_exec: cannot capture the output of job %u\033[0m\n", n);
+        if (in) fclose(in);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vm = avm_create(job->binary->program);
+    vm->out = out;
+    vm->in = in ? in : fopen("/dev/null", "r");
+    job->ok = avm_run(vm);
+    job->warnings = vm->warnings;
+    if (vm->in) fclose(vm->in);
+    avm_destroy(vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->ms = batch_ms(&start, &end);
+    job->ran = 1;
+    fclose(out);
+}
+
+void *batch_worker(void *arg) {
+    unsigned n;
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&batchLock);
+        n = nextBatchJob++;
+        pthread_mutex_unlock(&batchLock);
+        if (n >= totalBatchJobs) return NULL;
+        batch_run(n);
+    }
+}
+
+int batch_compare_ms(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// the latency below which p percent of the sorted latencies are
+double batch_percentile(double *ms, unsigned n, double p) {
+    unsigned i = (unsigned) (p / 100 * n);
+    return n ? ms[i < n ? i : n - 1] : 0;
+}
+
+int avm_batch(int argc, char *argv[]) {
+    batch_program *table[BATCH_HASHSIZE] = { 0 };
+    struct timespec start, loaded, end;
+    unsigned workers = 0, failed = 0, ran = 0, i;
+    double *ms, total = 0, wall;
+    pthread_t *threads;
+    long online;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: avm_exec --batch <manifest> [--jobs <n>] [--out <dir>]\n");
+        return 1;
+    }
+    for (i = 2; i + 1 < (unsigned) argc; i += 2) {
+        if (!strcmp(argv[i], "--jobs")) workers = (unsigned) atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--out")) batchOutDir = argv[i + 1];
+        else break;
+    }
+    if (i != (unsigned) argc) {
+        fprintf(stderr, "avm_exec: unknown batch option %s\n", argv[i]);
+        return 1;
+    }
+    if (!workers) workers = (online = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (unsigned) online : 1;
+    if (batchOutDir && mkdir(batchOutDir, 0777) && access(batchOutDir, W_OK)) {
+        fprintf(stderr, "avm_exec: cannot write to %s\n", batchOutDir);
+        return 1;
+    }
+    if (!batch_read_manifest(argv[1])) {
+        fprintf(stderr, "avm_exec: cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    batch_load(table);
+    clock_gettime(CLOCK_MONOTONIC, &loaded);
+    if (workers > totalBatchJobs) workers = totalBatchJobs ? totalBatchJobs : 1;
+    threads = (pthread_t *) malloc(sizeof(pthread_t) * workers);
+    for (i = 0; i < workers; i++) pthread_create(&threads[i], NULL, batch_worker, NULL);
+    for (i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ms = (double *) malloc(sizeof(double) * (totalBatchJobs + 1));
+    for (i = 0; i < totalBatchJobs; i++) {
+        batch_job *job = batchJobs + i;
+        printf("==> %u %s%s%s: %s, %.3f ms", i, job->path, job->input ? " < " : "", job->input ? job->input : "",
+            job->ok ? "ok" : "failed", job->ms);
+        if (job->warnings) printf(", %u warning(s)", job->warnings);
+        printf("\n");
+        if (job->output) {
+            fwrite(job->output, 1, job->outputSize, stdout);
+            if (job->outputSize && job->output[job->outputSize - 1] != '\n') printf("\n");
+            free(job->output);
+        }
+        if (!job->ok) failed++;
+        if (job->ran) {
+            ms[ran++] = job->ms;
+            total += job->ms;
+        }
+    }
+    qsort(ms, ran, sizeof(double), batch_compare_ms);
+    wall = batch_ms(&loaded, &end);
+    fprintf(stderr, "batch: %u jobs, %u failed, %u workers, loaded in %.3f ms, ran in %.3f ms, %.1f jobs/s\n",
+        totalBatchJobs, failed, workers, batch_ms(&start, &loaded), wall, wall > 0 ? totalBatchJobs * 1e3 / wall : 0);
+    fprintf(stderr, "batch: latency mean %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+        ran ? total / ran : 0, batch_percentile(ms, ran, 50), batch_percentile(ms, ran, 95),
+        batch_percentile(ms, ran, 99), ran ? ms[ran - 1] : 0);
+
+    for (i = 0; i < BATCH_HASHSIZE; i++) {
+        batch_program *b, *next;
+        for (b = table[i]; b; b = next) {
+            next = b->next;
+            avm_unload(b->program);
+            free(b);
+        }
+    }
+    for (i = 0; i < totalBatchJobs; i++) {
+        free(batchJobs[i].path);
+        free(batchJobs[i].input);
+    }
+    free(batchJobs);
+    free(threads);
+    free(ms);
+    return failed != 0;
+}
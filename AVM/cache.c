@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+unsigned long long cache_hash(unsigned long long h, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// hashes the contents of the file, 0 if it cannot be read
+int cache_hash_file(unsigned long long *h, const char *path) {
+    char buf[65536];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    while ((n = fread(buf, 1, sizeof(buf), f))) *h = cache_hash(*h, buf, n);
+    fclose(f);
+    return 1;
+}
+
+char *abc_cache_dir(const char *dir) {
+    if (!dir) dir = getenv(ABC_CACHE_ENV);
+    if (!dir || !*dir) return NULL;
+    if (mkdir(dir, 0777) && access(dir, W_OK)) return NULL;
+    return strdup(dir);
+}
+
+int abc_cache_key(char key[ABC_CACHE_KEYLEN + 1], const char *source, const char *compiler, const char *flags, const char *profile) {
+    unsigned long long h = FNV_OFFSET;
+    struct stat st;
+    if (!cache_hash_file(&h, source)) return 0;
+    // the compiler is told apart by what ccache uses by default, its size and mtime
+    if (compiler && !stat(compiler, &st)) {
+        h = cache_hash(h, &st.st_size, sizeof(st.st_size));
+        h = cache_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+    }
+    h = cache_hash(h, flags, strlen(flags) + 1);
+    if (profile && !cache_hash_file(&h, profile)) return 0;
+    snprintf(key, ABC_CACHE_KEYLEN + 1, "%016llx", h);
+    return 1;
+}
+
+char *abc_cache_entry(const char *dir, const char *key) {
+    char *path = (char *) malloc(strlen(dir) + strlen(key) + 6);
+    sprintf(path, "%s/%s.abc", dir, key);
+    return path;
+}
+
+int cache_copy(const char *from, const char *to) {
+    char buf[65536];
+    size_t n;
+    int ok = 1;
+    FILE *in = fopen(from, "rb"), *out;
+    if (!in) return 0;
+    if (!(out = fopen(to, "wb"))) {
+        fclose(in);
+        return 0;
+    }
+    while (ok && (n = fread(buf, 1, sizeof(buf), in))) ok = fwrite(buf, 1, n, out) == n;
+    fclose(in);
+    return !fclose(out) && ok;
+}
+
+int abc_cache_fetch(const char *dir, const char *key, const char *dest) {
+    char *entry = abc_cache_entry(dir, key);
+    int hit = !access(entry, R_OK) && cache_copy(entry, dest);
+    free(entry);
+    return hit;
+}
+
+int abc_cache_store(const char *dir, const char *key, const char *binary) {
+    char *entry = abc_cache_entry(dir, key), *tmp = (char *) malloc(strlen(entry) + 32);
+    int ok;
+    sprintf(tmp, "%s.%ld.tmp", entry, (long) getpid());
+    ok = cache_copy(binary, tmp) && !rename(tmp, entry);
+    if (!ok) unlink(tmp);
+    free(tmp);
+    free(entry);
+    return ok;
+}
+
+int abc_cache_store_image(const char *dir, const char *key, const char *image, size_t size) {
+    char *entry = abc_cache_entry(dir, key), *tmp = (char *) malloc(strlen(entry) + 32);
+    FILE *f;
+    int ok;
+    sprintf(tmp, "%s.%ld.tmp", entry, (long) getpid());
+    if ((ok = (f = fopen(tmp, "wb")) != NULL)) {
+        ok = fwrite(image, 1, size, f) == size;
+        ok = !fclose(f) && ok;
+    }
+    ok = ok && !rename(tmp, entry);
+    if (!ok) unlink(tmp);
+    free(tmp);
+    free(entry);
+    return ok;
+}
+
+// the counters are read and rewritten under an exclusive lock
+void abc_cache_count(const char *dir, int hit) {
+    char path[4096];
+    abc_cache_stats s = { 0, 0 };
+    int fd;
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0666)) < 0) return;
+    flock(fd, LOCK_EX);
+    f = fdopen(fd, "r+");
+    if (fscanf(f, "hits %lu misses %lu", &s.hits, &s.misses) != 2) s.hits = s.misses = 0;
+    if (hit) s.hits++;
+    else s.misses++;
+    rewind(f);
+    fprintf(f, "hits %lu misses %lu\n", s.hits, s.misses);
+    fflush(f);
+    flock(fd, LOCK_UN);
+    fclose(f);
+}
+
+int abc_cache_stats_read(const char *dir, abc_cache_stats *stats) {
+    char path[4096];
+    FILE *f;
+    int ok;
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    stats->hits = stats->misses = 0;
+    if (!(f = fopen(path, "r"))) return 0;
+    flock(fileno(f), LOCK_SH);
+    ok = fscanf(f, "hits %lu misses %lu", &stats->hits, &stats->misses) == 2;
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Content-addressed cache of compiled binaries, shared by `out --cache <dir>`
+ * and the alpha driver. An entry is <dir>/<key>.abc, where the key hashes the
+ * source, the options that change the binary (including the contents of a
+ * profile) and the size and modification time of the compiler. Entries are
+ * written to a temporary file and renamed, so concurrent compiles of the same
+ * source never see half a binary. <dir>/stats counts hits and misses.
+ */
+
+#define ABC_CACHE_ENV "ALPHA_CACHE"
+#define ABC_CACHE_KEYLEN 16
+// the options part of the key: -O and the binary version
+#define ABC_CACHE_FLAGS "O%u v%u"
+
+typedef struct abc_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+} abc_cache_stats;
+
+// dir if given, else $ALPHA_CACHE, else NULL; the directory is created if missing
+char *abc_cache_dir(const char *dir);
+// 0 when the source cannot be read; profile may be NULL
+int abc_cache_key(char key[ABC_CACHE_KEYLEN + 1], const char *source, const char *compiler, const char *flags, const char *profile);
+// malloc'd <dir>/<key>.abc
+char *abc_cache_entry(const char *dir, const char *key);
+// copies the entry for key to dest, 0 on a miss
+int abc_cache_fetch(const char *dir, const char *key, const char *dest);
+int abc_cache_store(const char *dir, const char *key, const char *binary);
+// the same for a binary image in memory
+int abc_cache_store_image(const char *dir, const char *key, const char *image, size_t size);
+void abc_cache_count(const char *dir, int hit);
+int abc_cache_stats_read(const char *dir, abc_cache_stats *stats);
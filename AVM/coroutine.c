@@ -0,0 +1,232 @@
+#include "avm.h"
+
+/*
+ * Coroutines on the VM stack:
+ *
+ *   gen = coroutine(f, a, b);   // f(a, b) does not run yet
+ *   x = resume(gen);            // runs f until it yields x or returns x
+ *   coroutinestatus(gen);       // "suspended", "running", "dead", ...
+ *
+ * A coroutine runs right below the frame of the resume() that runs it, as if
+ * that libfunc had called it: the frame of f returns to AVM_COROUTINE_PC and
+ * execution_cycle then hands the return value to the resumer. yield moves the
+ * cells from the top of the stack down to the resume() frame into the
+ * coroutine and returns from resume(); the next resume() copies them back
+ * below its own frame, wherever that is, and moves the saved top and topsp of
+ * every frame along with them. A coroutine that resumes itself or one of its
+ * resumers is an error.
+ */
+
+char *coroutineStatusNames[] = {
+    "created",
+    "suspended",
+    "running",
+    "dead"
+};
+
+void avm_coroutineincref(struct avm_coroutine *co) {
+    ++co->refCounter;
+}
+
+void avm_coroutinedecref(struct avm_coroutine *co) {
+    assert(co->refCounter > 0);
+    if (--co->refCounter) return;
+    for (unsigned i = 0; i < co->size; i++) avm_memcellclear(&co->segment[i]);
+    *co->prev = co->next;
+    if (co->next) co->next->prev = co->prev;
+    free(co->segment);
+    free(co);
+}
+
+void avm_coroutinesrelease(avm_state *vm) {
+    struct avm_coroutine *co, *next;
+    for (co = vm->coroutines; co; co = next) {
+        next = co->next;
+        for (unsigned i = 0; i < co->size; i++)
+            if (co->segment[i].type == string_m) free(co->segment[i].data.strVal);
+        free(co->segment);
+        free(co);
+    }
+    vm->coroutines = NULL;
+}
+
+void coroutine_reserve(struct avm_coroutine *co, unsigned size) {
+    if (size <= co->capacity) return;
+    co->capacity = size > 2 * co->capacity ? size : 2 * co->capacity;
+    co->segment = (avm_memcell *) realloc(co->segment, sizeof(avm_memcell) * co->capacity);
+}
+
+void coroutine_setenv(avm_state *vm, unsigned i, unsigned val) {
+    assert(vm->stack[i].type == number_m);
+    vm->stack[i].data.numVal = val;
+}
+
+// back to the resume() that ran co, dropping its frame like execute_funcexit would
+void coroutine_leave(avm_state *vm, struct avm_coroutine *co) {
+    for (unsigned i = co->anchor + 1; i <= co->resumerTop; i++) avm_memcellclear(&vm->stack[i]);
+    vm->top = co->resumerTop;
+    vm->topsp = co->resumerTopsp;
+    vm->pc = co->resumerPC;
+    vm->totalActuals = 0;
+    vm->running = co->resumer;
+    co->resumer = NULL;
+    avm_coroutinedecref(co);
+}
+
+void avm_coroutineyield(avm_state *vm, avm_memcell *value) {
+    struct avm_coroutine *co = vm->running;
+    unsigned i;
+    if (!co) {
+        avm_error(vm, "Line %u: yield outside a coroutine!", vm->program->codeLines[vm->pc]);
+        return;
+    }
+    avm_assign(vm, &vm->retval, value);
+    co->size = co->anchor - vm->top;
+    coroutine_reserve(co, co->size);
+    for (i = 0; i < co->size; i++) {
+        co->segment[i] = vm->stack[vm->top + 1 + i];
+        vm->stack[vm->top + 1 + i].type = undef_m;
+    }
+    co->pc = vm->pc + 1;
+    co->top = vm->top;
+    co->topsp = vm->topsp;
+    co->status = AVM_COROUTINE_SUSPENDED;
+    coroutine_leave(vm, co);
+}
+
+void avm_coroutinereturned(avm_state *vm) {
+    struct avm_coroutine *co = vm->running;
+    assert(vm->top == co->anchor);
+    co->status = AVM_COROUTINE_DEAD;
+    co->size = 0;
+    coroutine_leave(vm, co);
+}
+
+void libfunc_coroutine(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm), i;
+    struct avm_memcell *f = n ? avm_getactual(vm, 0) : NULL;
+    struct avm_coroutine *co;
+    if (!f || f->type != userfunc_m) {
+        avm_warning(vm, "'coroutine()': user function argument (not %s) expected!", n ? typeStrings[f->type] : "nothing");
+        avm_memcellclear(&vm->retval);
+        vm->retval.type = nil_m;
+        return;
+    }
+    co = (struct avm_coroutine *) calloc(1, sizeof(struct avm_coroutine));
+    co->func = f->data.funcVal;
+    co->status = AVM_COROUTINE_CREATED;
+    // the arguments of f, kept until the first resume() pushes them
+    coroutine_reserve(co, n - 1);
+    for (i = 1; i < n; i++) {
+        co->segment[i - 1].type = undef_m;
+        avm_assign(vm, &co->segment[i - 1], avm_getactual(vm, i));
+    }
+    co->size = n - 1;
+    if ((co->next = vm->coroutines)) co->next->prev = &co->next;
+    co->prev = &vm->coroutines;
+    vm->coroutines = co;
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = coroutine_m;
+    vm->retval.data.coroutineVal = co;
+    avm_coroutineincref(co);
+}
+
+// a created coroutine gets the call of its function below the frame of resume()
+void coroutine_start(avm_state *vm, struct avm_coroutine *co) {
+    unsigned pc = vm->pc, i;
+    vm->totalActuals = co->size;
+    for (i = co->size; i-- > 0;) {
+        vm->stack[vm->top] = co->segment[i];
+        avm_dec_top(vm);
+    }
+    co->size = 0;
+    vm->pc = AVM_COROUTINE_PC(vm) - 1;
+    avm_callsaveenvironment(vm);
+    vm->pc = pc;
+    co->pc = co->func;
+    co->top = co->topsp = co->base = vm->top;
+}
+
+// a suspended one gets its cells back, with the frames moved to the new anchor
+void coroutine_restore(avm_state *vm, struct avm_coroutine *co, unsigned anchor) {
+    int delta = (int) anchor - (int) co->anchor;
+    unsigned i, t, savedtopsp;
+    for (i = 0; i < co->size; i++) {
+        avm_memcellclear(&vm->stack[co->top + 1 + i + delta]);
+        vm->stack[co->top + 1 + i + delta] = co->segment[i];
+    }
+    co->size = 0;
+    for (t = co->topsp;; t = savedtopsp) {
+        savedtopsp = avm_get_envvalue(vm, t + delta + AVM_SAVEDTOPSP_OFFSET);
+        coroutine_setenv(vm, t + delta + AVM_SAVEDTOPSP_OFFSET, savedtopsp + delta);
+        coroutine_setenv(vm, t + delta + AVM_SAVEDTOP_OFFSET, avm_get_envvalue(vm, t + delta + AVM_SAVEDTOP_OFFSET) + delta);
+        if (t == co->base) break;
+    }
+    co->top += delta;
+    co->topsp += delta;
+    co->base += delta;
+}
+
+void libfunc_resume(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm), anchor = vm->topsp;
+    struct avm_memcell *c = n ? avm_getactual(vm, 0) : NULL;
+    struct avm_coroutine *co;
+    if (n != 1 || c->type != coroutine_m) {
+        avm_warning(vm, "'resume()': coroutine argument (not %s) expected!", n ? typeStrings[c->type] : "nothing");
+        avm_memcellclear(&vm->retval);
+        vm->retval.type = nil_m;
+        return;
+    }
+    co = c->data.coroutineVal;
+    if (co->status == AVM_COROUTINE_RUNNING) {
+        avm_error(vm, "Line %u: 'resume()': the coroutine is already running!", vm->program->codeLines[vm->pc]);
+        return;
+    }
+    if (co->status == AVM_COROUTINE_DEAD) {
+        avm_warning(vm, "'resume()': the coroutine is dead!");
+        avm_memcellclear(&vm->retval);
+        vm->retval.type = nil_m;
+        return;
+    }
+    if (vm->top < co->size + AVM_STACKENV_SIZE + 1) {
+        avm_error(vm, "Stack Overflow!");
+        return;
+    }
+    co->resumerPC = avm_get_envvalue(vm, anchor + AVM_SAVEDPC_OFFSET);
+    co->resumerTop = avm_get_envvalue(vm, anchor + AVM_SAVEDTOP_OFFSET);
+    co->resumerTopsp = avm_get_envvalue(vm, anchor + AVM_SAVEDTOPSP_OFFSET);
+    if (co->status == AVM_COROUTINE_CREATED) {
+        co->anchor = anchor;
+        coroutine_start(vm, co);
+    }
+    else {
+        coroutine_restore(vm, co, anchor);
+        co->anchor = anchor;
+    }
+    // nil unless it yields or returns a value
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = nil_m;
+    co->status = AVM_COROUTINE_RUNNING;
+    co->resumer = vm->running;
+    vm->running = co;
+    avm_coroutineincref(co);
+    // the funcexit of resume() continues the coroutine instead of returning
+    coroutine_setenv(vm, anchor + AVM_SAVEDPC_OFFSET, co->pc);
+    coroutine_setenv(vm, anchor + AVM_SAVEDTOP_OFFSET, co->top);
+    coroutine_setenv(vm, anchor + AVM_SAVEDTOPSP_OFFSET, co->topsp);
+    vm->top = co->top;
+}
+
+void libfunc_coroutinestatus(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
+    struct avm_memcell *c = n ? avm_getactual(vm, 0) : NULL;
+    if (n != 1 || c->type != coroutine_m) {
+        avm_warning(vm, "'coroutinestatus()': coroutine argument (not %s) expected!", n ? typeStrings[c->type] : "nothing");
+        avm_memcellclear(&vm->retval);
+        vm->retval.type = nil_m;
+        return;
+    }
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = string_m;
+    vm->retval.data.strVal = strdup(coroutineStatusNames[c->data.coroutineVal->status]);
+}
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "avm.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * Hardware counters of `avm_exec --counters [--counters-functions]`, opened
+ * with perf_event_open on the thread running the VM, user space only:
+ * cycles, instructions, branch misses, L1d read misses and last level cache
+ * misses. They count from avm_run to the end of the program; with
+ * --counters-functions they are also read at every funcenter and funcexit
+ * and added up per user function, inclusive (total) and without the
+ * functions it called (self). Reading them costs a system call each time,
+ * which the counts of the function include.
+ *
+ * The counters are one group, read together and scaled by the time they ran
+ * when the kernel had to multiplex them. A counter that cannot be opened,
+ * as in most containers or under a strict perf_event_paranoid, is reported
+ * as unavailable and the rest go on; with none at all there is one line on
+ * stderr and the program runs as it would without the option. The report
+ * goes to stderr after the opcode profile, and into its JSON file when
+ * --profile-opcodes is given as well.
+ */
+
+#define AVM_COUNTERS 5
+#define AVM_COUNTERS_TOP 15
+
+typedef struct avm_counter_event {
+    char *name;
+    unsigned type;
+    unsigned long long config;
+} avm_counter_event;
+
+avm_counter_event counterEvents[AVM_COUNTERS] = {
+    { "cycles",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1d-misses",     PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    { "LLC-misses",     PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 }
+};
+
+typedef struct avm_counters_frame {
+    unsigned func;
+    unsigned topsp;
+    unsigned long long start[AVM_COUNTERS];
+    unsigned long long children[AVM_COUNTERS];  // of the functions it called
+} avm_counters_frame;
+
+typedef struct avm_counters_func {
+    unsigned long calls;
+    unsigned active;                            // frames of it open, so recursion is counted once in total
+    unsigned long long total[AVM_COUNTERS];
+    unsigned long long self[AVM_COUNTERS];
+} avm_counters_func;
+
+struct avm_counters {
+    int fd[AVM_COUNTERS];                       // -1 when unavailable
+    int error[AVM_COUNTERS];                    // the errno it failed with
+    unsigned slot[AVM_COUNTERS];                // position in the group read
+    int leader;
+    unsigned opened;
+    unsigned long long start[AVM_COUNTERS];
+    unsigned long long total[AVM_COUNTERS];
+    int stopped;
+    // --counters-functions
+    avm_counters_func *funcs;
+    avm_counters_frame *frames;
+    unsigned depth, capacity;
+};
+
+int counters_open(struct perf_event_attr *attr, int group) {
+    return (int) syscall(SYS_perf_event_open, attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+// the current value of every counter, 0 for the unavailable ones
+void counters_read(struct avm_counters *c, unsigned long long *values) {
+    // nr, time_enabled, time_running, then a value per counter in the order they were opened
+    unsigned long long group[3 + AVM_COUNTERS];
+    double scale = 1;
+    unsigned i;
+    memset(values, 0, sizeof(unsigned long long) * AVM_COUNTERS);
+    if (read(c->leader, group, sizeof(group)) < (ssize_t) (3 * sizeof(unsigned long long))) return;
+    if (group[2] && group[2] < group[1]) scale = (double) group[1] / group[2];
+    for (i = 0; i < AVM_COUNTERS; i++)
+        if (c->fd[i] >= 0 && c->slot[i] < group[0]) values[i] = (unsigned long long) (group[3 + c->slot[i]] * scale);
+}
+
+int avm_counters_init(avm_state *vm, int functions) {
+    struct avm_counters *c = (struct avm_counters *) calloc(1, sizeof(struct avm_counters));
+    struct perf_event_attr attr;
+    unsigned i;
+    c->leader = -1;
+    for (i = 0; i < AVM_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counterEvents[i].type;
+        attr.config = counterEvents[i].config;
+        attr.disabled = c->leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if ((c->fd[i] = counters_open(&attr, c->leader)) < 0) {
+            c->error[i] = errno;
+            continue;
+        }
+        if (c->leader < 0) c->leader = c->fd[i];
+        c->slot[i] = c->opened++;
+    }
+    if (!c->opened) {
+        fprintf(stderr, "counters: unavailable (%s), running without them\n", strerror(c->error[0]));
+        free(c);
+        return 0;
+    }
+    if (functions) c->funcs = (avm_counters_func *) calloc(vm->program->totalUserFuncs + 1, sizeof(avm_counters_func));
+    vm->counters = c;
+    ioctl(c->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    counters_read(c, c->start);
+    return 1;
+}
+
+void counters_enter(struct avm_counters *c, unsigned func, unsigned topsp) {
+    avm_counters_frame *f;
+    if (c->depth == c->capacity) {
+        c->capacity = c->capacity ? 2 * c->capacity : 64;
+        c->frames = (avm_counters_frame *) realloc(c->frames, sizeof(avm_counters_frame) * c->capacity);
+    }
+    f = c->frames + c->depth++;
+    f->func = func;
+    f->topsp = topsp;
+    memset(f->children, 0, sizeof(f->children));
+    c->funcs[func].calls++;
+    c->funcs[func].active++;
+    counters_read(c, f->start);
+}
+
+// frames above the one exiting are of coroutines that yielded and are dropped uncounted
+void counters_exit(struct avm_counters *c, unsigned topsp) {
+    unsigned long long now[AVM_COUNTERS], spent;
+    avm_counters_frame *f;
+    unsigned d, i;
+    for (d = c->depth; d > 0 && c->frames[d - 1].topsp != topsp; d--);
+    if (!d) return;
+    counters_read(c, now);
+    while (c->depth > d) c->funcs[c->frames[--c->depth].func].active--;
+    f = c->frames + --c->depth;
+    c->funcs[f->func].active--;
+    for (i = 0; i < AVM_COUNTERS; i++) {
+        spent = now[i] - f->start[i];
+        if (!c->funcs[f->func].active) c->funcs[f->func].total[i] += spent;
+        c->funcs[f->func].self[i] += spent > f->children[i] ? spent - f->children[i] : 0;
+        if (c->depth) c->frames[c->depth - 1].children[i] += spent;
+    }
+}
+
+void avm_counters_before(avm_state *vm, struct instruction *instr) {
+    struct avm_counters *c = vm->counters;
+    if (!c->funcs || c->stopped) return;
+    switch (AVM_OPCODE(instr)) {
+        // the frame of the function starts at the top of the stack
+        case funcenter_v:   counters_enter(c, avm_operand(vm->program, instr, AVM_RESULT).val, vm->top); break;
+        case funcexit_v:    counters_exit(c, vm->topsp); break;
+        default:            break;
+    }
+}
+
+void avm_counters_stop(avm_state *vm) {
+    struct avm_counters *c = vm->counters;
+    if (!c || c->stopped) return;
+    counters_read(c, c->total);
+    ioctl(c->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (unsigned i = 0; i < AVM_COUNTERS; i++) c->total[i] -= c->start[i];
+    c->stopped = 1;
+}
+
+// the first counter that was opened, what functions are sorted by
+unsigned counters_first(struct avm_counters *c) {
+    unsigned i;
+    for (i = 0; i < AVM_COUNTERS && c->fd[i] < 0; i++);
+    return i;
+}
+
+unsigned *counters_sort_funcs(struct avm_counters *c, unsigned n, unsigned k) {
+    unsigned *order = (unsigned *) malloc(sizeof(unsigned) * (n + 1)), i, j, t;
+    for (i = 0; i < n; i++) order[i] = i;
+    // insertion sort by self, most first; there are as many entries as user functions
+    for (i = 1; i < n; i++)
+        for (j = i; j > 0 && c->funcs[order[j]].self[k] > c->funcs[order[j - 1]].self[k]; j--) {
+            t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    return order;
+}
+
+void avm_counters_report(avm_state *vm, FILE *f) {
+    struct avm_counters *c = vm->counters;
+    avm_program *p = vm->program;
+    unsigned i, n, k, *order, shown = 0;
+    if (!c) return;
+    avm_counters_stop(vm);
+    k = counters_first(c);
+    fprintf(f, "counters:");
+    for (i = 0; i < AVM_COUNTERS; i++) if (c->fd[i] >= 0) fprintf(f, " %s %llu", counterEvents[i].name, c->total[i]);
+    if (c->fd[0] >= 0 && c->fd[1] >= 0 && c->total[0]) fprintf(f, ", %.2f instructions per cycle", (double) c->total[1] / c->total[0]);
+    if (c->fd[1] >= 0 && c->fd[2] >= 0 && c->total[1]) fprintf(f, ", %.2f branch misses per 1000 instructions", 1e3 * c->total[2] / c->total[1]);
+    fprintf(f, "\n");
+    for (i = 0; i < AVM_COUNTERS; i++)
+        if (c->fd[i] < 0) fprintf(f, "counters: %s unavailable (%s)\n", counterEvents[i].name, strerror(c->error[i]));
+    if (!c->funcs) return;
+    n = p->totalUserFuncs;
+    order = counters_sort_funcs(c, n, k);
+    fprintf(f, "%-24s %10s %16s", "function", "calls", "total");
+    for (i = 0; i < AVM_COUNTERS; i++) if (c->fd[i] >= 0) fprintf(f, " %16s", counterEvents[i].name);
+    fprintf(f, "\n");
+    for (i = 0; i < n && shown < AVM_COUNTERS_TOP; i++) {
+        avm_counters_func *fn = c->funcs + order[i];
+        if (!fn->calls) continue;
+        fprintf(f, "%-24s %10lu %16llu", avm_funcname(p, p->userFuncs + order[i]), fn->calls, fn->total[k]);
+        for (unsigned j = 0; j < AVM_COUNTERS; j++) if (c->fd[j] >= 0) fprintf(f, " %16llu", fn->self[j]);
+        fprintf(f, "\n");
+        shown++;
+    }
+    fprintf(f, "(total is the %s of the function and what it called, the rest exclude what it called)\n", counterEvents[k].name);
+    free(order);
+}
+
+// a "counters" member for the JSON of the opcode profile, after the ones already written
+void avm_counters_json(avm_state *vm, FILE *f) {
+    struct avm_counters *c = vm->counters;
+    avm_program *p = vm->program;
+    unsigned i, j, n = 0;
+    if (!c) return;
+    avm_counters_stop(vm);
+    fprintf(f, ",\n  \"counters\": {");
+    for (i = 0; i < AVM_COUNTERS; i++)
+        if (c->fd[i] >= 0) fprintf(f, "%s\n    \"%s\": %llu", n++ ? "," : "", counterEvents[i].name, c->total[i]);
+    fprintf(f, "%s\n    \"unavailable\": [", n ? "," : "");
+    for (i = 0, n = 0; i < AVM_COUNTERS; i++)
+        if (c->fd[i] < 0) fprintf(f, "%s\"%s\"", n++ ? ", " : "", counterEvents[i].name);
+    fprintf(f, "]");
+    if (c->funcs) {
+        fprintf(f, ",\n    \"functions\": [");
+        for (i = 0, n = 0; i < p->totalUserFuncs; i++) {
+            if (!c->funcs[i].calls) continue;
+            fprintf(f, "%s\n      {\"function\": \"%s\", \"calls\": %lu", n++ ? "," : "", avm_funcname(p, p->userFuncs + i), c->funcs[i].calls);
+            for (j = 0; j < AVM_COUNTERS; j++)
+                if (c->fd[j] >= 0) fprintf(f, ", \"%s\": {\"total\": %llu, \"self\": %llu}", counterEvents[j].name, c->funcs[i].total[j], c->funcs[i].self[j]);
+            fprintf(f, "}");
+        }
+        fprintf(f, "\n    ]");
+    }
+    fprintf(f, "\n  }");
+}
+
+void avm_countersrelease(avm_state *vm) {
+    struct avm_counters *c = vm->counters;
+    if (!c) return;
+    for (unsigned i = 0; i < AVM_COUNTERS; i++) if (c->fd[i] >= 0) close(c->fd[i]);
+    free(c->funcs);
+    free(c->frames);
+    free(c);
+    vm->counters = NULL;
+}
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include "avm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Non-blocking I/O on an epoll loop:
+ *
+ *   fd = ioopen(path, "r"|"w"|"a");     p = iopipe();   // p.read, p.write
+ *   s = iolisten(path);   c = ioconnect(path);          // local (Unix) sockets
+ *   ioaccept(s, cb);      // cb(s, fd) once a client connects
+ *   ioread(fd, cb);       // cb(fd, data) once there is data, data is nil at the end
+ *   iowrite(fd, data, cb);// queued, cb(fd, n) (n nil on error) once it is all written
+ *   ioclose(fd);          // after the queued output
+ *
+ * Reads and accepts are one-shot, a callback arms the next one. A callback is
+ * a user function or a coroutine; a coroutine is resumed and gets the data of
+ * the event from ioresult(). When the program reaches its end the VM runs the
+ * loop until nothing is armed, each callback running on the stack through the
+ * dispatch loop and returning to AVM_CALLBACK_PC. Regular files, which epoll
+ * refuses, are always ready. Data is read into strings, so it ends at a 0 byte.
+ * Writing to a pipe or socket whose reader is gone raises no SIGPIPE, the
+ * callback of the write gets nil. A VM only reads, writes and closes the
+ * descriptors it opened or accepted, which it closes when it is destroyed.
+ */
+
+#define AVM_EVENTS_BATCH 64
+#define AVM_EVENTS_READSIZE 65536
+
+typedef struct avm_iowatch {
+    int fd;
+    unsigned char socket;       // written with send(), which can be told not to raise SIGPIPE
+    unsigned char always;       // refused by epoll, a regular file
+    unsigned char registered;   // in the epoll set
+    unsigned char accepting;    // the armed read is an ioaccept()
+    unsigned char closing;      // ioclose() waits for the queued output
+    avm_memcell reader;         // callback of the armed read, undef when there is none
+    avm_memcell writer;         // callback of the queued output, nil when there is none
+    char *out;                  // the queued output, NULL when there is none
+    size_t outSize, outDone;
+} avm_iowatch;
+
+struct avm_events {
+    int epfd;
+    avm_iowatch **watches;      // by fd
+    unsigned capacity;
+    unsigned pending;           // armed reads and queued outputs, the loop runs while there are any
+    avm_memcell result;         // what ioresult() returns
+};
+
+struct avm_events *events_get(avm_state *vm) {
+    struct avm_events *ev = vm->events;
+    if (ev) return ev;
+    ev = (struct avm_events *) calloc(1, sizeof(struct avm_events));
+    if ((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        avm_error(vm, "io: cannot create the event loop (%s)", strerror(errno));
+        free(ev);
+        return NULL;
+    }
+    ev->result.type = nil_m;
+    return vm->events = ev;
+}
+
+avm_iowatch *events_lookup(struct avm_events *ev, int fd) {
+    return ev && fd >= 0 && (unsigned) fd < ev->capacity ? ev->watches[fd] : NULL;
+}
+
+// a watch for fd, which the VM owns from now on
+avm_iowatch *events_watch(struct avm_events *ev, int fd) {
+    avm_iowatch *w = events_lookup(ev, fd);
+    struct stat st;
+    unsigned capacity;
+    if (w) return w;
+    if ((unsigned) fd >= ev->capacity) {
+        capacity = ev->capacity ? ev->capacity : 16;
+        while (capacity <= (unsigned) fd) capacity *= 2;
+        ev->watches = (avm_iowatch **) realloc(ev->watches, sizeof(avm_iowatch *) * capacity);
+        memset(ev->watches + ev->capacity, 0, sizeof(avm_iowatch *) * (capacity - ev->capacity));
+        ev->capacity = capacity;
+    }
+    w = (avm_iowatch *) calloc(1, sizeof(avm_iowatch));
+    w->fd = fd;
+    w->socket = !fstat(fd, &st) && S_ISSOCK(st.st_mode);
+    w->reader.type = undef_m;
+    w->writer.type = nil_m;
+    return ev->watches[fd] = w;
+}
+
+// the epoll interest of w follows what is armed on it
+void events_update(avm_state *vm, avm_iowatch *w) {
+    struct epoll_event e;
+    e.events = (w->reader.type != undef_m ? EPOLLIN : 0) | (w->out ? EPOLLOUT : 0);
+    e.data.fd = w->fd;
+    if (w->always) return;
+    if (!e.events) {
+        if (w->registered) epoll_ctl(vm->events->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+        w->registered = 0;
+        return;
+    }
+    if (!epoll_ctl(vm->events->epfd, w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, w->fd, &e)) w->registered = 1;
+    else if (errno == EPERM) w->always = 1;
+    else avm_warning(vm, "io: cannot watch %d (%s)", w->fd, strerror(errno));
+}
+
+// releases what w holds, closes its fd and forgets it
+void events_drop(avm_state *vm, avm_iowatch *w) {
+    struct avm_events *ev = vm->events;
+    if (w->reader.type != undef_m) ev->pending--;
+    if (w->out) ev->pending--;
+    avm_memcellclear(&w->reader);
+    avm_memcellclear(&w->writer);
+    free(w->out);
+    if (w->registered) epoll_ctl(ev->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    ev->watches[w->fd] = NULL;
+    free(w);
+}
+
+void avm_eventsrelease(avm_state *vm) {
+    struct avm_events *ev = vm->events;
+    avm_iowatch *w;
+    if (!ev) return;
+    for (unsigned i = 0; i < ev->capacity; i++) {
+        if (!(w = ev->watches[i])) continue;
+        // like avm_tablesrelease, the callbacks are not followed
+        free(w->out);
+        close(w->fd);
+        free(w);
+    }
+    if (ev->result.type == string_m) free(ev->result.data.strVal);
+    close(ev->epfd);
+    free(ev->watches);
+    free(ev);
+    vm->events = NULL;
+}
+
+// runs cb(fd, value) or resumes the coroutine cb, from the end of the program
+void avm_eventcall(avm_state *vm, avm_memcell *cb, int fd, avm_memcell *value) {
+    unsigned pc = vm->pc;
+    if (cb->type != userfunc_m && cb->type != coroutine_m) return;
+    if (vm->top < AVM_STACKENV_SIZE + 3) {
+        avm_error(vm, "Stack Overflow!");
+        return;
+    }
+    if (cb->type == userfunc_m) {
+        avm_assign(vm, &vm->stack[vm->top], value);
+        avm_dec_top(vm);
+        vm->stack[vm->top].type = number_m;
+        vm->stack[vm->top].data.numVal = fd;
+        avm_dec_top(vm);
+        vm->totalActuals = 2;
+    }
+    else {
+        avm_assign(vm, &vm->events->result, value);
+        avm_assign(vm, &vm->stack[vm->top], cb);
+        avm_dec_top(vm);
+        vm->totalActuals = 1;
+    }
+    vm->pc = AVM_CALLBACK_PC(vm) - 1;
+    avm_callsaveenvironment(vm);
+    vm->pc = pc;
+    if (cb->type == userfunc_m) vm->pc = cb->data.funcVal;
+    else {
+        // as avm_calllibfunc would call resume(cb)
+        vm->topsp = vm->top;
+        vm->totalActuals = 0;
+        libfunc_resume(vm);
+        if (!vm->executionFinished) execute_funcexit(vm, (struct instruction *) 0);
+    }
+    while (!vm->executionFinished && vm->pc != AVM_CALLBACK_PC(vm)) execution_cycle(vm);
+    vm->pc = pc;
+}
+
+void events_read(avm_state *vm, avm_iowatch *w) {
+    avm_memcell cb = w->reader, value;
+    int fd = w->fd, c;
+    ssize_t n;
+    value.type = nil_m;
+    if (w->accepting) {
+        if ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (c >= 0) {
+            events_watch(vm->events, c);
+            value.type = number_m;
+            value.data.numVal = c;
+        }
+    }
+    else {
+        value.data.strVal = (char *) malloc(AVM_EVENTS_READSIZE + 1);
+        if ((n = read(fd, value.data.strVal, AVM_EVENTS_READSIZE)) < 0 && (errno == EAGAIN || errno == EINTR)) {
+            free(value.data.strVal);
+            return;
+        }
+        if (n > 0) {
+            value.data.strVal = (char *) realloc(value.data.strVal, n + 1);
+            value.data.strVal[n] = '\0';
+            value.type = string_m;
+        }
+        else free(value.data.strVal);
+    }
+    w->reader.type = undef_m;
+    w->accepting = 0;
+    vm->events->pending--;
+    events_update(vm, w);
+    avm_eventcall(vm, &cb, fd, &value);
+    avm_memcellclear(&cb);
+    avm_memcellclear(&value);
+}
+
+// writes what is left of the output of w, failing with EPIPE instead of raising SIGPIPE
+// when the reader is gone; for pipes SIGPIPE is blocked around write() and taken back
+ssize_t events_send(avm_iowatch *w) {
+    sigset_t sigpipe, old, pending;
+    struct timespec now = { 0, 0 };
+    ssize_t n;
+    int waiting, saved;
+    if (w->socket) return send(w->fd, w->out + w->outDone, w->outSize - w->outDone, MSG_NOSIGNAL);
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    sigpending(&pending);
+    waiting = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &old);
+    n = write(w->fd, w->out + w->outDone, w->outSize - w->outDone);
+    saved = errno;
+    if (n < 0 && errno == EPIPE && !waiting) sigtimedwait(&sigpipe, NULL, &now);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    errno = saved;
+    return n;
+}
+
+void events_write(avm_state *vm, avm_iowatch *w) {
+    avm_memcell cb, value;
+    int fd = w->fd;
+    ssize_t n;
+    // what print() buffered goes first
+    fflush(vm->out);
+    if ((n = events_send(w)) < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n >= 0 && (w->outDone += n) < w->outSize) return;
+    value.type = nil_m;
+    if (n >= 0) {
+        value.type = number_m;
+        value.data.numVal = w->outSize;
+    }
+    cb = w->writer;
+    w->writer.type = nil_m;
+    free(w->out);
+    w->out = NULL;
+    w->outSize = w->outDone = 0;
+    vm->events->pending--;
+    if (w->closing) events_drop(vm, w);
+    else events_update(vm, w);
+    avm_eventcall(vm, &cb, fd, &value);
+    avm_memcellclear(&cb);
+}
+
+void events_dispatch(avm_state *vm, int fd, unsigned flags) {
+    avm_iowatch *w = events_lookup(vm->events, fd);
+    if (w && (flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) && w->reader.type != undef_m) events_read(vm, w);
+    // the callback may have closed it
+    w = events_lookup(vm->events, fd);
+    if (w && !vm->executionFinished && (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && w->out) events_write(vm, w);
+}
+
+unsigned avm_eventspending(avm_state *vm) {
+    return vm->events ? vm->events->pending : 0;
+}
+
+void avm_eventsrun(avm_state *vm) {
+    struct avm_events *ev = vm->events;
+    struct epoll_event ready[AVM_EVENTS_BATCH];
+    unsigned i, always;
+    int n;
+    while (ev->pending && !vm->executionFinished) {
+        for (i = always = 0; i < ev->capacity && !always; i++)
+            always = ev->watches[i] && ev->watches[i]->always && (ev->watches[i]->reader.type != undef_m || ev->watches[i]->out);
+        if ((n = epoll_wait(ev->epfd, ready, AVM_EVENTS_BATCH, always ? 0 : -1)) < 0) {
+            if (errno == EINTR) continue;
+            avm_error(vm, "io: event loop failed (%s)", strerror(errno));
+            return;
+        }
+        for (i = 0; i < (unsigned) n && !vm->executionFinished; i++) events_dispatch(vm, ready[i].data.fd, ready[i].events);
+        for (i = 0; i < ev->capacity && !vm->executionFinished; i++)
+            if (ev->watches[i] && ev->watches[i]->always) events_dispatch(vm, (int) i, EPOLLIN | EPOLLOUT);
+    }
+}
+
+// ------------------- LIBRARY FUNCTIONS
+
+void events_nil(avm_state *vm) {
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = nil_m;
+}
+
+void events_number(avm_state *vm, int n) {
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = n;
+}
+
+// the watch of argument i, a file descriptor this VM opened; NULL after a warning
+avm_iowatch *events_fdarg(avm_state *vm, char *name, unsigned i) {
+    struct avm_memcell *a = avm_getactual(vm, i);
+    avm_iowatch *w;
+    if (a->type != number_m || a->data.numVal < 0 || a->data.numVal != (int) a->data.numVal) {
+        avm_warning(vm, "'%s()': file descriptor argument (not %s) expected!", name, typeStrings[a->type]);
+        return NULL;
+    }
+    if (!(w = events_lookup(vm->events, (int) a->data.numVal)))
+        avm_warning(vm, "'%s()': %g is not a descriptor the program opened!", name, a->data.numVal);
+    return w;
+}
+
+// checks the number of arguments and, when it is not NULL, that the last is a string
+int events_args(avm_state *vm, char *name, unsigned n, char **s) {
+    struct avm_memcell *a;
+    if (avm_totalactuals(vm) != n) {
+        avm_warning(vm, "'%s()': %u argument(s) (not %u) expected!", name, n, avm_totalactuals(vm));
+        return 0;
+    }
+    if (!s) return 1;
+    if ((a = avm_getactual(vm, n - 1))->type != string_m) {
+        avm_warning(vm, "'%s()': string argument (not %s) expected!", name, typeStrings[a->type]);
+        return 0;
+    }
+    *s = a->data.strVal;
+    return 1;
+}
+
+int events_unixaddr(avm_state *vm, char *name, char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        avm_warning(vm, "'%s()': socket path '%s' is too long!", name, path);
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+// fd is returned and closed with the VM unless ioclose() closes it first
+void events_opened(avm_state *vm, char *name, int fd, char *path) {
+    struct avm_events *ev;
+    if (fd < 0) {
+        avm_warning(vm, "'%s()': %s: %s", name, path, strerror(errno));
+        return;
+    }
+    if (!(ev = events_get(vm))) {
+        close(fd);
+        return;
+    }
+    events_watch(ev, fd);
+    events_number(vm, fd);
+}
+
+void libfunc_ioopen(avm_state *vm) {
+    char *path, *mode;
+    int flags;
+    events_nil(vm);
+    if (!events_args(vm, "ioopen", 2, &mode)) return;
+    if (avm_getactual(vm, 0)->type != string_m) {
+        avm_warning(vm, "'ioopen()': string argument (not %s) expected!", typeStrings[avm_getactual(vm, 0)->type]);
+        return;
+    }
+    path = avm_getactual(vm, 0)->data.strVal;
+    if (!strcmp(mode, "r")) flags = O_RDONLY;
+    else if (!strcmp(mode, "w")) flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (!strcmp(mode, "a")) flags = O_WRONLY | O_CREAT | O_APPEND;
+    else {
+        avm_warning(vm, "'ioopen()': mode \"r\", \"w\" or \"a\" (not \"%s\") expected!", mode);
+        return;
+    }
+    events_opened(vm, "ioopen", open(path, flags | O_NONBLOCK | O_CLOEXEC, 0666), path);
+}
+
+void libfunc_iopipe(avm_state *vm) {
+    struct avm_memcell key, value;
+    struct avm_events *ev;
+    int p[2];
+    events_nil(vm);
+    if (!events_args(vm, "iopipe", 0, NULL)) return;
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC)) {
+        avm_warning(vm, "'iopipe()': %s", strerror(errno));
+        return;
+    }
+    if (!(ev = events_get(vm))) return;
+    events_watch(ev, p[0]);
+    events_watch(ev, p[1]);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = table_m;
+    vm->retval.data.tableVal = avm_tablenew(vm);
+    avm_tableincrefcounter(vm->retval.data.tableVal);
+    key.type = string_m;
+    value.type = number_m;
+    key.data.strVal = "read";
+    value.data.numVal = p[0];
+    avm_tablesetelem(vm, vm->retval.data.tableVal, &key, &value);
+    key.data.strVal = "write";
+    value.data.numVal = p[1];
+    avm_tablesetelem(vm, vm->retval.data.tableVal, &key, &value);
+}
+
+void libfunc_iolisten(avm_state *vm) {
+    struct sockaddr_un addr;
+    char *path;
+    int fd;
+    events_nil(vm);
+    if (!events_args(vm, "iolisten", 1, &path) || !events_unixaddr(vm, "iolisten", path, &addr)) return;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0) {
+        unlink(path);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    events_opened(vm, "iolisten", fd, path);
+}
+
+void libfunc_ioconnect(avm_state *vm) {
+    struct sockaddr_un addr;
+    char *path;
+    int fd;
+    events_nil(vm);
+    if (!events_args(vm, "ioconnect", 1, &path) || !events_unixaddr(vm, "ioconnect", path, &addr)) return;
+    // a local connect completes at once or fails
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    events_opened(vm, "ioconnect", fd, path);
+}
+
+// ioread() and ioaccept()
+void events_arm(avm_state *vm, char *name, int accepting) {
+    struct avm_memcell *cb;
+    avm_iowatch *w;
+    events_nil(vm);
+    if (!events_args(vm, name, 2, NULL) || !(w = events_fdarg(vm, name, 0))) return;
+    cb = avm_getactual(vm, 1);
+    if (cb->type != userfunc_m && cb->type != coroutine_m) {
+        avm_warning(vm, "'%s()': user function or coroutine argument (not %s) expected!", name, typeStrings[cb->type]);
+        return;
+    }
+    if (w->reader.type == undef_m) vm->events->pending++;
+    avm_assign(vm, &w->reader, cb);
+    w->accepting = accepting;
+    events_update(vm, w);
+}
+
+void libfunc_ioread(avm_state *vm) {
+    events_arm(vm, "ioread", 0);
+}
+
+void libfunc_ioaccept(avm_state *vm) {
+    events_arm(vm, "ioaccept", 1);
+}
+
+void libfunc_iowrite(avm_state *vm) {
+    struct avm_memcell *data, *cb;
+    avm_iowatch *w;
+    size_t n;
+    events_nil(vm);
+    if (avm_totalactuals(vm) != 2 && avm_totalactuals(vm) != 3) {
+        avm_warning(vm, "'iowrite()': 2 or 3 arguments (not %u) expected!", avm_totalactuals(vm));
+        return;
+    }
+    if (!(w = events_fdarg(vm, "iowrite", 0))) return;
+    if ((data = avm_getactual(vm, 1))->type != string_m) {
+        avm_warning(vm, "'iowrite()': string argument (not %s) expected!", typeStrings[data->type]);
+        return;
+    }
+    cb = avm_totalactuals(vm) == 3 ? avm_getactual(vm, 2) : NULL;
+    if (cb && cb->type != userfunc_m && cb->type != coroutine_m && cb->type != nil_m) {
+        avm_warning(vm, "'iowrite()': user function or coroutine argument (not %s) expected!", typeStrings[cb->type]);
+        return;
+    }
+    if (w->closing) {
+        avm_warning(vm, "'iowrite()': %d is closing!", w->fd);
+        return;
+    }
+    if (!w->out) vm->events->pending++;
+    n = strlen(data->data.strVal);
+    w->out = (char *) realloc(w->out, w->outSize + n + 1);
+    memcpy(w->out + w->outSize, data->data.strVal, n);
+    w->outSize += n;
+    // the callback of the last write runs once everything queued is written
+    if (cb && cb->type != nil_m) avm_assign(vm, &w->writer, cb);
+    events_update(vm, w);
+}
+
+void libfunc_ioclose(avm_state *vm) {
+    avm_iowatch *w;
+    events_nil(vm);
+    if (!events_args(vm, "ioclose", 1, NULL) || !(w = events_fdarg(vm, "ioclose", 0))) return;
+    if (!w->out) {
+        events_drop(vm, w);
+        return;
+    }
+    if (w->reader.type != undef_m) vm->events->pending--;
+    avm_memcellclear(&w->reader);
+    w->closing = 1;
+    events_update(vm, w);
+}
+
+void libfunc_ioresult(avm_state *vm) {
+    events_nil(vm);
+    if (vm->events) avm_assign(vm, &vm->retval, &vm->events->result);
+}
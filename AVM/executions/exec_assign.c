@@ -1,17 +1,17 @@
 #include "../avm.h"
 
-void execute_assign(struct instruction *instr) {
-    struct avm_memcell *lv = avm_translate_operand(&instr->result, (struct avm_memcell *) 0);
-    struct avm_memcell *rv = avm_translate_operand(&instr->arg1, &ax);
-    assert(lv && (&stack[N] >= lv && lv >= &stack[top] || lv == &retval));
+void execute_assign(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    assert(lv && (&vm->stack[N] >= lv && lv >= &vm->stack[vm->top] || lv == &vm->retval));
     assert(rv);
-    avm_assign(lv, rv);
+    avm_assign(vm, lv, rv);
 }
 
-void avm_assign (struct avm_memcell *lv, struct avm_memcell *rv) {
+void avm_assign (avm_state *vm, struct avm_memcell *lv, struct avm_memcell *rv) {
     if (lv == rv) return;
     // if (lv->type == table_m && rv->type == table_m && lv->data.tableVal == rv->data.tableVal) return;
-    if (rv->type == undef_m) avm_warning("Assigning from 'undef' content!");
+    if (rv->type == undef_m) avm_warning(vm, "Assigning from 'undef' content!");
     avm_memcellclear(lv);
     memcpy(lv, rv, sizeof(struct avm_memcell));
     // printf("%d %d\n",rv->type,pc);
@@ -19,6 +19,8 @@ void avm_assign (struct avm_memcell *lv, struct avm_memcell *rv) {
         lv->data.strVal = strdup(rv->data.strVal);
     else if (lv->type == table_m)
         avm_tableincrefcounter(lv->data.tableVal);
+    else if (lv->type == coroutine_m)
+        avm_coroutineincref(lv->data.coroutineVal);
 
     // lv->type = rv->type;
 }
\ No newline at end of file
@@ -1,56 +1,64 @@
 #include "../avm.h"
 
-void execute_call(struct instruction *instr) {
-    struct avm_memcell *func = avm_translate_operand(&instr->arg1, &ax);
+void execute_call(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *func = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
     assert(func);
-    avm_callsaveenvironment();
+    avm_callsaveenvironment(vm);
+    if (vm->executionFinished) return;
     char *s;
     switch (func->type) {
         case userfunc_m:
-            pc = func->data.funcVal;
-            assert(pc < AVM_ENDING_PC);
-            assert(code[pc].opcode == funcenter_v);
+            vm->pc = func->data.funcVal;
+            assert(vm->pc < AVM_ENDING_PC(vm));
+            assert(AVM_OPCODE(vm->program->code + vm->pc) == funcenter_v);
             break;
         case string_m:
-            avm_calllibfunc(func->data.strVal);
+            avm_calllibfunc(vm, func->data.strVal);
             break;
         case libfunc_m:
-            avm_calllibfunc(func->data.libfuncVal);
+            avm_calllibfunc(vm, func->data.libfuncVal);
             break;
         case table_m:
-            avm_error("DES %u %u\n", pc, instr->srcLine);
+            avm_error(vm, "DES %u %u\n", vm->pc, vm->program->codeLines[instr - vm->program->code]);
         default:
-            s = avm_tostring(func);
-            avm_error("Line %u: Call: cannot bind '%s' to function! PC %d",instr->srcLine, s,pc);
+            s = avm_tostring(vm, func);
+            avm_error(vm, "Line %u: Call: cannot bind '%s' to function! PC %d",vm->program->codeLines[instr - vm->program->code], s,vm->pc);
             free(s);
-            executionFinished = 1;
+            vm->executionFinished = 1;
             break;
     }
     // printf("%d %u")
 }
 
-void execute_funcenter(struct instruction *instr) {
-    struct avm_memcell *func = avm_translate_operand(&instr->result, &ax);
+void execute_funcenter(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *func = avm_translate(vm, instr, AVM_RESULT, &vm->ax);
     assert(func);
     // assert(pc == func->data.funcVal);
 
-    totalActuals = 0;
-    struct userfunc *funcInfo = avm_getfuncinfo(func->data.funcVal);
-    topsp = top;
-    top = top - funcInfo->localSize;
+    vm->totalActuals = 0;
+    struct userfunc *funcInfo = avm_getfuncinfo(vm->program, func->data.funcVal);
+    if (vm->top < funcInfo->localSize) {
+        avm_error(vm, "Stack Overflow!");
+        return;
+    }
+    vm->topsp = vm->top;
+    vm->top = vm->top - funcInfo->localSize;
 }
 
-void execute_funcexit(struct instruction *unused) {
-    unsigned oldTop = top;
-    top = avm_get_envvalue(topsp + AVM_SAVEDTOP_OFFSET);
-    pc = avm_get_envvalue(topsp + AVM_SAVEDPC_OFFSET);
-    topsp = avm_get_envvalue(topsp + AVM_SAVEDTOPSP_OFFSET);
-    while(++oldTop <= top) avm_memcellclear(&stack[oldTop]);
+void execute_funcexit(avm_state *vm, struct instruction *unused) {
+    unsigned oldTop = vm->top;
+    vm->top = avm_get_envvalue(vm, vm->topsp + AVM_SAVEDTOP_OFFSET);
+    vm->pc = avm_get_envvalue(vm, vm->topsp + AVM_SAVEDPC_OFFSET);
+    vm->topsp = avm_get_envvalue(vm, vm->topsp + AVM_SAVEDTOPSP_OFFSET);
+    while(++oldTop <= vm->top) avm_memcellclear(&vm->stack[oldTop]);
 }
 
-void execute_pusharg(struct instruction *instr) {
-    struct avm_memcell *arg = avm_translate_operand(&instr->arg1, &ax);
-    avm_assign(&stack[top], arg);
-    totalActuals++;
-    avm_dec_top();
-}
\ No newline at end of file
+void execute_pusharg(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *arg = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    avm_assign(vm, &vm->stack[vm->top], arg);
+    vm->totalActuals++;
+    avm_dec_top(vm);
+}
+void execute_yield(avm_state *vm, struct instruction *instr) {
+    avm_coroutineyield(vm, avm_translate(vm, instr, AVM_ARG1, &vm->ax));
+}
@@ -1,30 +1,28 @@
 #include "../avm.h"
 
 
-void execute_jump (struct instruction *instr) {
-    assert(instr->result.type == label_a);
-    if (!executionFinished) pc = instr->result.val;
+void execute_jump (avm_state *vm, struct instruction *instr) {
+    if (!vm->executionFinished) vm->pc = avm_label(vm->program, instr);
 }
 
-void execute_jeq (struct instruction *instr) {
+void execute_jeq (avm_state *vm, struct instruction *instr) {
     
-    assert(instr->result.type == label_a);
     // printf("ar1_instr====%d\n", instr->arg1.type);
     // printf("ar2_instr====%d\n", instr->arg2.type);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
     // printf("ar1====%d\n", rv1->type);
     // printf("ar2====%d\n", rv2->type);
 
     unsigned char result = 0;
     if (rv1->type == undef_m || rv2->type == undef_m) {
-        avm_error("'undef' involved in 'jeq'");
+        avm_error(vm, "'undef' involved in 'jeq'");
     } else if (rv1->type == nil_m || rv2->type == nil_m) {
         result = rv1->type == rv2->type;
     } else if (rv1->type == bool_m || rv2->type == bool_m) {
         result = avm_tobool(rv1) == avm_tobool(rv2);
     } else if (rv1->type != rv2->type){
-        avm_error("%s == %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
+        avm_error(vm, "%s == %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
     } else {
         switch (rv1->type) {
             case number_m:
@@ -37,6 +35,9 @@ void execute_jeq (struct instruction *instr) {
                 // table reference comparison
                 result = rv1->data.tableVal == rv2->data.tableVal;
                 break;
+            case coroutine_m:
+                result = rv1->data.coroutineVal == rv2->data.coroutineVal;
+                break;
             case userfunc_m:
                 result = rv1->data.funcVal == rv2->data.funcVal;
                 break;
@@ -44,28 +45,27 @@ void execute_jeq (struct instruction *instr) {
                 result = !strcmp(rv1->data.libfuncVal, rv2->data.libfuncVal);
                 break;
             default:
-                avm_error("ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
+                avm_error(vm, "ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
         }
 
     }
-    if (!executionFinished && result) pc = instr->result.val;
+    if (!vm->executionFinished && result) vm->pc = avm_label(vm->program, instr);
 }
 
-void execute_jne (struct instruction *instr) {
+void execute_jne (avm_state *vm, struct instruction *instr) {
 
-    assert(instr->result.type == label_a);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
 
     unsigned char result = 0;
     if (rv1->type == undef_m || rv2->type == undef_m) {
-        avm_error("'undef' involved in 'jne'");
+        avm_error(vm, "'undef' involved in 'jne'");
     } else if (rv1->type == nil_m || rv2->type == nil_m) {
         result = rv1->type != rv2->type;
     } else if (rv1->type == bool_m || rv2->type == bool_m) {
         result = avm_tobool(rv1) != avm_tobool(rv2);
     } else if (rv1->type != rv2->type){
-        avm_error("%s != %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
+        avm_error(vm, "%s != %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
     } else {
         
         switch (rv1->type) {
@@ -79,6 +79,9 @@ void execute_jne (struct instruction *instr) {
                 // table reference comparison
                 result = rv1->data.tableVal != rv2->data.tableVal;
                 break;
+            case coroutine_m:
+                result = rv1->data.coroutineVal != rv2->data.coroutineVal;
+                break;
             case userfunc_m:
                 result = rv1->data.funcVal != rv2->data.funcVal;
                 break;
@@ -86,27 +89,26 @@ void execute_jne (struct instruction *instr) {
                 result = strcmp(rv1->data.libfuncVal, rv2->data.libfuncVal);
                 break;
             default:
-                avm_error("ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
+                avm_error(vm, "ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
         }
     }
-    if (!executionFinished && result) pc = instr->result.val;
+    if (!vm->executionFinished && result) vm->pc = avm_label(vm->program, instr);
 }
 
-void execute_jle (struct instruction *instr) {
+void execute_jle (avm_state *vm, struct instruction *instr) {
 
-    assert(instr->result.type == label_a);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
 
     unsigned char result = 0;
     if (rv1->type == undef_m || rv2->type == undef_m) {
-        avm_error("'undef' involved in 'jle'");
+        avm_error(vm, "'undef' involved in 'jle'");
     } else if (rv1->type == nil_m || rv2->type == nil_m) {
-        avm_error("'nil' involved in 'jle'");
+        avm_error(vm, "'nil' involved in 'jle'");
     } else if (rv1->type == bool_m || rv2->type == bool_m) {
-        avm_error("'bool' involved in 'jle'");
+        avm_error(vm, "'bool' involved in 'jle'");
     } else if (rv1->type != rv2->type){
-        avm_error("%s <= %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
+        avm_error(vm, "%s <= %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
     } else {
         
         switch (rv1->type) {
@@ -127,27 +129,26 @@ void execute_jle (struct instruction *instr) {
                 result = strcmp(rv1->data.libfuncVal, rv2->data.libfuncVal) <= 0;
                 break;
             default:
-                avm_error("ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
+                avm_error(vm, "ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
         }
     }
-    if (!executionFinished && result) pc = instr->result.val;
+    if (!vm->executionFinished && result) vm->pc = avm_label(vm->program, instr);
 }
 
-void execute_jlt (struct instruction *instr) {
+void execute_jlt (avm_state *vm, struct instruction *instr) {
 
-    assert(instr->result.type == label_a);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
 
     unsigned char result = 0;
     if (rv1->type == undef_m || rv2->type == undef_m) {
-        avm_error("'undef' involved in 'jlt'");
+        avm_error(vm, "'undef' involved in 'jlt'");
     } else if (rv1->type == nil_m || rv2->type == nil_m) {
-        avm_error("'nil' involved in 'jlt'");
+        avm_error(vm, "'nil' involved in 'jlt'");
     } else if (rv1->type == bool_m || rv2->type == bool_m) {
-        avm_error("'bool' involved in 'jlt'");
+        avm_error(vm, "'bool' involved in 'jlt'");
     } else if (rv1->type != rv2->type){
-        avm_error("%s < %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
+        avm_error(vm, "%s < %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
     } else {
        
         switch (rv1->type) {
@@ -168,27 +169,26 @@ void execute_jlt (struct instruction *instr) {
                 result = strcmp(rv1->data.libfuncVal, rv2->data.libfuncVal) < 0;
                 break;
             default:
-                avm_error("ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
+                avm_error(vm, "ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
         }
     }
-    if (!executionFinished && result) pc = instr->result.val;
+    if (!vm->executionFinished && result) vm->pc = avm_label(vm->program, instr);
 }
 
-void execute_jge (struct instruction *instr) {
+void execute_jge (avm_state *vm, struct instruction *instr) {
     
-    assert(instr->result.type == label_a);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
 
     unsigned char result = 0;
     if (rv1->type == undef_m || rv2->type == undef_m) {
-        avm_error("'undef' involved in 'jge'");
+        avm_error(vm, "'undef' involved in 'jge'");
     } else if (rv1->type == nil_m || rv2->type == nil_m) {
-        avm_error("'nil' involved in 'jge'");
+        avm_error(vm, "'nil' involved in 'jge'");
     } else if (rv1->type == bool_m || rv2->type == bool_m) {
-        avm_error("'bool' involved in 'jge'");
+        avm_error(vm, "'bool' involved in 'jge'");
     } else if (rv1->type != rv2->type){
-        avm_error("%s >= %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
+        avm_error(vm, "%s >= %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
     } else {
         
         switch (rv1->type) {
@@ -209,27 +209,26 @@ void execute_jge (struct instruction *instr) {
                 result = strcmp(rv1->data.libfuncVal, rv2->data.libfuncVal) >= 0;
                 break;
             default:
-                avm_error("ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
+                avm_error(vm, "ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
         }
     }
-    if (!executionFinished && result) pc = instr->result.val;
+    if (!vm->executionFinished && result) vm->pc = avm_label(vm->program, instr);
 }
 
-void execute_jgt (struct instruction *instr) {
+void execute_jgt (avm_state *vm, struct instruction *instr) {
 
-    assert(instr->result.type == label_a);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
 
     unsigned char result = 0;
     if (rv1->type == undef_m || rv2->type == undef_m) {
-        avm_error("'undef' involved in 'jgt'");
+        avm_error(vm, "'undef' involved in 'jgt'");
     } else if (rv1->type == nil_m || rv2->type == nil_m) {
-        avm_error("'nil' involved in 'jgt'");
+        avm_error(vm, "'nil' involved in 'jgt'");
     } else if (rv1->type == bool_m || rv2->type == bool_m) {
-        avm_error("'bool' involved in 'jgt'");
+        avm_error(vm, "'bool' involved in 'jgt'");
     } else if (rv1->type != rv2->type){
-        avm_error("%s > %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
+        avm_error(vm, "%s > %s has illegal types", typeStrings[rv1->type], typeStrings[rv2->type]);
     } else {
         
         switch (rv1->type) {
@@ -250,8 +249,46 @@ void execute_jgt (struct instruction *instr) {
                 result = strcmp(rv1->data.libfuncVal, rv2->data.libfuncVal) > 0;
                 break;
             default:
-                avm_error("ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
+                avm_error(vm, "ar1:%s ar2:%s types, don't know what's wrong!", typeStrings[rv1->type], typeStrings[rv2->type]);
         }
     }
-    if (!executionFinished && result) pc = instr->result.val;
-}
\ No newline at end of file
+    if (!vm->executionFinished && result) vm->pc = avm_label(vm->program, instr);
+}
+
+// _nn: avm_verify() proved both operands are numbers, no tag checks
+
+void execute_jeq_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    if (rv1->data.numVal == rv2->data.numVal) vm->pc = avm_label(vm->program, instr);
+}
+
+void execute_jne_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    if (rv1->data.numVal != rv2->data.numVal) vm->pc = avm_label(vm->program, instr);
+}
+
+void execute_jle_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    if (rv1->data.numVal <= rv2->data.numVal) vm->pc = avm_label(vm->program, instr);
+}
+
+void execute_jge_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    if (rv1->data.numVal >= rv2->data.numVal) vm->pc = avm_label(vm->program, instr);
+}
+
+void execute_jlt_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    if (rv1->data.numVal < rv2->data.numVal) vm->pc = avm_label(vm->program, instr);
+}
+
+void execute_jgt_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    if (rv1->data.numVal > rv2->data.numVal) vm->pc = avm_label(vm->program, instr);
+}
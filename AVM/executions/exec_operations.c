@@ -6,20 +6,20 @@
 // #define execute_div(x) execute_arithmetic(x)
 // #define execute_mod(x) execute_arithmetic(x)
 
-void execute_add (struct instruction* x){
-    execute_arithmetic(x);
+void execute_add (avm_state *vm, struct instruction* x){
+    execute_arithmetic(vm, x);
 };
-void execute_sub (struct instruction* x){
-    execute_arithmetic(x);
+void execute_sub (avm_state *vm, struct instruction* x){
+    execute_arithmetic(vm, x);
 };
-void execute_mul (struct instruction* x){
-    execute_arithmetic(x);
+void execute_mul (avm_state *vm, struct instruction* x){
+    execute_arithmetic(vm, x);
 };
-void execute_div (struct instruction* x){
-    execute_arithmetic(x);
+void execute_div (avm_state *vm, struct instruction* x){
+    execute_arithmetic(vm, x);
 };  
-void execute_mod (struct instruction* x){
-    execute_arithmetic(x);
+void execute_mod (avm_state *vm, struct instruction* x){
+    execute_arithmetic(vm, x);
 };
 
 typedef double (*arithmetic_func_t)(double x, double y);
@@ -38,39 +38,91 @@ arithmetic_func_t arithmeticFuncs[] = {
     mod_impl
 };
 
-void execute_arithmetic (struct instruction *instr) {
-    struct avm_memcell *lv = avm_translate_operand(&instr->result, (struct avm_memcell *) 0);
-    struct avm_memcell *rv1 = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *rv2 = avm_translate_operand(&instr->arg2, &bx);
+void execute_arithmetic (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
 
     //assert(lv && (&stack[N-1] >= lv && lv < &stack[top] || lv == &retval));
     assert(rv1 && rv2);
 
     if (rv1->type != number_m || rv2->type != number_m) {
-        avm_error("Not a number in arithmetic! PC %d\n",pc);
-        executionFinished = 1;
+        avm_error(vm, "Not a number in arithmetic! PC %d\n",vm->pc);
+        vm->executionFinished = 1;
         return;
     }
-    arithmetic_func_t op = arithmeticFuncs[instr->opcode - add_v];
+    arithmetic_func_t op = arithmeticFuncs[AVM_OPCODE(instr) - add_v];
     avm_memcellclear(lv);
     lv->type = number_m;
     lv->data.numVal = (*op)(rv1->data.numVal, rv2->data.numVal);
 }
 
+// _nn: avm_verify() proved both operands are numbers, no tag checks
+
+void execute_add_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    double value = rv1->data.numVal + rv2->data.numVal;
+    if (lv->type != number_m) avm_memcellclear(lv);
+    lv->type = number_m;
+    lv->data.numVal = value;
+}
+
+void execute_sub_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    double value = rv1->data.numVal - rv2->data.numVal;
+    if (lv->type != number_m) avm_memcellclear(lv);
+    lv->type = number_m;
+    lv->data.numVal = value;
+}
+
+void execute_mul_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    double value = rv1->data.numVal * rv2->data.numVal;
+    if (lv->type != number_m) avm_memcellclear(lv);
+    lv->type = number_m;
+    lv->data.numVal = value;
+}
+
+void execute_div_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    double value = rv1->data.numVal / rv2->data.numVal;
+    if (lv->type != number_m) avm_memcellclear(lv);
+    lv->type = number_m;
+    lv->data.numVal = value;
+}
+
+void execute_mod_nn (avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *rv1 = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *rv2 = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    double value = ((unsigned) rv1->data.numVal) % ((unsigned) rv2->data.numVal);
+    if (lv->type != number_m) avm_memcellclear(lv);
+    lv->type = number_m;
+    lv->data.numVal = value;
+}
+
 // NOT SUPPORTED
 
-void execute_uminus(struct instruction *instr) {
-    avm_error("Unsuported op: %d", instr->opcode);
+void execute_uminus(avm_state *vm, struct instruction *instr) {
+    avm_error(vm, "Unsuported op: %d", AVM_OPCODE(instr));
 }
-void execute_and(struct instruction *instr) {
-    avm_error("Unsuported op: %d", instr->opcode);
+void execute_and(avm_state *vm, struct instruction *instr) {
+    avm_error(vm, "Unsuported op: %d", AVM_OPCODE(instr));
 }
-void execute_or(struct instruction *instr) {
-    avm_error("Unsuported op: %d", instr->opcode);
+void execute_or(avm_state *vm, struct instruction *instr) {
+    avm_error(vm, "Unsuported op: %d", AVM_OPCODE(instr));
 }
-void execute_not(struct instruction *instr) {
-    avm_error("Unsuported op: %d", instr->opcode);
+void execute_not(avm_state *vm, struct instruction *instr) {
+    avm_error(vm, "Unsuported op: %d", AVM_OPCODE(instr));
 }
-void execute_nop (struct instruction *instr) {
+void execute_nop (avm_state *vm, struct instruction *instr) {
     
 }
\ No newline at end of file
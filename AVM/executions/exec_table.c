@@ -4,16 +4,16 @@ void printtable(struct avm_table *t) {
     printf("================================ %u\n", t->boolIndexed[106]);
 }
 
-void execute_newtable(struct instruction *instr) {
-    struct avm_memcell *lv = avm_translate_operand(&instr->arg1, (struct avm_memcell *) 0);
+void execute_newtable(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_ARG1, (struct avm_memcell *) 0);
     //assert(lv && (&stack[N] >= lv && lv < &stack[top] || lv == &retval));
     avm_memcellclear(lv);
     lv->type = table_m;
-    lv->data.tableVal = avm_tablenew();
+    lv->data.tableVal = avm_tablenew(vm);
     avm_tableincrefcounter(lv->data.tableVal);
 }
 
-unsigned hsh(struct avm_memcell * index ){
+unsigned hsh(avm_state *vm, struct avm_memcell * index ){
     unsigned int key = 0;
     unsigned int i;
     char* tmp;
@@ -42,15 +42,16 @@ unsigned hsh(struct avm_memcell * index ){
         case table_m:
         case nil_m:
         case undef_m:
-            avm_warning("hash invalid index");
+        case coroutine_m:
+            avm_warning(vm, "hash invalid index");
             break;
     }
     return key % AVM_TABLE_HASHSIZE;
 } 
 
-struct avm_memcell *avm_tablegetelem (struct avm_table *table, struct avm_memcell *index){
+struct avm_memcell *avm_tablegetelem (avm_state *vm, struct avm_table *table, struct avm_memcell *index){
     struct avm_table_bucket *bucket ;//= (struct avm_table_bucket*)malloc(sizeof(struct avm_table_bucket));
-    unsigned b = hsh(index);
+    unsigned b = hsh(vm, index);
     switch (index->type) {
         case number_m:
             bucket = table->numIndexed[b];
@@ -90,107 +91,136 @@ struct avm_memcell *avm_tablegetelem (struct avm_table *table, struct avm_memcel
         case table_m:
         case nil_m:
         case undef_m:
-            avm_warning("invalid table index type (%s)", typeStrings[index->type]);
+        case coroutine_m:
+            avm_warning(vm, "invalid table index type (%s)", typeStrings[index->type]);
             break;
     }
     struct avm_memcell *new_mem = (struct avm_memcell *)malloc(sizeof(struct avm_memcell));
     new_mem->type = nil_m;
     return new_mem;
 }
-void avm_tablesetelem (struct avm_table *table, struct avm_memcell *index, struct avm_memcell *content){
+// buckets own their strings, a string constant lives in the binary and a variable may change
+void avm_tablecopycell(struct avm_memcell *dst, struct avm_memcell *src) {
+    *dst = *src;
+    if (src->type == string_m) dst->data.strVal = strdup(src->data.strVal);
+}
+
+void avm_tablesetelem (avm_state *vm, struct avm_table *table, struct avm_memcell *index, struct avm_memcell *content){
     struct avm_table_bucket *bucket, *new_cell;
-    unsigned b = hsh(index);
+    unsigned b = hsh(vm, index);
     if(content->type == table_m) avm_tableincrefcounter(content->data.tableVal);
+    else if(content->type == coroutine_m) avm_coroutineincref(content->data.coroutineVal);
     switch (index->type) {
         case number_m:
             bucket = table->numIndexed[b];
             while(bucket) {
                 if (bucket->key.data.numVal == index->data.numVal) {
-                    bucket->value = *content;
+                    avm_heapstats_value(table->stats, &bucket->value, -1);
+                    avm_memcellclear(&bucket->value);
+                    avm_tablecopycell(&bucket->value, content);
+                    avm_heapstats_value(table->stats, &bucket->value, 1);
                     return;
                 }
                 bucket = bucket->next;
             }
             new_cell = (struct avm_table_bucket *) malloc(sizeof(struct avm_table_bucket));
             new_cell->next = table->numIndexed[b];
-            new_cell->key = *index;
-            new_cell->value = *content;
+            avm_tablecopycell(&new_cell->key, index);
+            avm_tablecopycell(&new_cell->value, content);
+            avm_heapstats_bucket(table->stats, new_cell, 1);
             table->numIndexed[b] = new_cell;
             break;
         case string_m:
             bucket = table->strIndexed[b];
             while(bucket) {
                 if (!strcmp(bucket->key.data.strVal, index->data.strVal)) {
-                    bucket->value = *content;
+                    avm_heapstats_value(table->stats, &bucket->value, -1);
+                    avm_memcellclear(&bucket->value);
+                    avm_tablecopycell(&bucket->value, content);
+                    avm_heapstats_value(table->stats, &bucket->value, 1);
                     return;
                 }
                 bucket = bucket->next;
             }
             new_cell = (struct avm_table_bucket *) malloc(sizeof(struct avm_table_bucket));
             new_cell->next = table->strIndexed[b];
-            new_cell->key = *index;
-            new_cell->value = *content;
+            avm_tablecopycell(&new_cell->key, index);
+            avm_tablecopycell(&new_cell->value, content);
+            avm_heapstats_bucket(table->stats, new_cell, 1);
             table->strIndexed[b] = new_cell;
             break;
         case bool_m:
             bucket = table->boolIndexed[b];
             while(bucket) {
                 if (bucket->key.data.boolVal == index->data.boolVal) {
-                    bucket->value = *content;
+                    avm_heapstats_value(table->stats, &bucket->value, -1);
+                    avm_memcellclear(&bucket->value);
+                    avm_tablecopycell(&bucket->value, content);
+                    avm_heapstats_value(table->stats, &bucket->value, 1);
                     return;
                 }
                 bucket = bucket->next;
             }
             new_cell = (struct avm_table_bucket *) malloc(sizeof(struct avm_table_bucket));
             new_cell->next = table->boolIndexed[b];
-            new_cell->key = *index;
-            new_cell->value = *content;
+            avm_tablecopycell(&new_cell->key, index);
+            avm_tablecopycell(&new_cell->value, content);
+            avm_heapstats_bucket(table->stats, new_cell, 1);
             table->boolIndexed[b] = new_cell;
             break;
         case userfunc_m:
             bucket = table->ufncIndexed[b];
             while(bucket) {
                 if (bucket->key.data.funcVal == index->data.funcVal) {
-                    bucket->value = *content;
+                    avm_heapstats_value(table->stats, &bucket->value, -1);
+                    avm_memcellclear(&bucket->value);
+                    avm_tablecopycell(&bucket->value, content);
+                    avm_heapstats_value(table->stats, &bucket->value, 1);
                     return;
                 }
                 bucket = bucket->next;
             }
             new_cell = (struct avm_table_bucket *) malloc(sizeof(struct avm_table_bucket));
             new_cell->next = table->ufncIndexed[b];
-            new_cell->key = *index;
-            new_cell->value = *content;
+            avm_tablecopycell(&new_cell->key, index);
+            avm_tablecopycell(&new_cell->value, content);
+            avm_heapstats_bucket(table->stats, new_cell, 1);
             table->ufncIndexed[b] = new_cell;
             break;
         case libfunc_m:
             bucket = table->lfncIndexed[b];
             while(bucket) {
                 if (bucket->key.data.libfuncVal == index->data.libfuncVal) {
-                    bucket->value = *content;
+                    avm_heapstats_value(table->stats, &bucket->value, -1);
+                    avm_memcellclear(&bucket->value);
+                    avm_tablecopycell(&bucket->value, content);
+                    avm_heapstats_value(table->stats, &bucket->value, 1);
                     return;
                 }
                 bucket = bucket->next;
             }
             new_cell = (struct avm_table_bucket *) malloc(sizeof(struct avm_table_bucket));
             new_cell->next = table->lfncIndexed[b];
-            new_cell->key = *index;
-            new_cell->value = *content;
+            avm_tablecopycell(&new_cell->key, index);
+            avm_tablecopycell(&new_cell->value, content);
+            avm_heapstats_bucket(table->stats, new_cell, 1);
             table->lfncIndexed[b] = new_cell;
             break;
         case nil_m:
         case table_m:
         case undef_m:
-            avm_warning("avm tablesetelem: nil or a undef");
+        case coroutine_m:
+            avm_warning(vm, "avm tablesetelem: nil or a undef");
             break;
     }
     table->total++;
 
 }
 
-void execute_tablegetelem(struct instruction *instr) {
-    struct avm_memcell *lv = avm_translate_operand(&instr->result, (struct avm_memcell *) 0);
-    struct avm_memcell *t = avm_translate_operand(&instr->arg1, (struct avm_memcell *) 0);
-    struct avm_memcell *i = avm_translate_operand(&instr->arg2, &ax);
+void execute_tablegetelem(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *lv = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *t = avm_translate(vm, instr, AVM_ARG1, (struct avm_memcell *) 0);
+    struct avm_memcell *i = avm_translate(vm, instr, AVM_ARG2, &vm->ax);
     // printf("retval %u \n", retval);
     // printf("instr->result %d \n", instr->result.val);
     // printf("type %d \n", lv->type);
@@ -203,30 +233,31 @@ void execute_tablegetelem(struct instruction *instr) {
     avm_memcellclear(lv);
     lv->type = nil_m;
     if (t->type != table_m) {
-        avm_error("Illegal use of type '%s' as table! PC %d", typeStrings[t->type],pc);
+        avm_error(vm, "Illegal use of type '%s' as table! PC %d", typeStrings[t->type],vm->pc);
         return;
     }
-    struct avm_memcell *content = avm_tablegetelem(t->data.tableVal, i);
+    struct avm_memcell *content = avm_tablegetelem(vm, t->data.tableVal, i);
     if (content) {
-        avm_assign(lv, content);
+        avm_assign(vm, lv, content);
         return;
     }else{
         // char *ts = avm_tostring(t);
         // char *is = avm_tostring(i);
-        avm_warning(" not found!");//, ts, is);
+        avm_warning(vm, " not found!");//, ts, is);
         // free(ts);
         // free(is);
     }
 }
 
-void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
-    struct avm_table_bucket *bucket, *bucket_next;
-    unsigned b = hsh(index);
+void avm_tableremoveindex(avm_state *vm, struct avm_table *table, struct avm_memcell *index) {
+    struct avm_table_bucket *bucket, *bucket_next, *removed = NULL;
+    unsigned b = hsh(vm, index);
     switch (index->type) {
         case number_m:
             bucket = table->numIndexed[b];
             if (bucket && bucket->key.data.numVal == index->data.numVal) {
                 table->numIndexed[b] = bucket->next;
+                removed = bucket;
                 table->total--;
                 break;
             }
@@ -234,6 +265,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             while (bucket_next = bucket->next) {
                 if (bucket_next && bucket_next->key.data.numVal == index->data.numVal) {
                     bucket->next = bucket_next->next;
+                    removed = bucket_next;
                     table->total--;
                     break;
                 }
@@ -244,6 +276,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             bucket = table->strIndexed[b];
             if (bucket && !strcmp(bucket->key.data.strVal, index->data.strVal)) {
                 table->strIndexed[b] = bucket->next;
+                removed = bucket;
                 table->total--;
                 break;
             }
@@ -251,6 +284,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             while (bucket_next = bucket->next) {
                 if (bucket_next && !strcmp(bucket_next->key.data.strVal, index->data.strVal)) {
                     bucket->next = bucket_next->next;
+                    removed = bucket_next;
                     table->total--;
                     break;
                 }
@@ -261,6 +295,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             bucket = table->boolIndexed[b];
             if (bucket && bucket->key.data.boolVal == index->data.boolVal) {
                 table->boolIndexed[b] = bucket->next;
+                removed = bucket;
                 table->total--;
                 break;
             }
@@ -268,6 +303,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             while (bucket_next = bucket->next) {
                 if (bucket_next && bucket_next->key.data.boolVal == index->data.boolVal) {
                     bucket->next = bucket_next->next;
+                    removed = bucket_next;
                     table->total--;
                     break;
                 }
@@ -278,6 +314,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             bucket = table->ufncIndexed[b];
             if (bucket && bucket->key.data.funcVal == index->data.funcVal) {
                 table->ufncIndexed[b] = bucket->next;
+                removed = bucket;
                 table->total--;
                 break;
             }
@@ -285,6 +322,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             while (bucket_next = bucket->next) {
                 if (bucket_next && bucket_next->key.data.funcVal == index->data.funcVal) {
                     bucket->next = bucket_next->next;
+                    removed = bucket_next;
                     table->total--;
                     break;
                 }
@@ -295,6 +333,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             bucket = table->lfncIndexed[b];
             if (bucket && bucket->key.data.libfuncVal == index->data.libfuncVal) {
                 table->lfncIndexed[b] = bucket->next;
+                removed = bucket;
                 table->total--;
                 break;
             }
@@ -302,6 +341,7 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
             while (bucket_next = bucket->next) {
                 if (bucket_next && bucket_next->key.data.libfuncVal == index->data.libfuncVal) {
                     bucket->next = bucket_next->next;
+                    removed = bucket_next;
                     table->total--;
                     break;
                 }
@@ -311,23 +351,30 @@ void avm_tableremoveindex(struct avm_table *table, struct avm_memcell *index) {
         case nil_m:
         case table_m:
         case undef_m:
-            avm_warning("avm table_removeindex: nil or a undef");
+        case coroutine_m:
+            avm_warning(vm, "avm table_removeindex: nil or a undef");
             break;
     }
+    if (removed) {
+        avm_heapstats_bucket(table->stats, removed, -1);
+        avm_memcellclear(&removed->key);
+        avm_memcellclear(&removed->value);
+        free(removed);
+    }
 }
 
-void execute_tablesetelem(struct instruction *instr) {
-    struct avm_memcell *t = avm_translate_operand(&instr->result, (struct avm_memcell *) 0);
-    struct avm_memcell *i = avm_translate_operand(&instr->arg1, &ax);
-    struct avm_memcell *c = avm_translate_operand(&instr->arg2, &bx);
-    assert(t && &stack[N] >= t && &stack[top]);
+void execute_tablesetelem(avm_state *vm, struct instruction *instr) {
+    struct avm_memcell *t = avm_translate(vm, instr, AVM_RESULT, (struct avm_memcell *) 0);
+    struct avm_memcell *i = avm_translate(vm, instr, AVM_ARG1, &vm->ax);
+    struct avm_memcell *c = avm_translate(vm, instr, AVM_ARG2, &vm->bx);
+    assert(t && &vm->stack[N] >= t && &vm->stack[vm->top]);
     assert(i && c);
     if (t->type != table_m) {
-        avm_error("Illegal use of type '%s' as table. PC %d", typeStrings[t->type],pc);
+        avm_error(vm, "Illegal use of type '%s' as table. PC %d", typeStrings[t->type],vm->pc);
         return;
     }
-    if (c->type == nil_m) avm_tableremoveindex(t->data.tableVal, i);
-    else avm_tablesetelem(t->data.tableVal, i, c);
+    if (c->type == nil_m) avm_tableremoveindex(vm, t->data.tableVal, i);
+    else avm_tablesetelem(vm, t->data.tableVal, i, c);
 }
 
 void avm_tableincrefcounter(struct avm_table *t) {
@@ -346,15 +393,20 @@ void avm_tablebucketsinit(struct avm_table_bucket **p) {
     for (unsigned i=0; i<AVM_TABLE_HASHSIZE; ++i) p[i] = (struct avm_table_bucket *) 0;
 }
 
-struct avm_table *avm_tablenew(void) {
+struct avm_table *avm_tablenew(avm_state *vm) {
     struct avm_table *t = (struct avm_table *) malloc(sizeof(struct avm_table)*2);
     AVM_WIPEOUT(*t);
     t->refCounter = t->total = 0;
+    t->stats = &vm->heap;
+    avm_heapstats_table(t->stats, 1);
     avm_tablebucketsinit(t->numIndexed);
     avm_tablebucketsinit(t->strIndexed);
     avm_tablebucketsinit(t->ufncIndexed);
     avm_tablebucketsinit(t->lfncIndexed);
     avm_tablebucketsinit(t->boolIndexed);
+    if ((t->next = vm->tables)) t->next->prev = &t->next;
+    t->prev = &vm->tables;
+    vm->tables = t;
     
     return t;
 }
@@ -379,25 +431,57 @@ struct avm_table *avm_tablenew(void) {
 //     }
 // }
 
-void avm_tablebucketsdestroy(struct avm_table_bucket **p) {
+void avm_tablebucketsdestroy(struct avm_heapstats *stats, struct avm_table_bucket **p) {
     struct avm_table_bucket *b, *del;
     for (unsigned i=0; i<AVM_TABLE_HASHSIZE; i++, p++) {
         for (b = *p; b;) {
             del = b;
             b = b->next;
+            avm_heapstats_bucket(stats, del, -1);
             avm_memcellclear(&del->key);
             avm_memcellclear(&del->value);
             free(del);
         }
-        p[i] = (struct avm_table_bucket *) 0;
+        *p = (struct avm_table_bucket *) 0;
     }
 }
 
 void avm_tabledestroy(struct avm_table *t) {
-    avm_tablebucketsdestroy(t->strIndexed);
-    avm_tablebucketsdestroy(t->numIndexed);
-    avm_tablebucketsdestroy(t->ufncIndexed);
-    avm_tablebucketsdestroy(t->lfncIndexed);
-    avm_tablebucketsdestroy(t->boolIndexed);
+    avm_tablebucketsdestroy(t->stats, t->strIndexed);
+    avm_tablebucketsdestroy(t->stats, t->numIndexed);
+    avm_tablebucketsdestroy(t->stats, t->ufncIndexed);
+    avm_tablebucketsdestroy(t->stats, t->lfncIndexed);
+    avm_tablebucketsdestroy(t->stats, t->boolIndexed);
+    avm_heapstats_table(t->stats, -1);
+    *t->prev = t->next;
+    if (t->next) t->next->prev = t->prev;
     free(t);
 }
+
+// frees every table left when a VM is destroyed, without following the references
+// between them; the counts are not trusted, retval holds tables it does not count
+void avm_tablesrelease(avm_state *vm) {
+    struct avm_table *t, *next;
+    struct avm_table_bucket **lists[5], *b, *del;
+    for (t = vm->tables; t; t = next) {
+        next = t->next;
+        lists[0] = t->strIndexed;
+        lists[1] = t->numIndexed;
+        lists[2] = t->ufncIndexed;
+        lists[3] = t->lfncIndexed;
+        lists[4] = t->boolIndexed;
+        for (unsigned k = 0; k < 5; k++) {
+            for (unsigned i = 0; i < AVM_TABLE_HASHSIZE; i++) {
+                for (b = lists[k][i]; b;) {
+                    del = b;
+                    b = b->next;
+                    if (del->key.type == string_m) free(del->key.data.strVal);
+                    if (del->value.type == string_m) free(del->value.data.strVal);
+                    free(del);
+                }
+            }
+        }
+        free(t);
+    }
+    vm->tables = NULL;
+}
@@ -0,0 +1,243 @@
+#include "avm.h"
+
+/*
+ * What the tables of a VM hold. avm_tablenew, avm_tabledestroy,
+ * avm_tablesetelem, avm_tableremoveindex and avm_tablecopy (task.c) keep the
+ * counts of vm->heap up to date: the live tables and buckets, the bytes of
+ * the tables, of the buckets and of the strings of their keys and values,
+ * and the peaks. Every VM counts its own tables, so the VMs of --batch,
+ * spawn() and parallel_map() need no locks.
+ *
+ * The lengths of the chains and the tables no longer reachable are worked
+ * out when asked for, by walking vm->tables. A table is reachable from the
+ * stack above top, retval, ax, bx, cx and the segments of the coroutines;
+ * one that is not is only kept alive by a cycle of references, which the
+ * reference counts never free (avm_destroy does).
+ *
+ * vmstats() returns all of it as a table; avm_exec --vmstats prints it to
+ * stderr when the program ends.
+ */
+
+#define HEAPSTATS_ARRAYS 5
+#define HEAPSTATS_BINS 8
+
+// a table is malloc'd twice its size, avm_tablenew
+#define HEAPSTATS_TABLEBYTES (2 * sizeof(struct avm_table))
+
+char *heapstatsArrayNames[HEAPSTATS_ARRAYS] = { "str", "num", "userfunc", "libfunc", "bool" };
+// chain lengths, 0 for the empty slots of an array
+char *heapstatsBinNames[HEAPSTATS_BINS] = { "0", "1", "2", "3-4", "5-8", "9-16", "17-32", "33+" };
+
+struct heapstats_snapshot {
+    struct avm_heapstats counts;
+    unsigned long chains[HEAPSTATS_ARRAYS][HEAPSTATS_BINS];
+    unsigned long longest[HEAPSTATS_ARRAYS];
+    unsigned long unreachableTables, unreachableBuckets;
+    unsigned long long unreachableBytes;
+};
+
+unsigned long long heapstats_bytes(struct avm_heapstats *s) {
+    return s->tableBytes + s->bucketBytes + s->keyBytes + s->valueBytes;
+}
+
+void heapstats_peak(struct avm_heapstats *s) {
+    if (s->tables > s->tablesPeak) s->tablesPeak = s->tables;
+    if (s->buckets > s->bucketsPeak) s->bucketsPeak = s->buckets;
+    if (heapstats_bytes(s) > s->bytesPeak) s->bytesPeak = heapstats_bytes(s);
+}
+
+void heapstats_add(unsigned long long *bytes, int delta, unsigned long long n) {
+    if (delta > 0) *bytes += n;
+    else *bytes -= n;
+}
+
+unsigned long long heapstats_string(struct avm_memcell *m) {
+    return m->type == string_m ? strlen(m->data.strVal) + 1 : 0;
+}
+
+void avm_heapstats_table(struct avm_heapstats *s, int delta) {
+    s->tables += delta;
+    if (delta > 0) s->tablesCreated++;
+    heapstats_add(&s->tableBytes, delta, HEAPSTATS_TABLEBYTES);
+    heapstats_peak(s);
+}
+
+void avm_heapstats_bucket(struct avm_heapstats *s, struct avm_table_bucket *b, int delta) {
+    s->buckets += delta;
+    heapstats_add(&s->bucketBytes, delta, sizeof(struct avm_table_bucket));
+    heapstats_add(&s->keyBytes, delta, heapstats_string(&b->key));
+    heapstats_add(&s->valueBytes, delta, heapstats_string(&b->value));
+    heapstats_peak(s);
+}
+
+void avm_heapstats_value(struct avm_heapstats *s, struct avm_memcell *m, int delta) {
+    heapstats_add(&s->valueBytes, delta, heapstats_string(m));
+    heapstats_peak(s);
+}
+
+// ------------------- WALKING THE TABLES
+
+void heapstats_arrays(struct avm_table *t, struct avm_table_bucket **arrays[HEAPSTATS_ARRAYS]) {
+    arrays[0] = t->strIndexed;
+    arrays[1] = t->numIndexed;
+    arrays[2] = t->ufncIndexed;
+    arrays[3] = t->lfncIndexed;
+    arrays[4] = t->boolIndexed;
+}
+
+unsigned heapstats_bin(unsigned long length) {
+    unsigned bin;
+    if (length <= 2) return length;
+    for (bin = 3, length = (length - 1) >> 2; length && bin < HEAPSTATS_BINS - 1; length >>= 1) bin++;
+    return bin;
+}
+
+struct heapstats_marks {
+    struct avm_table **tables;
+    unsigned size, capacity;
+};
+
+void heapstats_mark(struct heapstats_marks *marks, struct avm_memcell *m) {
+    if (m->type != table_m || m->data.tableVal->reached) return;
+    m->data.tableVal->reached = 1;
+    if (marks->size == marks->capacity) {
+        marks->capacity = marks->capacity ? 2 * marks->capacity : 64;
+        marks->tables = (struct avm_table **) realloc(marks->tables, sizeof(struct avm_table *) * marks->capacity);
+    }
+    marks->tables[marks->size++] = m->data.tableVal;
+}
+
+// marks every table reachable from the roots, the tables it leaves unmarked only cycles keep alive
+void heapstats_reach(avm_state *vm) {
+    struct heapstats_marks marks = { NULL, 0, 0 };
+    struct avm_table_bucket **arrays[HEAPSTATS_ARRAYS], *b;
+    struct avm_coroutine *co;
+    struct avm_table *t;
+    unsigned i, k;
+    for (t = vm->tables; t; t = t->next) t->reached = 0;
+    for (i = vm->top + 1; i < AVM_STACKSIZE; i++) heapstats_mark(&marks, &vm->stack[i]);
+    heapstats_mark(&marks, &vm->retval);
+    heapstats_mark(&marks, &vm->ax);
+    heapstats_mark(&marks, &vm->bx);
+    heapstats_mark(&marks, &vm->cx);
+    for (co = vm->coroutines; co; co = co->next)
+        for (i = 0; i < co->size; i++) heapstats_mark(&marks, &co->segment[i]);
+    while (marks.size) {
+        heapstats_arrays(marks.tables[--marks.size], arrays);
+        for (k = 0; k < HEAPSTATS_ARRAYS; k++)
+            for (i = 0; i < AVM_TABLE_HASHSIZE; i++)
+                for (b = arrays[k][i]; b; b = b->next) {
+                    heapstats_mark(&marks, &b->key);
+                    heapstats_mark(&marks, &b->value);
+                }
+    }
+    free(marks.tables);
+}
+
+void heapstats_snapshot(avm_state *vm, struct heapstats_snapshot *snap) {
+    struct avm_table_bucket **arrays[HEAPSTATS_ARRAYS], *b;
+    struct avm_table *t;
+    unsigned long length;
+    unsigned i, k;
+    memset(snap, 0, sizeof(*snap));
+    snap->counts = vm->heap;
+    heapstats_reach(vm);
+    for (t = vm->tables; t; t = t->next) {
+        heapstats_arrays(t, arrays);
+        if (!t->reached) {
+            snap->unreachableTables++;
+            snap->unreachableBytes += HEAPSTATS_TABLEBYTES;
+        }
+        for (k = 0; k < HEAPSTATS_ARRAYS; k++)
+            for (i = 0; i < AVM_TABLE_HASHSIZE; i++) {
+                for (length = 0, b = arrays[k][i]; b; b = b->next, length++)
+                    if (!t->reached) {
+                        snap->unreachableBuckets++;
+                        snap->unreachableBytes += sizeof(struct avm_table_bucket) + heapstats_string(&b->key) + heapstats_string(&b->value);
+                    }
+                snap->chains[k][heapstats_bin(length)]++;
+                if (length > snap->longest[k]) snap->longest[k] = length;
+            }
+    }
+}
+
+// ------------------- vmstats() AND --vmstats
+
+void heapstats_set(avm_state *vm, struct avm_table *t, const char *key, double value) {
+    struct avm_memcell k, v;
+    k.type = string_m;
+    k.data.strVal = (char *) key;
+    v.type = number_m;
+    v.data.numVal = value;
+    avm_tablesetelem(vm, t, &k, &v);
+}
+
+void heapstats_settable(avm_state *vm, struct avm_table *t, const char *key, struct avm_table *value) {
+    struct avm_memcell k, v;
+    k.type = string_m;
+    k.data.strVal = (char *) key;
+    v.type = table_m;
+    v.data.tableVal = value;
+    avm_tablesetelem(vm, t, &k, &v);
+}
+
+// a snapshot taken before the table it returns is made, which the next call counts
+void libfunc_vmstats(avm_state *vm) {
+    struct heapstats_snapshot snap;
+    struct avm_table *r, *chains, *array;
+    unsigned k, bin;
+    if (avm_totalactuals(vm)) {
+        avm_warning(vm, "'vmstats()': no arguments (not %u) expected!", avm_totalactuals(vm));
+        avm_memcellclear(&vm->retval);
+        vm->retval.type = nil_m;
+        return;
+    }
+    heapstats_snapshot(vm, &snap);
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = table_m;
+    vm->retval.data.tableVal = r = avm_tablenew(vm);
+    avm_tableincrefcounter(r);
+    heapstats_set(vm, r, "tables", snap.counts.tables);
+    heapstats_set(vm, r, "tablesPeak", snap.counts.tablesPeak);
+    heapstats_set(vm, r, "tablesCreated", snap.counts.tablesCreated);
+    heapstats_set(vm, r, "buckets", snap.counts.buckets);
+    heapstats_set(vm, r, "bucketsPeak", snap.counts.bucketsPeak);
+    heapstats_set(vm, r, "bytes", heapstats_bytes(&snap.counts));
+    heapstats_set(vm, r, "bytesPeak", snap.counts.bytesPeak);
+    heapstats_set(vm, r, "tableBytes", snap.counts.tableBytes);
+    heapstats_set(vm, r, "bucketBytes", snap.counts.bucketBytes);
+    heapstats_set(vm, r, "keyBytes", snap.counts.keyBytes);
+    heapstats_set(vm, r, "valueBytes", snap.counts.valueBytes);
+    heapstats_set(vm, r, "unreachableTables", snap.unreachableTables);
+    heapstats_set(vm, r, "unreachableBuckets", snap.unreachableBuckets);
+    heapstats_set(vm, r, "unreachableBytes", snap.unreachableBytes);
+    chains = avm_tablenew(vm);
+    heapstats_settable(vm, r, "chains", chains);
+    for (k = 0; k < HEAPSTATS_ARRAYS; k++) {
+        array = avm_tablenew(vm);
+        heapstats_settable(vm, chains, heapstatsArrayNames[k], array);
+        for (bin = 0; bin < HEAPSTATS_BINS; bin++) heapstats_set(vm, array, heapstatsBinNames[bin], snap.chains[k][bin]);
+        heapstats_set(vm, array, "max", snap.longest[k]);
+    }
+}
+
+void avm_heapstats_dump(avm_state *vm, FILE *f) {
+    struct heapstats_snapshot snap;
+    struct avm_heapstats *s = &snap.counts;
+    unsigned k, bin;
+    heapstats_snapshot(vm, &snap);
+    fprintf(f, "vmstats: %lu tables (peak %lu, %lu created), %lu buckets (peak %lu)\n",
+        s->tables, s->tablesPeak, s->tablesCreated, s->buckets, s->bucketsPeak);
+    fprintf(f, "vmstats: %llu bytes (peak %llu): tables %llu, buckets %llu, keys %llu, values %llu\n",
+        heapstats_bytes(s), s->bytesPeak, s->tableBytes, s->bucketBytes, s->keyBytes, s->valueBytes);
+    fprintf(f, "vmstats: unreachable, kept alive by cycles: %lu tables, %lu buckets, %llu bytes\n",
+        snap.unreachableTables, snap.unreachableBuckets, snap.unreachableBytes);
+    fprintf(f, "vmstats: chain lengths %10s", "");
+    for (bin = 0; bin < HEAPSTATS_BINS; bin++) fprintf(f, " %9s", heapstatsBinNames[bin]);
+    fprintf(f, " %9s\n", "max");
+    for (k = 0; k < HEAPSTATS_ARRAYS; k++) {
+        fprintf(f, "vmstats:   %-22s", heapstatsArrayNames[k]);
+        for (bin = 0; bin < HEAPSTATS_BINS; bin++) fprintf(f, " %9lu", snap.chains[k][bin]);
+        fprintf(f, " %9lu\n", snap.longest[k]);
+    }
+}
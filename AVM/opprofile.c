@@ -0,0 +1,224 @@
+#include "avm.h"
+#include <time.h>
+
+/*
+ * Opcode profile of `avm_exec --profile-opcodes <file.json>`: per vmopcode
+ * the number of instructions executed and the time spent in them, the
+ * operand kind (vmarg_t) pairs seen and the opcode bigrams and trigrams in
+ * execution order. A report sorted by time goes to stderr when the program
+ * ends and the same numbers, with the n-grams cut to AVM_OPPROFILE_JSONTOP,
+ * are written to the JSON file.
+ *
+ * Time is counted in ticks of the time stamp counter on x86 and in
+ * nanoseconds of CLOCK_MONOTONIC elsewhere, less the cost of reading the
+ * clock twice, measured when profiling starts. ns_per_tick converts ticks by
+ * the wall clock of the whole run. A call counts the library function it
+ * runs, a user function is counted instruction by instruction.
+ */
+
+#define AVM_OPCODES (AVM_MAX_INSTRUCTIONS + 1)
+#define AVM_ARGKINDS (empty_a + 1)
+#define AVM_OPPROFILE_TOP 15
+#define AVM_OPPROFILE_JSONTOP 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define OPPROFILE_CLOCK "rdtsc"
+unsigned long long opprofile_ticks(void) {
+    return __rdtsc();
+}
+#else
+#define OPPROFILE_CLOCK "clock_gettime"
+unsigned long long opprofile_ticks(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#endif
+
+struct avm_opprofile {
+    unsigned long long count[AVM_OPCODES];
+    unsigned long long ticks[AVM_OPCODES];
+    unsigned long long kinds[AVM_OPCODES][AVM_ARGKINDS][AVM_ARGKINDS];
+    unsigned long long bigrams[AVM_OPCODES][AVM_OPCODES];
+    unsigned long long trigrams[AVM_OPCODES][AVM_OPCODES][AVM_OPCODES];
+    unsigned prev[2];               // the last two opcodes, AVM_OPCODES before there are any
+    unsigned long long overhead;    // ticks of reading the clock twice
+    unsigned long long start;       // of the instruction running
+    unsigned long long runTicks;    // from avm_opprofile_init
+    struct timespec runStart;
+};
+
+char *opprofileArgNames[] = {
+    "label", "global", "formal", "local", "number", "string",
+    "bool", "nil", "userfunc", "libfunc", "retval", "empty"
+};
+
+extern char *profileOpcodeNames[];
+unsigned verify_used_operands(enum vmopcode op);
+
+// empty_a for an operand the opcode does not use, the binary stores those as labels
+unsigned opprofile_kind(avm_state *vm, struct instruction *instr, unsigned which, unsigned bit) {
+    return verify_used_operands(AVM_OPCODE(instr)) & bit ? avm_operand(vm->program, instr, which).type : empty_a;
+}
+
+void avm_opprofile_init(avm_state *vm) {
+    struct avm_opprofile *p = (struct avm_opprofile *) calloc(1, sizeof(struct avm_opprofile));
+    unsigned long long t0, t1;
+    p->prev[0] = p->prev[1] = AVM_OPCODES;
+    p->overhead = ~0ull;
+    for (unsigned i = 0; i < 1000; i++) {
+        t0 = opprofile_ticks();
+        t1 = opprofile_ticks();
+        if (t1 - t0 < p->overhead) p->overhead = t1 - t0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p->runStart);
+    p->runTicks = opprofile_ticks();
+    vm->opprofile = p;
+}
+
+void avm_opprofile_before(avm_state *vm, struct instruction *instr) {
+    struct avm_opprofile *p = vm->opprofile;
+    unsigned op = AVM_OPCODE(instr);
+    p->count[op]++;
+    p->kinds[op][opprofile_kind(vm, instr, AVM_ARG1, 2)][opprofile_kind(vm, instr, AVM_ARG2, 4)]++;
+    if (p->prev[1] != AVM_OPCODES) {
+        p->bigrams[p->prev[1]][op]++;
+        if (p->prev[0] != AVM_OPCODES) p->trigrams[p->prev[0]][p->prev[1]][op]++;
+    }
+    p->prev[0] = p->prev[1];
+    p->prev[1] = op;
+    // last, the bookkeeping above is not the instruction's
+    p->start = opprofile_ticks();
+}
+
+void avm_opprofile_after(avm_state *vm, struct instruction *instr) {
+    unsigned long long t = opprofile_ticks() - vm->opprofile->start;
+    struct avm_opprofile *p = vm->opprofile;
+    p->ticks[AVM_OPCODE(instr)] += t > p->overhead ? t - p->overhead : 0;
+}
+
+typedef struct opprofile_rank {
+    unsigned index;
+    unsigned long long value;
+} opprofile_rank;
+
+int opprofile_compare(const void *a, const void *b) {
+    const opprofile_rank *x = (const opprofile_rank *) a, *y = (const opprofile_rank *) b;
+    if (x->value != y->value) return x->value < y->value ? 1 : -1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// the nonzero values of v, largest first; *n is their number
+opprofile_rank *opprofile_rank_values(unsigned long long *v, unsigned size, unsigned *n) {
+    opprofile_rank *r = (opprofile_rank *) malloc(sizeof(opprofile_rank) * (size + 1));
+    unsigned i;
+    for (i = *n = 0; i < size; i++) {
+        if (!v[i]) continue;
+        r[*n].index = i;
+        r[(*n)++].value = v[i];
+    }
+    qsort(r, *n, sizeof(opprofile_rank), opprofile_compare);
+    return r;
+}
+
+// the opcodes that ran, the most time first
+opprofile_rank *opprofile_rank_opcodes(struct avm_opprofile *p, unsigned *n) {
+    opprofile_rank *r = (opprofile_rank *) malloc(sizeof(opprofile_rank) * AVM_OPCODES);
+    unsigned i;
+    for (i = *n = 0; i < AVM_OPCODES; i++) {
+        if (!p->count[i]) continue;
+        r[*n].index = i;
+        r[(*n)++].value = p->ticks[i];
+    }
+    qsort(r, *n, sizeof(opprofile_rank), opprofile_compare);
+    return r;
+}
+
+void opprofile_write_json(FILE *f, struct avm_opprofile *p, unsigned long long total, unsigned long long ticks, double nsPerTick) {
+    opprofile_rank *r;
+    unsigned n, i, k = AVM_ARGKINDS;
+    fprintf(f, "{\n  \"clock\": \"%s\",\n  \"instructions\": %llu,\n  \"ticks\": %llu,\n  \"ns_per_tick\": %.6f,\n  \"clock_overhead\": %llu,\n",
+        OPPROFILE_CLOCK, total, ticks, nsPerTick, p->overhead);
+    r = opprofile_rank_opcodes(p, &n);
+    fprintf(f, "  \"opcodes\": [");
+    for (i = 0; i < n; i++)
+        fprintf(f, "%s\n    {\"opcode\": \"%s\", \"count\": %llu, \"ticks\": %llu, \"ns\": %.0f}", i ? "," : "",
+            profileOpcodeNames[r[i].index], p->count[r[i].index], r[i].value, r[i].value * nsPerTick);
+    free(r);
+    r = opprofile_rank_values(&p->kinds[0][0][0], AVM_OPCODES * k * k, &n);
+    fprintf(f, "\n  ],\n  \"operand_kinds\": [");
+    for (i = 0; i < n; i++)
+        fprintf(f, "%s\n    {\"opcode\": \"%s\", \"arg1\": \"%s\", \"arg2\": \"%s\", \"count\": %llu}", i ? "," : "",
+            profileOpcodeNames[r[i].index / (k * k)], opprofileArgNames[r[i].index / k % k], opprofileArgNames[r[i].index % k], r[i].value);
+    free(r);
+    r = opprofile_rank_values(&p->bigrams[0][0], AVM_OPCODES * AVM_OPCODES, &n);
+    fprintf(f, "\n  ],\n  \"bigrams\": [");
+    for (i = 0; i < n && i < AVM_OPPROFILE_JSONTOP; i++)
+        fprintf(f, "%s\n    {\"opcodes\": [\"%s\", \"%s\"], \"count\": %llu}", i ? "," : "",
+            profileOpcodeNames[r[i].index / AVM_OPCODES], profileOpcodeNames[r[i].index % AVM_OPCODES], r[i].value);
+    free(r);
+    r = opprofile_rank_values(&p->trigrams[0][0][0], AVM_OPCODES * AVM_OPCODES * AVM_OPCODES, &n);
+    fprintf(f, "\n  ],\n  \"trigrams\": [");
+    for (i = 0; i < n && i < AVM_OPPROFILE_JSONTOP; i++)
+        fprintf(f, "%s\n    {\"opcodes\": [\"%s\", \"%s\", \"%s\"], \"count\": %llu}", i ? "," : "",
+            profileOpcodeNames[r[i].index / (AVM_OPCODES * AVM_OPCODES)], profileOpcodeNames[r[i].index / AVM_OPCODES % AVM_OPCODES],
+            profileOpcodeNames[r[i].index % AVM_OPCODES], r[i].value);
+    free(r);
+    fprintf(f, "\n  ]");
+}
+
+void opprofile_write_report(FILE *f, struct avm_opprofile *p, unsigned long long total, unsigned long long ticks, double nsPerTick) {
+    opprofile_rank *r;
+    unsigned n, i, k = AVM_ARGKINDS;
+    unsigned long long spent = 0;
+    for (i = 0; i < AVM_OPCODES; i++) spent += p->ticks[i];
+    fprintf(f, "opcode profile: %llu instructions, %llu %s ticks (%.3f ms), %.3f ns per tick\n",
+        total, ticks, OPPROFILE_CLOCK, ticks * nsPerTick / 1e6, nsPerTick);
+    fprintf(f, "%-14s %14s %7s %16s %7s %10s\n", "opcode", "count", "count%", "ticks", "time%", "ns/op");
+    r = opprofile_rank_opcodes(p, &n);
+    for (i = 0; i < n; i++)
+        fprintf(f, "%-14s %14llu %6.2f%% %16llu %6.2f%% %10.2f\n", profileOpcodeNames[r[i].index], p->count[r[i].index],
+            100.0 * p->count[r[i].index] / total, r[i].value, spent ? 100.0 * r[i].value / spent : 0,
+            r[i].value * nsPerTick / p->count[r[i].index]);
+    free(r);
+    r = opprofile_rank_values(&p->kinds[0][0][0], AVM_OPCODES * k * k, &n);
+    fprintf(f, "top operand kinds:\n");
+    for (i = 0; i < n && i < AVM_OPPROFILE_TOP; i++)
+        fprintf(f, "  %-14s %-9s %-9s %14llu\n", profileOpcodeNames[r[i].index / (k * k)],
+            opprofileArgNames[r[i].index / k % k], opprofileArgNames[r[i].index % k], r[i].value);
+    free(r);
+    r = opprofile_rank_values(&p->bigrams[0][0], AVM_OPCODES * AVM_OPCODES, &n);
+    fprintf(f, "top bigrams:\n");
+    for (i = 0; i < n && i < AVM_OPPROFILE_TOP; i++)
+        fprintf(f, "  %-14s %-14s %14llu\n", profileOpcodeNames[r[i].index / AVM_OPCODES],
+            profileOpcodeNames[r[i].index % AVM_OPCODES], r[i].value);
+    free(r);
+    r = opprofile_rank_values(&p->trigrams[0][0][0], AVM_OPCODES * AVM_OPCODES * AVM_OPCODES, &n);
+    fprintf(f, "top trigrams:\n");
+    for (i = 0; i < n && i < AVM_OPPROFILE_TOP; i++)
+        fprintf(f, "  %-14s %-14s %-14s %14llu\n", profileOpcodeNames[r[i].index / (AVM_OPCODES * AVM_OPCODES)],
+            profileOpcodeNames[r[i].index / AVM_OPCODES % AVM_OPCODES], profileOpcodeNames[r[i].index % AVM_OPCODES], r[i].value);
+    free(r);
+}
+
+int avm_opprofile_write(avm_state *vm, char *path) {
+    struct avm_opprofile *p = vm->opprofile;
+    unsigned long long ticks = opprofile_ticks() - p->runTicks, total = 0;
+    struct timespec end;
+    double nsPerTick;
+    FILE *f;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nsPerTick = ticks ? ((end.tv_sec - p->runStart.tv_sec) * 1e9 + (end.tv_nsec - p->runStart.tv_nsec)) / ticks : 0;
+    for (unsigned i = 0; i < AVM_OPCODES; i++) total += p->count[i];
+    opprofile_write_report(stderr, p, total, ticks, nsPerTick);
+    if (!(f = fopen(path, "w"))) {
+        avm_warning(vm, "cannot write opcode profile '%s'", path);
+        return 0;
+    }
+    opprofile_write_json(f, p, total, ticks, nsPerTick);
+    avm_counters_json(vm, f);
+    fprintf(f, "\n}\n");
+    fclose(f);
+    return 1;
+}
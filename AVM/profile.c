@@ -0,0 +1,156 @@
+#include "avm.h"
+
+/*
+ * Execution profile written by `avm_exec --profile <file>`, read back by
+ * `out --profile <file>`. After an "alpha-profile 1 <codeSize>" header there
+ * is one line per instruction, including the ones that never ran:
+ *
+ *   <index> <srcLine> <opcode> <count> [taken <n>] [arg1 <hist>] [arg2 <hist>] [calls <hist>]
+ *
+ * srcLine is the quad the instruction was generated from, which is what the
+ * compiler keys the profile by. Type histograms are <type>=<n> pairs using
+ * the typeStrings names, call histograms <function>=<n> with at most
+ * AVM_PROFILE_TARGETS named targets and the rest counted as "other".
+ */
+
+#define AVM_PROFILE_TARGETS 4
+
+typedef struct avm_profile_target {
+    char *name;
+    unsigned long count;
+} avm_profile_target;
+
+typedef struct avm_profile_entry {
+    unsigned long count;
+    unsigned long taken;
+    unsigned long types[2][8];
+    avm_profile_target targets[AVM_PROFILE_TARGETS];
+    unsigned long otherTargets;
+} avm_profile_entry;
+
+char *profileOpcodeNames[] = {
+    "assign", "add", "sub", "mul", "div", "mod", "uminus", "and", "or", "not",
+    "jeq", "jne", "jle", "jge", "jlt", "jgt", "jump", "call", "pusharg",
+    "funcenter", "funcexit", "newtable", "tablegetelem", "tablesetelem", "nop",
+    "add_nn", "sub_nn", "mul_nn", "div_nn", "mod_nn",
+    "jeq_nn", "jne_nn", "jle_nn", "jge_nn", "jlt_nn", "jgt_nn", "yield"
+};
+
+void avm_profile_init(avm_state *vm) {
+    vm->profile = (avm_profile_entry *) calloc(vm->program->codeSize + 1, sizeof(avm_profile_entry));
+}
+
+int profile_reads_operands(enum vmopcode op) {
+    switch (op) {
+        case assign_v:
+        case pusharg_v:
+        case newtable_v:
+        case call_v:
+        case jump_v:
+        case funcenter_v:
+        case funcexit_v:
+        case yield_v:
+        case nop_v:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+void profile_operand_type(avm_state *vm, avm_profile_entry *e, unsigned k, struct instruction *instr, unsigned which) {
+    avm_memcell reg, *m;
+    struct vmarg arg = avm_operand(vm->program, instr, which);
+    if (arg.type == label_a || arg.type > retval_a) return;
+    reg.type = undef_m;
+    m = avm_translate_operand(vm, &arg, &reg);
+    if (m && m->type <= undef_m) e->types[k][m->type]++;
+}
+
+void profile_call_target(avm_state *vm, avm_profile_entry *e, struct instruction *instr) {
+    avm_memcell reg, *m;
+    char *name = NULL;
+    unsigned i;
+    struct vmarg arg = avm_operand(vm->program, instr, AVM_ARG1);
+    if (arg.type == label_a || arg.type > retval_a) return;
+    m = avm_translate_operand(vm, &arg, &reg);
+    switch (m->type) {
+        case userfunc_m:    name = avm_funcname(vm->program, avm_getfuncinfo(vm->program, m->data.funcVal)); break;
+        case libfunc_m:     name = m->data.libfuncVal; break;
+        case string_m:      name = m->data.strVal; break;
+        default:            break;
+    }
+    if (!name) {
+        e->otherTargets++;
+        return;
+    }
+    for (i = 0; i < AVM_PROFILE_TARGETS && e->targets[i].name; i++) {
+        if (!strcmp(e->targets[i].name, name)) {
+            e->targets[i].count++;
+            return;
+        }
+    }
+    if (i == AVM_PROFILE_TARGETS) {
+        e->otherTargets++;
+        return;
+    }
+    e->targets[i].name = strdup(name);
+    e->targets[i].count = 1;
+}
+
+// operands are looked at before the instruction runs, since it may overwrite them
+void avm_profile_before(avm_state *vm, struct instruction *instr) {
+    avm_profile_entry *e = vm->profile + vm->pc;
+    e->count++;
+    enum vmopcode op = AVM_OPCODE(instr);
+    if (op == call_v) profile_call_target(vm, e, instr);
+    else if (op == assign_v || op == pusharg_v) profile_operand_type(vm, e, 0, instr, AVM_ARG1);
+    else if (profile_reads_operands(op)) {
+        profile_operand_type(vm, e, 0, instr, AVM_ARG1);
+        profile_operand_type(vm, e, 1, instr, AVM_ARG2);
+    }
+}
+
+void avm_profile_after(avm_state *vm, struct instruction *instr, unsigned oldPC) {
+    enum vmopcode op = AVM_OPCODE(instr);
+    int branch = (op >= jeq_v && op <= jgt_v) || (op >= jeq_nn_v && op <= jgt_nn_v);
+    if (branch && !vm->executionFinished && vm->pc == avm_label(vm->program, instr) && vm->pc != oldPC + 1) vm->profile[oldPC].taken++;
+}
+
+void profile_write_types(FILE *f, char *label, unsigned long *types) {
+    unsigned t, first = 1;
+    for (t = 0; t <= undef_m; t++) {
+        if (!types[t]) continue;
+        if (first) fprintf(f, " %s ", label);
+        fprintf(f, "%s%s=%lu", first ? "" : ",", typeStrings[t], types[t]);
+        first = 0;
+    }
+}
+
+int avm_profile_write(avm_state *vm, char *path) {
+    FILE *f = fopen(path, "w");
+    unsigned i, t;
+    avm_profile_entry *e;
+    enum vmopcode op;
+    if (!f) {
+        avm_warning(vm, "cannot write profile '%s'", path);
+        return 0;
+    }
+    fprintf(f, "alpha-profile 1 %u\n", vm->program->codeSize);
+    for (i = 0; i < vm->program->codeSize; i++) {
+        e = vm->profile + i;
+        op = AVM_OPCODE(vm->program->code + i);
+        fprintf(f, "%u %u %s %lu", i, vm->program->codeLines[i], profileOpcodeNames[op], e->count);
+        if ((op >= jeq_v && op <= jgt_v) || (op >= jeq_nn_v && op <= jgt_nn_v)) fprintf(f, " taken %lu", e->taken);
+        profile_write_types(f, "arg1", e->types[0]);
+        profile_write_types(f, "arg2", e->types[1]);
+        if (op == call_v) {
+            fprintf(f, " calls ");
+            for (t = 0; t < AVM_PROFILE_TARGETS && e->targets[t].name; t++)
+                fprintf(f, "%s%s=%lu", t ? "," : "", e->targets[t].name, e->targets[t].count);
+            if (e->otherTargets) fprintf(f, "%sother=%lu", t ? "," : "", e->otherTargets);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return 1;
+}
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "avm.h"
 #include "reader.h"
+#include "abc.h"
 
 
 // int main(){
@@ -18,7 +21,7 @@
 //     }
 //     printf("USRFUNCS\n");
 //     for (unsigned i = 0; i<totalUserFuncs; i++) {
-//         printf("%u: %u %u %s\n", i,userFuncs[i].address,userFuncs[i].localSize,userFuncs[i].id);
+//         printf("%u: %u %u %s\n", i,userFuncs[i].address,userFuncs[i].localSize,avm_funcname(&userFuncs[i]));
         
 //     }
 //     printf("LIBFUNCS\n");
@@ -29,123 +32,172 @@
 //     return 0;
 // }
 
-int avmbinaryfile() {
-    bin_file = fopen(bin_file_name,"rb");
+// the whole file is mapped once, versions 1 and 2 are copied out of it and it is unmapped
+int avmbinaryfile(avm_program *p, char *path) {
+    avm_reader reader, *r = &reader;
+    int version, ok;
+    struct stat st;
+    FILE *bin_file = fopen(path,"rb");
     if (!bin_file) {
-        avm_error("BINARY FILE ERROR");
+        avm_error(NULL, "BINARY FILE ERROR");
         return 0;
     }
-    if(!magicnumber()) {
-        avm_error("Error reading magicnumber");
+    if (fstat(fileno(bin_file), &st) || (size_t) st.st_size < sizeof(unsigned)) {
+        fclose(bin_file);
+        avm_error(NULL, "Truncated binary");
         return 0;
     }
-    if(!arrays()) {
-        avm_error("Error reading arrays");
+    // private and writable, the verifier downgrades unproven typed instructions in place
+    r->buf = (char *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(bin_file), 0);
+    fclose(bin_file);
+    if (r->buf == MAP_FAILED) {
+        avm_error(NULL, "Cannot map binary '%s'", path);
         return 0;
     }
-    if(!t_code()) {
-        avm_error("Error reading code");
+    r->size = st.st_size;
+    r->pos = 0;
+    if(!(version = magicnumber(r))) {
+        munmap(r->buf, r->size);
+        avm_error(NULL, "Error reading magicnumber");
         return 0;
     }
+    if (version != 1 && version != ABC_VERSION_V2) {
+        p->image = r->buf;
+        p->imageSize = r->size;
+        p->mapped = 1;
+        if (!avm_mapbinary(r, p)) return 0;
+        printf("=========================================================\n");
+        return 1;
+    }
+    if (version == ABC_VERSION_V2) ok = avm_readv2(r, p);
+    else if ((ok = arrays(r, p)) && !(ok = t_code(r, p))) avm_error(NULL, "Error reading code");
+    munmap(r->buf, r->size);
+    if (!ok) return 0;
     printf("=========================================================\n");
     return 1;
 }
 
-int magicnumber() {
+// the version of the binary, 1 or the one in the header, 0 if it is neither
+int magicnumber(avm_reader *r) {
     unsigned n;
-    if(!readUnsigned(&n)) return 0;
+    if(!readUnsigned(r, &n)) return 0;
     printf("=========================================================\n");
+    if (n == ABC_MAGIC_V2) return readUnsigned(r, &n) ? n : 0;
     if (n != MAGICNUMBER) {
-        avm_error("MAGIC NUMBER MISMATCH");
+        avm_error(NULL, "MAGIC NUMBER MISMATCH");
         return 0;
     }
     return 1;
 }
 
-int arrays() {
-    return arrays_strings() && arrays_numbers() && arrays_userfunctions() && arrays_libfunctions();
+// count records of at least size bytes each can still follow, checked before allocating them
+int readFits(avm_reader *r, unsigned count, size_t size) {
+    if (count <= (r->size - r->pos) / size) return 1;
+    avm_error(NULL, "Truncated binary: %u records of %u bytes at offset %lu, file has %lu", count, (unsigned) size, (unsigned long) r->pos, (unsigned long) r->size);
+    return 0;
+}
+
+int arrays(avm_reader *r, avm_program *p) {
+    if (arrays_strings(r, p) && arrays_numbers(r, p) && arrays_userfunctions(r, p) && arrays_libfunctions(r, p)) return 1;
+    avm_error(NULL, "Error reading arrays");
+    return 0;
 }
 
-int arrays_strings() {
-    if(!readUnsigned(&totalStringConsts)) {
-        avm_error("Error reading number of total strings");
+int arrays_strings(avm_reader *r, avm_program *p) {
+    if(!readUnsigned(r, &p->totalStringConsts)) {
+        avm_error(NULL, "Error reading number of total strings");
         return 0;
     }
-    stringConsts =(char **) malloc(sizeof(char *) * totalStringConsts);
-    for (int i = 0; i<totalStringConsts; i++) if (!readString(&stringConsts[i])) {
-        avm_error("Error reading string(%d)", i);
+    if (!readFits(r, p->totalStringConsts, sizeof(unsigned))) return 0;
+    // every string is in the file with its length, so the blob can never outgrow it
+    p->stringBlob = (char *) malloc(r->size);
+    p->totalBlobSize = 0;
+    p->stringConsts =(unsigned *) malloc(sizeof(unsigned) * p->totalStringConsts);
+    for (int i = 0; i<p->totalStringConsts; i++) if (!readBlobString(r, p, &p->stringConsts[i])) {
+        avm_error(NULL, "Error reading string(%d)", i);
         return 0;
     }
     return 1;
 }
 
-int arrays_numbers() {
-    if(!readUnsigned(&totalNumConsts)) {
-        avm_error("Error reading number of total numbers");
-        return 0;
-    }
-    numConsts =(double*) malloc(sizeof(double) * totalNumConsts);
-    for (int i = 0; i<totalNumConsts; i++) if(!readDouble(&numConsts[i])) {
-        avm_error("Error reading number(%d)", i);
+int arrays_numbers(avm_reader *r, avm_program *p) {
+    if(!readUnsigned(r, &p->totalNumConsts)) {
+        avm_error(NULL, "Error reading number of total numbers");
         return 0;
     }
+    if (!readFits(r, p->totalNumConsts, sizeof(double))) return 0;
+    p->numConsts =(double*) malloc(sizeof(double) * p->totalNumConsts);
+    memcpy(p->numConsts, r->buf + r->pos, sizeof(double) * p->totalNumConsts);
+    r->pos += sizeof(double) * p->totalNumConsts;
     return 1;
 }
 
-int arrays_userfunctions() {
-    if(!readUnsigned(&totalUserFuncs)) {
-        avm_error("Error reading number of total userfuncs");
+int arrays_userfunctions(avm_reader *r, avm_program *p) {
+    if(!readUnsigned(r, &p->totalUserFuncs)) {
+        avm_error(NULL, "Error reading number of total userfuncs");
         return 0;
     }
+    if (!readFits(r, p->totalUserFuncs, 3 * sizeof(unsigned))) return 0;
     struct userfunc *iter;
-    userFuncs = malloc(sizeof(struct userfunc) * totalUserFuncs);
-    for (int i = 0; i<totalUserFuncs; i++) {
-        iter = &userFuncs[i];
-        if(!readUnsigned(&iter->address)) return 0;
-        if(!readUnsigned(&iter->localSize)) return 0;
-        if(!readString(&iter->id)) return 0;
+    p->userFuncs = malloc(sizeof(struct userfunc) * p->totalUserFuncs);
+    for (int i = 0; i<p->totalUserFuncs; i++) {
+        iter = &p->userFuncs[i];
+        if(!readUnsigned(r, &iter->address)) return 0;
+        if(!readUnsigned(r, &iter->localSize)) return 0;
+        if(!readBlobString(r, p, &iter->id)) return 0;
         iter->address++;
     }
     return 1;
 }
 
-int arrays_libfunctions() {
-     if(!readUnsigned(&totalNamedLibFuncs)) {
-        avm_error("Error reading number of total libfuncs");
+int arrays_libfunctions(avm_reader *r, avm_program *p) {
+     if(!readUnsigned(r, &p->totalNamedLibFuncs)) {
+        avm_error(NULL, "Error reading number of total libfuncs");
         return 0;
     }
-    namedLibFuncs = (char**)malloc(sizeof(char *) * totalNamedLibFuncs);
-    for (int i = 0; i<totalNamedLibFuncs; i++) if (!readString(&namedLibFuncs[i])) {
-        avm_error("Error reading libfunc(%d)", i);
+    if (!readFits(r, p->totalNamedLibFuncs, sizeof(unsigned))) return 0;
+    p->namedLibFuncs = (unsigned *)malloc(sizeof(unsigned) * p->totalNamedLibFuncs);
+    for (int i = 0; i<p->totalNamedLibFuncs; i++) if (!readBlobString(r, p, &p->namedLibFuncs[i])) {
+        avm_error(NULL, "Error reading libfunc(%d)", i);
         return 0;
     }
     return 1;
 }
 
-int t_code() {
-    if (!readUnsigned(&GlobalProgrammVarOffset)) {
-        avm_error("Error reading number of globals");
+int t_code(avm_reader *r, avm_program *p) {
+    if (!readUnsigned(r, &p->globals)) {
+        avm_error(NULL, "Error reading number of globals");
         return 0;
     }
-    if (!readUnsigned(&codeSize)) {
-        avm_error("Error reading number of total instructions");
+    if (!readUnsigned(r, &p->codeSize)) {
+        avm_error(NULL, "Error reading number of total instructions");
         return 0;
     }
-    struct instruction *instr;
-    code = (struct instruction*)malloc(sizeof(struct instruction) * codeSize);
+    // a srcLine and an opcode at least
+    if (!readFits(r, p->codeSize, sizeof(unsigned) + 1)) return 0;
+    enum vmopcode opcode;
+    struct vmarg result, arg1, arg2;
+    char op;
+    p->code = (struct instruction*)malloc(sizeof(struct instruction) * p->codeSize);
+    p->codeLines = (unsigned *)malloc(sizeof(unsigned) * p->codeSize);
+    p->totalWide = 0;
+    p->codeWide = NULL;
 // printf("currInstr / totalInstr : opcode \n");
-    for (int i = 0; i<codeSize; i++) {
-        instr = &code[i];
-        if (!readUnsigned((unsigned *)&instr->srcLine)) {
-            avm_error("Error reading instruction(%d) srcLine", i);
+    for (int i = 0; i<p->codeSize; i++) {
+        memset(&result, 0, sizeof(result));
+        memset(&arg1, 0, sizeof(arg1));
+        memset(&arg2, 0, sizeof(arg2));
+        if (!readUnsigned(r, &p->codeLines[i])) {
+            avm_error(NULL, "Error reading instruction(%d) srcLine", i);
             return 0;
         }
-        if (!readByte((char *)&instr->opcode)) {
-            avm_error("Error reading instruction(%d) opcode", i);
+        if (!readByte(r, &op)) {
+            avm_error(NULL, "Error reading instruction(%d) opcode", i);
             return 0;
         }
-// printf("%d/%d:%d = ",i,codeSize-1,instr->opcode);
-        switch (instr->opcode) {
+        opcode = (enum vmopcode) (unsigned char) op;
+// printf("%d/%d:%d = ",i,codeSize-1,opcode);
+        switch (opcode) {
             case add_v:
             case sub_v:
             case mul_v:
@@ -157,31 +209,43 @@ int t_code() {
             case jge_v:
             case jlt_v:
             case jgt_v:
+            case add_nn_v:
+            case sub_nn_v:
+            case mul_nn_v:
+            case div_nn_v:
+            case mod_nn_v:
+            case jeq_nn_v:
+            case jne_nn_v:
+            case jle_nn_v:
+            case jge_nn_v:
+            case jlt_nn_v:
+            case jgt_nn_v:
             case uminus_v:
             case tablegetelem_v:
             case tablesetelem_v:
-                if(!operand(&instr->arg2)) {
-                    avm_error("Error reading instruction(%d) arg2", i);
+                if(!operand(r, &arg2)) {
+                    avm_error(NULL, "Error reading instruction(%d) arg2", i);
                     return 0;
                 }
             case assign_v:
-                if(!operand(&instr->arg1)) {
-                    avm_error("Error reading instruction(%d) arg1", i);
+                if(!operand(r, &arg1)) {
+                    avm_error(NULL, "Error reading instruction(%d) arg1", i);
                     return 0;
                 }
             case jump_v:
             case funcenter_v:
             case funcexit_v:
-                if(!operand(&instr->result)) {
-                    avm_error("Error reading instruction(%d) arg1", i);
+                if(!operand(r, &result)) {
+                    avm_error(NULL, "Error reading instruction(%d) arg1", i);
                     return 0;
                 }
                 break;
             case call_v:
             case pusharg_v:
             case newtable_v:
-                if(!operand(&instr->arg1)) {
-                    avm_error("Error reading instruction(%d) arg1", i);
+            case yield_v:
+                if(!operand(r, &arg1)) {
+                    avm_error(NULL, "Error reading instruction(%d) arg1", i);
                     return 0;
                 }
             case nop_v:
@@ -189,21 +253,25 @@ int t_code() {
             case and_v:
             case or_v:
             case not_v:
-                avm_error("Error reading instruction(%d), illegal opcode", i);
+                avm_error(NULL, "Error reading instruction(%d), illegal opcode", i);
+                return 0;
             default:
-                avm_error("Error reading instruction(%d), invalid opcode", i);
-                assert(0);
+                avm_error(NULL, "Error reading instruction(%d), invalid opcode", i);
+                return 0;
         }
-// printf(" res: %u, a1: %u, a2: %u\n",instr->result.type,instr->arg1.type,instr->arg2.type);
+// printf(" res: %u, a1: %u, a2: %u\n",result.type,arg1.type,arg2.type);
+        avm_encode(p, i, opcode, &result, &arg1, &arg2);
     }
     return 1;
 }
 
-int operand(struct vmarg *vmarg) {
-    if (!readByte((char *)&vmarg->type)) {
-        avm_error("Error reading operand type");
+int operand(avm_reader *r, struct vmarg *vmarg) {
+    char type;
+    if (!readByte(r, &type)) {
+        avm_error(NULL, "Error reading operand type");
         return 0;
     }
+    vmarg->type = (enum vmarg_t) (unsigned char) type;
     switch (vmarg->type) {
         case label_a:
         case global_a:
@@ -215,43 +283,246 @@ int operand(struct vmarg *vmarg) {
         case nil_a:
         case userfunc_a:
         case libfunc_a:
-            if (!readUnsigned(&vmarg->val)){
-                avm_error("Error reading operand value");
+            if (!readUnsigned(r, &vmarg->val)){
+                avm_error(NULL, "Error reading operand value");
                 return 0;
             }
         case retval_a:
             break;
         default:
-            avm_error("Error invalid vmarg type(%u)", vmarg->type);
+            avm_error(NULL, "Error invalid vmarg type(%u)", vmarg->type);
             return 0;
     }
     return 1;
 }
 
-int readString(char **str) {
+// appends the string to stringBlob, which arrays_strings sized for the whole file; *offset is where it starts
+int readBlobString(avm_reader *r, avm_program *p, unsigned *offset) {
     unsigned s;
-    if (!readUnsigned(&s)) {
+    if (!readUnsigned(r, &s) || s > r->size - r->pos) return 0;
+    memcpy(p->stringBlob + p->totalBlobSize, r->buf + r->pos, s);
+    r->pos += s;
+    p->stringBlob[p->totalBlobSize + s] = '\0';
+    *offset = p->totalBlobSize;
+    p->totalBlobSize += s + 1;
+    return 1;
+}
+
+int readUnsigned(avm_reader *r, unsigned *u) {
+    if (r->size - r->pos < sizeof(unsigned)) return 0;
+    memcpy(u, r->buf + r->pos, sizeof(unsigned));
+    r->pos += sizeof(unsigned);
+    return 1;
+}
+
+int readDouble(avm_reader *r, double *d) {
+    if (r->size - r->pos < sizeof(double)) return 0;
+    memcpy(d, r->buf + r->pos, sizeof(double));
+    r->pos += sizeof(double);
+    return 1;
+}
+
+int readByte(avm_reader *r, char *c) {
+    if (r->pos == r->size) return 0;
+    *c = r->buf[r->pos++];
+    return 1;
+}
+
+/* ---------------- versions 2 and 3 ---------------- */
+
+// count elements of size bytes at offset lie inside the file and are aligned for them
+int section_fits(unsigned offset, unsigned count, size_t size, size_t fileSize) {
+    if (offset % 8 || offset > fileSize) return 0;
+    return count <= (fileSize - offset) / size;
+}
+
+// every blob offset of the table names a string inside the blob
+int offsets_fit(avm_program *p, unsigned *offsets, unsigned count, size_t stride) {
+    for (unsigned i = 0; i < count; i++, offsets = (unsigned *) ((char *) offsets + stride))
+        if (*offsets >= p->totalBlobSize) return 0;
+    return 1;
+}
+
+// a copy of size bytes of the binary at offset
+void *section_copy(avm_reader *r, unsigned offset, size_t size) {
+    void *copy = malloc(size ? size : 1);
+    memcpy(copy, r->buf + offset, size);
+    return copy;
+}
+
+// copies the tables of a version 2 binary and packs its instructions, as t_code does for version 1
+int avm_readv2(avm_reader *r, avm_program *p) {
+    abc_header_v2 *h = (abc_header_v2 *) r->buf;
+    abc_instruction_v2 *in;
+    struct vmarg ops[3];
+    unsigned i, k;
+
+    if (r->size < sizeof(abc_header_v2) || h->fileSize != r->size || h->instrSize != sizeof(abc_instruction_v2)) {
+        avm_error(NULL, "Version 2 binary of %u bytes with %u-byte instructions, file has %lu", h->fileSize, h->instrSize, (unsigned long) r->size);
         return 0;
     }
-    *str = (char *)malloc(s+1);
-    if (!fread(*str, sizeof(char), s, bin_file)){
+    if (!section_fits(h->strings, h->totalStrings, sizeof(unsigned), r->size)
+     || !section_fits(h->numbers, h->totalNumbers, sizeof(double), r->size)
+     || !section_fits(h->userFuncs, h->totalUserFuncs, sizeof(struct userfunc), r->size)
+     || !section_fits(h->libFuncs, h->totalLibFuncs, sizeof(unsigned), r->size)
+     || !section_fits(h->code, h->codeSize, sizeof(abc_instruction_v2), r->size)
+     || !section_fits(h->lines, h->codeSize, sizeof(unsigned), r->size)
+     || !section_fits(h->blob, h->blobSize, 1, r->size)
+     || (h->blobSize && r->buf[h->blob + h->blobSize - 1])) {
+        avm_error(NULL, "Binary section outside the file");
         return 0;
     }
-    (*str)[s] = '\0';
+    p->globals = h->globals;
+    p->totalBlobSize = h->blobSize;
+    p->stringBlob = (char *) section_copy(r, h->blob, h->blobSize);
+    p->totalStringConsts = h->totalStrings;
+    p->stringConsts = (unsigned *) section_copy(r, h->strings, sizeof(unsigned) * h->totalStrings);
+    p->totalNumConsts = h->totalNumbers;
+    p->numConsts = (double *) section_copy(r, h->numbers, sizeof(double) * h->totalNumbers);
+    p->totalUserFuncs = h->totalUserFuncs;
+    p->userFuncs = (struct userfunc *) section_copy(r, h->userFuncs, sizeof(struct userfunc) * h->totalUserFuncs);
+    p->totalNamedLibFuncs = h->totalLibFuncs;
+    p->namedLibFuncs = (unsigned *) section_copy(r, h->libFuncs, sizeof(unsigned) * h->totalLibFuncs);
+    p->codeSize = h->codeSize;
+    p->codeLines = (unsigned *) section_copy(r, h->lines, sizeof(unsigned) * h->codeSize);
+    p->code = (struct instruction *) malloc(sizeof(struct instruction) * (h->codeSize ? h->codeSize : 1));
+    p->totalWide = 0;
+    p->codeWide = NULL;
+    if (!offsets_fit(p, p->stringConsts, p->totalStringConsts, sizeof(unsigned))
+     || !offsets_fit(p, p->namedLibFuncs, p->totalNamedLibFuncs, sizeof(unsigned))
+     || !offsets_fit(p, &p->userFuncs->id, p->totalUserFuncs, sizeof(struct userfunc))) {
+        avm_error(NULL, "Binary string outside the blob");
+        return 0;
+    }
+    for (i = 0; i < h->codeSize; i++) {
+        in = (abc_instruction_v2 *) (r->buf + h->code) + i;
+        // packed, a larger opcode or kind would be cut to a valid one the verifier cannot reject
+        if (in->opcode > AVM_MAX_INSTRUCTIONS) {
+            avm_error(NULL, "Error reading instruction(%u), invalid opcode", i);
+            return 0;
+        }
+        for (k = 0; k < 3; k++) {
+            if (in->operands[k][0] > empty_a) {
+                avm_error(NULL, "Error invalid vmarg type(%u)", in->operands[k][0]);
+                return 0;
+            }
+            ops[k].type = (enum vmarg_t) in->operands[k][0];
+            ops[k].val = in->operands[k][1];
+        }
+        avm_encode(p, i, (enum vmopcode) in->opcode, &ops[0], &ops[1], &ops[2]);
+    }
     return 1;
 }
 
-int readUnsigned(unsigned *u) {
-    if (!fread(u, sizeof(unsigned), 1, bin_file)) return 0;
-    return 1; 
-}
+// points the tables into the mapped binary, nothing but the header and the offsets is looked at
+int avm_mapbinary(avm_reader *r, avm_program *p) {
+    abc_header *h = (abc_header *) r->buf;
+    char *base = r->buf;
 
-int readDouble(double *d) {
-    if (!fread(d, sizeof(double), 1, bin_file)) return 0;
+    if (r->size < sizeof(abc_header)) {
+        avm_error(NULL, "Truncated binary");
+        return 0;
+    }
+    if (h->version != ABC_VERSION || h->fileSize != r->size) {
+        avm_error(NULL, "Binary version %u of %u bytes, file has %lu", h->version, h->fileSize, (unsigned long) r->size);
+        return 0;
+    }
+    if (h->instrSize != sizeof(struct instruction)) {
+        avm_error(NULL, "Binary instructions are %u bytes, this VM uses %u", h->instrSize, (unsigned) sizeof(struct instruction));
+        return 0;
+    }
+    if (!section_fits(h->strings, h->totalStrings, sizeof(unsigned), r->size)
+     || !section_fits(h->numbers, h->totalNumbers, sizeof(double), r->size)
+     || !section_fits(h->userFuncs, h->totalUserFuncs, sizeof(struct userfunc), r->size)
+     || !section_fits(h->libFuncs, h->totalLibFuncs, sizeof(unsigned), r->size)
+     || !section_fits(h->code, h->codeSize, sizeof(struct instruction), r->size)
+     || !section_fits(h->wide, h->totalWide, sizeof(struct wide_operands), r->size)
+     || !section_fits(h->lines, h->codeSize, sizeof(unsigned), r->size)
+     || !section_fits(h->blob, h->blobSize, 1, r->size)
+     || (h->blobSize && base[h->blob + h->blobSize - 1])) {
+        avm_error(NULL, "Binary section outside the file");
+        return 0;
+    }
+    p->globals = h->globals;
+    p->stringBlob = base + h->blob;
+    p->totalBlobSize = h->blobSize;
+    p->totalStringConsts = h->totalStrings;
+    p->stringConsts = (unsigned *) (base + h->strings);
+    p->totalNumConsts = h->totalNumbers;
+    p->numConsts = (double *) (base + h->numbers);
+    p->totalUserFuncs = h->totalUserFuncs;
+    p->userFuncs = (struct userfunc *) (base + h->userFuncs);
+    p->totalNamedLibFuncs = h->totalLibFuncs;
+    p->namedLibFuncs = (unsigned *) (base + h->libFuncs);
+    p->codeSize = h->codeSize;
+    p->code = (struct instruction *) (base + h->code);
+    p->totalWide = h->totalWide;
+    p->codeWide = (struct wide_operands *) (base + h->wide);
+    p->codeLines = (unsigned *) (base + h->lines);
+    if (!offsets_fit(p, p->stringConsts, p->totalStringConsts, sizeof(unsigned))
+     || !offsets_fit(p, p->namedLibFuncs, p->totalNamedLibFuncs, sizeof(unsigned))
+     || !offsets_fit(p, &p->userFuncs->id, p->totalUserFuncs, sizeof(struct userfunc))) {
+        avm_error(NULL, "Binary string outside the blob");
+        return 0;
+    }
     return 1;
 }
 
-int readByte(char *c) {
-    if (!fread(c, sizeof(char), 1, bin_file)) return 0;
+// a binary image already in memory, such as alpha_compile returns; it must stay allocated
+// and writable while it runs, since the tables point into it
+int avm_imagebinary(avm_program *p, char *image, size_t size) {
+    avm_reader reader, *r = &reader;
+    r->buf = image;
+    r->size = size;
+    r->pos = 0;
+    p->image = image;
+    p->imageSize = size;
+    if (magicnumber(r) != ABC_VERSION) {
+        avm_error(NULL, "Not a version %u binary image", ABC_VERSION);
+        return 0;
+    }
+    if (!avm_mapbinary(r, p)) return 0;
+    printf("=========================================================\n");
     return 1;
-}
\ No newline at end of file
+}
+
+// verifies what avmbinaryfile or avm_imagebinary read, the program is unloaded when it must not run
+avm_program *avm_verified(avm_program *p, int ok) {
+    unsigned downgraded;
+    if (!ok || !avm_verify(p, &downgraded)) {
+        avm_unload(p);
+        return NULL;
+    }
+    if (downgraded) {
+        avm_warning(NULL, "Verifier: %u typed instruction(s) could not be proven and run checked", downgraded);
+        p->warnings++;
+    }
+    return p;
+}
+
+avm_program *avm_load(char *path) {
+    avm_program *p = (avm_program *) calloc(1, sizeof(avm_program));
+    return avm_verified(p, avmbinaryfile(p, path));
+}
+
+avm_program *avm_loadimage(char *image, size_t size) {
+    avm_program *p = (avm_program *) calloc(1, sizeof(avm_program));
+    return avm_verified(p, avm_imagebinary(p, image, size));
+}
+
+void avm_unload(avm_program *p) {
+    if (!p) return;
+    if (p->mapped) munmap(p->image, p->imageSize);
+    // version 1 and 2 tables were copied out of the file
+    else if (!p->image) {
+        free(p->stringBlob);
+        free(p->stringConsts);
+        free(p->numConsts);
+        free(p->userFuncs);
+        free(p->namedLibFuncs);
+        free(p->code);
+        free(p->codeLines);
+        free(p->codeWide);
+    }
+    free(p);
+}
@@ -1,20 +1,31 @@
 #pragma once
 
 #define MAGICNUMBER 194623425 //655*639*465 from 3655 3639 3465
-FILE *stream;
-FILE *bin_file;
-char* bin_file_name;
+// the binary being loaded and the read position in it, each load has its own
+typedef struct avm_reader {
+    char *buf;
+    size_t size;
+    size_t pos;
+} avm_reader;
 
-int avmbinaryfile();
-int magicnumber();
-int arrays();
-int arrays_strings();
-int arrays_numbers();
-int arrays_userfunctions();
-int arrays_libfunctions();
-int t_code();
-int operand(struct vmarg *);
-int readString(char **);
-int readUnsigned(unsigned *);
-int readDouble(double *);
-int readByte(char *);
\ No newline at end of file
+int avmbinaryfile(avm_program *, char *);
+int avm_imagebinary(avm_program *, char *, size_t);
+avm_program *avm_verified(avm_program *, int);
+int magicnumber(avm_reader *);
+int readFits(avm_reader *, unsigned, size_t);
+int arrays(avm_reader *, avm_program *);
+int arrays_strings(avm_reader *, avm_program *);
+int arrays_numbers(avm_reader *, avm_program *);
+int arrays_userfunctions(avm_reader *, avm_program *);
+int arrays_libfunctions(avm_reader *, avm_program *);
+int t_code(avm_reader *, avm_program *);
+int operand(avm_reader *, struct vmarg *);
+int readBlobString(avm_reader *, avm_program *, unsigned *);
+int readUnsigned(avm_reader *, unsigned *);
+int readDouble(avm_reader *, double *);
+int readByte(avm_reader *, char *);
+int section_fits(unsigned, unsigned, size_t, size_t);
+int offsets_fit(avm_program *, unsigned *, unsigned, size_t);
+void *section_copy(avm_reader *, unsigned, size_t);
+int avm_readv2(avm_reader *, avm_program *);
+int avm_mapbinary(avm_reader *, avm_program *);
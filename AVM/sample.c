@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include "avm.h"
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+ * Sampling profiler of `avm_exec --sample <file> [--sample-hz <n>]`. A
+ * timer sends SIGPROF to the thread running the VM every 1/n seconds (1000 by
+ * default) and the handler copies the pc and the return pc of every frame,
+ * found by following the saved topsp and pc of the environments from
+ * vm->topsp outwards, into a buffer allocated up front. Through a coroutine
+ * the walk goes on from the resume() that runs it.
+ *
+ * When the program ends the pcs are mapped to the user functions containing
+ * them and written as folded stacks, `[program];f;g <samples>` a line, the
+ * input of flamegraph.pl and the like. A sample taken in a library function
+ * ends in its name. The functions and source lines with the most samples go
+ * to stderr.
+ *
+ * The timer runs on CLOCK_MONOTONIC rather than CPU time, which the kernel
+ * only accounts at its tick rate, so 1 kHz is 1 kHz; time the program spends
+ * blocked in input() or the event loop is sampled there too. The workers of
+ * spawn() and parallel_map() are not sampled.
+ */
+
+#define AVM_SAMPLE_DEPTH 128
+#define AVM_SAMPLE_BUFFER (1u << 23)
+#define AVM_SAMPLE_TOP 15
+// set on the pc of a call instruction when the sample is in the library function it calls
+#define AVM_SAMPLE_LIBFUNC (1u << 31)
+
+struct avm_sampler {
+    avm_state *vm;
+    unsigned hz;
+    // <depth> <pc>... per sample, innermost frame first
+    unsigned *buffer;
+    unsigned used;
+    unsigned samples;
+    unsigned dropped;           // the buffer was full
+    unsigned truncated;         // deeper than AVM_SAMPLE_DEPTH
+    timer_t timer;
+    struct sigaction previous;
+};
+
+struct avm_sampler *avmSampler;
+
+// the environment at t is a frame when its saved values are numbers, as callsaveenvironment left them
+int sample_isframe(avm_state *vm, unsigned t) {
+    return t && t + AVM_NUMACTUALS_OFFSET < AVM_STACKSIZE
+        && vm->stack[t + AVM_SAVEDPC_OFFSET].type == number_m
+        && vm->stack[t + AVM_SAVEDTOPSP_OFFSET].type == number_m;
+}
+
+unsigned sample_envvalue(avm_state *vm, unsigned i) {
+    return (unsigned) vm->stack[i].data.numVal;
+}
+
+int sample_calls_libfunc(avm_state *vm, unsigned pc) {
+    struct instruction *instr = vm->program->code + pc;
+    return AVM_OPCODE(instr) == call_v && avm_operand(vm->program, instr, AVM_ARG1).type == libfunc_a;
+}
+
+// runs in the signal handler: reads the stack as it is, trusting no value it did not check
+void sample_record(struct avm_sampler *s) {
+    avm_state *vm = s->vm;
+    struct avm_coroutine *co = vm->running;
+    unsigned codeSize = vm->program->codeSize, *frames, depth = 0, pc = vm->pc, t, next, saved;
+    if (s->used + AVM_SAMPLE_DEPTH + 2 > AVM_SAMPLE_BUFFER) {
+        s->dropped++;
+        return;
+    }
+    frames = s->buffer + s->used + 1;
+    if (pc >= codeSize) {
+        // the event loop, or between the end of a function and the coroutine or callback it returns to
+        frames[depth++] = codeSize;
+        t = 0;
+    }
+    else {
+        // funcenter has not yet moved topsp to the frame that was pushed for it
+        t = AVM_OPCODE(vm->program->code + pc) == funcenter_v ? vm->top : vm->topsp;
+        if (sample_calls_libfunc(vm, pc) && sample_isframe(vm, t) && sample_envvalue(vm, t + AVM_SAVEDPC_OFFSET) == pc + 1) {
+            // the frame of the library function returns to the call itself
+            frames[depth++] = pc | AVM_SAMPLE_LIBFUNC;
+            t = sample_envvalue(vm, t + AVM_SAVEDTOPSP_OFFSET);
+        }
+        frames[depth++] = pc;
+    }
+    while (sample_isframe(vm, t)) {
+        if (depth == AVM_SAMPLE_DEPTH) {
+            s->truncated++;
+            break;
+        }
+        saved = sample_envvalue(vm, t + AVM_SAVEDPC_OFFSET);
+        if (saved == AVM_COROUTINE_PC(vm) && co) {
+            // the function of a coroutine, called from the resume() that runs it
+            saved = co->resumerPC;
+            next = co->resumerTopsp;
+            co = co->resumer;
+        }
+        else next = sample_envvalue(vm, t + AVM_SAVEDTOPSP_OFFSET);
+        if (!saved || saved > codeSize) break;
+        frames[depth++] = saved - 1;
+        if (next && next <= t) break;
+        t = next;
+    }
+    s->buffer[s->used] = depth;
+    s->used += depth + 1;
+    s->samples++;
+}
+
+void sample_handler(int sig) {
+    struct avm_sampler *s = avmSampler;
+    (void) sig;
+    if (s) sample_record(s);
+}
+
+// 0 when the timer cannot be set up, and nothing is sampled
+int avm_sample_start(avm_state *vm, unsigned hz) {
+    struct avm_sampler *s = (struct avm_sampler *) calloc(1, sizeof(struct avm_sampler));
+    struct sigaction action;
+    struct sigevent event;
+    struct itimerspec period;
+    s->vm = vm;
+    s->hz = hz ? hz : 1000;
+    // untouched pages of the buffer cost nothing
+    s->buffer = (unsigned *) malloc(sizeof(unsigned) * AVM_SAMPLE_BUFFER);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    period.it_interval.tv_sec = 0;
+    period.it_interval.tv_nsec = 1000000000 / s->hz;
+    if (s->hz == 1) {
+        period.it_interval.tv_sec = 1;
+        period.it_interval.tv_nsec = 0;
+    }
+    period.it_value = period.it_interval;
+    if (timer_create(CLOCK_MONOTONIC, &event, &s->timer)) {
+        free(s->buffer);
+        free(s);
+        return 0;
+    }
+    avmSampler = s;
+    if (sigaction(SIGPROF, &action, &s->previous) || timer_settime(s->timer, 0, &period, NULL)) {
+        avmSampler = NULL;
+        timer_delete(s->timer);
+        free(s->buffer);
+        free(s);
+        return 0;
+    }
+    return 1;
+}
+
+void avm_sample_stop(avm_state *vm) {
+    struct avm_sampler *s = avmSampler;
+    (void) vm;
+    if (!s) return;
+    timer_delete(s->timer);
+    sigaction(SIGPROF, &s->previous, NULL);
+}
+
+// the user function containing every instruction, totalUserFuncs outside of any
+unsigned *sample_owners(avm_program *p) {
+    unsigned *owner = (unsigned *) malloc(sizeof(unsigned) * (p->codeSize + 1));
+    unsigned *open = (unsigned *) malloc(sizeof(unsigned) * (p->totalUserFuncs + 1));
+    unsigned n = 0;
+    for (unsigned pc = 0; pc < p->codeSize; pc++) {
+        switch (AVM_OPCODE(p->code + pc)) {
+            case funcenter_v:
+                open[n++] = avm_operand(p, p->code + pc, AVM_RESULT).val;
+                owner[pc] = open[n - 1];
+                break;
+            case funcexit_v:
+                owner[pc] = n ? open[n - 1] : p->totalUserFuncs;
+                if (n) n--;
+                break;
+            default:
+                owner[pc] = n ? open[n - 1] : p->totalUserFuncs;
+                break;
+        }
+    }
+    owner[p->codeSize] = p->totalUserFuncs;
+    free(open);
+    return owner;
+}
+
+char *sample_framename(avm_program *p, unsigned *owner, unsigned frame) {
+    if (frame & AVM_SAMPLE_LIBFUNC)
+        return libfuncs_getused(p, avm_operand(p, p->code + (frame & ~AVM_SAMPLE_LIBFUNC), AVM_ARG1).val);
+    if (frame == p->codeSize) return "[event loop]";
+    return owner[frame] == p->totalUserFuncs ? "[program]" : avm_funcname(p, p->userFuncs + owner[frame]);
+}
+
+int sample_compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+struct sample_count {
+    unsigned key;
+    unsigned long self, total;
+};
+
+int sample_compare_counts(const void *a, const void *b) {
+    const struct sample_count *x = (const struct sample_count *) a, *y = (const struct sample_count *) b;
+    if (x->self != y->self) return x->self < y->self ? 1 : -1;
+    if (x->total != y->total) return x->total < y->total ? 1 : -1;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+void sample_report(struct avm_sampler *s, unsigned *owner) {
+    avm_program *p = s->vm->program;
+    unsigned nf = p->totalUserFuncs + 1, nl = 1, i, k, n, depth, *frames, *seen;
+    struct sample_count *funcs = (struct sample_count *) calloc(nf, sizeof(struct sample_count)), *lines;
+    for (i = 0; i < p->codeSize; i++) if (p->codeLines[i] >= nl) nl = p->codeLines[i] + 1;
+    lines = (struct sample_count *) calloc(nl, sizeof(struct sample_count));
+    seen = (unsigned *) malloc(sizeof(unsigned) * nf);
+    for (i = 0; i < nf; i++) {
+        funcs[i].key = i;
+        seen[i] = ~0u;
+    }
+    for (i = 0; i < nl; i++) lines[i].key = i;
+    for (i = 0, n = 0; i < s->used; i += depth + 1, n++) {
+        depth = s->buffer[i];
+        frames = s->buffer + i + 1;
+        // self goes to the innermost Alpha frame, a library function counts for its caller's line
+        for (k = 0; k < depth && (frames[k] & AVM_SAMPLE_LIBFUNC); k++);
+        if (k == depth) continue;
+        funcs[owner[frames[k]]].self++;
+        if (frames[k] < p->codeSize) lines[p->codeLines[frames[k]]].self++;
+        for (; k < depth; k++) {
+            if (frames[k] & AVM_SAMPLE_LIBFUNC) continue;
+            if (seen[owner[frames[k]]] != n) funcs[owner[frames[k]]].total++;
+            seen[owner[frames[k]]] = n;
+        }
+    }
+    fprintf(stderr, "sample profile: %u samples at %u Hz", s->samples, s->hz);
+    if (s->dropped) fprintf(stderr, ", %u dropped with the buffer full", s->dropped);
+    if (s->truncated) fprintf(stderr, ", %u cut at %u frames", s->truncated, AVM_SAMPLE_DEPTH);
+    fprintf(stderr, "\n%-24s %10s %8s %10s %8s\n", "function", "self", "self%", "total", "total%");
+    qsort(funcs, nf, sizeof(struct sample_count), sample_compare_counts);
+    for (i = 0; i < nf && i < AVM_SAMPLE_TOP && funcs[i].total; i++)
+        fprintf(stderr, "%-24s %10lu %7.2f%% %10lu %7.2f%%\n",
+            funcs[i].key == p->totalUserFuncs ? "[program]" : avm_funcname(p, p->userFuncs + funcs[i].key),
+            funcs[i].self, 100.0 * funcs[i].self / s->samples, funcs[i].total, 100.0 * funcs[i].total / s->samples);
+    fprintf(stderr, "%-24s %10s %8s\n", "line", "self", "self%");
+    qsort(lines, nl, sizeof(struct sample_count), sample_compare_counts);
+    for (i = 0; i < nl && i < AVM_SAMPLE_TOP && lines[i].self; i++)
+        fprintf(stderr, "%-24u %10lu %7.2f%%\n", lines[i].key, lines[i].self, 100.0 * lines[i].self / s->samples);
+    free(funcs);
+    free(lines);
+    free(seen);
+}
+
+// the sampler, stopped by avm_sample_stop, is forgotten with its buffer
+void sample_release(struct avm_sampler *s) {
+    avmSampler = NULL;
+    free(s->buffer);
+    free(s);
+}
+
+// the folded stacks to path and the report to stderr, 0 when path cannot be written;
+// the samples are released either way
+int avm_sample_write(avm_state *vm, char *path) {
+    struct avm_sampler *s = avmSampler;
+    avm_program *p = vm->program;
+    unsigned *owner, i, k, n, depth, *frames, run;
+    char **stacks, *name;
+    size_t size, length;
+    FILE *f;
+    if (!s) return 0;
+    if (!(f = fopen(path, "w"))) {
+        fprintf(stderr, "avm_exec: cannot write %s\n", path);
+        sample_release(s);
+        return 0;
+    }
+    owner = sample_owners(p);
+    stacks = (char **) malloc(sizeof(char *) * (s->samples + 1));
+    for (i = 0, n = 0; i < s->used; i += depth + 1) {
+        depth = s->buffer[i];
+        frames = s->buffer + i + 1;
+        size = 1;
+        for (k = 0; k < depth; k++) size += strlen(sample_framename(p, owner, frames[k])) + 1;
+        // a root for the samples that did not reach the program's own frame
+        size += sizeof("[program];");
+        stacks[n] = (char *) malloc(size);
+        length = 0;
+        if (!depth || (frames[depth - 1] != p->codeSize && owner[frames[depth - 1] & ~AVM_SAMPLE_LIBFUNC] != p->totalUserFuncs))
+            length += sprintf(stacks[n] + length, "[program];");
+        // outermost first; each frame is named by its function, so the call sites of one function merge
+        for (k = depth; k-- > 0;) {
+            name = sample_framename(p, owner, frames[k]);
+            length += sprintf(stacks[n] + length, "%s;", name);
+        }
+        if (length) stacks[n][length - 1] = '\0';
+        else stacks[n][0] = '\0';
+        n++;
+    }
+    qsort(stacks, n, sizeof(char *), sample_compare_strings);
+    for (i = 0; i < n; i = k) {
+        for (k = i + 1, run = 1; k < n && !strcmp(stacks[k], stacks[i]); k++) run++;
+        fprintf(f, "%s %u\n", stacks[i], run);
+    }
+    fclose(f);
+    sample_report(s, owner);
+    for (i = 0; i < n; i++) free(stacks[i]);
+    free(stacks);
+    free(owner);
+    sample_release(s);
+    return 1;
+}
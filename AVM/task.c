@@ -0,0 +1,647 @@
+#include "avm.h"
+#include <pthread.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/*
+ * Fork-join tasks for scripts:
+ *
+ *   h = spawn(f, a, b);     // f(a, b) on another thread, h is a number naming the task
+ *   r = join(h);            // waits for f and returns what it returned
+ *
+ * A task is a user function run by a VM of its own (avm_create), sharing the
+ * loaded program with its parent. The arguments and the globals of the parent
+ * are deep-copied into the child when it is spawned and the result into the
+ * joining VM, so no table is ever reachable from two VMs; what a task does to
+ * its copies is not seen by its parent. Tasks run on $ALPHA_THREADS worker
+ * threads (one less than the processors by default), started with the first
+ * spawn. Every worker owns a Chase–Lev deque: it pushes the tasks it spawns
+ * at the bottom, takes its own work from there and steals from the top of
+ * the others when it runs out. Threads that are not workers, such as the one
+ * running the program, submit to a shared queue. A thread waiting in join()
+ * runs other tasks until the one it waits for is done, and sleeps while there
+ * are none. Handles belong to the VM that spawned the task, and a VM waits for
+ * the tasks it did not join before it is destroyed, so none outlives the
+ * program it runs.
+ */
+
+#define AVM_DEQUE_SIZE 4096
+
+typedef struct avm_task {
+    avm_state *vm;              // the child, set up to return from the function to the end of the code
+    void (*run)(struct avm_task *);     // what the task does when not just running vm
+    atomic_int done;
+    struct avm_task *next;      // in the submission queue
+} avm_task;
+
+// Chase–Lev deque: the owner pushes and takes at bottom, the others steal at top
+typedef struct avm_deque {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(avm_task *) tasks[AVM_DEQUE_SIZE];
+} avm_deque;
+
+typedef struct avm_scheduler {
+    unsigned workers;
+    avm_deque *deques;
+    // tasks spawned by threads without a deque
+    avm_task *submitted, *lastSubmitted;
+    atomic_uint totalSubmitted;
+    pthread_mutex_t submitLock;
+    // workers sleep while no task is queued anywhere
+    atomic_uint queued;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idle;
+    // threads in task_wait sleep until a task is done or queued
+    pthread_cond_t progress;
+} avm_scheduler;
+
+avm_scheduler scheduler = {
+    .submitLock = PTHREAD_MUTEX_INITIALIZER,
+    .idleLock = PTHREAD_MUTEX_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .progress = PTHREAD_COND_INITIALIZER
+};
+pthread_once_t schedulerOnce = PTHREAD_ONCE_INIT;
+// the deque of the worker running on this thread, -1 on threads that are not workers
+__thread int taskWorker = -1;
+
+// ------------------- DEQUES
+
+// 0 when the deque is full
+int deque_push(avm_deque *d, avm_task *task) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= AVM_DEQUE_SIZE) return 0;
+    atomic_store_explicit(&d->tasks[b & (AVM_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 1;
+}
+
+avm_task *deque_take(avm_deque *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1, t;
+    avm_task *task = NULL;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t <= b) {
+        task = atomic_load_explicit(&d->tasks[b & (AVM_DEQUE_SIZE - 1)], memory_order_relaxed);
+        // the last task, a thief may be taking it too
+        if (t == b) {
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+                task = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return task;
+}
+
+// NULL when the deque is empty or another thread stole the task first
+avm_task *deque_steal(avm_deque *d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire), b;
+    avm_task *task;
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+    task = atomic_load_explicit(&d->tasks[t & (AVM_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+// ------------------- SCHEDULER
+
+avm_task *task_submitted(void) {
+    avm_task *task;
+    if (!atomic_load(&scheduler.totalSubmitted)) return NULL;
+    pthread_mutex_lock(&scheduler.submitLock);
+    if ((task = scheduler.submitted)) {
+        if (!(scheduler.submitted = task->next)) scheduler.lastSubmitted = NULL;
+        atomic_fetch_sub(&scheduler.totalSubmitted, 1);
+    }
+    pthread_mutex_unlock(&scheduler.submitLock);
+    return task;
+}
+
+// a task for the given worker (-1 for none): its own newest, then the oldest submitted, then a stolen one
+avm_task *task_find(int self) {
+    avm_task *task = NULL;
+    unsigned i, victim;
+    if (self >= 0) task = deque_take(&scheduler.deques[self]);
+    if (!task) task = task_submitted();
+    for (i = 0; !task && i < scheduler.workers; i++) {
+        victim = (self + 1 + i) % scheduler.workers;
+        if ((int) victim != self) task = deque_steal(&scheduler.deques[victim]);
+    }
+    if (task) atomic_fetch_sub(&scheduler.queued, 1);
+    return task;
+}
+
+void task_run(avm_task *task) {
+    if (task->run) task->run(task);
+    else avm_run(task->vm);
+    atomic_store_explicit(&task->done, 1, memory_order_release);
+    pthread_mutex_lock(&scheduler.idleLock);
+    pthread_cond_broadcast(&scheduler.progress);
+    pthread_mutex_unlock(&scheduler.idleLock);
+}
+
+void *task_worker(void *arg) {
+    avm_task *task;
+    taskWorker = (int) (long) arg;
+    for (;;) {
+        if ((task = task_find(taskWorker))) {
+            task_run(task);
+            continue;
+        }
+        pthread_mutex_lock(&scheduler.idleLock);
+        while (!atomic_load(&scheduler.queued)) pthread_cond_wait(&scheduler.idle, &scheduler.idleLock);
+        pthread_mutex_unlock(&scheduler.idleLock);
+    }
+    return NULL;
+}
+
+void task_start_workers(void) {
+    char *threads = getenv("ALPHA_THREADS");
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t thread;
+    scheduler.workers = threads && atoi(threads) > 0 ? (unsigned) atoi(threads) : online > 1 ? (unsigned) online - 1 : 1;
+    scheduler.deques = (avm_deque *) calloc(scheduler.workers, sizeof(avm_deque));
+    for (unsigned i = 0; i < scheduler.workers; i++) {
+        pthread_create(&thread, NULL, task_worker, (void *) (long) i);
+        pthread_detach(thread);
+    }
+}
+
+// queues the task, or runs it right away when the deque of this worker is full
+void task_submit(avm_task *task) {
+    pthread_once(&schedulerOnce, task_start_workers);
+    // counted first, a worker may take it as soon as it is pushed
+    atomic_fetch_add(&scheduler.queued, 1);
+    if (taskWorker >= 0) {
+        if (!deque_push(&scheduler.deques[taskWorker], task)) {
+            atomic_fetch_sub(&scheduler.queued, 1);
+            task_run(task);
+            return;
+        }
+    }
+    else {
+        task->next = NULL;
+        pthread_mutex_lock(&scheduler.submitLock);
+        if (scheduler.lastSubmitted) scheduler.lastSubmitted->next = task;
+        else scheduler.submitted = task;
+        scheduler.lastSubmitted = task;
+        atomic_fetch_add(&scheduler.totalSubmitted, 1);
+        pthread_mutex_unlock(&scheduler.submitLock);
+    }
+    pthread_mutex_lock(&scheduler.idleLock);
+    pthread_cond_signal(&scheduler.idle);
+    // a waiting thread may run it too
+    pthread_cond_broadcast(&scheduler.progress);
+    pthread_mutex_unlock(&scheduler.idleLock);
+}
+
+// runs other tasks on this thread until the task is done, sleeping while there are none
+void task_wait(avm_task *task) {
+    avm_task *other;
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        if ((other = task_find(taskWorker))) {
+            task_run(other);
+            continue;
+        }
+        pthread_mutex_lock(&scheduler.idleLock);
+        while (!atomic_load_explicit(&task->done, memory_order_acquire) && !atomic_load(&scheduler.queued))
+            pthread_cond_wait(&scheduler.progress, &scheduler.idleLock);
+        pthread_mutex_unlock(&scheduler.idleLock);
+    }
+}
+
+// handles are the VM's own, a handle is the index + 1 of its task
+unsigned task_handle(avm_state *vm, avm_task *task) {
+    if (vm->totalHandles == vm->handlesSize) {
+        vm->handlesSize = vm->handlesSize ? vm->handlesSize * 2 : 64;
+        vm->handles = (struct avm_task **) realloc(vm->handles, sizeof(struct avm_task *) * vm->handlesSize);
+    }
+    vm->handles[vm->totalHandles++] = task;
+    return vm->totalHandles;
+}
+
+// the task of the handle, which is forgotten; NULL when there is none or it was joined already.
+// The joined handles at the end are reused
+avm_task *task_claim(avm_state *vm, double handle) {
+    avm_task *task = NULL;
+    unsigned i = (unsigned) handle;
+    if (handle == (double) i && i >= 1 && i <= vm->totalHandles) {
+        task = vm->handles[i - 1];
+        vm->handles[i - 1] = NULL;
+    }
+    while (vm->totalHandles && !vm->handles[vm->totalHandles - 1]) vm->totalHandles--;
+    return task;
+}
+
+// waits for the tasks vm spawned and did not join, they run on the program vm runs
+void avm_tasksrelease(avm_state *vm) {
+    for (unsigned i = 0; i < vm->totalHandles; i++) {
+        if (!vm->handles[i]) continue;
+        task_wait(vm->handles[i]);
+        avm_destroy(vm->handles[i]->vm);
+        free(vm->handles[i]);
+    }
+    free(vm->handles);
+    vm->handles = NULL;
+    vm->totalHandles = vm->handlesSize = 0;
+}
+
+// ------------------- COPIES BETWEEN VMS
+
+// the tables already copied, so shared and cyclic ones stay shared and cyclic
+typedef struct avm_copymap {
+    struct avm_table **from;
+    struct avm_table **to;
+    unsigned size;
+    unsigned used;
+} avm_copymap;
+
+void avm_copymap_init(avm_copymap *map) {
+    map->size = 64;
+    map->used = 0;
+    map->from = (struct avm_table **) calloc(map->size, sizeof(struct avm_table *));
+    map->to = (struct avm_table **) malloc(sizeof(struct avm_table *) * map->size);
+}
+
+void avm_copymap_free(avm_copymap *map) {
+    free(map->from);
+    free(map->to);
+}
+
+unsigned avm_copymap_slot(avm_copymap *map, struct avm_table *t) {
+    unsigned i = (unsigned) (((size_t) t >> 4) * 2654435761u) & (map->size - 1);
+    while (map->from[i] && map->from[i] != t) i = (i + 1) & (map->size - 1);
+    return i;
+}
+
+void avm_copymap_add(avm_copymap *map, struct avm_table *from, struct avm_table *to) {
+    avm_copymap old = *map;
+    if (2 * (map->used + 1) > map->size) {
+        map->size *= 2;
+        map->used = 0;
+        map->from = (struct avm_table **) calloc(map->size, sizeof(struct avm_table *));
+        map->to = (struct avm_table **) malloc(sizeof(struct avm_table *) * map->size);
+        for (unsigned i = 0; i < old.size; i++) if (old.from[i]) avm_copymap_add(map, old.from[i], old.to[i]);
+        avm_copymap_free(&old);
+    }
+    unsigned i = avm_copymap_slot(map, from);
+    map->from[i] = from;
+    map->to[i] = to;
+    map->used++;
+}
+
+struct avm_table *avm_tablecopy(avm_state *to, struct avm_table *t, avm_copymap *map);
+
+// src of another VM into the empty cell dst of to, tables are counted like avm_assign counts them;
+// a coroutine runs on the stack of its own VM and arrives as nil
+void avm_copycell(avm_state *to, struct avm_memcell *dst, struct avm_memcell *src, avm_copymap *map) {
+    *dst = *src;
+    if (src->type == string_m) dst->data.strVal = strdup(src->data.strVal);
+    else if (src->type == table_m) {
+        dst->data.tableVal = avm_tablecopy(to, src->data.tableVal, map);
+        avm_tableincrefcounter(dst->data.tableVal);
+    }
+    else if (src->type == coroutine_m) dst->type = nil_m;
+}
+
+// the buckets keep their chains, both tables hash the same keys the same way
+struct avm_table *avm_tablecopy(avm_state *to, struct avm_table *t, avm_copymap *map) {
+    unsigned i = avm_copymap_slot(map, t), k;
+    struct avm_table *copy;
+    struct avm_table_bucket **from[5], **into[5], *b, **last;
+    if (map->from[i] == t) return map->to[i];
+    copy = avm_tablenew(to);
+    avm_copymap_add(map, t, copy);
+    copy->total = t->total;
+    from[0] = t->strIndexed;   into[0] = copy->strIndexed;
+    from[1] = t->numIndexed;   into[1] = copy->numIndexed;
+    from[2] = t->ufncIndexed;  into[2] = copy->ufncIndexed;
+    from[3] = t->lfncIndexed;  into[3] = copy->lfncIndexed;
+    from[4] = t->boolIndexed;  into[4] = copy->boolIndexed;
+    for (k = 0; k < 5; k++) {
+        for (i = 0; i < AVM_TABLE_HASHSIZE; i++) {
+            last = &into[k][i];
+            for (b = from[k][i]; b; b = b->next) {
+                *last = (struct avm_table_bucket *) malloc(sizeof(struct avm_table_bucket));
+                avm_copycell(to, &(*last)->key, &b->key, map);
+                avm_copycell(to, &(*last)->value, &b->value, map);
+                avm_heapstats_bucket(&to->heap, *last, 1);
+                last = &(*last)->next;
+            }
+            *last = NULL;
+        }
+    }
+    return copy;
+}
+
+// ------------------- CALLS IN CHILD VMS
+
+// a VM for running functions of vm on another thread, with copies of its globals
+avm_state *task_child(avm_state *vm, avm_copymap *map) {
+    avm_state *child = avm_create(vm->program);
+    child->out = vm->out;
+    child->in = vm->in;
+    for (unsigned i = 0; i < vm->program->globals; i++)
+        avm_copycell(child, &child->stack[AVM_STACKSIZE - 1 - i], &vm->stack[AVM_STACKSIZE - 1 - i], map);
+    return child;
+}
+
+// sets child up to call the function at func with the n arguments pushed last,
+// returning to the end of the code; a VM that ran to its end can be set up again
+void task_setcall(avm_state *child, unsigned func, unsigned n) {
+    // nil unless the function returns something
+    child->retval.type = nil_m;
+    child->totalActuals = n;
+    child->pc = AVM_ENDING_PC(child) - 1;
+    avm_callsaveenvironment(child);
+    child->pc = func;
+    child->executionFinished = child->errors != 0;
+}
+
+// pushes a copy of a cell of another VM the way pusharg pushes an argument
+void task_pusharg(avm_state *child, struct avm_memcell *arg, avm_copymap *map) {
+    avm_copycell(child, &child->stack[child->top], arg, map);
+    avm_dec_top(child);
+}
+
+// takes the result out of retval, leaving nil; a table gets a reference of its own
+// and keeps the one retval may hold until the child is destroyed, since the
+// library functions leave uncounted tables in retval
+void task_takeretval(avm_state *child, struct avm_memcell *dst) {
+    *dst = child->retval;
+    if (dst->type == table_m) avm_tableincrefcounter(dst->data.tableVal);
+    child->retval.type = nil_m;
+}
+
+// ------------------- LIBRARY FUNCTIONS
+
+void libfunc_spawn(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm), i;
+    struct avm_memcell *f;
+    avm_state *child;
+    avm_copymap map;
+    avm_task *task;
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = nil_m;
+    if (!n || (f = avm_getactual(vm, 0))->type != userfunc_m) {
+        avm_warning(vm, "'spawn()': user function argument (not %s) expected!", n ? typeStrings[f->type] : "nothing");
+        return;
+    }
+    avm_copymap_init(&map);
+    child = task_child(vm, &map);
+    for (i = n - 1; i >= 1; i--) task_pusharg(child, avm_getactual(vm, i), &map);
+    avm_copymap_free(&map);
+    task_setcall(child, f->data.funcVal, n - 1);
+
+    task = (avm_task *) calloc(1, sizeof(avm_task));
+    task->vm = child;
+    vm->retval.type = number_m;
+    vm->retval.data.numVal = task_handle(vm, task);
+    task_submit(task);
+}
+
+void libfunc_join(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm);
+    struct avm_memcell *h = n ? avm_getactual(vm, 0) : NULL;
+    avm_task *task;
+    avm_copymap map;
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = nil_m;
+    if (n != 1 || h->type != number_m) {
+        avm_warning(vm, "'join()': one spawn() handle argument expected!");
+        return;
+    }
+    if (!(task = task_claim(vm, h->data.numVal))) {
+        avm_warning(vm, "'join()': %g is not a task that was spawned and not joined yet", h->data.numVal);
+        return;
+    }
+    task_wait(task);
+    vm->warnings += task->vm->warnings - vm->program->warnings;
+    if (task->vm->errors) avm_error(vm, "'join()': the task stopped on an error");
+    // a table in retval is counted, the next value assigned to retval releases it
+    else if (task->vm->retval.type != undef_m) {
+        avm_copymap_init(&map);
+        avm_copycell(vm, &vm->retval, &task->vm->retval, &map);
+        avm_copymap_free(&map);
+    }
+    avm_destroy(task->vm);
+    free(task);
+}
+
+// ------------------- PARALLEL MAP AND REDUCE
+
+/*
+ *   squares = parallel_map(t, f);          // [ k: f(t[k], k) ] for the integer keys k of t, nil results left out
+ *   sum = parallel_reduce(t, f, init);     // f(...f(f(init, t[k0]), t[k1])..., t[kn]) in key order
+ *
+ * The integer-keyed entries are sorted by key and cut into a few ranges per
+ * thread, every range is a task with a VM of its own calling f on its
+ * entries. parallel_reduce folds each range from its first entry and then the
+ * partial results into init on the calling thread, so f has to be
+ * associative. Values cross VMs as deep copies, like spawn's arguments.
+ */
+
+#define AVM_CHUNKS_PER_THREAD 4
+
+typedef struct avm_chunk {
+    avm_task task;                      // first, the task is what runs it
+    avm_state *parent;
+    unsigned func;
+    struct avm_table_bucket **entries;  // of the whole table, sorted by key
+    unsigned first;
+    unsigned end;
+    int reduce;
+    struct avm_memcell *results;        // a result per entry, or the fold of the range for reduce
+} avm_chunk;
+
+int task_compare_keys(const void *a, const void *b) {
+    double x = (*(struct avm_table_bucket * const *) a)->key.data.numVal;
+    double y = (*(struct avm_table_bucket * const *) b)->key.data.numVal;
+    return (x > y) - (x < y);
+}
+
+// the entries of t with integer keys, sorted by key
+struct avm_table_bucket **task_entries(struct avm_table *t, unsigned *total) {
+    struct avm_table_bucket **entries, *b;
+    unsigned n = 0, i;
+    for (i = 0; i < AVM_TABLE_HASHSIZE; i++)
+        for (b = t->numIndexed[i]; b; b = b->next) n++;
+    entries = (struct avm_table_bucket **) malloc(sizeof(struct avm_table_bucket *) * (n + 1));
+    n = 0;
+    for (i = 0; i < AVM_TABLE_HASHSIZE; i++)
+        for (b = t->numIndexed[i]; b; b = b->next)
+            if (b->key.data.numVal == floor(b->key.data.numVal)) entries[n++] = b;
+    qsort(entries, n, sizeof(struct avm_table_bucket *), task_compare_keys);
+    *total = n;
+    return entries;
+}
+
+void task_runchunk(avm_task *task) {
+    avm_chunk *c = (avm_chunk *) task;
+    struct avm_memcell *acc = c->results;
+    avm_copymap map;
+    avm_state *child;
+    unsigned i = c->first;
+    avm_copymap_init(&map);
+    child = task->vm = task_child(c->parent, &map);
+    // a range is folded from its first entry
+    if (c->reduce) avm_copycell(child, acc, &c->entries[i++]->value, &map);
+    for (; i < c->end && !child->errors; i++) {
+        if (c->reduce) {
+            task_pusharg(child, &c->entries[i]->value, &map);
+            // moved, the return releases it
+            child->stack[child->top] = *acc;
+            avm_dec_top(child);
+        }
+        else {
+            task_pusharg(child, &c->entries[i]->key, &map);
+            task_pusharg(child, &c->entries[i]->value, &map);
+        }
+        task_setcall(child, c->func, 2);
+        avm_run(child);
+        task_takeretval(child, c->reduce ? acc : &c->results[i - c->first]);
+    }
+    avm_copymap_free(&map);
+}
+
+// the chunks of the integer-keyed entries of t, submitted; NULL when there are none
+avm_chunk *task_chunks(avm_state *vm, struct avm_table *t, unsigned func, int reduce, unsigned *total) {
+    unsigned n, chunks, i, j;
+    struct avm_table_bucket **entries = task_entries(t, &n);
+    avm_chunk *c;
+    if (!n) {
+        free(entries);
+        *total = 0;
+        return NULL;
+    }
+    pthread_once(&schedulerOnce, task_start_workers);
+    // the calling thread runs chunks as well while it waits
+    chunks = AVM_CHUNKS_PER_THREAD * (scheduler.workers + 1);
+    if (chunks > n) chunks = n;
+    c = (avm_chunk *) calloc(chunks, sizeof(avm_chunk));
+    for (i = 0; i < chunks; i++) {
+        c[i].task.run = task_runchunk;
+        c[i].parent = vm;
+        c[i].func = func;
+        c[i].entries = entries;
+        c[i].first = (unsigned) ((unsigned long) n * i / chunks);
+        c[i].end = (unsigned) ((unsigned long) n * (i + 1) / chunks);
+        c[i].reduce = reduce;
+        c[i].results = (struct avm_memcell *) malloc(sizeof(struct avm_memcell) * (reduce ? 1 : c[i].end - c[i].first));
+        for (j = 0; j < (reduce ? 1 : c[i].end - c[i].first); j++) c[i].results[j].type = undef_m;
+    }
+    for (i = 0; i < chunks; i++) task_submit(&c[i].task);
+    *total = chunks;
+    return c;
+}
+
+// waits for the chunks and adds their warnings to vm, 0 when one stopped on an error
+int task_waitchunks(avm_state *vm, avm_chunk *c, unsigned total) {
+    int ok = 1;
+    for (unsigned i = 0; i < total; i++) {
+        task_wait(&c[i].task);
+        vm->warnings += c[i].task.vm->warnings - vm->program->warnings;
+        if (c[i].task.vm->errors) ok = 0;
+    }
+    return ok;
+}
+
+// the strings of the results are the chunk's own, its tables go with its VM
+void task_freechunks(avm_chunk *c, unsigned total) {
+    for (unsigned i = 0; i < total; i++) {
+        for (unsigned j = 0; j < (c[i].reduce ? 1 : c[i].end - c[i].first); j++)
+            if (c[i].results[j].type == string_m) free(c[i].results[j].data.strVal);
+        free(c[i].results);
+        avm_destroy(c[i].task.vm);
+    }
+    if (total) free(c[0].entries);
+    free(c);
+}
+
+void libfunc_parallel_map(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm), total, i, j;
+    struct avm_memcell *t = n > 0 ? avm_getactual(vm, 0) : NULL, *f = n > 1 ? avm_getactual(vm, 1) : NULL;
+    struct avm_memcell key, value;
+    struct avm_table *result;
+    avm_copymap map;
+    avm_chunk *c;
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = nil_m;
+    if (n != 2 || t->type != table_m || f->type != userfunc_m) {
+        avm_warning(vm, "'parallel_map()': table and user function arguments expected!");
+        return;
+    }
+    c = task_chunks(vm, t->data.tableVal, f->data.funcVal, 0, &total);
+    if (!task_waitchunks(vm, c, total)) avm_error(vm, "'parallel_map()': the function stopped on an error");
+    else {
+        result = avm_tablenew(vm);
+        avm_copymap_init(&map);
+        key.type = number_m;
+        for (i = 0; i < total; i++)
+            for (j = c[i].first; j < c[i].end; j++) {
+                if (c[i].results[j - c[i].first].type == nil_m || c[i].results[j - c[i].first].type == undef_m) continue;
+                key.data.numVal = c[i].entries[j]->key.data.numVal;
+                avm_copycell(vm, &value, &c[i].results[j - c[i].first], &map);
+                avm_tablesetelem(vm, result, &key, &value);
+                avm_memcellclear(&value);
+            }
+        avm_copymap_free(&map);
+        vm->retval.type = table_m;
+        vm->retval.data.tableVal = result;
+        avm_tableincrefcounter(result);
+    }
+    task_freechunks(c, total);
+}
+
+void libfunc_parallel_reduce(avm_state *vm) {
+    unsigned n = avm_totalactuals(vm), total, i;
+    struct avm_memcell *t = n > 0 ? avm_getactual(vm, 0) : NULL, *f = n > 1 ? avm_getactual(vm, 1) : NULL;
+    struct avm_memcell acc;
+    avm_state *combine;
+    avm_copymap map;
+    avm_chunk *c;
+    avm_memcellclear(&vm->retval);
+    vm->retval.type = nil_m;
+    if (n != 3 || t->type != table_m || f->type != userfunc_m) {
+        avm_warning(vm, "'parallel_reduce()': table, user function and initial value arguments expected!");
+        return;
+    }
+    c = task_chunks(vm, t->data.tableVal, f->data.funcVal, 1, &total);
+    if (!task_waitchunks(vm, c, total)) {
+        avm_error(vm, "'parallel_reduce()': the function stopped on an error");
+        task_freechunks(c, total);
+        return;
+    }
+    // the partial results folded into init, in order, by a VM of this thread
+    avm_copymap_init(&map);
+    combine = task_child(vm, &map);
+    avm_copycell(combine, &acc, avm_getactual(vm, 2), &map);
+    for (i = 0; i < total && !combine->errors; i++) {
+        task_pusharg(combine, c[i].results, &map);
+        combine->stack[combine->top] = acc;
+        avm_dec_top(combine);
+        task_setcall(combine, f->data.funcVal, 2);
+        avm_run(combine);
+        task_takeretval(combine, &acc);
+    }
+    avm_copymap_free(&map);
+    vm->warnings += combine->warnings - vm->program->warnings;
+    if (combine->errors) avm_error(vm, "'parallel_reduce()': the function stopped on an error");
+    else {
+        avm_copymap_init(&map);
+        avm_copycell(vm, &vm->retval, &acc, &map);
+        avm_copymap_free(&map);
+    }
+    if (acc.type == string_m) free(acc.data.strVal);
+    avm_destroy(combine);
+    task_freechunks(c, total);
+}
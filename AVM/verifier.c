@@ -0,0 +1,312 @@
+#include "avm.h"
+
+/*
+ * Load-time check of the bytecode. Operand indices and jump targets must stay
+ * inside the tables read from the binary, globals below the program's count
+ * and locals below the localSize of the function around them (there are none
+ * outside functions), and every _nn instruction must have
+ * operands that are numbers on all paths: the same forward type analysis the
+ * compiler runs on quads is repeated here on the instructions, so a binary
+ * that was not produced by `out -O` (or was edited) cannot make the VM read a
+ * number out of a string or a table. Typed instructions that cannot be proven
+ * are turned back into their checked versions.
+ */
+
+#define VTYPE_NUMBER 1
+#define VTYPE_ANY 15
+
+unsigned verifyGlobals, verifyFormals, verifyLocals, verifyVars;
+
+// an instruction with its operands unpacked
+typedef struct verify_instr {
+    enum vmopcode opcode;
+    struct vmarg result;
+    struct vmarg arg1;
+    struct vmarg arg2;
+} verify_instr;
+
+int is_typed_opcode(enum vmopcode op) {
+    return op >= add_nn_v && op <= jgt_nn_v;
+}
+
+enum vmopcode checked_opcode(enum vmopcode op) {
+    if (op >= jeq_nn_v) return (enum vmopcode) (jeq_v + (op - jeq_nn_v));
+    return (enum vmopcode) (add_v + (op - add_nn_v));
+}
+
+int is_jump_opcode(enum vmopcode op) {
+    return op == jump_v || (op >= jeq_v && op <= jgt_v) || (op >= jeq_nn_v && op <= jgt_nn_v);
+}
+
+// slot of the variable in the type state, verifyVars when the operand is not a variable
+unsigned verify_slot(struct vmarg *arg) {
+    switch (arg->type) {
+        case global_a:  return arg->val < verifyGlobals ? arg->val : verifyVars;
+        case formal_a:  return arg->val < verifyFormals ? verifyGlobals + arg->val : verifyVars;
+        case local_a:   return arg->val < verifyLocals ? verifyGlobals + verifyFormals + arg->val : verifyVars;
+        default:        return verifyVars;
+    }
+}
+
+unsigned char verify_type(struct vmarg *arg, unsigned char *state) {
+    unsigned s;
+    switch (arg->type) {
+        case number_a:
+            return VTYPE_NUMBER;
+        case global_a:
+        case formal_a:
+        case local_a:
+            s = verify_slot(arg);
+            return s == verifyVars ? VTYPE_ANY : state[s];
+        case retval_a:
+            return VTYPE_ANY;
+        default:
+            return VTYPE_ANY & ~VTYPE_NUMBER;
+    }
+}
+
+void verify_transfer(verify_instr *instr, unsigned char *state) {
+    unsigned v, s;
+    unsigned char t;
+    switch (instr->opcode) {
+        // whatever runs until the coroutine is resumed may write the globals too
+        case call_v:
+        case yield_v:
+            for (v = 0; v < verifyGlobals; v++) state[v] = VTYPE_ANY;
+            return;
+        case newtable_v:
+            s = verify_slot(&instr->arg1);
+            if (s != verifyVars) state[s] = VTYPE_ANY & ~VTYPE_NUMBER;
+            return;
+        case assign_v:
+            t = verify_type(&instr->arg1, state);
+            break;
+        case add_v:
+        case sub_v:
+        case mul_v:
+        case div_v:
+        case mod_v:
+        case add_nn_v:
+        case sub_nn_v:
+        case mul_nn_v:
+        case div_nn_v:
+        case mod_nn_v:
+            t = VTYPE_NUMBER;
+            break;
+        case uminus_v:
+        case and_v:
+        case or_v:
+        case not_v:
+        case tablegetelem_v:
+            t = VTYPE_ANY;
+            break;
+        default:
+            return;
+    }
+    s = verify_slot(&instr->result);
+    if (s != verifyVars) state[s] = t;
+}
+
+// bit 0 result, bit 1 arg1, bit 2 arg2, the operands the writer stores; and, or and not are never generated
+unsigned verify_used_operands(enum vmopcode op) {
+    switch (op) {
+        case assign_v:      return 3;
+        case jump_v:
+        case funcenter_v:
+        case funcexit_v:    return 1;
+        case call_v:
+        case pusharg_v:
+        case newtable_v:
+        case yield_v:       return 2;
+        case nop_v:
+        case and_v:
+        case or_v:
+        case not_v:         return 0;
+        default:            return 7;
+    }
+}
+
+// locals is the localSize of the function the instruction is in, 0 outside functions
+int verify_operand(avm_program *p, struct vmarg *arg, unsigned locals) {
+    if (arg->type > retval_a) return 0;
+    switch (arg->type) {
+        case global_a:      return arg->val < p->globals;
+        case local_a:       return arg->val < locals;
+        case string_a:      return arg->val < p->totalStringConsts;
+        case number_a:      return arg->val < p->totalNumConsts;
+        case userfunc_a:    return arg->val < p->totalUserFuncs;
+        case libfunc_a:     return arg->val < p->totalNamedLibFuncs;
+        default:            return 1;
+    }
+}
+
+int avm_verify(avm_program *p, unsigned *downgraded) {
+    unsigned char *leader, *in, *visited, *state;
+    unsigned *blockOf, *blockStart, *work, *queued;
+    unsigned totalBlocks = 0, top = 0, i, b, v, k, end, succ[2], nsucc, used, depth = 0, *frames;
+    verify_instr *vcode, *instr;
+
+    verifyGlobals = p->globals;
+    verifyFormals = 0;
+    verifyLocals = 0;
+    for (i = 0; i < p->totalUserFuncs; i++) if (p->userFuncs[i].localSize > verifyLocals) verifyLocals = p->userFuncs[i].localSize;
+    for (i = 0; i < p->codeSize; i++) {
+        if (p->code[i].kinds == ABC_WIDE && (p->code[i].arg1 | (unsigned) p->code[i].arg2 << 16) >= p->totalWide) {
+            avm_error(NULL, "Verifier: instruction %u has its operands outside the wide table", i);
+            return 0;
+        }
+    }
+    vcode = (verify_instr *) malloc(sizeof(verify_instr) * (p->codeSize + 1));
+    // the localSize of the functions around the instruction, innermost last; each has one funcenter, so they nest at most totalUserFuncs deep
+    frames = (unsigned *) malloc(sizeof(unsigned) * (p->totalUserFuncs + 1));
+    frames[0] = 0;
+    for (i = 0; i < p->codeSize; i++) {
+        vcode[i].opcode = AVM_OPCODE(p->code + i);
+        vcode[i].result = avm_operand(p, p->code + i, AVM_RESULT);
+        vcode[i].arg1 = avm_operand(p, p->code + i, AVM_ARG1);
+        vcode[i].arg2 = avm_operand(p, p->code + i, AVM_ARG2);
+    }
+    for (i = 0; i < p->codeSize; i++) {
+        instr = vcode + i;
+        used = instr->opcode <= AVM_MAX_INSTRUCTIONS ? verify_used_operands(instr->opcode) : 0;
+        if (!used && instr->opcode != nop_v) {
+            avm_error(NULL, "Verifier: instruction %u has an invalid opcode (%u)", i, instr->opcode);
+            free(vcode);
+            free(frames);
+            return 0;
+        }
+        if (instr->opcode == funcenter_v && instr->result.type == userfunc_a && instr->result.val < p->totalUserFuncs) {
+            if (depth == p->totalUserFuncs) {
+                avm_error(NULL, "Verifier: instruction %u enters more functions than there are", i);
+                free(vcode);
+                free(frames);
+                return 0;
+            }
+            frames[++depth] = p->userFuncs[instr->result.val].localSize;
+        }
+        if (((used & 1) && !verify_operand(p, &instr->result, frames[depth]))
+         || ((used & 2) && !verify_operand(p, &instr->arg1, frames[depth]))
+         || ((used & 4) && !verify_operand(p, &instr->arg2, frames[depth]))
+         || (is_jump_opcode(instr->opcode) && instr->result.type != label_a)
+         || (instr->opcode == funcenter_v && instr->result.type != userfunc_a)
+         || (instr->opcode == funcexit_v && !depth)) {
+            avm_error(NULL, "Verifier: instruction %u has an invalid operand or one outside the constant tables, the globals or the locals", i);
+            free(vcode);
+            free(frames);
+            return 0;
+        }
+        if (instr->opcode == funcexit_v) depth--;
+        if (is_jump_opcode(instr->opcode) && instr->result.val > p->codeSize) {
+            avm_error(NULL, "Verifier: instruction %u jumps outside the code (%u)", i, instr->result.val);
+            free(vcode);
+            free(frames);
+            return 0;
+        }
+        if (instr->arg1.type == formal_a && instr->arg1.val >= verifyFormals) verifyFormals = instr->arg1.val + 1;
+        if (instr->arg2.type == formal_a && instr->arg2.val >= verifyFormals) verifyFormals = instr->arg2.val + 1;
+        if (instr->result.type == formal_a && instr->result.val >= verifyFormals) verifyFormals = instr->result.val + 1;
+        if (instr->arg1.type == local_a && instr->arg1.val >= verifyLocals) verifyLocals = instr->arg1.val + 1;
+        if (instr->arg2.type == local_a && instr->arg2.val >= verifyLocals) verifyLocals = instr->arg2.val + 1;
+        if (instr->result.type == local_a && instr->result.val >= verifyLocals) verifyLocals = instr->result.val + 1;
+    }
+    free(frames);
+    for (i = 0; i < p->totalUserFuncs; i++) {
+        if (p->userFuncs[i].address >= p->codeSize || vcode[p->userFuncs[i].address].opcode != funcenter_v) {
+            avm_error(NULL, "Verifier: function %u does not start at a funcenter", i);
+            free(vcode);
+            return 0;
+        }
+    }
+    verifyVars = verifyGlobals + verifyFormals + verifyLocals;
+    *downgraded = 0;
+    if (!p->codeSize) {
+        free(vcode);
+        return 1;
+    }
+
+    // basic blocks: jump targets, what follows a jump or a funcexit, and every funcenter
+    leader = (unsigned char *) calloc(p->codeSize + 1, 1);
+    leader[0] = 1;
+    for (i = 0; i < p->codeSize; i++) {
+        instr = vcode + i;
+        if (is_jump_opcode(instr->opcode)) {
+            leader[instr->result.val] = 1;
+            leader[i + 1] = 1;
+        }
+        if (instr->opcode == funcexit_v) leader[i + 1] = 1;
+        if (instr->opcode == funcenter_v) leader[i] = 1;
+    }
+    blockOf = (unsigned *) malloc(sizeof(unsigned) * (p->codeSize + 1));
+    blockStart = (unsigned *) malloc(sizeof(unsigned) * (p->codeSize + 2));
+    for (i = 0; i < p->codeSize; i++) {
+        if (leader[i]) blockStart[totalBlocks++] = i;
+        blockOf[i] = totalBlocks - 1;
+    }
+    blockStart[totalBlocks] = p->codeSize;
+
+    in = (unsigned char *) calloc((size_t) totalBlocks * (verifyVars + 1), 1);
+    state = (unsigned char *) malloc(verifyVars + 1);
+    visited = (unsigned char *) calloc(totalBlocks, 1);
+    work = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    queued = (unsigned *) calloc(totalBlocks, sizeof(unsigned));
+
+    // program start and function entries know nothing about the variables
+    for (b = 0; b < totalBlocks; b++) {
+        if (b && vcode[blockStart[b]].opcode != funcenter_v) continue;
+        memset(in + (size_t) b * verifyVars, VTYPE_ANY, verifyVars);
+        visited[b] = queued[b] = 1;
+        work[top++] = b;
+    }
+    while (top) {
+        b = work[--top];
+        queued[b] = 0;
+        memcpy(state, in + (size_t) b * verifyVars, verifyVars);
+        end = blockStart[b + 1];
+        for (i = blockStart[b]; i < end; i++) verify_transfer(vcode + i, state);
+        instr = vcode + end - 1;
+        nsucc = 0;
+        if (is_jump_opcode(instr->opcode) && instr->result.val < p->codeSize) succ[nsucc++] = blockOf[instr->result.val];
+        if (instr->opcode != jump_v && instr->opcode != funcexit_v && end < p->codeSize) succ[nsucc++] = blockOf[end];
+        for (k = 0; k < nsucc; k++) {
+            unsigned char *target = in + (size_t) succ[k] * verifyVars;
+            int changed = !visited[succ[k]];
+            visited[succ[k]] = 1;
+            for (v = 0; v < verifyVars; v++) {
+                if ((target[v] | state[v]) != target[v]) {
+                    target[v] |= state[v];
+                    changed = 1;
+                }
+            }
+            if (changed && !queued[succ[k]]) {
+                queued[succ[k]] = 1;
+                work[top++] = succ[k];
+            }
+        }
+    }
+
+    for (b = 0; b < totalBlocks; b++) {
+        memcpy(state, in + (size_t) b * verifyVars, verifyVars);
+        for (i = blockStart[b]; i < blockStart[b + 1]; i++) {
+            instr = vcode + i;
+            if (is_typed_opcode(instr->opcode)
+             && (!visited[b] || verify_type(&instr->arg1, state) != VTYPE_NUMBER
+              || verify_type(&instr->arg2, state) != VTYPE_NUMBER)) {
+                instr->opcode = checked_opcode(instr->opcode);
+                AVM_SETOPCODE(p->code + i, instr->opcode);
+                (*downgraded)++;
+            }
+            verify_transfer(instr, state);
+        }
+    }
+
+    free(vcode);
+    free(leader);
+    free(blockOf);
+    free(blockStart);
+    free(in);
+    free(state);
+    free(visited);
+    free(work);
+    free(queued);
+    return 1;
+}
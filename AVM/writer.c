@@ -1,94 +1,111 @@
 #include "writer.h"
+#include "abc.h"
 #include <string.h>
 
 #define MAGICNUMBER magic_number //655*639*465 from 3655 3639 3465
 unsigned magic_number = 194623425;
+unsigned abc_version = ABC_VERSION;
+int write_binary = 1;
 FILE *bin_file;
 char* bin_file_name;
 
-void init_writter() {
-    printf("=========================================================\n");
-    printf("==================== to binary ==========================\n");
-    
-    int init_size = strlen(file_name),i = 0,k=0;
+// the source path without its extension, and with .abc
+char *binary_name(char *source) {
+    int init_size = strlen(source),i = 0,k=0;
 	char delim[] = ".";
     char* tok[init_size+1];
-    char* file_name_dup = strdup(file_name);
+    char* file_name_dup = strdup(source);
 	char *ptr = strtok(file_name_dup, delim);
+    char *name;
     // tok[i++] = strdup(ptr);
 	while(ptr != NULL)
 	{
         tok[i++] = strdup(ptr);
 		ptr = strtok(NULL, delim);
 	}
-    bin_file_name = (char*)malloc(init_size+5);
-        bin_file_name[0]= '\0';
+    name = (char*)malloc(init_size+5);
+        name[0]= '\0';
     while(k<i-1){
-        strcat(bin_file_name,strdup(tok[k++]));
+        strcat(name,strdup(tok[k++]));
     }
-    sprintf(bin_file_name,"%s%s",bin_file_name,".abc");
+    strcat(name, ".abc");
+    return name;
+}
+
+void init_writter() {
+    printf("=========================================================\n");
+    printf("==================== to binary ==========================\n");
+    
+    bin_file_name = binary_name(file_name);
     bin_file = fopen(bin_file_name,"wb");
 }
 
-void avmbinaryfile() {
+void write_avmbinaryfile() {
     init_writter();
-    if(!magicnumber()) {
+    if (abc_version == ABC_VERSION) {
+        if (!write_v2()) {
+            fprintf(stderr,"\033[0;31mError writing binary\033[0m\n");
+            return;
+        }
+    }
+    else if(!write_magicnumber()) {
         fprintf(stderr,"\033[0;31mError writing magicnumber\033[0m\n");
         return;
     }
-    if(!arrays()) {
+    else if(!write_arrays()) {
         fprintf(stderr,"\033[0;31mError writing arrays\033[0m\n");
         return;
     }
-    if(!t_code()) {
+    else if(!write_t_code()) {
         fprintf(stderr,"\033[0;31mError writing code\033[0m\n");
         return;
     }
+    fclose(bin_file);
     printf("<==\033[0;32m %s \033[0m\n",file_name);
     printf("==>\033[0;32m Compilation completed succesfully \033[0m\n");
     printf("==>\033[0;32m %s \033[0m\n",strdup(bin_file_name));
     printf("=========================================================\n");
 }
 
-int magicnumber() {
+int write_magicnumber() {
 	return writeUnsigned(MAGICNUMBER);
 }
 
-int arrays() {
-    return arrays_strings() && arrays_numbers() && arrays_userfunctions() && arrays_libfunctions();
+int write_arrays() {
+    return write_arrays_strings() && write_arrays_numbers() && write_arrays_userfunctions() && write_arrays_libfunctions();
 }
 
-int arrays_strings() {
-    if(!writeUnsigned(totalStringConsts)) {
+int write_arrays_strings() {
+    if(!writeUnsigned(t_totalStringConsts)) {
         fprintf(stderr,"\033[0;31mError writing number of total strings\033[0m\n");
         return 0;
     }
-    for(int i = 0 ; i < totalStringConsts ;i++) if (!writeString(stringConsts[i])) {
+    for(int i = 0 ; i < t_totalStringConsts ;i++) if (!writeString(t_stringConsts[i])) {
         fprintf(stderr,"\033[0;31mError writing string(%d)\033[0m\n", i);
         return 0;
     }
     return 1;
 }
 
-int arrays_numbers() {
-    if(!writeUnsigned(totalNumConsts)) {
+int write_arrays_numbers() {
+    if(!writeUnsigned(t_totalNumConsts)) {
         fprintf(stderr,"\033[0;31mError writing number of total numbers\033[0m\n");
         return 0;
     }
-    for(int i = 0 ; i < totalNumConsts ; i++) if(!writeDouble(numConsts[i])) {
+    for(int i = 0 ; i < t_totalNumConsts ; i++) if(!writeDouble(t_numConsts[i])) {
         fprintf(stderr,"\033[0;31mError writing number(%d)\033[0m\n", i);
         return 0;
     }
     return 1;
 }
 
-int arrays_userfunctions() {
-    if(!writeUnsigned(totalUserFuncs)) {
+int write_arrays_userfunctions() {
+    if(!writeUnsigned(t_totalUserFuncs)) {
         fprintf(stderr,"\033[0;31mError writing number of total userfuncs\033[0m\n");
         return 0;
     }
     userfunc* iter;
-    for(int i = 0 ; i < totalUserFuncs ; i++) {
+    for(int i = 0 ; i < t_totalUserFuncs ; i++) {
         iter = (userfunc*)Queue_get(userfunctions,i);
         if(!writeUnsigned(iter->address)) return 0;
         if(!writeUnsigned(iter->localSize)) return 0;
@@ -97,7 +114,7 @@ int arrays_userfunctions() {
     return 1;
 }
 
-int arrays_libfunctions() {
+int write_arrays_libfunctions() {
     if(!writeUnsigned(totalNamedLibfuncs)) {
         fprintf(stderr,"\033[0;31mError writing number of total libfuncs\033[0m\n");
         return 0;
@@ -111,7 +128,7 @@ int arrays_libfunctions() {
     return 1;
 }
 
-int t_code() {
+int write_t_code() {
     if(!writeUnsigned(programVarOffset)) {
         fprintf(stderr,"\033[0;31mError writing number of globals\033[0m\n");
         return 0;
@@ -143,27 +160,39 @@ int t_code() {
             case jge_v:
             case jlt_v:
             case jgt_v:
+            case add_nn_v:
+            case sub_nn_v:
+            case mul_nn_v:
+            case div_nn_v:
+            case mod_nn_v:
+            case jeq_nn_v:
+            case jne_nn_v:
+            case jle_nn_v:
+            case jge_nn_v:
+            case jlt_nn_v:
+            case jgt_nn_v:
             case uminus_v:
             case tablegetelem_v:
             case tablesetelem_v:
-                if(!operand(&instr->arg2)) {
+                if(!write_operand(&instr->arg2)) {
                     fprintf(stderr,"\033[0;31mError reading instruction(%d) arg2\033[0m\n", i);
                     return 0;
                 }
             case assign_v:
-                if(!operand(&instr->arg1)) {
+                if(!write_operand(&instr->arg1)) {
                     fprintf(stderr,"\033[0;31mError reading instruction(%d) arg1\033[0m\n", i);
                     return 0;
                 }
             case jump_v:
             case funcenter_v:
             case funcexit_v:
-                operand(&instr->result);
+                write_operand(&instr->result);
                 break;
             case call_v:
             case pusharg_v:
             case newtable_v:
-                if(!operand(&instr->arg1)) {
+            case yield_v:
+                if(!write_operand(&instr->arg1)) {
                     fprintf(stderr,"\033[0;31mError reading instruction(%d) arg1\033[0m\n", i);
                     return 0;
                 }
@@ -181,7 +210,7 @@ int t_code() {
     return 1;
 }
 
-int operand(vmarg *v) {
+int write_operand(vmarg *v) {
     if(!writeByte(v->type)) {
         fprintf(stderr,"\033[0;31mError writing operand type\033[0m\n");
         return 0;
@@ -215,4 +244,134 @@ int writeDouble(double d) {
 int writeByte(char b) {
     if (!fwrite(&b, sizeof(char), 1, bin_file)) return 0;
     return 1;
-}
\ No newline at end of file
+}
+
+/* ---------------- version 2 ---------------- */
+
+// bit 0 result, bit 1 arg1, bit 2 arg2: the operands t_code writes for each opcode
+unsigned used_operands(vmopcode op) {
+    switch (op) {
+        case assign_v:      return 3;
+        case jump_v:
+        case funcenter_v:
+        case funcexit_v:    return 1;
+        case call_v:
+        case pusharg_v:
+        case newtable_v:
+        case yield_v:       return 2;
+        case nop_v:         return 0;
+        default:            return 7;
+    }
+}
+
+void put_operand(unsigned *kind, unsigned *val, vmarg *v, int used) {
+    *kind = used ? v->type : label_a;
+    *val = used && v->type != retval_a ? v->val : 0;
+}
+
+// the result kind the VM assumes for op, see avm_implied_result
+unsigned writer_implied_result(vmopcode op) {
+    switch (op) {
+        case jeq_v: case jne_v: case jle_v: case jge_v: case jlt_v: case jgt_v:
+        case jeq_nn_v: case jne_nn_v: case jle_nn_v: case jge_nn_v: case jlt_nn_v: case jgt_nn_v:
+        case jump_v:
+        case call_v:
+        case pusharg_v:
+        case newtable_v:
+        case yield_v:
+        case nop_v:         return label_a;
+        case funcenter_v:
+        case funcexit_v:    return userfunc_a;
+        default:            return ABC_VARIABLE;
+    }
+}
+
+unsigned blob_add(char *blob, unsigned *size, char *str) {
+    unsigned at = *size, n = strlen(str) + 1;
+    memcpy(blob + at, str, n);
+    *size += n;
+    return at;
+}
+
+// the mapped binary of the generated code, as the VM reads it; *size is its length
+char *write_image(unsigned *size_out) {
+    abc_header h;
+    unsigned i, used, size, blobSize = 0, totalWide = 0, kinds[3], vals[3];
+    char *image, *blob;
+    abc_instruction *packed;
+    abc_wide *wide;
+    userfunc *f;
+    abc_userfunc *uf;
+
+    // packed first, the operands that do not fit go to the wide section
+    packed = (abc_instruction *) calloc(currInstruction + 1, sizeof(abc_instruction));
+    wide = (abc_wide *) malloc(sizeof(abc_wide) * (currInstruction + 1));
+    for (i = 0; i < currInstruction; i++) {
+        used = used_operands(instructions[i].opcode);
+        put_operand(kinds, vals, &instructions[i].result, used & 1);
+        put_operand(kinds + 1, vals + 1, &instructions[i].arg1, used & 2);
+        put_operand(kinds + 2, vals + 2, &instructions[i].arg2, used & 4);
+        if (!abc_encode(packed + i, instructions[i].opcode, writer_implied_result(instructions[i].opcode), kinds, vals)) {
+            abc_encode_wide(packed + i, instructions[i].opcode, totalWide, wide + totalWide, kinds, vals);
+            totalWide++;
+        }
+    }
+
+    memset(&h, 0, sizeof(h));
+    for (i = 0; i < t_totalStringConsts; i++) blobSize += strlen(t_stringConsts[i]) + 1;
+    for (i = 0; i < t_totalUserFuncs; i++) blobSize += strlen(((userfunc *) Queue_get(userfunctions, i))->id) + 1;
+    for (i = 0; i < totalNamedLibfuncs; i++) blobSize += strlen((char *) Queue_get(libfuncs, i)) + 1;
+
+    h.magic = ABC_MAGIC_V2;
+    h.version = ABC_VERSION;
+    h.globals = programVarOffset;
+    h.totalStrings = t_totalStringConsts;
+    h.totalNumbers = t_totalNumConsts;
+    h.totalUserFuncs = t_totalUserFuncs;
+    h.totalLibFuncs = totalNamedLibfuncs;
+    h.codeSize = currInstruction;
+    h.instrSize = sizeof(abc_instruction);
+    h.totalWide = totalWide;
+    size = ABC_ALIGN(sizeof(h));
+    h.strings = size;       size = ABC_ALIGN(size + sizeof(unsigned) * h.totalStrings);
+    h.numbers = size;       size = ABC_ALIGN(size + sizeof(double) * h.totalNumbers);
+    h.userFuncs = size;     size = ABC_ALIGN(size + sizeof(abc_userfunc) * h.totalUserFuncs);
+    h.libFuncs = size;      size = ABC_ALIGN(size + sizeof(unsigned) * h.totalLibFuncs);
+    h.code = size;          size = ABC_ALIGN(size + h.instrSize * h.codeSize);
+    h.wide = size;          size = ABC_ALIGN(size + sizeof(abc_wide) * h.totalWide);
+    h.lines = size;         size = ABC_ALIGN(size + sizeof(unsigned) * h.codeSize);
+    h.blob = size;          size = ABC_ALIGN(size + blobSize);
+    h.blobSize = blobSize;
+    h.fileSize = size;
+
+    image = (char *) calloc(size, 1);
+    blob = image + h.blob;
+    blobSize = 0;
+    memcpy(image, &h, sizeof(h));
+    for (i = 0; i < h.totalStrings; i++) ((unsigned *) (image + h.strings))[i] = blob_add(blob, &blobSize, t_stringConsts[i]);
+    if (h.totalNumbers) memcpy(image + h.numbers, t_numConsts, sizeof(double) * h.totalNumbers);
+    for (i = 0; i < h.totalUserFuncs; i++) {
+        f = (userfunc *) Queue_get(userfunctions, i);
+        uf = (abc_userfunc *) (image + h.userFuncs) + i;
+        uf->address = f->address + 1;
+        uf->localSize = f->localSize;
+        uf->id = blob_add(blob, &blobSize, f->id);
+    }
+    for (i = 0; i < h.totalLibFuncs; i++) ((unsigned *) (image + h.libFuncs))[i] = blob_add(blob, &blobSize, (char *) Queue_get(libfuncs, i));
+    if (h.codeSize) memcpy(image + h.code, packed, sizeof(abc_instruction) * h.codeSize);
+    if (h.totalWide) memcpy(image + h.wide, wide, sizeof(abc_wide) * h.totalWide);
+    for (i = 0; i < h.codeSize; i++) ((unsigned *) (image + h.lines))[i] = instructions[i].srcLine;
+    free(packed);
+    free(wide);
+    *size_out = size;
+    return image;
+}
+
+// the whole image is built in memory and written with a single fwrite
+int write_v2() {
+    unsigned size;
+    char *image = write_image(&size);
+    size_t written = fwrite(image, 1, size, bin_file);
+    free(image);
+    return written == size;
+}
@@ -8,17 +8,27 @@
 
 // extern void* Queue_get(Queue*,int);
 
+// version of the .abc written, ABC_VERSION unless `out --abc-v1`
+extern unsigned abc_version;
+// 0 when generateCode leaves the binary to write_image, see alpha_compile
+extern int write_binary;
+// where write_avmbinaryfile wrote the binary
+extern char *bin_file_name;
+
+char *binary_name(char *source);
 void init_writter();
-void avmbinaryfile();
-int magicnumber();
-int arrays();
-int arrays_strings();
-int arrays_numbers();
-int arrays_userfunctions();
-int arrays_libfunctions();
-int t_code();
-int operand(vmarg* v);
+void write_avmbinaryfile();
+int write_magicnumber();
+int write_arrays();
+int write_arrays_strings();
+int write_arrays_numbers();
+int write_arrays_userfunctions();
+int write_arrays_libfunctions();
+int write_t_code();
+int write_operand(vmarg* v);
 int writeString(char *buff);
 int writeUnsigned(unsigned buff);
 int writeDouble(double buff);
-int writeByte(char buff);
\ No newline at end of file
+int writeByte(char buff);
+char *write_image(unsigned *size);
+int write_v2();
@@ -0,0 +1,104 @@
+#include "Arena.h"
+
+Arena *ir_arena = NULL;
+
+Arena *Arena_init() {
+    Arena *arena;
+
+    arena = (Arena *)malloc(sizeof(Arena));
+    arena->head = NULL;
+    arena->used = 0;
+    arena->reserved = 0;
+    arena->peak = 0;
+    arena->chunks = 0;
+
+    return arena;
+}
+
+void Arena_destroy(Arena *arena) {
+    assert(arena != NULL);
+
+    Arena_release(arena);
+    free(arena);
+}
+
+static Arena_Chunk *Arena_newchunk(Arena *arena, size_t size) {
+    Arena_Chunk *chunk;
+
+    if (size < ARENA_CHUNK_SIZE) size = ARENA_CHUNK_SIZE;
+    chunk = (Arena_Chunk *) malloc(sizeof(Arena_Chunk) + size);
+    if (chunk == NULL) {
+        fprintf(stderr, "Arena chunk malloc error\n");
+        exit(EXIT_FAILURE);
+    }
+    chunk->data = (char *)(chunk + 1);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->head;
+    arena->head = chunk;
+    arena->reserved += size;
+    arena->chunks++;
+    return chunk;
+}
+
+void *Arena_alloc(Arena *arena, size_t size) {
+    assert(arena != NULL);
+
+    Arena_Chunk *chunk = arena->head;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (chunk == NULL || chunk->size - chunk->used < size) chunk = Arena_newchunk(arena, size);
+
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak) arena->peak = arena->used;
+    memset(p, 0, size);
+    return p;
+}
+
+char *Arena_strdup(Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *dup = (char *) Arena_alloc(arena, len);
+    memcpy(dup, s, len);
+    return dup;
+}
+
+// frees every chunk at once, the peak survives so it can be reported afterwards
+void Arena_release(Arena *arena) {
+    assert(arena != NULL);
+
+    Arena_Chunk *chunk, *next;
+
+    for (chunk = arena->head; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->head = NULL;
+    arena->used = 0;
+    arena->reserved = 0;
+    arena->chunks = 0;
+}
+
+void Arena_report(Arena *arena, const char *name) {
+    if (arena == NULL) return;
+    printf("Arena '%s': %zu bytes in use, %zu reserved in %u chunk(s), peak %zu bytes\n",
+        name, arena->used, arena->reserved, arena->chunks, arena->peak);
+}
+
+void *ir_alloc(size_t size) {
+    if (ir_arena == NULL) ir_arena = Arena_init();
+    return Arena_alloc(ir_arena, size);
+}
+
+char *ir_strdup(const char *s) {
+    if (ir_arena == NULL) ir_arena = Arena_init();
+    return Arena_strdup(ir_arena, s);
+}
+
+void ir_release() {
+    if (ir_arena == NULL) return;
+    Arena_report(ir_arena, "ir");
+    Arena_release(ir_arena);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN 16
+
+typedef struct Arena_Chunk Arena_Chunk;
+typedef struct Arena Arena;
+
+struct Arena_Chunk{
+        Arena_Chunk *next;
+        size_t size;
+        size_t used;
+        char *data;
+};
+
+struct Arena{
+        Arena_Chunk *head;
+        size_t used;            // bytes handed out since the last release
+        size_t reserved;        // bytes held in chunks
+        size_t peak;            // max of used over the arena lifetime
+        unsigned int chunks;
+};
+
+// per-compilation arena for the IR (Expr, symbol records, temp names, error buffers)
+extern Arena *ir_arena;
+
+Arena *Arena_init();
+
+void Arena_destroy(Arena *arena);
+
+void *Arena_alloc(Arena *arena, size_t size);
+
+char *Arena_strdup(Arena *arena, const char *s);
+
+void Arena_release(Arena *arena);
+
+void Arena_report(Arena *arena, const char *name);
+
+void *ir_alloc(size_t size);
+
+char *ir_strdup(const char *s);
+
+void ir_release();
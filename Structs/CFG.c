@@ -0,0 +1,417 @@
+#include "CFG.h"
+#include "Optimize.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+basic_block *blocks = NULL;
+unsigned totalBlocks = 0;
+unsigned *quad_block = NULL;
+
+cfg_stats dce_stats;
+
+unsigned matching_funcend(unsigned i) {
+    unsigned depth = 0;
+    for (; i < currQuad; i++) {
+        if (quads[i].op == funcstart) depth++;
+        else if (quads[i].op == funcend && --depth == 0) return i;
+    }
+    assert(0);
+    return currQuad;
+}
+
+int is_temp(SymbolTableRecord *sym) {
+    return sym && !strncmp(sym->name, "_tmp", 4);
+}
+
+SymbolTableRecord *enclosing_function(unsigned i) {
+    unsigned depth = 0;
+    while (i-- > 0) {
+        if (quads[i].op == funcend) depth++;
+        else if (quads[i].op == funcstart) {
+            if (!depth) return quads[i].arg1->sym;
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+Expr *new_frame_var(SymbolTableRecord *func, const char *name) {
+    SymbolTableRecord *sym = (SymbolTableRecord *) ir_alloc(sizeof(SymbolTableRecord));
+    Expr *e = new_expr(var_e);
+    sym->name = ir_strdup(name);
+    sym->stype = var_s;
+    sym->active = 1;
+    if (func) {
+        sym->type = LCL;
+        sym->space = functionlocal;
+        sym->scope = func->scope + 1;
+        sym->offset = func->totallocals++;
+    }
+    else {
+        sym->type = GLBL;
+        sym->space = programvar;
+        sym->offset = programVarOffset++;
+    }
+    e->sym = sym;
+    return e;
+}
+
+void cfg_free(void) {
+    free(blocks);
+    free(quad_block);
+    blocks = NULL;
+    quad_block = NULL;
+    totalBlocks = 0;
+}
+
+void add_succ(basic_block *b, unsigned target) {
+    // jumps past the last quad leave the program
+    if (target >= currQuad) return;
+    assert(b->nsucc < 2);
+    b->succ[b->nsucc++] = quad_block[target];
+}
+
+// function bodies are entered through call, so every funcstart is a root; funcend
+// has to survive even when each path returns before it, generate_FUNCEND patches the returns
+void mark_reachable(void) {
+    unsigned *work = (unsigned *) malloc(sizeof(unsigned) * totalBlocks);
+    unsigned top = 0, b, s;
+    Iopcode op;
+    for (b = 0; b < totalBlocks; b++) {
+        op = quads[blocks[b].start].op;
+        if (b == 0 || op == funcstart || op == funcend) {
+            blocks[b].reachable = 1;
+            work[top++] = b;
+        }
+    }
+    while (top) {
+        b = work[--top];
+        for (s = 0; s < blocks[b].nsucc; s++) {
+            if (blocks[blocks[b].succ[s]].reachable) continue;
+            blocks[blocks[b].succ[s]].reachable = 1;
+            work[top++] = blocks[b].succ[s];
+        }
+    }
+    free(work);
+}
+
+void cfg_build(void) {
+    unsigned char *leader;
+    unsigned i, b;
+    Quad *last;
+
+    cfg_free();
+    if (!currQuad) return;
+    leader = find_leaders();
+    for (i = 0; i < currQuad; i++) if (leader[i]) totalBlocks++;
+    blocks = (basic_block *) calloc(totalBlocks, sizeof(basic_block));
+    quad_block = (unsigned *) malloc(sizeof(unsigned) * currQuad);
+
+    b = 0;
+    for (i = 0; i < currQuad; i++) {
+        if (leader[i] && i) blocks[++b].start = i;
+        quad_block[i] = b;
+    }
+    for (b = 0; b + 1 < totalBlocks; b++) blocks[b].end = blocks[b + 1].start;
+    blocks[totalBlocks - 1].end = currQuad;
+
+    for (b = 0; b < totalBlocks; b++) {
+        last = quads + blocks[b].end - 1;
+        switch (last->op) {
+            case jump:
+                add_succ(blocks + b, last->label - 1);
+                break;
+            case if_eq:
+            case if_noteq:
+            case if_lesseq:
+            case if_greatereq:
+            case if_less:
+            case if_greater:
+                add_succ(blocks + b, last->label - 1);
+                add_succ(blocks + b, blocks[b].end);
+                break;
+            case ret:
+            case funcend:
+                break;
+            case funcstart:
+                // the body, and the jump generate_FUNCSTART emits over it
+                add_succ(blocks + b, blocks[b].end);
+                add_succ(blocks + b, matching_funcend(blocks[b].start) + 1);
+                break;
+            default:
+                add_succ(blocks + b, blocks[b].end);
+                break;
+        }
+    }
+    mark_reachable();
+}
+
+void cfg_print(void) {
+    unsigned b, s;
+    printf("========== CFG (%u blocks) ==========\n", totalBlocks);
+    for (b = 0; b < totalBlocks; b++) {
+        printf("B%u [%u..%u]%s ->", b, blocks[b].start + 1, blocks[b].end, blocks[b].reachable ? "" : " unreachable");
+        for (s = 0; s < blocks[b].nsucc; s++) printf(" B%u", blocks[b].succ[s]);
+        printf("\n");
+    }
+}
+
+void compact_quads(unsigned char *dead) {
+    unsigned *remap = (unsigned *) malloc(sizeof(unsigned) * (currQuad + 1));
+    unsigned i, n = 0;
+
+    // a label pointing at a deleted quad moves on to the next one that survives
+    for (i = 0; i < currQuad; i++) {
+        remap[i] = n;
+        if (!dead[i]) n++;
+    }
+    remap[currQuad] = n;
+
+    n = 0;
+    for (i = 0; i < currQuad; i++) {
+        if (dead[i]) continue;
+        quads[n] = quads[i];
+        if ((quads[n].op == jump || is_branch(quads[n].op)) && quads[n].label) {
+            assert(quads[n].label <= currQuad + 1);
+            quads[n].label = remap[quads[n].label - 1] + 1;
+        }
+        if (quads[n].op == funcstart) quads[n].arg1->sym->iaddress = n + 1;
+        n++;
+    }
+    for (i = n; i < currQuad; i++) {
+        quads[i].op = -1;
+        quads[i].taddress = 0;
+    }
+    currQuad = n;
+    free(remap);
+}
+
+void insert_quads(unsigned at, Quad *ins, unsigned n, unsigned char *fromInside) {
+    unsigned i, t;
+    Quad *q;
+
+    if (currQuad + n > total) {
+        quads = (Quad *) realloc(quads, sizeof(Quad) * (currQuad + n));
+        total = currQuad + n;
+    }
+    memmove(quads + at + n, quads + at, sizeof(Quad) * (currQuad - at));
+    memcpy(quads + at, ins, sizeof(Quad) * n);
+    for (i = 0; i < currQuad + n; i++) {
+        if (i >= at && i < at + n) continue;
+        q = quads + i;
+        if ((q->op == jump || is_branch(q->op)) && q->label) {
+            t = q->label - 1;
+            if (t > at || (t == at && fromInside[i < at ? i : i - n])) q->label += n;
+        }
+        if (q->op == funcstart) q->arg1->sym->iaddress = i + 1;
+    }
+    currQuad += n;
+}
+
+unsigned thread_target(unsigned label) {
+    unsigned hops = 0;
+    while (label >= 1 && label <= currQuad && hops++ < currQuad) {
+        if (quads[label - 1].op == nop) {
+            label++;
+            continue;
+        }
+        if (quads[label - 1].op != jump || !quads[label - 1].label) break;
+        label = quads[label - 1].label;
+    }
+    return label;
+}
+
+unsigned thread_jumps(void) {
+    unsigned i, label, changed = 0;
+    for (i = 0; i < currQuad; i++) {
+        if (quads[i].op != jump && !is_branch(quads[i].op)) continue;
+        label = thread_target(quads[i].label);
+        if (label != quads[i].label) {
+            quads[i].label = label;
+            changed++;
+        }
+    }
+    dce_stats.threaded += changed;
+    return changed;
+}
+
+unsigned remove_unreachable(void) {
+    unsigned char *dead;
+    unsigned i, j, t, removed = 0;
+
+    cfg_build();
+    if (!currQuad) return 0;
+    dead = (unsigned char *) calloc(currQuad, 1);
+    for (i = 0; i < currQuad; i++) {
+        if (!blocks[quad_block[i]].reachable) {
+            dead[i] = 1;
+            dce_stats.unreachable++;
+        }
+        else if (quads[i].op == nop) {
+            dead[i] = 1;
+            dce_stats.nops++;
+        }
+    }
+    // a jump over nothing but deleted quads goes to the next quad anyway
+    for (i = currQuad; i-- > 0;) {
+        if (dead[i] || quads[i].op != jump) continue;
+        t = quads[i].label - 1;
+        if (t <= i) continue;
+        for (j = i + 1; j < t && dead[j]; j++);
+        if (j == t) {
+            dead[i] = 1;
+            dce_stats.nops++;
+        }
+    }
+    for (i = 0; i < currQuad; i++) removed += dead[i];
+    if (removed) compact_quads(dead);
+    free(dead);
+    return removed;
+}
+
+/* ---------------- dead temporaries ---------------- */
+
+SymbolTableRecord **live_temps = NULL;
+unsigned totalLiveTemps = 0;
+unsigned liveTempsCapacity = 0;
+
+int temp_index(SymbolTableRecord *sym) {
+    unsigned i;
+    for (i = 0; i < totalLiveTemps; i++) if (live_temps[i] == sym) return i;
+    if (totalLiveTemps == liveTempsCapacity) {
+        liveTempsCapacity = liveTempsCapacity ? 2*liveTempsCapacity : 64;
+        live_temps = (SymbolTableRecord **) realloc(live_temps, sizeof(SymbolTableRecord *) * liveTempsCapacity);
+    }
+    live_temps[totalLiveTemps] = sym;
+    return totalLiveTemps++;
+}
+
+Expr **quad_defp(Quad *q) {
+    switch (q->op) {
+        case assign:
+        case add:
+        case sub:
+        case mul:
+        case divi:
+        case mod:
+        case uminus:
+        case and:
+        case or:
+        case not:
+        case getretval:
+        case tablegetelem:
+            return &q->result;
+        case tablecreate:
+            return &q->arg1;
+        default:
+            return NULL;
+    }
+}
+
+int defined_temp(Quad *q) {
+    Expr **d = quad_defp(q);
+    if (!d || !*d || (*d)->type == tableitem_e || !is_temp((*d)->sym)) return -1;
+    return temp_index((*d)->sym);
+}
+
+unsigned quad_reads(Quad *q, Expr **reads) {
+    Expr **slots[3] = { &q->arg1, &q->arg2, &q->result };
+    Expr **d = quad_defp(q);
+    unsigned k, n = 0;
+    for (k = 0; k < 3; k++) {
+        if (!*slots[k]) continue;
+        if (slots[k] != d) reads[n++] = *slots[k];
+        if ((*slots[k])->index) reads[n++] = (*slots[k])->index;
+    }
+    return n;
+}
+
+#define BIT_WORDS(n) (((n) + 31) / 32)
+#define BIT_SET(v, i) ((v)[(i) / 32] |= 1u << ((i) % 32))
+#define BIT_CLEAR(v, i) ((v)[(i) / 32] &= ~(1u << ((i) % 32)))
+#define BIT_TEST(v, i) ((v)[(i) / 32] & (1u << ((i) % 32)))
+
+// clears the bit of a written temp, then sets the bits of the temps read
+void transfer(Quad *q, unsigned *live) {
+    Expr *reads[6];
+    unsigned n, k;
+    int t = defined_temp(q);
+    if (t >= 0) BIT_CLEAR(live, t);
+    n = quad_reads(q, reads);
+    for (k = 0; k < n; k++) if (is_temp(reads[k]->sym)) BIT_SET(live, temp_index(reads[k]->sym));
+}
+
+void collect_temps(void) {
+    Expr *reads[6];
+    unsigned i, n, k;
+    totalLiveTemps = 0;
+    for (i = 0; i < currQuad; i++) {
+        defined_temp(quads + i);
+        n = quad_reads(quads + i, reads);
+        for (k = 0; k < n; k++) if (is_temp(reads[k]->sym)) temp_index(reads[k]->sym);
+    }
+}
+
+int removable(Quad *q) {
+    return q->op == assign || q->op == and || q->op == or || q->op == not || q->op == getretval;
+}
+
+unsigned eliminate_dead_temps_once(void) {
+    unsigned words, b, s, w, i, changed, removed = 0;
+    unsigned *in, *out, *live;
+    unsigned char *dead;
+    int t;
+
+    cfg_build();
+    if (!currQuad) return 0;
+    collect_temps();
+    if (!totalLiveTemps) return 0;
+
+    words = BIT_WORDS(totalLiveTemps);
+    in = (unsigned *) calloc(totalBlocks * words, sizeof(unsigned));
+    out = (unsigned *) calloc(totalBlocks * words, sizeof(unsigned));
+    live = (unsigned *) malloc(words * sizeof(unsigned));
+
+    do {
+        changed = 0;
+        for (b = totalBlocks; b-- > 0;) {
+            for (s = 0; s < blocks[b].nsucc; s++)
+                for (w = 0; w < words; w++) out[b*words + w] |= in[blocks[b].succ[s]*words + w];
+            memcpy(live, out + b*words, words * sizeof(unsigned));
+            for (i = blocks[b].end; i-- > blocks[b].start;) transfer(quads + i, live);
+            if (memcmp(live, in + b*words, words * sizeof(unsigned))) {
+                memcpy(in + b*words, live, words * sizeof(unsigned));
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    dead = (unsigned char *) calloc(currQuad, 1);
+    for (b = 0; b < totalBlocks; b++) {
+        memcpy(live, out + b*words, words * sizeof(unsigned));
+        for (i = blocks[b].end; i-- > blocks[b].start;) {
+            t = defined_temp(quads + i);
+            if (t >= 0 && !BIT_TEST(live, t) && removable(quads + i)) {
+                dead[i] = 1;
+                removed++;
+                continue;
+            }
+            transfer(quads + i, live);
+        }
+    }
+    if (removed) compact_quads(dead);
+    free(dead);
+    free(in);
+    free(out);
+    free(live);
+    return removed;
+}
+
+unsigned eliminate_dead_temps(void) {
+    unsigned removed, total_removed = 0;
+    while ((removed = eliminate_dead_temps_once())) total_removed += removed;
+    dce_stats.dead_stores += total_removed;
+    return total_removed;
+}
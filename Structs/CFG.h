@@ -0,0 +1,52 @@
+#pragma once
+#include "Quad.h"
+
+typedef struct basic_block {
+	unsigned start;			// first quad (0 based)
+	unsigned end;			// one past the last quad
+	unsigned succ[2];
+	unsigned nsucc;
+	unsigned char reachable;
+} basic_block;
+
+extern basic_block *blocks;
+extern unsigned totalBlocks;
+extern unsigned *quad_block;	// block of every quad
+
+typedef struct cfg_stats {
+	unsigned threaded;
+	unsigned unreachable;
+	unsigned nops;
+	unsigned dead_stores;
+} cfg_stats;
+
+extern cfg_stats dce_stats;
+
+void cfg_build(void);
+void cfg_free(void);
+void cfg_print(void);
+
+// index of the funcend quad closing the funcstart at i
+unsigned matching_funcend(unsigned i);
+int is_temp(SymbolTableRecord *sym);
+// function whose body holds quads[i], NULL at program level
+SymbolTableRecord *enclosing_function(unsigned i);
+// a fresh slot in the frame of func, or a global when func is NULL
+Expr *new_frame_var(SymbolTableRecord *func, const char *name);
+
+// retarget jumps that land on jumps, returns how many were changed
+unsigned thread_jumps(void);
+// drop unreachable blocks, nops and jumps to the next quad
+unsigned remove_unreachable(void);
+// drop writes to temporaries that are never read afterwards
+unsigned eliminate_dead_temps(void);
+
+// the operand slot the quad writes, NULL if it only reads
+Expr **quad_defp(Quad *q);
+unsigned quad_reads(Quad *q, Expr **reads);
+
+// delete every quad with dead[i] set and renumber labels so patch_incomplete_jumps still resolves them
+void compact_quads(unsigned char *dead);
+// put n quads before quads[at]; jumps to at from quads with fromInside set keep
+// landing on the old quad, every other jump to at now enters the inserted ones
+void insert_quads(unsigned at, Quad *ins, unsigned n, unsigned char *fromInside);
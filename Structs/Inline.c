@@ -0,0 +1,334 @@
+#include "Inline.h"
+#include "Optimize.h"
+#include "CFG.h"
+#include "SSA.h"
+#include "Profile.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+inline_stats inliner_stats;
+
+typedef struct inline_callee {
+    SymbolTableRecord *func;
+    unsigned start;			// funcstart quad
+    unsigned end;			// funcend quad
+    unsigned falls;			// some path leaves without a return value
+    unsigned inlined;
+    SymbolTableRecord **formals;	// formal of every offset the body uses, NULL otherwise
+} inline_callee;
+
+// slot given to a callee variable in the frame of one caller, shared by all sites there
+typedef struct inline_slot {
+    SymbolTableRecord *caller;
+    SymbolTableRecord *sym;
+    Expr *var;
+} inline_slot;
+
+inline_callee *callees = NULL;
+unsigned totalCallees = 0;
+unsigned calleesCapacity = 0;
+inline_slot *slots = NULL;
+unsigned totalSlots = 0;
+unsigned slotsCapacity = 0;
+
+int is_frame_var(SymbolTableRecord *sym) {
+    return sym && sym->stype == var_s && (sym->space == functionlocal || sym->space == formalarg);
+}
+
+// every operand symbol the quad reads, including the variable of a table member it writes
+unsigned operand_syms(Quad *q, SymbolTableRecord **syms) {
+    Expr *reads[6];
+    Expr **d = quad_defp(q);
+    unsigned k, n = quad_reads(q, reads), m = 0;
+    for (k = 0; k < n; k++) if (reads[k]->sym) syms[m++] = reads[k]->sym;
+    if (d && *d && !is_sym_value(*d) && (*d)->sym) syms[m++] = (*d)->sym;
+    return m;
+}
+
+int calls_argument_funcs(Expr *f) {
+    return f->type == libraryfunc_e && f->sym
+        && (!strcmp(f->sym->name, "argument") || !strcmp(f->sym->name, "totalarguments"));
+}
+
+// fills c when the function starting at quads[s] may be copied into its callers
+int inlinable(unsigned s, unsigned char *target, inline_callee *c) {
+    SymbolTableRecord *f = quads[s].arg1->sym, *written[INLINE_HOT_QUADS], *syms[8], *sym;
+    unsigned e = matching_funcend(s), i, k, w, n, totalWritten = 0, straight = 1;
+    Quad *q;
+    Expr **d;
+
+    if (e - s - 1 > (profile_file ? INLINE_HOT_QUADS : INLINE_MAX_QUADS)) return 0;
+    c->func = f;
+    c->start = s;
+    c->end = e;
+    c->inlined = 0;
+    c->falls = e == s + 1 || quads[e - 1].op != ret || !quads[e - 1].result;
+    c->formals = (SymbolTableRecord **) ir_alloc(sizeof(SymbolTableRecord *) * (f->totalformals + 1));
+    memset(c->formals, 0, sizeof(SymbolTableRecord *) * (f->totalformals + 1));
+    for (i = s + 1; i < e; i++) {
+        q = quads + i;
+        if (target[i]) straight = 0;
+        if (q->op == funcstart) return 0;
+        if (q->op == call && (q->result->sym == f || calls_argument_funcs(q->result))) return 0;
+        if (q->op == ret && !q->result) c->falls = 1;
+        if ((q->op == jump || is_branch(q->op)) && q->label == e + 1) c->falls = 1;
+
+        n = operand_syms(q, syms);
+        for (k = 0; k < n; k++) {
+            sym = syms[k];
+            if (!is_frame_var(sym)) continue;
+            if (sym->space == formalarg) {
+                if (sym->offset >= f->totalformals) return 0;
+                c->formals[sym->offset] = sym;
+                continue;
+            }
+            if (is_temp(sym)) continue;
+            for (w = 0; w < totalWritten && written[w] != sym; w++);
+            if (w == totalWritten) return 0;
+        }
+        d = quad_defp(q);
+        if (d && *d && is_sym_value(*d)) {
+            sym = (*d)->sym;
+            if (sym->space == formalarg && sym->offset < f->totalformals) c->formals[sym->offset] = sym;
+            else if (straight && is_frame_var(sym) && !is_temp(sym)) written[totalWritten++] = sym;
+        }
+        if (q->op == jump || is_branch(q->op) || q->op == ret) straight = 0;
+    }
+    return 1;
+}
+
+inline_callee *find_callee(Expr *f) {
+    unsigned i;
+    if (f->type != programfunc_e || !f->sym) return NULL;
+    for (i = 0; i < totalCallees; i++) if (callees[i].func == f->sym) return callees + i;
+    return NULL;
+}
+
+// with a profile, sites that never ran stay calls and hot ones may take longer bodies
+int site_allowed(inline_callee *c, unsigned line, unsigned round) {
+    profile_line *p = profile_at(line);
+    unsigned size = c->end - c->start - 1;
+    if (!p) return size <= INLINE_MAX_QUADS;
+    if (!p->count) {
+        if (!round) profile_stats.cold_sites++;
+        return 0;
+    }
+    return size <= INLINE_MAX_QUADS || p->count >= PROFILE_HOT_CALLS;
+}
+
+Expr *inline_slot_var(SymbolTableRecord *caller, inline_callee *c, SymbolTableRecord *sym) {
+    char name[128];
+    unsigned i;
+    for (i = 0; i < totalSlots; i++) if (slots[i].caller == caller && slots[i].sym == sym) return slots[i].var;
+    slots = (inline_slot *) grow(slots, &slotsCapacity, totalSlots + 1, sizeof(inline_slot));
+    snprintf(name, sizeof(name), "%s.%s", sym->name, c->func->name);
+    slots[totalSlots].caller = caller;
+    slots[totalSlots].sym = sym;
+    slots[totalSlots].var = new_frame_var(caller, name);
+    return slots[totalSlots++].var;
+}
+
+Expr *remap_expr(Expr *e, SymbolTableRecord *caller, inline_callee *c) {
+    Expr *copy;
+    if (!e || (!is_frame_var(e->sym) && !e->index)) return e;
+    copy = (Expr *) ir_alloc(sizeof(Expr));
+    *copy = *e;
+    if (is_frame_var(e->sym)) copy->sym = inline_slot_var(caller, c, e->sym)->sym;
+    copy->index = remap_expr(e->index, caller, c);
+    return copy;
+}
+
+// the value of the call is never read: the temp it went to is written again first
+int result_unused(unsigned g, unsigned char *target) {
+    SymbolTableRecord *t = quads[g].result->sym, *syms[8];
+    Expr **d;
+    unsigned i, k, n;
+    if (!is_temp(t)) return 0;
+    for (i = g + 1; i < currQuad; i++) {
+        if (target[i]) return 0;
+        n = operand_syms(quads + i, syms);
+        for (k = 0; k < n; k++) if (syms[k] == t) return 0;
+        d = quad_defp(quads + i);
+        if (d && *d && (*d)->sym == t) return 1;
+        if (quads[i].op == jump || is_branch(quads[i].op) || quads[i].op == ret
+         || quads[i].op == funcstart || quads[i].op == funcend) return 0;
+    }
+    return 0;
+}
+
+Quad *out = NULL;
+unsigned char *copied = NULL;	// label of out[i] is already final
+unsigned totalOut = 0;
+unsigned outCapacity = 0;
+unsigned copiedCapacity = 0;
+
+Quad *out_quad(unsigned line, int fixed) {
+    out = (Quad *) grow(out, &outCapacity, totalOut + 1, sizeof(Quad));
+    copied = (unsigned char *) grow(copied, &copiedCapacity, totalOut + 1, 1);
+    memset(out + totalOut, 0, sizeof(Quad));
+    out[totalOut].line = line;
+    copied[totalOut] = fixed;
+    return out + totalOut++;
+}
+
+// emits the body of c in place of the params, call and getretval at [first, g]
+void expand_site(unsigned first, unsigned g, SymbolTableRecord *caller, inline_callee *c) {
+    unsigned callAt = g - 1, line = quads[callAt].line;
+    unsigned *bodyPos, i, k, pos, base, endLabel, bodySize = c->end - c->start - 1;
+    Expr *result = quads[g].result;
+    Quad *q, *src;
+
+    // arguments were pushed last to first, the one next to the call is formal 0
+    for (k = 0; k < callAt - first; k++) {
+        if (!c->formals[k]) continue;
+        q = out_quad(line, 1);
+        q->op = assign;
+        q->result = inline_slot_var(caller, c, c->formals[k]);
+        q->arg1 = quads[callAt - 1 - k].result;
+    }
+
+    bodyPos = (unsigned *) malloc(sizeof(unsigned) * (bodySize + 1));
+    base = totalOut;
+    for (i = 0, pos = 0; i < bodySize; i++) {
+        bodyPos[i] = pos;
+        src = quads + c->start + 1 + i;
+        pos += src->op == ret && src->result ? 2 : 1;
+    }
+    bodyPos[bodySize] = pos;
+    endLabel = base + pos + 1;
+
+    for (i = 0; i < bodySize; i++) {
+        src = quads + c->start + 1 + i;
+        if (src->op == ret) {
+            if (src->result) {
+                q = out_quad(src->line, 1);
+                q->op = assign;
+                q->result = result;
+                q->arg1 = remap_expr(src->result, caller, c);
+            }
+            q = out_quad(src->line, 1);
+            q->op = jump;
+            q->label = endLabel;
+            continue;
+        }
+        q = out_quad(src->line, 1);
+        *q = *src;
+        q->taddress = 0;
+        q->result = remap_expr(src->result, caller, c);
+        q->arg1 = remap_expr(src->arg1, caller, c);
+        q->arg2 = remap_expr(src->arg2, caller, c);
+        if ((q->op == jump || is_branch(q->op)) && q->label) {
+            assert(q->label - 1 > c->start && q->label - 1 <= c->end);
+            q->label = base + bodyPos[q->label - 1 - c->start - 1] + 1;
+        }
+    }
+    free(bodyPos);
+    inliner_stats.quads += totalOut - base;
+    if (!c->inlined++) inliner_stats.functions++;
+    inliner_stats.sites++;
+}
+
+unsigned inline_round(unsigned budget, unsigned round) {
+    unsigned char *target = (unsigned char *) calloc(currQuad + 1, 1);
+    unsigned *remap, i, j, n = 0;
+    SymbolTableRecord **funcStack;
+    unsigned depth = 0;
+    inline_callee *c;
+
+    for (i = 0; i < currQuad; i++)
+        if ((quads[i].op == jump || is_branch(quads[i].op)) && quads[i].label) target[quads[i].label - 1] = 1;
+
+    totalCallees = 0;
+    for (i = 0; i < currQuad; i++) {
+        if (quads[i].op != funcstart) continue;
+        callees = (inline_callee *) grow(callees, &calleesCapacity, totalCallees + 1, sizeof(inline_callee));
+        if (inlinable(i, target, callees + totalCallees)) totalCallees++;
+    }
+    if (!totalCallees) {
+        free(target);
+        return 0;
+    }
+
+    // functions whose bodies enclose the current quad, the innermost one is the caller
+    funcStack = (SymbolTableRecord **) malloc(sizeof(SymbolTableRecord *) * (currQuad + 1));
+    remap = (unsigned *) malloc(sizeof(unsigned) * (currQuad + 1));
+    totalOut = 0;
+    for (i = 0; i < currQuad; i++) {
+        SymbolTableRecord *caller = NULL;
+        if (quads[i].op == funcstart) funcStack[depth++] = quads[i].arg1->sym;
+        if (depth && quads[i].op != funcstart && quads[i].op != funcend) caller = funcStack[depth - 1];
+        if (quads[i].op == param || quads[i].op == call) {
+            for (j = i; j < currQuad && quads[j].op == param; j++);
+            c = j < currQuad && quads[j].op == call ? find_callee(quads[j].result) : NULL;
+            if (c && c->func != caller && j + 1 < currQuad && quads[j + 1].op == getretval
+             && j - i == c->func->totalformals && totalOut + c->end - c->start <= budget
+             && site_allowed(c, quads[j].line, round)) {
+                unsigned k, inside = 0;
+                for (k = i + 1; k <= j + 1; k++) inside |= target[k];
+                if (!inside && (!c->falls || result_unused(j + 1, target))) {
+                    if (c->end - c->start - 1 > INLINE_MAX_QUADS) profile_stats.hot_sites++;
+                    for (k = i; k <= j + 1; k++) remap[k] = totalOut;
+                    expand_site(i, j + 1, caller, c);
+                    n++;
+                    i = j + 1;
+                    continue;
+                }
+            }
+        }
+        remap[i] = totalOut;
+        *out_quad(quads[i].line, 0) = quads[i];
+        if (quads[i].op == funcend) depth--;
+    }
+    remap[currQuad] = totalOut;
+
+    if (n) {
+        for (i = 0; i < totalOut; i++) {
+            if (!copied[i] && (out[i].op == jump || is_branch(out[i].op)) && out[i].label) {
+                assert(out[i].label <= currQuad + 1);
+                out[i].label = remap[out[i].label - 1] + 1;
+            }
+            if (out[i].op == funcstart) out[i].arg1->sym->iaddress = i + 1;
+        }
+        free(quads);
+        if (outCapacity < totalOut + 1) {
+            out = (Quad *) realloc(out, sizeof(Quad) * (totalOut + 1));
+            outCapacity = totalOut + 1;
+        }
+        for (i = totalOut; i < outCapacity; i++) {
+            memset(out + i, 0, sizeof(Quad));
+            out[i].op = -1;
+        }
+        quads = out;
+        total = outCapacity;
+        currQuad = totalOut;
+        out = NULL;
+        outCapacity = 0;
+    }
+    free(out);
+    free(copied);
+    out = NULL;
+    copied = NULL;
+    outCapacity = copiedCapacity = 0;
+    free(remap);
+    free(funcStack);
+    free(target);
+    return n;
+}
+
+unsigned inline_calls(void) {
+    unsigned rounds, n, sites = 0, budget = 2 * currQuad + 64;
+    memset(&inliner_stats, 0, sizeof(inliner_stats));
+    for (rounds = 0; rounds < INLINE_ROUNDS; rounds++) {
+        n = inline_round(budget, rounds);
+        if (!n) break;
+        sites += n;
+    }
+    free(callees);
+    free(slots);
+    callees = NULL;
+    slots = NULL;
+    totalCallees = calleesCapacity = totalSlots = slotsCapacity = 0;
+    return sites;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "Quad.h"
+
+/*
+ * Inlining of small user functions under -O. A call to a programfunc_e is
+ * replaced by the body of the callee when the body is short, does not define
+ * functions, does not call itself and does not look at its own actuals through
+ * argument()/totalarguments(). Formals, locals and temporaries of the callee get
+ * slots in the frame of the caller, so locals must be written before they are
+ * read on the straight-line start of the body (a fresh frame would hold undef).
+ */
+
+#define INLINE_MAX_QUADS 24		// longest callee body that is copied
+#define INLINE_HOT_QUADS 64		// longest body copied into a hot call site of a profile
+#define INLINE_ROUNDS 2			// inlining into bodies that were just inlined
+
+typedef struct inline_stats {
+	unsigned sites;
+	unsigned functions;		// distinct callees inlined at least once
+	unsigned quads;			// quads added
+} inline_stats;
+
+extern inline_stats inliner_stats;
+
+// returns how many call sites were replaced
+unsigned inline_calls(void);
@@ -0,0 +1,431 @@
+#include "Optimize.h"
+#include "CFG.h"
+#include "SSA.h"
+#include "Inline.h"
+#include "Types.h"
+#include "Profile.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+unsigned optimize_flag = 0;
+opt_stats fold_stats;
+
+// what is known about a symbol inside the current basic block
+typedef enum fact_t {
+    unknown_f,
+    number_f,
+    const_f
+} fact_t;
+
+typedef struct fact {
+    SymbolTableRecord *sym;
+    fact_t kind;
+    Expr *value;
+} fact;
+
+fact *facts = NULL;
+unsigned totalFacts = 0;
+unsigned factsCapacity = 0;
+
+void optimize_quads(void) {
+    if (!optimize_flag) return;
+    printf("================= Optimizing quads (-O) =================\n");
+    memset(&profile_stats, 0, sizeof(profile_stats));
+    inline_calls();
+    printf("inline: %u call sites of %u functions, %u quads copied\n",
+        inliner_stats.sites, inliner_stats.functions, inliner_stats.quads);
+    fold_constants();
+    printf("fold: %u folded, %u simplified, %u propagated, %u branches taken, %u branches removed\n",
+        fold_stats.folded, fold_stats.simplified, fold_stats.propagated,
+        fold_stats.branches_taken, fold_stats.branches_removed);
+    memset(&dce_stats, 0, sizeof(dce_stats));
+    thread_jumps();
+    remove_unreachable();
+    eliminate_dead_temps();
+    printf("dce: %u jumps threaded, %u unreachable, %u no-op, %u dead stores removed\n",
+        dce_stats.threaded, dce_stats.unreachable, dce_stats.nops, dce_stats.dead_stores);
+
+    memset(&middle_stats, 0, sizeof(middle_stats));
+    memset(&dce_stats, 0, sizeof(dce_stats));
+    ssa_optimize();
+    printf("ssa: %u phis, %u values, %u constants and %u copies propagated, %u redundant expressions\n",
+        middle_stats.phis, middle_stats.values, middle_stats.constants, middle_stats.copies, middle_stats.redundant);
+    hoist_invariants();
+    printf("licm: %u quads hoisted out of %u loops\n", middle_stats.hoisted, middle_stats.loops);
+    remove_unreachable();
+    eliminate_dead_temps();
+    printf("dce: %u no-op, %u dead stores removed\n", dce_stats.nops, dce_stats.dead_stores);
+    layout_blocks();
+    infer_types();
+    printf("types: %u of %u arithmetic and relational quads typed number-only\n",
+        infer_stats.typed, infer_stats.candidates);
+    if (profile_file) {
+        profile_number_only();
+        printf("pgo: %u cold and %u hot call sites, %u blocks moved, %u branches inverted, %u untyped quads saw only numbers\n",
+            profile_stats.cold_sites, profile_stats.hot_sites, profile_stats.moved, profile_stats.inverted,
+            profile_stats.speculative);
+    }
+    cfg_build();
+    cfg_print();
+    cfg_free();
+}
+
+int is_branch(Iopcode op) {
+    return op == if_eq || op == if_noteq || op == if_lesseq || op == if_greatereq
+        || op == if_less || op == if_greater;
+}
+
+unsigned char *find_leaders(void) {
+    unsigned char *leader = (unsigned char *) ir_alloc(currQuad + 1);
+    unsigned i;
+    if (currQuad) leader[0] = 1;
+    for (i = 0; i < currQuad; i++) {
+        switch (quads[i].op) {
+            case jump:
+            case if_eq:
+            case if_noteq:
+            case if_lesseq:
+            case if_greatereq:
+            case if_less:
+            case if_greater:
+                if (quads[i].label >= 1 && quads[i].label <= currQuad) leader[quads[i].label - 1] = 1;
+                leader[i + 1] = 1;
+                break;
+            case ret:
+                leader[i + 1] = 1;
+                break;
+            case funcstart:
+            case funcend:
+                leader[i] = 1;
+                leader[i + 1] = 1;
+                break;
+            default:
+                break;
+        }
+    }
+    return leader;
+}
+
+int is_const_expr(Expr *e) {
+    if (!e) return 0;
+    return e->type == constnum_e || e->type == constbool_e
+        || e->type == conststring_e || e->type == nil_e;
+}
+
+// same truth rules as avm_tobool
+int const_tobool(Expr *e) {
+    switch (e->type) {
+        case constnum_e:    return e->value.numConst != 0;
+        case conststring_e: return e->value.strConst[0] != 0;
+        case constbool_e:   return e->value.boolConst != 0;
+        case nil_e:         return 0;
+        default: assert(0);
+    }
+    return 0;
+}
+
+// the operand stands for the current value of its symbol
+int is_sym_value(Expr *e) {
+    if (!e || !e->sym) return 0;
+    return e->type == var_e || e->type == arithexpr_e || e->type == boolexpr_e
+        || e->type == assignexpr_e || e->type == newtable_e;
+}
+
+void facts_reset() {
+    totalFacts = 0;
+}
+
+fact *fact_get(SymbolTableRecord *sym) {
+    unsigned i;
+    for (i = 0; i < totalFacts; i++) if (facts[i].sym == sym) return facts + i;
+    return NULL;
+}
+
+void fact_set(SymbolTableRecord *sym, fact_t kind, Expr *value) {
+    fact *f = fact_get(sym);
+    if (!f) {
+        if (kind == unknown_f) return;
+        if (totalFacts == factsCapacity) {
+            factsCapacity = factsCapacity ? 2*factsCapacity : 64;
+            facts = (fact *) realloc(facts, sizeof(fact) * factsCapacity);
+        }
+        f = facts + totalFacts++;
+        f->sym = sym;
+    }
+    f->kind = kind;
+    f->value = value;
+}
+
+// a user function may assign any global while it runs
+void facts_killglobals() {
+    unsigned i, j = 0;
+    for (i = 0; i < totalFacts; i++) if (facts[i].sym->space != programvar) facts[j++] = facts[i];
+    totalFacts = j;
+}
+
+Expr *value_of(Expr *e) {
+    fact *f;
+    if (is_const_expr(e)) return e;
+    if (is_sym_value(e) && (f = fact_get(e->sym)) && f->kind == const_f) return f->value;
+    return NULL;
+}
+
+int is_number(Expr *e) {
+    fact *f;
+    if (!e) return 0;
+    if (e->type == constnum_e) return 1;
+    if (is_sym_value(e) && (f = fact_get(e->sym))) return f->kind == number_f || (f->kind == const_f && f->value->type == constnum_e);
+    return 0;
+}
+
+// replace an operand whose value is a known constant
+Expr *propagate(Expr *e) {
+    Expr *c;
+    if (!e || is_const_expr(e)) return e;
+    if ((c = value_of(e))) {
+        fold_stats.propagated++;
+        return c;
+    }
+    return e;
+}
+
+void define(Expr *e, fact_t kind, Expr *value) {
+    if (!is_sym_value(e)) return;
+    fact_set(e->sym, kind, value);
+}
+
+void define_from(Expr *e, Expr *from) {
+    Expr *c = value_of(from);
+    if (c) define(e, const_f, c);
+    else if (is_number(from)) define(e, number_f, NULL);
+    else define(e, unknown_f, NULL);
+}
+
+int is_numconst(Expr *e, double n) {
+    return e && e->type == constnum_e && e->value.numConst == n;
+}
+
+void to_assign(Quad *q, Expr *from) {
+    q->op = assign;
+    q->arg1 = from;
+    q->arg2 = NULL;
+}
+
+// x-0, x*1, 1*x, x/1 -> x, only when x is known to be a number; the numbers are doubles, so
+// x*0 is NaN for an infinite x and x+0 is 0 for -0, those two are left alone
+int simplify_arith(Quad *q) {
+    Expr *a = q->arg1, *b = q->arg2;
+    if (!is_number(a) || !is_number(b)) return 0;
+    switch (q->op) {
+        case sub:
+            if (is_numconst(b, 0)) { to_assign(q, a); return 1; }
+            break;
+        case mul:
+            if (is_numconst(b, 1)) { to_assign(q, a); return 1; }
+            if (is_numconst(a, 1)) { to_assign(q, b); return 1; }
+            break;
+        case divi:
+            if (is_numconst(b, 1)) { to_assign(q, a); return 1; }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+void fold_arith(Quad *q) {
+    Expr *c;
+    q->arg1 = propagate(q->arg1);
+    q->arg2 = propagate(q->arg2);
+    if (q->arg1->type == constnum_e && q->arg2->type == constnum_e) {
+        // leave division by zero to the VM
+        if ((q->op == divi && q->arg2->value.numConst == 0)
+         || (q->op == mod && (unsigned) q->arg2->value.numConst == 0)) {
+            define(q->result, number_f, NULL);
+            return;
+        }
+        c = valid_arithop(q->op, q->arg1, q->arg2);
+        assert(c);
+        to_assign(q, c);
+        fold_stats.folded++;
+        define(q->result, const_f, c);
+        return;
+    }
+    if (simplify_arith(q)) {
+        fold_stats.simplified++;
+        define_from(q->result, q->arg1);
+        return;
+    }
+    // arithmetic halts the VM on anything but numbers, so past this quad all of them are numbers
+    if (is_sym_value(q->arg1) && !value_of(q->arg1)) define(q->arg1, number_f, NULL);
+    if (is_sym_value(q->arg2) && !value_of(q->arg2)) define(q->arg2, number_f, NULL);
+    define(q->result, number_f, NULL);
+}
+
+void fold_uminus(Quad *q) {
+    Expr *c;
+    q->arg1 = propagate(q->arg1);
+    if (q->arg1->type == constnum_e) {
+        c = newexpr_constnum(-q->arg1->value.numConst);
+        to_assign(q, c);
+        fold_stats.folded++;
+        define(q->result, const_f, c);
+        return;
+    }
+    define(q->result, number_f, NULL);
+}
+
+void fold_logical(Quad *q) {
+    Expr *a, *b, *c = NULL;
+    q->arg1 = propagate(q->arg1);
+    if (q->arg2) q->arg2 = propagate(q->arg2);
+    a = q->arg1;
+    b = q->arg2;
+    switch (q->op) {
+        case not:
+            if (is_const_expr(a)) c = newexpr_constbool(!const_tobool(a));
+            break;
+        case and:
+            if ((is_const_expr(a) && !const_tobool(a)) || (is_const_expr(b) && !const_tobool(b))) c = newexpr_constbool(0);
+            else if (is_const_expr(a) && is_const_expr(b)) c = newexpr_constbool(1);
+            break;
+        case or:
+            if ((is_const_expr(a) && const_tobool(a)) || (is_const_expr(b) && const_tobool(b))) c = newexpr_constbool(1);
+            else if (is_const_expr(a) && is_const_expr(b)) c = newexpr_constbool(0);
+            break;
+        default:
+            assert(0);
+    }
+    if (c) {
+        to_assign(q, c);
+        fold_stats.folded++;
+        define(q->result, const_f, c);
+        return;
+    }
+    define(q->result, unknown_f, NULL);
+}
+
+// -1: not known at compile time, otherwise the outcome of the relop as the VM computes it
+int fold_relop(Iopcode op, Expr *a, Expr *b) {
+    int cmp;
+    if (!is_const_expr(a) || !is_const_expr(b)) return -1;
+    if (op == if_eq || op == if_noteq) {
+        int eq;
+        if (a->type == nil_e || b->type == nil_e) eq = a->type == b->type;
+        else if (a->type == constbool_e || b->type == constbool_e) eq = const_tobool(a) == const_tobool(b);
+        else if (a->type != b->type) return -1; // runtime error, keep it
+        else if (a->type == constnum_e) eq = a->value.numConst == b->value.numConst;
+        else eq = !strcmp(a->value.strConst, b->value.strConst);
+        return op == if_eq ? eq : !eq;
+    }
+    if (a->type == constnum_e && b->type == constnum_e) {
+        double x = a->value.numConst, y = b->value.numConst;
+        switch (op) {
+            case if_lesseq:     return x <= y;
+            case if_greatereq:  return x >= y;
+            case if_less:       return x < y;
+            case if_greater:    return x > y;
+            default: assert(0);
+        }
+    }
+    if (a->type == conststring_e && b->type == conststring_e) {
+        cmp = strcmp(a->value.strConst, b->value.strConst);
+        switch (op) {
+            case if_lesseq:     return cmp <= 0;
+            case if_greatereq:  return cmp >= 0;
+            case if_less:       return cmp < 0;
+            case if_greater:    return cmp > 0;
+            default: assert(0);
+        }
+    }
+    return -1;
+}
+
+void fold_branch(Quad *q) {
+    int taken;
+    q->arg1 = propagate(q->arg1);
+    q->arg2 = propagate(q->arg2);
+    taken = fold_relop(q->op, q->arg1, q->arg2);
+    if (taken < 0) return;
+    q->arg1 = q->arg2 = NULL;
+    if (taken) {
+        q->op = jump;
+        fold_stats.branches_taken++;
+    } else {
+        q->op = nop;
+        fold_stats.branches_removed++;
+    }
+}
+
+void fold_constants(void) {
+    unsigned char *leader = find_leaders();
+    unsigned i;
+    Quad *q;
+    memset(&fold_stats, 0, sizeof(fold_stats));
+    for (i = 0; i < currQuad; i++) {
+        q = quads + i;
+        if (leader[i]) facts_reset();
+        switch (q->op) {
+            case assign:
+                q->arg1 = propagate(q->arg1);
+                define_from(q->result, q->arg1);
+                break;
+            case add:
+            case sub:
+            case mul:
+            case divi:
+            case mod:
+                fold_arith(q);
+                break;
+            case uminus:
+                fold_uminus(q);
+                break;
+            case and:
+            case or:
+            case not:
+                fold_logical(q);
+                break;
+            case if_eq:
+            case if_noteq:
+            case if_lesseq:
+            case if_greatereq:
+            case if_less:
+            case if_greater:
+                fold_branch(q);
+                break;
+            case param:
+                q->result = propagate(q->result);
+                break;
+            case ret:
+                if (q->result) q->result = propagate(q->result);
+                break;
+            case call:
+                facts_killglobals();
+                break;
+            // whatever resumes the coroutine may write the globals
+            case yield:
+                if (q->result) q->result = propagate(q->result);
+                facts_killglobals();
+                break;
+            case getretval:
+                define(q->result, unknown_f, NULL);
+                break;
+            case tablecreate:
+                define(q->arg1, unknown_f, NULL);
+                break;
+            case tablegetelem:
+                q->arg2 = propagate(q->arg2);
+                define(q->result, unknown_f, NULL);
+                break;
+            case tablesetelem:
+                q->arg1 = propagate(q->arg1);
+                q->arg2 = propagate(q->arg2);
+                break;
+            default:
+                break;
+        }
+    }
+    facts_reset();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "Quad.h"
+
+// set by `out -O`, the passes below run between yyparse() and generateCode()
+extern unsigned optimize_flag;
+
+typedef struct opt_stats {
+	unsigned folded;
+	unsigned simplified;
+	unsigned propagated;
+	unsigned branches_taken;
+	unsigned branches_removed;
+} opt_stats;
+
+extern opt_stats fold_stats;
+
+void optimize_quads(void);
+
+// constant folding, algebraic identities and known branches
+void fold_constants(void);
+
+// quad index (0 based) that starts a basic block
+unsigned char *find_leaders(void);
+int is_branch(Iopcode op);
+int is_const_expr(Expr *e);
+int is_sym_value(Expr *e);
+int const_tobool(Expr *e);
@@ -0,0 +1,279 @@
+#include "Profile.h"
+#include "Optimize.h"
+#include "CFG.h"
+#include "Types.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+char *profile_file = NULL;
+pgo_stats profile_stats;
+
+profile_line *profileLines = NULL;
+unsigned char *profileSeen = NULL;
+unsigned totalProfileLines = 0;
+
+void profile_types(profile_line *p, char *hist) {
+    char *pair, *save, *eq;
+    for (pair = strtok_r(hist, ",", &save); pair; pair = strtok_r(NULL, ",", &save)) {
+        if (!(eq = strchr(pair, '='))) continue;
+        *eq = '\0';
+        if (!strcmp(pair, "number")) p->numbers += strtoul(eq + 1, NULL, 10);
+        p->operands += strtoul(eq + 1, NULL, 10);
+    }
+}
+
+int profile_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    char buf[4096], op[32], *tok, *save;
+    unsigned version, size, index, line;
+    unsigned long count;
+    profile_line *p;
+
+    if (!f) return 0;
+    if (!fgets(buf, sizeof(buf), f) || sscanf(buf, "alpha-profile %u %u", &version, &size) != 2 || version != 1) {
+        fclose(f);
+        return 0;
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        if (sscanf(buf, "%u %u %31s %lu", &index, &line, op, &count) != 4) continue;
+        if (line >= totalProfileLines) {
+            unsigned n = line + 1 > 2 * totalProfileLines ? line + 1 : 2 * totalProfileLines;
+            profileLines = (profile_line *) realloc(profileLines, sizeof(profile_line) * n);
+            profileSeen = (unsigned char *) realloc(profileSeen, n);
+            memset(profileLines + totalProfileLines, 0, sizeof(profile_line) * (n - totalProfileLines));
+            memset(profileSeen + totalProfileLines, 0, n - totalProfileLines);
+            totalProfileLines = n;
+        }
+        p = profileLines + line;
+        profileSeen[line] = 1;
+        if (count > p->count) p->count = count;
+        strtok_r(buf, " \n", &save);
+        for (index = 0; index < 3; index++) strtok_r(NULL, " \n", &save);
+        while ((tok = strtok_r(NULL, " \n", &save))) {
+            if (!strcmp(tok, "taken") && (tok = strtok_r(NULL, " \n", &save))) {
+                p->taken = strtoul(tok, NULL, 10);
+                strncpy(p->branch, op, 3);
+            }
+            else if ((!strcmp(tok, "arg1") || !strcmp(tok, "arg2")) && (tok = strtok_r(NULL, " \n", &save)))
+                profile_types(p, tok);
+            // call targets are informational, call quads name their function statically
+        }
+    }
+    fclose(f);
+    profile_file = strdup(path);
+    return 1;
+}
+
+profile_line *profile_at(unsigned line) {
+    if (!profile_file || line >= totalProfileLines || !profileSeen[line]) return NULL;
+    return profileLines + line;
+}
+
+/* ---------------- block layout ---------------- */
+
+const char *branch_name(Iopcode op) {
+    switch (op) {
+        case if_eq:         return "jeq";
+        case if_noteq:      return "jne";
+        case if_lesseq:     return "jle";
+        case if_greatereq:  return "jge";
+        case if_less:       return "jlt";
+        case if_greater:    return "jgt";
+        default:            return "";
+    }
+}
+
+// only equality flips exactly, a NaN fails both x < y and x >= y
+int is_invertible(Iopcode op) {
+    return op == if_eq || op == if_noteq;
+}
+
+// first block control falls into after b, totalBlocks when b ends in a jump or leaves the function
+unsigned fall_block(unsigned b) {
+    Iopcode op = quads[blocks[b].end - 1].op;
+    if (op == jump || op == ret || op == funcend || blocks[b].end >= currQuad) return totalBlocks;
+    return quad_block[blocks[b].end];
+}
+
+unsigned target_block(unsigned b) {
+    Quad *last = quads + blocks[b].end - 1;
+    if ((last->op != jump && !is_branch(last->op)) || !last->label || last->label > currQuad) return totalBlocks;
+    return quad_block[last->label - 1];
+}
+
+// how often control went from b to s in the profiled run
+unsigned long edge_weight(unsigned b, unsigned s) {
+    Quad *last = quads + blocks[b].end - 1;
+    profile_line *p = profile_at(last->line);
+    unsigned long taken;
+    if (!p) return 0;
+    if (!is_branch(last->op)) return p->count;
+    taken = p->taken > p->count ? p->count : p->taken;
+    // the profiled build may have had this branch the other way round
+    if (p->branch[0] && strcmp(p->branch, branch_name(last->op)) && is_invertible(last->op)) taken = p->count - taken;
+    return s == target_block(b) ? taken : p->count - taken;
+}
+
+int is_movable(unsigned b) {
+    unsigned i;
+    if (!b) return 0;
+    for (i = blocks[b].start; i < blocks[b].end; i++)
+        if (quads[i].op == funcstart || quads[i].op == funcend) return 0;
+    return 1;
+}
+
+typedef struct layout_edge {
+    unsigned from;
+    unsigned to;
+    unsigned long weight;
+    unsigned fall;			// to is where from falls through in source order
+} layout_edge;
+
+int layout_edge_cmp(const void *a, const void *b) {
+    const layout_edge *x = (const layout_edge *) a, *y = (const layout_edge *) b;
+    if (x->weight != y->weight) return x->weight > y->weight ? -1 : 1;
+    if (x->fall != y->fall) return x->fall ? -1 : 1;
+    return x->from < y->from ? -1 : x->from > y->from;
+}
+
+// Pettis-Hansen chaining of the blocks [first, last): edges are taken hottest first and
+// join the chain ending at their source to the chain starting at their target. Only
+// edges that can become fall-throughs count, which are the source order ones, jumps
+// and the targets of branches that can be flipped; first stays at the front.
+void layout_region(unsigned first, unsigned last, unsigned *chainNext, unsigned char *hasPred, unsigned *order, unsigned *n) {
+    layout_edge *edges = (layout_edge *) malloc(sizeof(layout_edge) * 2 * (last - first));
+    unsigned totalEdges = 0, b, k, s, fall, e;
+    Iopcode op;
+
+    for (b = first; b < last; b++) {
+        fall = fall_block(b);
+        op = quads[blocks[b].end - 1].op;
+        for (k = 0; k < blocks[b].nsucc; k++) {
+            s = blocks[b].succ[k];
+            if (s < first || s >= last || s == first) continue;
+            if (s != fall && op != jump && !(is_invertible(op) && s == target_block(b))) continue;
+            edges[totalEdges].from = b;
+            edges[totalEdges].to = s;
+            edges[totalEdges].weight = edge_weight(b, s);
+            edges[totalEdges].fall = s == fall;
+            if (edges[totalEdges].fall || edges[totalEdges].weight) totalEdges++;
+        }
+    }
+    qsort(edges, totalEdges, sizeof(layout_edge), layout_edge_cmp);
+    for (e = 0; e < totalEdges; e++) {
+        b = edges[e].from;
+        s = edges[e].to;
+        if (chainNext[b] != totalBlocks || hasPred[s]) continue;
+        for (k = s; chainNext[k] != totalBlocks && k != b; k = chainNext[k]);
+        if (k == b) continue;
+        chainNext[b] = s;
+        hasPred[s] = 1;
+    }
+    for (b = first; b < last; b++) {
+        if (hasPred[b]) continue;
+        for (k = b; k != totalBlocks; k = chainNext[k]) order[(*n)++] = k;
+    }
+    free(edges);
+}
+
+Quad *layoutQuads = NULL;
+unsigned totalLayout = 0;
+
+Quad *layout_jump(unsigned line, unsigned label) {
+    Quad *q = layoutQuads + totalLayout++;
+    memset(q, 0, sizeof(Quad));
+    q->op = jump;
+    q->label = label;
+    q->line = line;
+    return q;
+}
+
+// copies b, then fixes its exit for the block that now follows it (totalBlocks if none)
+void emit_block(unsigned b, unsigned next, unsigned *remap) {
+    unsigned i, fall;
+    Quad *last;
+    remap[blocks[b].start] = totalLayout;
+    for (i = blocks[b].start; i < blocks[b].end; i++) layoutQuads[totalLayout++] = quads[i];
+    last = layoutQuads + totalLayout - 1;
+    if (last->op == jump || last->op == ret || last->op == funcend || last->op == funcstart) return;
+    fall = blocks[b].end < currQuad ? quad_block[blocks[b].end] : totalBlocks;
+    if (next == fall) return;
+    if (is_branch(last->op) && next == target_block(b) && is_invertible(last->op)) {
+        last->op = last->op == if_eq ? if_noteq : if_eq;
+        last->label = blocks[b].end + 1;
+        profile_stats.inverted++;
+        return;
+    }
+    layout_jump(last->line, blocks[b].end + 1);
+}
+
+unsigned layout_blocks(void) {
+    unsigned char *hasPred;
+    unsigned *order, *chainNext, *remap, b, last, n = 0, k, i;
+
+    if (!profile_file || !currQuad) return 0;
+    cfg_build();
+    hasPred = (unsigned char *) calloc(totalBlocks, 1);
+    chainNext = (unsigned *) malloc(sizeof(unsigned) * totalBlocks);
+    order = (unsigned *) malloc(sizeof(unsigned) * totalBlocks);
+    for (b = 0; b < totalBlocks; b++) chainNext[b] = totalBlocks;
+
+    // runs of blocks between function boundaries are reordered, the first keeps its place
+    for (b = 0; b < totalBlocks;) {
+        if (!is_movable(b)) {
+            order[n++] = b++;
+            continue;
+        }
+        for (last = b; last < totalBlocks && is_movable(last); last++);
+        layout_region(b, last, chainNext, hasPred, order, &n);
+        b = last;
+    }
+    assert(n == totalBlocks);
+
+    layoutQuads = (Quad *) malloc(sizeof(Quad) * (currQuad + totalBlocks + 1));
+    remap = (unsigned *) malloc(sizeof(unsigned) * (currQuad + 1));
+    totalLayout = 0;
+    for (k = 0; k < totalBlocks; k++) {
+        if (order[k] != k) profile_stats.moved++;
+        emit_block(order[k], k + 1 < totalBlocks ? order[k + 1] : totalBlocks, remap);
+    }
+    remap[currQuad] = totalLayout;
+    for (i = 0; i < totalLayout; i++) {
+        Quad *q = layoutQuads + i;
+        if ((q->op == jump || is_branch(q->op)) && q->label) {
+            assert(q->label <= currQuad + 1);
+            q->label = remap[q->label - 1] + 1;
+        }
+        if (q->op == funcstart) q->arg1->sym->iaddress = i + 1;
+    }
+
+    free(quads);
+    quads = (Quad *) realloc(layoutQuads, sizeof(Quad) * (totalLayout + 1));
+    total = totalLayout + 1;
+    memset(quads + totalLayout, 0, sizeof(Quad));
+    quads[totalLayout].op = -1;
+    currQuad = totalLayout;
+    layoutQuads = NULL;
+
+    free(hasPred);
+    free(chainNext);
+    free(order);
+    free(remap);
+    cfg_free();
+    thread_jumps();
+    remove_unreachable();
+    return profile_stats.moved;
+}
+
+unsigned profile_number_only(void) {
+    unsigned i;
+    profile_line *p;
+    for (i = 0; i < currQuad; i++) {
+        if (quads[i].typed || !is_typed_candidate(quads[i].op)) continue;
+        p = profile_at(quads[i].line);
+        if (p && p->operands && p->numbers == p->operands) profile_stats.speculative++;
+    }
+    return profile_stats.speculative;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "Quad.h"
+
+/*
+ * Profile-guided optimization with `out -O --profile <file>`. The file is the
+ * one `avm_exec --profile <file>` writes; its instructions are keyed by the
+ * quad they were generated from (quad->line), so a profile of any earlier
+ * build of the same source applies, with or without -O. Call sites that never
+ * ran are not inlined and hot ones may take longer bodies, and basic blocks
+ * are laid out so the hot successor of each block follows it.
+ */
+
+#define PROFILE_HOT_CALLS 100	// a call site run this often may inline up to INLINE_HOT_QUADS
+
+typedef struct profile_line {
+	unsigned long count;		// executions of the busiest instruction of the quad
+	unsigned long taken;		// of its conditional jump
+	char branch[4];			// opcode of that jump ("jeq", "jlt", ...), empty if none
+	unsigned long numbers;		// operand reads that found a number
+	unsigned long operands;		// all operand reads
+} profile_line;
+
+typedef struct pgo_stats {
+	unsigned cold_sites;		// inlinable sites left alone because they never ran
+	unsigned hot_sites;		// inlined only because they are hot
+	unsigned moved;			// blocks placed away from their source position
+	unsigned inverted;		// branches flipped so the hot successor falls through
+	unsigned speculative;		// untyped quads that only ever saw numbers
+} pgo_stats;
+
+extern char *profile_file;
+extern pgo_stats profile_stats;
+
+// 0 when the file cannot be read or is not a profile
+int profile_load(const char *path);
+// NULL without a profile or when no instruction came from the quad
+profile_line *profile_at(unsigned line);
+
+// reorders the blocks of every function body by edge counts, returns how many moved
+unsigned layout_blocks(void);
+// counts quads the type inference left untyped although the profile only saw numbers
+unsigned profile_number_only(void);
@@ -46,7 +46,9 @@ const char *iopcodeNames[] = {
 	"TABLECREATE",
 	"TABLEGETELEM",
 	"TABLESETELEM",
-    "JUMP"
+	"NOP",
+    "JUMP",
+	"YIELD"
 };
 
 const char *expr_tNames[] = {
@@ -68,13 +70,28 @@ const char *expr_tNames[] = {
 	"nil"
 };
 
+// temps of the current function (or of the program), reused between statements
+typedef struct temp_frame {
+    SymbolTableRecord **temps;
+    unsigned size;
+    unsigned capacity;
+    unsigned temp_no;
+} temp_frame;
+
+temp_frame curr_temps = { NULL, 0, 0, 0 };
+Stack *temp_frames = NULL;
+
 SymbolTableRecord *new_temp() {
+    if (temp_no < curr_temps.size) {
+        // slot is dead since the last reset_temp(), hand it out again
+        return curr_temps.temps[temp_no++];
+    }
     int no = temp_no, digits = 0;
     do {
         no = no/10;
         digits++;
     } while(no!=0);
-    char *name = malloc(sizeof(char)*(digits+4));
+    char *name = ir_alloc(sizeof(char)*(digits+5));
     strcpy(name, "_tmp");
     sprintf(name+4, "%u", temp_no);
     // itoa(temp_no, name+4, 10);
@@ -84,20 +101,69 @@ SymbolTableRecord *new_temp() {
     // printf("XAXAXAXAcurrscopeoffset %d %u",currscopeoffset(),currscopespace());
     new_sym->offset = currscopeoffset();
     new_sym->space = currscopespace();
+    new_sym->stype = var_s;
     printf("\033[0;34mtemp = currscopespace %u %u\n\033[0m",currscopespace(),currscopeoffset());
     
     inccurrscopeoffset();
+    if (curr_temps.size == curr_temps.capacity) {
+        curr_temps.capacity = curr_temps.capacity ? 2*curr_temps.capacity : 16;
+        curr_temps.temps = (SymbolTableRecord **) realloc(curr_temps.temps, sizeof(SymbolTableRecord *) * curr_temps.capacity);
+    }
+    curr_temps.temps[curr_temps.size++] = new_sym;
     // _stop_
     // new_sym->name = name;
     return new_sym;
 }
 
+// called at the end of every statement: no temp outlives the statement that made it
 void reset_temp() {
     temp_no = 0;
 }
 
+// a function body gets its own temp slots, the enclosing expression keeps its live ones
+void enter_temp_frame() {
+    if (temp_frames == NULL) temp_frames = Stack_init();
+    temp_frame *saved = (temp_frame *) malloc(sizeof(temp_frame));
+    *saved = curr_temps;
+    saved->temp_no = temp_no;
+    Stack_append(temp_frames, saved);
+    curr_temps.temps = NULL;
+    curr_temps.size = curr_temps.capacity = 0;
+    temp_no = 0;
+}
+
+void exit_temp_frame() {
+    temp_frame *saved = (temp_frame *) Stack_pop(temp_frames);
+    assert(saved);
+    free(curr_temps.temps);
+    curr_temps = *saved;
+    temp_no = saved->temp_no;
+    free(saved);
+}
+
+// back to the state before the first statement, for compiling another source in the same process
+void reset_quads() {
+    temp_frame *saved;
+    free(quads);
+    quads = NULL;
+    total = 0;
+    currQuad = 0;
+    while (temp_frames && (saved = (temp_frame *) Stack_pop(temp_frames))) {
+        free(saved->temps);
+        free(saved);
+    }
+    free(curr_temps.temps);
+    curr_temps.temps = NULL;
+    curr_temps.size = curr_temps.capacity = 0;
+    temp_no = 0;
+    programVarOffset = 0;
+    functionLocalOffset = 0;
+    formalArgOffset = 0;
+    scopeSpaceCounter = 1;
+}
+
 Expr *new_expr(Expr_t type) {
-    Expr *expression = (Expr *) malloc(sizeof(Expr));
+    Expr *expression = (Expr *) ir_alloc(sizeof(Expr));
     expression->type = type;
     expression->truelist= NULL;
     expression->falselist = NULL;
@@ -106,8 +172,7 @@ Expr *new_expr(Expr_t type) {
 
 Expr* lvalue_expr (SymbolTableRecord* sym){
     assert(sym);
-    Expr * e = (Expr*)malloc(sizeof(Expr));
-    memset(e,0,sizeof(Expr));
+    Expr * e = (Expr*)ir_alloc(sizeof(Expr));
     printf("%s\n",sym->name);
     e->next = (Expr*)0;
     e->sym = sym;
@@ -145,22 +210,22 @@ Expr* make_call(Expr* lvalue, Queue* elist){ //elist = arg list
 }
 
 Expr *newexpr_conststring(const char* name){
-    Expr *expression = (Expr *) malloc(sizeof(Expr));
+    Expr *expression = (Expr *) ir_alloc(sizeof(Expr));
     expression->type = conststring_e;
-    expression->value.strConst = strdup(name);
+    expression->value.strConst = ir_strdup(name);
     // expression->index = //;
     return expression;
 }
 
 Expr *newexpr_constbool(const unsigned n){
-    Expr *expression = (Expr *) malloc(sizeof(Expr));
+    Expr *expression = (Expr *) ir_alloc(sizeof(Expr));
     expression->type = constbool_e;
     expression->value.boolConst =(char)n;
     return expression;
 }
 
 Expr *newexpr_constnum(const double n){
-    Expr *expression = (Expr *) malloc(sizeof(Expr));
+    Expr *expression = (Expr *) ir_alloc(sizeof(Expr));
     expression->type = constnum_e;
     expression->value.numConst =n;
     return expression;
@@ -199,6 +264,7 @@ void emit(Iopcode iopcode, Expr *arg1, Expr *arg2, Expr *result, unsigned label)
     p->result = result;
     p->label = label;
     p->line = currQuad-1;
+    p->typed = 0;
 }
 
 unsigned nextQuad(){
@@ -421,6 +487,9 @@ void printQuads() {
                 printf(" %15u", q.label);
                 break;
 
+            case nop:
+                break;
+
             case call:
                 printf(" ");
                 switch (result->type) {
@@ -461,6 +530,7 @@ void printQuads() {
                 break;
 
             case ret:
+            case yield:
                 if (result) {
                     switch (result->type){
                         case newtable_e:
@@ -656,7 +726,7 @@ Expr * valid_arithop(Iopcode iop, Expr *e1, Expr *e2)    {
                 valid_expr->value.numConst = e1->value.numConst / e2->value.numConst;
                 break;
             case mod:
-                valid_expr->value.numConst = (long) e1->value.numConst % (long) e2->value.numConst;
+                valid_expr->value.numConst = (unsigned) e1->value.numConst % (unsigned) e2->value.numConst;
                 break;
             case mul:
                 valid_expr->value.numConst = e1->value.numConst * e2->value.numConst;
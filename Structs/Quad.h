@@ -48,7 +48,9 @@ typedef enum iopcode_t {
 	tablecreate,
 	tablegetelem,
 	tablesetelem,
-	jmp
+	nop,
+	jmp,
+	yield
 } Iopcode;
 
 typedef enum expr_t {
@@ -102,6 +104,7 @@ struct quad {
 	unsigned label;
 	unsigned line;
 	unsigned taddress;
+	unsigned char typed;	// operands proven numbers, emitted as a _nn opcode
 };
 
 extern const char *iopcodeNames[];
@@ -120,6 +123,9 @@ extern unsigned scopeSpaceCounter;
 SymbolTableRecord *new_temp();
 
 void reset_temp();
+void enter_temp_frame();
+void exit_temp_frame();
+void reset_quads();
 
 Expr *new_expr(Expr_t type);
 Expr* lvalue_expr (SymbolTableRecord* sym);
@@ -0,0 +1,980 @@
+#include "SSA.h"
+#include "Optimize.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#define ROOT totalBlocks
+#define UNDEF ((unsigned) -1)
+#define SSA_BUCKETS 1024
+
+ssa_stats middle_stats;
+
+unsigned *idom = NULL;
+
+// predecessors of b are predList[predStart[b] .. predStart[b+1])
+unsigned *predStart = NULL;
+unsigned *predList = NULL;
+unsigned *rpoNum = NULL;
+unsigned *rpoOrder = NULL;
+unsigned totalRPO = 0;
+
+// dominator tree, children of b are domChildList[domChildStart[b] .. domChildStart[b+1])
+unsigned *domChildStart = NULL;
+unsigned *domChildList = NULL;
+unsigned *domPre = NULL;
+unsigned *domPost = NULL;
+
+unsigned **dfList = NULL;
+unsigned *dfCount = NULL;
+unsigned *dfCapacity = NULL;
+
+/* ---------------- variables and values ---------------- */
+
+SymbolTableRecord **ssaVars = NULL;
+unsigned totalSSAVars = 0;
+unsigned ssaVarsCapacity = 0;
+unsigned *varSlots = NULL;		// open addressing, index+1 of the var
+unsigned varSlotsCapacity = 0;
+
+unsigned **phiVars = NULL;
+unsigned *phiCount = NULL;
+unsigned *phiCapacity = NULL;
+
+typedef struct ssa_value {
+    unsigned var;
+    int quad;				// defining quad, -1 for phis and entry values
+    unsigned block;			// UNDEF for entry values
+    unsigned vn;
+    unsigned copyVar;			// var+1 when the value is a copy of another variable
+    unsigned copyVal;
+    Expr *copyExpr;
+    Expr *konst;
+    unsigned char number;
+    unsigned proofs;			// head of the blocks where arithmetic proved it a number
+} ssa_value;
+
+ssa_value *values = NULL;
+unsigned totalValues = 0;
+unsigned valuesCapacity = 0;
+unsigned *entryVal = NULL;
+
+typedef struct number_proof {
+    unsigned block;
+    unsigned next;
+} number_proof;
+
+number_proof *proofs = NULL;
+unsigned totalProofs = 0;
+unsigned proofsCapacity = 0;
+
+unsigned **stacks = NULL;
+unsigned *stackSize = NULL;
+unsigned *stackCapacity = NULL;
+unsigned *undoLog = NULL;
+unsigned undoSize = 0;
+unsigned undoCapacity = 0;
+
+unsigned *useVal = NULL;		// SSA value read by slot k of quad i at useVal[3*i+k]
+unsigned *defVal = NULL;
+
+unsigned nextVN = 1;
+unsigned nextEpoch = 1;
+int ssa_rewrite = 0;
+
+/* ---------------- value number tables ---------------- */
+
+typedef struct const_entry {
+    Expr_t type;
+    double num;
+    const char *str;
+    unsigned vn;
+    unsigned cls;			// alias class when used as a table key
+    struct const_entry *next;
+} const_entry;
+
+const_entry *constBuckets[SSA_BUCKETS];
+
+typedef struct glob_entry {
+    SymbolTableRecord *sym;
+    unsigned epoch;
+    unsigned vn;
+    struct glob_entry *next;
+} glob_entry;
+
+glob_entry *globBuckets[SSA_BUCKETS];
+
+typedef struct gvn_entry {
+    Iopcode op;
+    unsigned a, b, m;
+    unsigned holderVar;
+    unsigned holderVal;
+    Expr *holder;
+    unsigned vn;
+    int next;
+} gvn_entry;
+
+gvn_entry *gvnEntries = NULL;
+unsigned totalGVN = 0;
+unsigned gvnCapacity = 0;
+int gvnBuckets[SSA_BUCKETS];
+// entries below it belong to the code around the function being renamed, a holder of another frame
+unsigned gvnFloor = 0;
+
+unsigned totalClasses = 0;
+
+void *grow(void *p, unsigned *capacity, unsigned needed, size_t size) {
+    if (needed <= *capacity) return p;
+    while (*capacity < needed) *capacity = *capacity ? 2 * *capacity : 16;
+    return realloc(p, *capacity * size);
+}
+
+int is_ssa_var(SymbolTableRecord *sym) {
+    if (!sym || sym->stype != var_s) return 0;
+    return sym->space == functionlocal || sym->space == formalarg || is_temp(sym);
+}
+
+unsigned hash_ptr(const void *p) {
+    unsigned long x = (unsigned long) p;
+    x ^= x >> 17;
+    x *= 0x9E3779B1u;
+    return (unsigned) (x ^ (x >> 15));
+}
+
+// index of the variable, UNDEF if it is not in SSA form
+unsigned ssa_var(SymbolTableRecord *sym) {
+    unsigned h, i;
+    if (!is_ssa_var(sym)) return UNDEF;
+    if (2 * (totalSSAVars + 1) > varSlotsCapacity) {
+        unsigned old = varSlotsCapacity, *oldSlots = varSlots;
+        varSlotsCapacity = old ? 2 * old : 256;
+        varSlots = (unsigned *) calloc(varSlotsCapacity, sizeof(unsigned));
+        for (i = 0; i < totalSSAVars; i++) {
+            h = hash_ptr(ssaVars[i]) & (varSlotsCapacity - 1);
+            while (varSlots[h]) h = (h + 1) & (varSlotsCapacity - 1);
+            varSlots[h] = i + 1;
+        }
+        free(oldSlots);
+    }
+    h = hash_ptr(sym) & (varSlotsCapacity - 1);
+    while (varSlots[h]) {
+        if (ssaVars[varSlots[h] - 1] == sym) return varSlots[h] - 1;
+        h = (h + 1) & (varSlotsCapacity - 1);
+    }
+    ssaVars = (SymbolTableRecord **) grow(ssaVars, &ssaVarsCapacity, totalSSAVars + 1, sizeof(SymbolTableRecord *));
+    ssaVars[totalSSAVars] = sym;
+    varSlots[h] = ++totalSSAVars;
+    return totalSSAVars - 1;
+}
+
+unsigned new_value(unsigned var, int quad, unsigned block, unsigned vn) {
+    ssa_value *v;
+    values = (ssa_value *) grow(values, &valuesCapacity, totalValues + 1, sizeof(ssa_value));
+    v = values + totalValues;
+    memset(v, 0, sizeof(ssa_value));
+    v->var = var;
+    v->quad = quad;
+    v->block = block;
+    v->vn = vn ? vn : nextVN++;
+    return totalValues++;
+}
+
+// value of the variable at the current point of the walk
+unsigned ssa_top(unsigned var) {
+    if (stackSize[var]) return stacks[var][stackSize[var] - 1];
+    if (!entryVal[var]) entryVal[var] = new_value(var, -1, UNDEF, 0);
+    return entryVal[var];
+}
+
+void ssa_push(unsigned var, unsigned value) {
+    stacks[var] = (unsigned *) grow(stacks[var], stackCapacity + var, stackSize[var] + 1, sizeof(unsigned));
+    stacks[var][stackSize[var]++] = value;
+    undoLog = (unsigned *) grow(undoLog, &undoCapacity, undoSize + 1, sizeof(unsigned));
+    undoLog[undoSize++] = var;
+}
+
+void add_proof(unsigned value, unsigned block) {
+    proofs = (number_proof *) grow(proofs, &proofsCapacity, totalProofs + 1, sizeof(number_proof));
+    proofs[totalProofs].block = block;
+    proofs[totalProofs].next = values[value].proofs;
+    values[value].proofs = ++totalProofs;
+}
+
+const_entry *const_lookup(Expr *e) {
+    unsigned h;
+    const_entry *c;
+    switch (e->type) {
+        case constnum_e:    { unsigned long bits; memcpy(&bits, &e->value.numConst, sizeof(bits)); h = (unsigned) (bits ^ (bits >> 29)); } break;
+        case conststring_e: h = 5381; { const char *s; for (s = e->value.strConst; *s; s++) h = h * 33 + *s; } break;
+        case constbool_e:   h = e->value.boolConst; break;
+        default:            h = 7; break;
+    }
+    h = (h + e->type) & (SSA_BUCKETS - 1);
+    for (c = constBuckets[h]; c; c = c->next) {
+        if (c->type != e->type) continue;
+        if (e->type == constnum_e && c->num != e->value.numConst) continue;
+        if (e->type == conststring_e && strcmp(c->str, e->value.strConst)) continue;
+        if (e->type == constbool_e && c->num != e->value.boolConst) continue;
+        return c;
+    }
+    c = (const_entry *) ir_alloc(sizeof(const_entry));
+    c->type = e->type;
+    c->num = e->type == constbool_e ? e->value.boolConst : e->type == constnum_e ? e->value.numConst : 0;
+    c->str = e->type == conststring_e ? e->value.strConst : NULL;
+    c->vn = nextVN++;
+    c->cls = UNDEF;
+    c->next = constBuckets[h];
+    constBuckets[h] = c;
+    return c;
+}
+
+unsigned glob_vn(SymbolTableRecord *sym, unsigned epoch) {
+    unsigned h = (hash_ptr(sym) + epoch * 31) & (SSA_BUCKETS - 1);
+    glob_entry *g;
+    for (g = globBuckets[h]; g; g = g->next) if (g->sym == sym && g->epoch == epoch) return g->vn;
+    g = (glob_entry *) ir_alloc(sizeof(glob_entry));
+    g->sym = sym;
+    g->epoch = epoch;
+    g->vn = nextVN++;
+    g->next = globBuckets[h];
+    globBuckets[h] = g;
+    return g->vn;
+}
+
+unsigned gvn_hash(Iopcode op, unsigned a, unsigned b, unsigned m) {
+    return (op * 31 + a * 131 + b * 8191 + m * 524287) & (SSA_BUCKETS - 1);
+}
+
+gvn_entry *gvn_lookup(Iopcode op, unsigned a, unsigned b, unsigned m) {
+    int i;
+    // a bucket lists its entries newest first, the ones under the floor are out of scope
+    for (i = gvnBuckets[gvn_hash(op, a, b, m)]; i >= (int) gvnFloor; i = gvnEntries[i].next) {
+        gvn_entry *g = gvnEntries + i;
+        if (g->op == op && g->a == a && g->b == b && g->m == m) return g;
+    }
+    return NULL;
+}
+
+void gvn_insert(Iopcode op, unsigned a, unsigned b, unsigned m, unsigned var, unsigned val, Expr *holder, unsigned vn) {
+    unsigned h = gvn_hash(op, a, b, m);
+    gvn_entry *g;
+    gvnEntries = (gvn_entry *) grow(gvnEntries, &gvnCapacity, totalGVN + 1, sizeof(gvn_entry));
+    g = gvnEntries + totalGVN;
+    g->op = op;
+    g->a = a;
+    g->b = b;
+    g->m = m;
+    g->holderVar = var;
+    g->holderVal = val;
+    g->holder = holder;
+    g->vn = vn;
+    g->next = gvnBuckets[h];
+    gvnBuckets[h] = totalGVN++;
+}
+
+// entries are removed in reverse order, each one is still the head of its bucket
+void gvn_pop(unsigned mark) {
+    while (totalGVN > mark) {
+        gvn_entry *g = gvnEntries + --totalGVN;
+        gvnBuckets[gvn_hash(g->op, g->a, g->b, g->m)] = g->next;
+    }
+}
+
+/* ---------------- blocks and dominators ---------------- */
+
+int is_root(unsigned b) {
+    Iopcode op = quads[blocks[b].start].op;
+    return b == 0 || op == funcstart || op == funcend;
+}
+
+void build_preds(void) {
+    unsigned b, s, *fill;
+    predStart = (unsigned *) calloc(totalBlocks + 2, sizeof(unsigned));
+    for (b = 0; b < totalBlocks; b++)
+        for (s = 0; s < blocks[b].nsucc; s++) predStart[blocks[b].succ[s] + 1]++;
+    for (b = 0; b < totalBlocks; b++) predStart[b + 1] += predStart[b];
+    predList = (unsigned *) malloc(sizeof(unsigned) * (predStart[totalBlocks] + 1));
+    fill = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    memcpy(fill, predStart, sizeof(unsigned) * (totalBlocks + 1));
+    for (b = 0; b < totalBlocks; b++)
+        for (s = 0; s < blocks[b].nsucc; s++) predList[fill[blocks[b].succ[s]]++] = b;
+    free(fill);
+}
+
+// reverse postorder from the virtual root, whose successors are the roots
+void build_rpo(void) {
+    unsigned *stack = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    unsigned *next = (unsigned *) calloc(totalBlocks + 1, sizeof(unsigned));
+    unsigned *post = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    unsigned char *seen = (unsigned char *) calloc(totalBlocks + 1, 1);
+    unsigned top = 0, totalPost = 0, b, s, i;
+
+    stack[top++] = ROOT;
+    seen[ROOT] = 1;
+    while (top) {
+        b = stack[top - 1];
+        s = UNDEF;
+        if (b == ROOT) {
+            while (next[b] < totalBlocks && s == UNDEF) {
+                i = next[b]++;
+                if (blocks[i].reachable && is_root(i) && !seen[i]) s = i;
+            }
+        }
+        else {
+            while (next[b] < blocks[b].nsucc && s == UNDEF) {
+                i = blocks[b].succ[next[b]++];
+                if (!seen[i]) s = i;
+            }
+        }
+        if (s == UNDEF) {
+            post[totalPost++] = b;
+            top--;
+            continue;
+        }
+        seen[s] = 1;
+        stack[top++] = s;
+    }
+    rpoNum = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    rpoOrder = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    for (b = 0; b <= totalBlocks; b++) rpoNum[b] = UNDEF;
+    totalRPO = totalPost;
+    for (i = 0; i < totalPost; i++) {
+        rpoOrder[i] = post[totalPost - 1 - i];
+        rpoNum[rpoOrder[i]] = i;
+    }
+    free(stack);
+    free(next);
+    free(post);
+    free(seen);
+}
+
+unsigned intersect(unsigned a, unsigned b) {
+    while (a != b) {
+        while (rpoNum[a] > rpoNum[b]) a = idom[a];
+        while (rpoNum[b] > rpoNum[a]) b = idom[b];
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy, iterating over reverse postorder
+void build_dominators(void) {
+    unsigned i, p, b, d, changed;
+    idom = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    for (b = 0; b <= totalBlocks; b++) idom[b] = UNDEF;
+    idom[ROOT] = ROOT;
+    do {
+        changed = 0;
+        for (i = 1; i < totalRPO; i++) {
+            b = rpoOrder[i];
+            d = is_root(b) ? ROOT : UNDEF;
+            for (p = predStart[b]; p < predStart[b + 1]; p++) {
+                if (idom[predList[p]] == UNDEF) continue;
+                d = d == UNDEF ? predList[p] : intersect(predList[p], d);
+            }
+            if (d != idom[b]) {
+                idom[b] = d;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    domChildStart = (unsigned *) calloc(totalBlocks + 3, sizeof(unsigned));
+    domChildList = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    for (i = 1; i < totalRPO; i++) domChildStart[idom[rpoOrder[i]] + 1]++;
+    for (b = 0; b <= totalBlocks; b++) domChildStart[b + 1] += domChildStart[b];
+    {
+        unsigned *fill = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+        memcpy(fill, domChildStart, sizeof(unsigned) * (totalBlocks + 1));
+        for (i = 1; i < totalRPO; i++) domChildList[fill[idom[rpoOrder[i]]]++] = rpoOrder[i];
+        free(fill);
+    }
+
+    // pre/post numbers make dominates() constant time
+    domPre = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    domPost = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    {
+        unsigned *stack = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+        unsigned *next = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+        unsigned top = 0, clock = 0;
+        for (b = 0; b <= totalBlocks; b++) domPre[b] = domPost[b] = UNDEF;
+        stack[top++] = ROOT;
+        next[ROOT] = domChildStart[ROOT];
+        domPre[ROOT] = clock++;
+        while (top) {
+            b = stack[top - 1];
+            if (next[b] < domChildStart[b + 1]) {
+                d = domChildList[next[b]++];
+                domPre[d] = clock++;
+                next[d] = domChildStart[d];
+                stack[top++] = d;
+            }
+            else {
+                domPost[b] = clock++;
+                top--;
+            }
+        }
+        free(stack);
+        free(next);
+    }
+}
+
+int dominates(unsigned a, unsigned b) {
+    if (domPre[a] == UNDEF || domPre[b] == UNDEF) return 0;
+    return domPre[a] <= domPre[b] && domPost[b] <= domPost[a];
+}
+
+void df_add(unsigned runner, unsigned b) {
+    if (dfCount[runner] && dfList[runner][dfCount[runner] - 1] == b) return;
+    dfList[runner] = (unsigned *) grow(dfList[runner], dfCapacity + runner, dfCount[runner] + 1, sizeof(unsigned));
+    dfList[runner][dfCount[runner]++] = b;
+}
+
+void build_frontiers(void) {
+    unsigned b, p, runner, npreds;
+    dfList = (unsigned **) calloc(totalBlocks + 1, sizeof(unsigned *));
+    dfCount = (unsigned *) calloc(totalBlocks + 1, sizeof(unsigned));
+    dfCapacity = (unsigned *) calloc(totalBlocks + 1, sizeof(unsigned));
+    for (b = 0; b < totalBlocks; b++) {
+        if (idom[b] == UNDEF) continue;
+        npreds = predStart[b + 1] - predStart[b] + is_root(b);
+        if (npreds < 2) continue;
+        for (p = predStart[b]; p < predStart[b + 1]; p++) {
+            if (idom[predList[p]] == UNDEF) continue;
+            for (runner = predList[p]; runner != idom[b] && runner != ROOT; runner = idom[runner]) df_add(runner, b);
+        }
+    }
+}
+
+Expr **ssa_defp(Quad *q) {
+    Expr **d = quad_defp(q);
+    if (!d || !*d || !is_sym_value(*d)) return NULL;
+    return d;
+}
+
+void place_phis(void) {
+    unsigned *defStart, *defList, *fill, *work, *hasPhi, *inWork;
+    unsigned i, v, b, top, k, x, total = 0;
+    Expr **d;
+
+    defStart = (unsigned *) calloc(totalSSAVars + 2, sizeof(unsigned));
+    for (i = 0; i < currQuad; i++) {
+        if (!blocks[quad_block[i]].reachable || !(d = ssa_defp(quads + i))) continue;
+        if ((v = ssa_var((*d)->sym)) == UNDEF) continue;
+        defStart[v + 1]++;
+        total++;
+    }
+    for (v = 0; v < totalSSAVars; v++) defStart[v + 1] += defStart[v];
+    defList = (unsigned *) malloc(sizeof(unsigned) * (total + 1));
+    fill = (unsigned *) malloc(sizeof(unsigned) * (totalSSAVars + 1));
+    memcpy(fill, defStart, sizeof(unsigned) * (totalSSAVars + 1));
+    for (i = 0; i < currQuad; i++) {
+        if (!blocks[quad_block[i]].reachable || !(d = ssa_defp(quads + i))) continue;
+        if ((v = ssa_var((*d)->sym)) == UNDEF) continue;
+        defList[fill[v]++] = quad_block[i];
+    }
+    free(fill);
+
+    phiVars = (unsigned **) calloc(totalBlocks, sizeof(unsigned *));
+    phiCount = (unsigned *) calloc(totalBlocks, sizeof(unsigned));
+    phiCapacity = (unsigned *) calloc(totalBlocks, sizeof(unsigned));
+    work = (unsigned *) malloc(sizeof(unsigned) * (total + totalBlocks + 1));
+    hasPhi = (unsigned *) calloc(totalBlocks + 1, sizeof(unsigned));
+    inWork = (unsigned *) calloc(totalBlocks + 1, sizeof(unsigned));
+    for (v = 0; v < totalSSAVars; v++) {
+        top = 0;
+        for (k = defStart[v]; k < defStart[v + 1]; k++) {
+            b = defList[k];
+            if (inWork[b] == v + 1) continue;
+            inWork[b] = v + 1;
+            work[top++] = b;
+        }
+        while (top) {
+            b = work[--top];
+            for (k = 0; k < dfCount[b]; k++) {
+                x = dfList[b][k];
+                if (hasPhi[x] == v + 1) continue;
+                hasPhi[x] = v + 1;
+                phiVars[x] = (unsigned *) grow(phiVars[x], phiCapacity + x, phiCount[x] + 1, sizeof(unsigned));
+                phiVars[x][phiCount[x]++] = v;
+                middle_stats.phis++;
+                if (inWork[x] != v + 1) {
+                    inWork[x] = v + 1;
+                    work[top++] = x;
+                }
+            }
+        }
+    }
+    free(defStart);
+    free(defList);
+    free(work);
+    free(hasPhi);
+    free(inWork);
+}
+
+/* ---------------- renaming walk ---------------- */
+
+// slots where a constant may stand in for a variable, the same ones fold_constants uses
+int const_slot(Quad *q, unsigned k) {
+    switch (q->op) {
+        case assign:
+        case uminus:
+        case not:
+            return k == 0;
+        case add:
+        case sub:
+        case mul:
+        case divi:
+        case mod:
+        case and:
+        case or:
+        case if_eq:
+        case if_noteq:
+        case if_lesseq:
+        case if_greatereq:
+        case if_less:
+        case if_greater:
+        case tablesetelem:
+            return k < 2;
+        case param:
+        case ret:
+        case yield:
+            return k == 2;
+        case tablegetelem:
+            return k == 1;
+        default:
+            return 0;
+    }
+}
+
+int is_gvn_op(Iopcode op) {
+    switch (op) {
+        case add:
+        case sub:
+        case mul:
+        case divi:
+        case mod:
+        case uminus:
+        case and:
+        case or:
+        case not:
+        case tablegetelem:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int is_arith_op(Iopcode op) {
+    return op == add || op == sub || op == mul || op == divi || op == mod || op == uminus;
+}
+
+// replace a use by a constant or by the source of a copy when that still holds the same value
+Expr *ssa_use(Quad *q, unsigned k, Expr **slot, unsigned *value) {
+    Expr *e = *slot;
+    unsigned var, v;
+    if (e->type == tableitem_e && e->sym && (var = ssa_var(e->sym)) != UNDEF) {
+        // the table variable of a member access is read but never rewritten
+        *value = ssa_top(var);
+        return e;
+    }
+    if (!is_sym_value(e) || (var = ssa_var(e->sym)) == UNDEF) return e;
+    v = ssa_top(var);
+    while (ssa_rewrite) {
+        if (values[v].konst && const_slot(q, k)) {
+            *slot = values[v].konst;
+            middle_stats.constants++;
+            *value = 0;
+            return *slot;
+        }
+        if (!values[v].copyVar || ssa_top(values[v].copyVar - 1) != values[v].copyVal) break;
+        *slot = values[v].copyExpr;
+        v = values[v].copyVal;
+        middle_stats.copies++;
+    }
+    *value = v;
+    return *slot;
+}
+
+unsigned operand_vn(Expr *e, unsigned value, unsigned epoch) {
+    if (is_const_expr(e)) return const_lookup(e)->vn;
+    if (value) return values[value].vn;
+    if (e->sym && (e->type == programfunc_e || e->type == libraryfunc_e)) return glob_vn(e->sym, 0);
+    if (is_sym_value(e) || (e->type == tableitem_e && e->sym)) return glob_vn(e->sym, epoch);
+    return nextVN++;
+}
+
+void fresh_memory(unsigned *mem) {
+    unsigned c;
+    for (c = 0; c <= totalClasses; c++) mem[c] = nextVN++;
+}
+
+unsigned key_class(Expr *key) {
+    if (!key || !is_const_expr(key)) return UNDEF;
+    return const_lookup(key)->cls;
+}
+
+void rename_quad(unsigned i, unsigned b, unsigned *mem, unsigned *epoch) {
+    Quad *q = quads + i;
+    Expr **slots[3] = { &q->arg1, &q->arg2, &q->result };
+    Expr **d = ssa_defp(q);
+    Expr *e;
+    unsigned vals[3] = { 0, 0, 0 }, vns[3] = { 0, 0, 0 };
+    unsigned k, var, val, vn = 0, a, c, m = 0;
+    gvn_entry *g = NULL;
+
+    for (k = 0; k < 3; k++) {
+        if (!*slots[k] || slots[k] == d) continue;
+        e = ssa_use(q, k, slots[k], vals + k);
+        vns[k] = operand_vn(e, vals[k], *epoch);
+        useVal[3 * i + k] = vals[k];
+    }
+
+    if (is_arith_op(q->op)) {
+        for (k = 0; k < 2; k++) if (vals[k]) add_proof(vals[k], b);
+    }
+
+    if (ssa_rewrite && d && is_gvn_op(q->op)) {
+        a = vns[0];
+        c = vns[1];
+        if ((q->op == add || q->op == mul || q->op == and || q->op == or) && a > c) { a = vns[1]; c = vns[0]; }
+        if (q->op == tablegetelem) {
+            k = key_class(q->arg2);
+            m = mem[k == UNDEF ? totalClasses : k];
+        }
+        g = gvn_lookup(q->op, a, c, m);
+        if (g && ssa_top(g->holderVar) == g->holderVal) {
+            middle_stats.redundant++;
+            if (g->holder->sym == (*d)->sym) {
+                // recomputes the value the variable already holds
+                q->op = nop;
+                q->arg1 = q->arg2 = q->result = NULL;
+                defVal[i] = 0;
+                return;
+            }
+            q->op = assign;
+            q->arg1 = g->holder;
+            q->arg2 = NULL;
+            vals[0] = g->holderVal;
+            vn = g->vn;
+        }
+        else if (g) vn = g->vn;
+        else vn = nextVN++;
+        if (q->op != assign && (var = ssa_var((*d)->sym)) != UNDEF) {
+            gvn_insert(q->op, a, c, m, var, totalValues, *d, vn);
+        }
+    }
+
+    switch (q->op) {
+        case call:
+        case yield:
+            fresh_memory(mem);
+            *epoch = nextEpoch++;
+            break;
+        case tablesetelem:
+            k = key_class(q->arg1);
+            if (k == UNDEF) fresh_memory(mem);
+            else {
+                mem[k] = nextVN++;
+                mem[totalClasses] = nextVN++;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (!d) return;
+    if ((var = ssa_var((*d)->sym)) == UNDEF) {
+        // globals are not renamed, a write only moves their epoch
+        *epoch = nextEpoch++;
+        return;
+    }
+    if (q->op == assign) vn = vals[0] ? values[vals[0]].vn : operand_vn(q->arg1, 0, *epoch);
+    val = new_value(var, i, b, vn);
+    if (q->op == assign) {
+        if (is_const_expr(q->arg1)) {
+            values[val].konst = q->arg1;
+            values[val].number = q->arg1->type == constnum_e;
+        }
+        else if (vals[0]) {
+            values[val].konst = values[vals[0]].konst;
+            values[val].number = values[vals[0]].number;
+            values[val].copyVar = values[vals[0]].var + 1;
+            values[val].copyVal = vals[0];
+            values[val].copyExpr = q->arg1;
+        }
+    }
+    else values[val].number = is_arith_op(q->op);
+    defVal[i] = val;
+    ssa_push(var, val);
+}
+
+void rename_block(unsigned b, unsigned *parentMem, unsigned parentEpoch) {
+    unsigned *mem = (unsigned *) malloc(sizeof(unsigned) * (totalClasses + 1));
+    unsigned undoMark = undoSize, gvnMark = totalGVN, gvnOuter = gvnFloor;
+    unsigned epoch, i, k, single;
+
+    // a function body sees no value numbered in the code around it, whose frame it does not share
+    if (quads[blocks[b].start].op == funcstart) gvnFloor = totalGVN;
+
+    // state flows in only along an edge from the immediate dominator that nothing else joins
+    single = predStart[b + 1] - predStart[b] == 1 && predList[predStart[b]] == idom[b]
+        && !is_root(b) && !(blocks[b].start && quads[blocks[b].start - 1].op == funcstart);
+    if (single && parentMem) {
+        memcpy(mem, parentMem, sizeof(unsigned) * (totalClasses + 1));
+        epoch = parentEpoch;
+    }
+    else {
+        fresh_memory(mem);
+        epoch = nextEpoch++;
+    }
+
+    for (k = 0; k < phiCount[b]; k++) ssa_push(phiVars[b][k], new_value(phiVars[b][k], -1, b, 0));
+    for (i = blocks[b].start; i < blocks[b].end; i++) rename_quad(i, b, mem, &epoch);
+    for (k = domChildStart[b]; k < domChildStart[b + 1]; k++) rename_block(domChildList[k], mem, epoch);
+
+    gvn_pop(gvnMark);
+    gvnFloor = gvnOuter;
+    while (undoSize > undoMark) stackSize[undoLog[--undoSize]]--;
+    free(mem);
+}
+
+void assign_classes(void) {
+    unsigned i;
+    Expr *key;
+    const_entry *c;
+    totalClasses = 0;
+    for (i = 0; i < currQuad; i++) {
+        if (quads[i].op == tablegetelem) key = quads[i].arg2;
+        else if (quads[i].op == tablesetelem) key = quads[i].arg1;
+        else continue;
+        if (!key || !is_const_expr(key)) continue;
+        c = const_lookup(key);
+        if (c->cls == UNDEF) c->cls = totalClasses++;
+    }
+}
+
+void ssa_rename(void) {
+    unsigned k;
+    stacks = (unsigned **) calloc(totalSSAVars, sizeof(unsigned *));
+    stackSize = (unsigned *) calloc(totalSSAVars, sizeof(unsigned));
+    stackCapacity = (unsigned *) calloc(totalSSAVars, sizeof(unsigned));
+    entryVal = (unsigned *) calloc(totalSSAVars, sizeof(unsigned));
+    useVal = (unsigned *) calloc(3 * currQuad + 1, sizeof(unsigned));
+    defVal = (unsigned *) calloc(currQuad + 1, sizeof(unsigned));
+    totalValues = 0;
+    new_value(UNDEF, -1, UNDEF, 0);	// value 0 means no SSA value
+    for (k = domChildStart[ROOT]; k < domChildStart[ROOT + 1]; k++) rename_block(domChildList[k], NULL, 0);
+    middle_stats.values += totalValues - 1;
+}
+
+void ssa_free(void) {
+    unsigned v, b;
+    if (stacks) for (v = 0; v < totalSSAVars; v++) free(stacks[v]);
+    if (dfList) for (b = 0; b <= totalBlocks; b++) free(dfList[b]);
+    if (phiVars) for (b = 0; b < totalBlocks; b++) free(phiVars[b]);
+    free(stacks); free(stackSize); free(stackCapacity); free(entryVal);
+    free(dfList); free(dfCount); free(dfCapacity);
+    free(phiVars); free(phiCount); free(phiCapacity);
+    free(idom); free(predStart); free(predList); free(rpoNum); free(rpoOrder);
+    free(domChildStart); free(domChildList); free(domPre); free(domPost);
+    free(useVal); free(defVal); free(values); free(proofs); free(undoLog);
+    free(gvnEntries); free(ssaVars); free(varSlots);
+    stacks = NULL; stackSize = stackCapacity = entryVal = NULL;
+    dfList = NULL; dfCount = dfCapacity = NULL;
+    phiVars = NULL; phiCount = phiCapacity = NULL;
+    idom = predStart = predList = rpoNum = rpoOrder = NULL;
+    domChildStart = domChildList = domPre = domPost = NULL;
+    useVal = defVal = undoLog = NULL;
+    values = NULL;
+    proofs = NULL;
+    gvnEntries = NULL;
+    ssaVars = NULL;
+    varSlots = NULL;
+    totalValues = valuesCapacity = totalProofs = proofsCapacity = 0;
+    undoSize = undoCapacity = totalGVN = gvnCapacity = gvnFloor = 0;
+    totalSSAVars = ssaVarsCapacity = varSlotsCapacity = 0;
+    memset(constBuckets, 0, sizeof(constBuckets));
+    memset(globBuckets, 0, sizeof(globBuckets));
+    cfg_free();
+}
+
+void ssa_build(void) {
+    unsigned i;
+    ssa_free();
+    cfg_build();
+    if (!currQuad) return;
+    memset(gvnBuckets, -1, sizeof(gvnBuckets));
+    // every variable gets its index up front, the walk sizes its stacks by totalSSAVars
+    for (i = 0; i < currQuad; i++) {
+        Expr *ops[3] = { quads[i].arg1, quads[i].arg2, quads[i].result };
+        unsigned k;
+        for (k = 0; k < 3; k++) {
+            if (!ops[k]) continue;
+            if (ops[k]->sym) ssa_var(ops[k]->sym);
+            if (ops[k]->index && ops[k]->index->sym) ssa_var(ops[k]->index->sym);
+        }
+    }
+    build_preds();
+    build_rpo();
+    build_dominators();
+    build_frontiers();
+    place_phis();
+    assign_classes();
+    ssa_rename();
+}
+
+void ssa_print(void) {
+    unsigned b, k;
+    printf("========== SSA (%u blocks, %u vars, %u values) ==========\n", totalBlocks, totalSSAVars, totalValues - 1);
+    for (b = 0; b < totalBlocks; b++) {
+        if (idom[b] == UNDEF) continue;
+        printf("B%u idom ", b);
+        if (idom[b] == ROOT) printf("entry");
+        else printf("B%u", idom[b]);
+        for (k = 0; k < phiCount[b]; k++) printf(" phi(%s)", ssaVars[phiVars[b][k]]->name);
+        printf("\n");
+    }
+}
+
+void ssa_optimize(void) {
+    ssa_rewrite = 1;
+    ssa_build();
+    ssa_rewrite = 0;
+    ssa_print();
+    ssa_free();
+}
+
+/* ---------------- loop-invariant code motion ---------------- */
+
+unsigned hoistedTemps = 0;
+
+// a fresh slot in the frame of func, or a global when func is NULL
+Expr *new_hoist_temp(SymbolTableRecord *func) {
+    char name[32];
+    sprintf(name, "_tmph%u", hoistedTemps++);
+    return new_frame_var(func, name);
+}
+
+int proven_number(unsigned v, unsigned h) {
+    unsigned p;
+    if (values[v].number) return 1;
+    for (p = values[v].proofs; p; p = proofs[p - 1].next)
+        if (proofs[p - 1].block != h && dominates(proofs[p - 1].block, h)) return 1;
+    return 0;
+}
+
+// NULL if the operand changes inside the loop or may not be a number, else the Expr to read it from
+Expr *invariant_operand(Expr *e, unsigned v, unsigned h, unsigned char *inLoop, Expr **hoisted) {
+    if (e->type == constnum_e) return e;
+    if (!is_sym_value(e) || ssa_var(e->sym) == UNDEF || !v) return NULL;
+    if (hoisted[v]) return hoisted[v];
+    if (values[v].block != UNDEF && inLoop[values[v].block]) return NULL;
+    return proven_number(v, h) ? e : NULL;
+}
+
+// the arithmetic may not halt the VM where the loop would not have run it
+int hoistable_op(Quad *q) {
+    switch (q->op) {
+        case add:
+        case sub:
+        case mul:
+        case divi:
+        case uminus:
+            return 1;
+        case mod:
+            return q->arg2->type == constnum_e && (unsigned) q->arg2->value.numConst != 0;
+        default:
+            return 0;
+    }
+}
+
+unsigned hoist_loop(unsigned h) {
+    unsigned char *inLoop = (unsigned char *) calloc(totalBlocks, 1);
+    unsigned char *fromLoop;
+    unsigned *stack = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    Expr **hoisted, *a1, *a2, *t;
+    Quad *pre = NULL;
+    unsigned top = 0, p, b, i, n = 0, capacity = 0, s = blocks[h].start;
+    SymbolTableRecord *func;
+
+    inLoop[h] = 1;
+    for (p = predStart[h]; p < predStart[h + 1]; p++) {
+        b = predList[p];
+        if (!dominates(h, b) || inLoop[b]) continue;
+        inLoop[b] = 1;
+        stack[top++] = b;
+    }
+    while (top) {
+        b = stack[--top];
+        for (p = predStart[b]; p < predStart[b + 1]; p++) {
+            if (inLoop[predList[p]] || idom[predList[p]] == UNDEF) continue;
+            inLoop[predList[p]] = 1;
+            stack[top++] = predList[p];
+        }
+    }
+    free(stack);
+
+    // the preheader goes right before the header, so only outside code may fall into it
+    if (s && inLoop[quad_block[s - 1]] && quads[s - 1].op != jump && quads[s - 1].op != ret && quads[s - 1].op != funcend) {
+        free(inLoop);
+        return 0;
+    }
+
+    func = enclosing_function(s);
+    hoisted = (Expr **) calloc(totalValues, sizeof(Expr *));
+    for (b = 0; b < totalBlocks; b++) {
+        if (!inLoop[b]) continue;
+        for (i = blocks[b].start; i < blocks[b].end; i++) {
+            Quad *q = quads + i;
+            if (!hoistable_op(q) || !defVal[i]) continue;
+            if (!(a1 = invariant_operand(q->arg1, useVal[3 * i], h, inLoop, hoisted))) continue;
+            a2 = NULL;
+            if (q->op != uminus && !(a2 = invariant_operand(q->arg2, useVal[3 * i + 1], h, inLoop, hoisted))) continue;
+            t = new_hoist_temp(func);
+            pre = (Quad *) grow(pre, &capacity, n + 1, sizeof(Quad));
+            pre[n] = *q;
+            pre[n].arg1 = a1;
+            pre[n].arg2 = a2;
+            pre[n].result = t;
+            pre[n].label = 0;
+            pre[n].taddress = 0;
+            n++;
+            q->op = assign;
+            q->arg1 = t;
+            q->arg2 = NULL;
+            hoisted[defVal[i]] = t;
+        }
+    }
+    if (n) {
+        fromLoop = (unsigned char *) calloc(currQuad, 1);
+        for (i = 0; i < currQuad; i++) fromLoop[i] = inLoop[quad_block[i]];
+        insert_quads(s, pre, n, fromLoop);
+        free(fromLoop);
+        middle_stats.loops++;
+        middle_stats.hoisted += n;
+    }
+    free(pre);
+    free(hoisted);
+    free(inLoop);
+    return n;
+}
+
+unsigned hoist_invariants(void) {
+    unsigned b, p, n, rounds = 0, total_hoisted = 0;
+    do {
+        n = 0;
+        ssa_build();
+        for (b = 0; b < totalBlocks && !n; b++) {
+            if (idom[b] == UNDEF) continue;
+            for (p = predStart[b]; p < predStart[b + 1]; p++) {
+                if (!dominates(b, predList[p])) continue;
+                n = hoist_loop(b);
+                break;
+            }
+        }
+        total_hoisted += n;
+    } while (n && ++rounds < 1000);
+    ssa_free();
+    return total_hoisted;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "CFG.h"
+
+/*
+ * SSA layer over the quad array. Locals, formals and temporaries get a value
+ * number per definition (phis are placed on the dominance frontiers), globals
+ * and table contents do not and are tracked through epochs instead, since any
+ * call may change them. Variables keep their storage, so the passes only rewrite
+ * a use when the variable it is replaced with still holds the same SSA value
+ * there; lowering back to quads is then just dropping the phis.
+ */
+
+typedef struct ssa_stats {
+	unsigned phis;
+	unsigned values;
+	unsigned constants;		// uses replaced by a constant
+	unsigned copies;		// uses replaced by the source of a copy
+	unsigned redundant;		// expressions replaced by an earlier equal one
+	unsigned loops;
+	unsigned hoisted;		// invariant quads moved to a loop preheader
+} ssa_stats;
+
+extern ssa_stats middle_stats;
+
+extern unsigned *idom;		// immediate dominator, totalBlocks stands for the virtual root
+
+// blocks, dominator tree and phis for the current quads
+void ssa_build(void);
+void ssa_free(void);
+void ssa_print(void);
+int dominates(unsigned a, unsigned b);
+
+int is_ssa_var(SymbolTableRecord *sym);
+// realloc p so it holds at least needed elements, doubling the capacity
+void *grow(void *p, unsigned *capacity, unsigned needed, size_t size);
+
+// copy propagation and global value numbering in one walk of the dominator tree
+void ssa_optimize(void);
+// loop-invariant code motion, returns how many quads were hoisted
+unsigned hoist_invariants(void);
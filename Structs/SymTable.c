@@ -25,13 +25,11 @@ int hash_f(SymbolTableRecord *record)
         //expected == 0 , we want to declare the var
 SymbolTableRecord *lookup(char *name, enum SymType type, unsigned int line, unsigned int expected, unsigned int func_def, unsigned local)
 {
-        SymbolTableRecord *record = (SymbolTableRecord *)malloc(sizeof(SymbolTableRecord));
-        record->name = name;
-        int hash_index = hash_f(record);
-        free(record);
+        SymbolTableRecord key, *record = NULL;
+        key.name = name;
+        int hash_index = hash_f(&key);
 
         SymbolTableRecord *iter = GST[hash_index];
-        record = NULL;
 
         int i, wasFunction = 0, isFunction = 0;
         int all_scopes = GSS->size;
@@ -71,7 +69,7 @@ SymbolTableRecord *lookup(char *name, enum SymType type, unsigned int line, unsi
         }
         if(record != NULL){
                 if(record->type == LIBFUNC && func_def){
-                        char *buffer = (char*)malloc(50+strlen(name));
+                        char *buffer = (char*)ir_alloc(50+strlen(name));
                         sprintf(buffer, "library function cannot be shadowed with func: \'%s\'", name);
                         alpha_yyerror(buffer);
                 }
@@ -85,7 +83,7 @@ SymbolTableRecord *lookup(char *name, enum SymType type, unsigned int line, unsi
         // printRecord(record);
         if(!func_def){
                 if (isFunction && record!= NULL && record->scope!=0) {
-                        char *buffer = (char*)malloc(50+strlen(name));
+                        char *buffer = (char*)ir_alloc(50+strlen(name));
                         sprintf(buffer, "variable with scope %d access not allowed \'%s\'",record->scope, name);
                         alpha_yyerror(buffer);
                 }
@@ -93,7 +91,7 @@ SymbolTableRecord *lookup(char *name, enum SymType type, unsigned int line, unsi
         if (expected){
                 if (record != NULL) return record;
                 if (record == NULL) {
-                        char *buffer = (char*)malloc(50+strlen(name));
+                        char *buffer = (char*)ir_alloc(50+strlen(name));
                         sprintf(buffer, "Undefined variable \'%s\'", name);
                         alpha_yyerror(buffer);
                 }
@@ -130,7 +128,7 @@ SymbolTableRecord *lookupGlobal(char *name, enum SymType type, unsigned int line
 }
 SymbolTableRecord* insert(char *name, enum SymType type, unsigned int scope, unsigned int line)
 {
-        SymbolTableRecord *record = (SymbolTableRecord *)malloc(sizeof(SymbolTableRecord));
+        SymbolTableRecord *record = (SymbolTableRecord *)ir_alloc(sizeof(SymbolTableRecord));
         record->name = name;
         record->type = type;
         record->scope = scope;
@@ -260,6 +258,23 @@ void sym_init()
         insert("sqrt",LIBFUNC,0,0);
         insert("cos",LIBFUNC,0,0);
         insert("sin",LIBFUNC,0,0);
+        insert("spawn",LIBFUNC,0,0);
+        insert("join",LIBFUNC,0,0);
+        insert("parallel_map",LIBFUNC,0,0);
+        insert("parallel_reduce",LIBFUNC,0,0);
+        insert("coroutine",LIBFUNC,0,0);
+        insert("resume",LIBFUNC,0,0);
+        insert("coroutinestatus",LIBFUNC,0,0);
+        insert("ioopen",LIBFUNC,0,0);
+        insert("iopipe",LIBFUNC,0,0);
+        insert("iolisten",LIBFUNC,0,0);
+        insert("ioconnect",LIBFUNC,0,0);
+        insert("ioaccept",LIBFUNC,0,0);
+        insert("ioread",LIBFUNC,0,0);
+        insert("iowrite",LIBFUNC,0,0);
+        insert("ioclose",LIBFUNC,0,0);
+        insert("ioresult",LIBFUNC,0,0);
+        insert("vmstats",LIBFUNC,0,0);
 
 
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <string.h>
 #include "Stack.h"
 #include "Queue.h"
+#include "Arena.h"
 char* file_name;
 #define SYM_SIZE 1000
 #define GlobalSymbolTable GST
@@ -44,6 +45,7 @@ typedef struct SymbolTableRecord
 	unsigned iaddress;
     unsigned taddress;
 	unsigned totallocals;
+	unsigned totalformals;
 }SymbolTableRecord;
 
 typedef struct Scope {
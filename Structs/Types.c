@@ -0,0 +1,205 @@
+#include "Types.h"
+#include "Optimize.h"
+#include "SSA.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+type_stats infer_stats;
+
+#define TYPE_BUCKETS 1024
+
+typedef struct type_var {
+    SymbolTableRecord *sym;
+    unsigned index;
+    struct type_var *next;
+} type_var;
+
+type_var *typeBuckets[TYPE_BUCKETS];
+SymbolTableRecord **typeVars = NULL;
+unsigned totalTypeVars = 0;
+unsigned typeVarsCapacity = 0;
+
+unsigned type_var_index(SymbolTableRecord *sym) {
+    unsigned h = (unsigned) (((unsigned long) sym >> 4) & (TYPE_BUCKETS - 1));
+    type_var *v;
+    for (v = typeBuckets[h]; v; v = v->next) if (v->sym == sym) return v->index;
+    v = (type_var *) ir_alloc(sizeof(type_var));
+    v->sym = sym;
+    v->index = totalTypeVars;
+    v->next = typeBuckets[h];
+    typeBuckets[h] = v;
+    typeVars = (SymbolTableRecord **) grow(typeVars, &typeVarsCapacity, totalTypeVars + 1, sizeof(SymbolTableRecord *));
+    typeVars[totalTypeVars] = sym;
+    return totalTypeVars++;
+}
+
+int is_type_var(Expr *e) {
+    return e && e->sym && e->sym->stype == var_s
+        && (is_sym_value(e) || e->type == tableitem_e);
+}
+
+void register_type_vars(void) {
+    Expr **slots[3];
+    unsigned i, k;
+    memset(typeBuckets, 0, sizeof(typeBuckets));
+    totalTypeVars = 0;
+    for (i = 0; i < currQuad; i++) {
+        slots[0] = &quads[i].arg1;
+        slots[1] = &quads[i].arg2;
+        slots[2] = &quads[i].result;
+        for (k = 0; k < 3; k++) {
+            if (!is_type_var(*slots[k])) continue;
+            type_var_index((*slots[k])->sym);
+            if ((*slots[k])->index && is_type_var((*slots[k])->index)) type_var_index((*slots[k])->index->sym);
+        }
+    }
+}
+
+unsigned char expr_type(Expr *e, unsigned char *state) {
+    if (!e) return TYPE_ANY;
+    switch (e->type) {
+        case constnum_e:
+            return TYPE_NUMBER;
+        case conststring_e:
+            return TYPE_STRING;
+        case constbool_e:
+        case nil_e:
+        case programfunc_e:
+        case libraryfunc_e:
+            return TYPE_OTHER;
+        default:
+            if (is_type_var(e)) return state[type_var_index(e->sym)];
+            return TYPE_ANY;
+    }
+}
+
+int is_typed_candidate(Iopcode op) {
+    switch (op) {
+        case add:
+        case sub:
+        case mul:
+        case divi:
+        case mod:
+            return 1;
+        default:
+            return is_branch(op);
+    }
+}
+
+// globals may be written by whatever the call runs, frame variables and temps may not
+void kill_globals(unsigned char *state) {
+    unsigned v;
+    for (v = 0; v < totalTypeVars; v++)
+        if (typeVars[v]->space == programvar && !is_temp(typeVars[v])) state[v] = TYPE_ANY;
+}
+
+void type_transfer(Quad *q, unsigned char *state) {
+    Expr **d = quad_defp(q);
+    unsigned char t;
+
+    if (q->op == call || q->op == yield) {
+        kill_globals(state);
+        return;
+    }
+    if (!d || !is_type_var(*d) || !is_sym_value(*d)) return;
+    switch (q->op) {
+        case assign:
+            t = expr_type(q->arg1, state);
+            break;
+        case add:
+        case sub:
+        case mul:
+        case divi:
+        case mod:
+            // the VM halts instead of writing a result when an operand is not a number
+            t = TYPE_NUMBER;
+            break;
+        case tablecreate:
+            t = TYPE_TABLE;
+            break;
+        default:
+            t = TYPE_ANY;
+            break;
+    }
+    state[type_var_index((*d)->sym)] = t;
+}
+
+// block entered when a function is called, no state flows into it from the definition
+int is_function_entry(unsigned b) {
+    return blocks[b].start && quads[blocks[b].start - 1].op == funcstart;
+}
+
+unsigned infer_types(void) {
+    unsigned char *in, *state, *visited;
+    unsigned *work, *queued, top = 0, b, i, k, s, v, changed;
+    unsigned n = 0;
+
+    memset(&infer_stats, 0, sizeof(infer_stats));
+    for (i = 0; i < currQuad; i++) quads[i].typed = 0;
+    if (!currQuad) return 0;
+    register_type_vars();
+    cfg_build();
+
+    in = (unsigned char *) calloc((size_t) totalBlocks * (totalTypeVars + 1), 1);
+    state = (unsigned char *) malloc(totalTypeVars + 1);
+    visited = (unsigned char *) calloc(totalBlocks, 1);
+    work = (unsigned *) malloc(sizeof(unsigned) * (totalBlocks + 1));
+    queued = (unsigned *) calloc(totalBlocks, sizeof(unsigned));
+
+    for (b = 0; b < totalBlocks; b++) {
+        if (b && !is_function_entry(b)) continue;
+        memset(in + (size_t) b * totalTypeVars, TYPE_ANY, totalTypeVars);
+        visited[b] = 1;
+        queued[b] = 1;
+        work[top++] = b;
+    }
+    while (top) {
+        b = work[--top];
+        queued[b] = 0;
+        memcpy(state, in + (size_t) b * totalTypeVars, totalTypeVars);
+        for (i = blocks[b].start; i < blocks[b].end; i++) type_transfer(quads + i, state);
+        for (k = 0; k < blocks[b].nsucc; k++) {
+            s = blocks[b].succ[k];
+            changed = !visited[s];
+            visited[s] = 1;
+            for (v = 0; v < totalTypeVars; v++) {
+                unsigned char joined = in[(size_t) s * totalTypeVars + v] | state[v];
+                if (joined != in[(size_t) s * totalTypeVars + v]) {
+                    in[(size_t) s * totalTypeVars + v] = joined;
+                    changed = 1;
+                }
+            }
+            if (changed && !queued[s]) {
+                queued[s] = 1;
+                work[top++] = s;
+            }
+        }
+    }
+
+    for (b = 0; b < totalBlocks; b++) {
+        if (!visited[b]) continue;
+        memcpy(state, in + (size_t) b * totalTypeVars, totalTypeVars);
+        for (i = blocks[b].start; i < blocks[b].end; i++) {
+            Quad *q = quads + i;
+            if (is_typed_candidate(q->op)) {
+                infer_stats.candidates++;
+                if (expr_type(q->arg1, state) == TYPE_NUMBER && expr_type(q->arg2, state) == TYPE_NUMBER) {
+                    q->typed = 1;
+                    n++;
+                }
+            }
+            type_transfer(q, state);
+        }
+    }
+    infer_stats.typed = n;
+
+    free(in);
+    free(state);
+    free(visited);
+    free(work);
+    free(queued);
+    cfg_free();
+    return n;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "CFG.h"
+
+/*
+ * Flow-sensitive type inference over the quads. Every variable carries the set
+ * of runtime types it may hold at a program point, joined at merges; globals
+ * become unknown at every call and everything is unknown on function entry.
+ * Arithmetic and relational quads whose operands are both definitely numbers
+ * are marked typed and generated as the _nn opcodes, which the VM runs without
+ * tag checks once its verifier has proven the same thing on the bytecode.
+ */
+
+#define TYPE_NUMBER	1
+#define TYPE_STRING	2
+#define TYPE_TABLE	4
+#define TYPE_OTHER	8		// bool, nil, functions and undef
+#define TYPE_ANY	15
+
+typedef struct type_stats {
+	unsigned candidates;	// arithmetic and relational quads
+	unsigned typed;
+} type_stats;
+
+extern type_stats infer_stats;
+
+// arithmetic and relational quads, the ones that have an _nn opcode
+int is_typed_candidate(Iopcode op);
+
+// sets quad->typed, returns how many quads were marked
+unsigned infer_types(void);
@@ -33,7 +33,19 @@ char *vmopcode_name[] = {
     "newtable",
     "tablegetelem",
     "tablesetelem",
-    "nop"
+    "nop",
+    "add_nn",
+    "sub_nn",
+    "mul_nn",
+    "div_nn",
+    "mod_nn",
+    "jeq_nn",
+    "jne_nn",
+    "jle_nn",
+    "jge_nn",
+    "jlt_nn",
+    "jgt_nn",
+    "yield"
 };
 
 struct instruction *instructions = (struct instruction *)0;
@@ -54,7 +66,7 @@ void userfunctions_add(unsigned address, unsigned localSize, char *id)
     new_ufunc->localSize = (unsigned int) localSize;
     if(localSize >1000000)new_ufunc->localSize=0;
     printf("%u assert\n", localSize);
-    totalUserFuncs++;
+    t_totalUserFuncs++;
 
     Queue_enqueue(userfunctions, new_ufunc);
 }
@@ -97,7 +109,8 @@ generator_func_t generators[] = {
     generate_TABLEGETELEM,
     generate_TABLESETELEM,
     generate_NOP,
-    generate_JUMP
+    generate_JUMP,
+    generate_YIELD
 };
 
 void emit_instr(instruction *t)
@@ -130,7 +143,7 @@ void expand_instructions()
     }
     instructions = p;
     totalInstructions += EXPAND_SIZE;
-    for (int k = 0; k < totalInstructions; k++) //init
+    for (int k = i; k < totalInstructions; k++) // only the new ones, the rest were just copied
     {
         instructions[k].arg1.type = empty_a;
         instructions[k].arg2.type = empty_a;
@@ -166,6 +179,23 @@ void generate(vmopcode op, Quad *quad)
     emit_instr(&t);
 }
 
+// drops the code and the constant tables, for compiling another source in the same process
+void reset_tcode(void)
+{
+    unsigned i;
+    free(instructions);
+    instructions = NULL;
+    totalInstructions = currInstruction = currprocessedquads = 0;
+    for (i = 0; i < t_totalStringConsts; i++) free(t_stringConsts[i]);
+    free(t_stringConsts);
+    free(t_numConsts);
+    t_stringConsts = NULL;
+    t_numConsts = NULL;
+    t_totalStringConsts = t_totalNumConsts = 0;
+    totalNamedLibfuncs = 0;
+    t_totalUserFuncs = 0;
+}
+
 void generateCode(void) // main target code function
 {
     //init
@@ -258,7 +288,7 @@ void patch_incomplete_jumps()
 {
     incomplete_jump *iter;
     while (iter = Queue_dequeue(ij_head)) {
-        if (iter->iaddress == currInstruction){
+        if (iter->iaddress > currQuad){
             printf("IJ_1 %d %d\n",iter->iaddress,currInstruction);
             instructions[iter->instrNo].result.val = currInstruction;
         }else{
@@ -288,9 +318,9 @@ void generate_relational(vmopcode op, Quad *quad)
     make_operand(quad->arg2, &t.arg2);
     t.result.type = label_a;
     // printf("rel gen %s %d %d\n", vmopcode_name[op],quad->label,currprocessedquads);
-    if (quad->label < currprocessedquads){
+    if (quad->label - 1 < currprocessedquads){
         printf("rel gen %s %d %d\n", vmopcode_name[op],quad->label,currprocessedquads);
-        t.result.val = quads[quad->label].taddress-1;
+        t.result.val = quads[quad->label - 1].taddress;
     }
     else{
         printf("rel gen ij %s %d %d\n", vmopcode_name[op],quad->label,currprocessedquads);
@@ -419,7 +449,6 @@ void generate_PARAM(Quad *quad)
     reset_operand(&t.arg2);
     reset_operand(&t.result);
     printf("%d\n",quad->result->type);
-    if(quad->result->type==libfunc_a)printf("=====%s\n",quad->result->value.strConst);
     // _stop_;
     make_operand(quad->result, &t.arg1);
     emit_instr(&t);
@@ -467,6 +496,7 @@ void generate_FUNCSTART(Quad *q)
     emit_instr(&t_jump);
 
     instruction t;
+    t.srcLine = q->line;
     t.opcode = funcenter_v;
     reset_operand(&t.arg1);
     reset_operand(&t.arg2);
@@ -528,27 +558,27 @@ void generate_FUNCEND(Quad *q)
 
 void generate_ADD(Quad *q)
 {
-    generate(add_v, q);
+    generate(q->typed ? add_nn_v : add_v, q);
     return;
 }
 void generate_SUB(Quad *q)
 {
-    generate(sub_v, q);
+    generate(q->typed ? sub_nn_v : sub_v, q);
     return;
 }
 void generate_MUL(Quad *q)
 {
-    generate(mul_v, q);
+    generate(q->typed ? mul_nn_v : mul_v, q);
     return;
 }
 void generate_DIV(Quad *q)
 {
-    generate(div_v, q);
+    generate(q->typed ? div_nn_v : div_v, q);
     return;
 }
 void generate_MOD(Quad *q)
 {
-    generate(mod_v, q);
+    generate(q->typed ? mod_nn_v : mod_v, q);
     return;
 }
 
@@ -562,8 +592,7 @@ void generate_UMINUS(Quad *q)
         // printf("arg1\n");
         make_operand(q->arg1, &t.arg1);
     }
-    Expr* arg2 = (Expr*)malloc(sizeof(Expr));
-    arg2 =  newexpr_constnum(-1);
+    Expr* arg2 = newexpr_constnum(-1);
     q->arg2 = arg2;
     make_operand(q->arg2,&t.arg2);
     if (q->result)
@@ -596,10 +625,34 @@ void generate_ASSIGN(Quad *q)
     generate(assign_v, q);
     return;
 }
+// the value goes in arg1 like pusharg's, nil for a bare yield
+void generate_YIELD(Quad *q)
+{
+    q->taddress = nextinstructionlabel();
+    instruction t;
+    t.srcLine = q->line;
+    t.opcode = yield_v;
+    reset_operand(&t.result);
+    reset_operand(&t.arg1);
+    reset_operand(&t.arg2);
+    if (q->result) make_operand(q->result, &t.arg1);
+    else {
+        t.arg1.type = nil_a;
+        t.arg1.val = 0;
+    }
+    emit_instr(&t);
+    return;
+}
+
 void generate_NOP(Quad *q)
 {
+    q->taddress = nextinstructionlabel();
     instruction t;
+    t.srcLine = q->line;
     t.opcode = nop_v;
+    reset_operand(&t.result);
+    reset_operand(&t.arg1);
+    reset_operand(&t.arg2);
     emit_instr(&t);
     return;
 }
@@ -611,64 +664,64 @@ void generate_JUMP(Quad *q)
 }
 void generate_IF_EQ(Quad *q)
 {
-    generate_relational(jeq_v, q);
+    generate_relational(q->typed ? jeq_nn_v : jeq_v, q);
     return;
 }
 void generate_IF_NOTEQ(Quad *q)
 {
-    generate_relational(jne_v, q);
+    generate_relational(q->typed ? jne_nn_v : jne_v, q);
     return;
 }
 void generate_IF_GREATER(Quad *q)
 {
-    generate_relational(jgt_v, q);
+    generate_relational(q->typed ? jgt_nn_v : jgt_v, q);
     return;
 }
 void generate_IF_GREATEREQ(Quad *q)
 {
-    generate_relational(jge_v, q);
+    generate_relational(q->typed ? jge_nn_v : jge_v, q);
     return;
 }
 void generate_IF_LESS(Quad *q)
 {
-    generate_relational(jlt_v, q);
+    generate_relational(q->typed ? jlt_nn_v : jlt_v, q);
     return;
 }
 void generate_IF_LESSEQ(Quad *q)
 {
-    generate_relational(jle_v, q);
+    generate_relational(q->typed ? jle_nn_v : jle_v, q);
     return;
 }
 
 unsigned consts_newstring(char *s)
 {
     int i;
-    for (i=0; i<totalStringConsts; i++)
-        if (!strcmp(stringConsts[i], s)) return i;
-    if(!totalStringConsts){
-		stringConsts = (char **) malloc(sizeof(char*));
+    for (i=0; i<t_totalStringConsts; i++)
+        if (!strcmp(t_stringConsts[i], s)) return i;
+    if(!t_totalStringConsts){
+		t_stringConsts = (char **) malloc(sizeof(char*));
 	}else{
-		stringConsts = (char **) realloc(stringConsts,  sizeof(char*) * (totalStringConsts + 1)  );
+		t_stringConsts = (char **) realloc(t_stringConsts,  sizeof(char*) * (t_totalStringConsts + 1)  );
 	}
     // _stop_
-	stringConsts[totalStringConsts++] = strdup(s);
-    printf("const string added \"%s\"\n",stringConsts[totalStringConsts-1] );
-	return totalStringConsts - 1;
+	t_stringConsts[t_totalStringConsts++] = strdup(s);
+    printf("const string added \"%s\"\n",t_stringConsts[t_totalStringConsts-1] );
+	return t_totalStringConsts - 1;
     
 }
 unsigned consts_newnumber(double n)
 {
     int i;
-    for (i=0; i<totalNumConsts; i++)
-        if (numConsts[i] == n) return i;
-    if(!totalNumConsts){
-		numConsts = (double *) malloc(sizeof(double));
+    for (i=0; i<t_totalNumConsts; i++)
+        if (t_numConsts[i] == n) return i;
+    if(!t_totalNumConsts){
+		t_numConsts = (double *) malloc(sizeof(double));
 	}else{
-		numConsts = (double *) realloc(numConsts,  sizeof(double) * (totalNumConsts + 1)  );
+		t_numConsts = (double *) realloc(t_numConsts,  sizeof(double) * (t_totalNumConsts + 1)  );
 	}
-	numConsts[totalNumConsts++] = n;
-    printf("const number added %f\n",numConsts[totalNumConsts-1] );
-	return totalNumConsts - 1;
+	t_numConsts[t_totalNumConsts++] = n;
+    printf("const number added %f\n",t_numConsts[t_totalNumConsts-1] );
+	return t_totalNumConsts - 1;
 }
 unsigned libfuncs_newused(char *s)
 {
@@ -689,6 +742,7 @@ void generate_CALL(Quad *quad)
 {
     quad->taddress = nextinstructionlabel();
     instruction t;
+    t.srcLine = quad->line;
     t.opcode = call_v;
     reset_operand(&t.arg1);
     reset_operand(&t.arg2);
@@ -757,15 +811,15 @@ void add_incomplete_jump(unsigned insrtNo, unsigned jump_to)
 
 void printTables(){
     int i = 0;
-    for( i; i < totalNumConsts;i++){
-        printf("%d | %f\n",i,numConsts[i]);
+    for( i; i < t_totalNumConsts;i++){
+        printf("%d | %f\n",i,t_numConsts[i]);
     }
     printf("---------------------------------------------------------\n");
-    for( i = 0 ; i < totalStringConsts ; i++){
-        printf("%d | %s\n",i,stringConsts[i]);
+    for( i = 0 ; i < t_totalStringConsts ; i++){
+        printf("%d | %s\n",i,t_stringConsts[i]);
     }
     printf("---------------------------------------------------------\n");
-    for( i=0; i < totalUserFuncs; i++){
+    for( i=0; i < t_totalUserFuncs; i++){
         userfunc* f = (userfunc*)Queue_get(userfunctions,i);
         printf("%d | Func Address %d, Local Size %u, ID %s\n",i,f->address,f->localSize,f->id);
     }
@@ -816,6 +870,17 @@ void display_instr()
             case jgt_v:
             case tablegetelem_v:
             case tablesetelem_v:
+            case add_nn_v:
+            case sub_nn_v:
+            case mul_nn_v:
+            case div_nn_v:
+            case mod_nn_v:
+            case jeq_nn_v:
+            case jne_nn_v:
+            case jle_nn_v:
+            case jge_nn_v:
+            case jlt_nn_v:
+            case jgt_nn_v:
                 use_instr_result(instr.result);
                 use_instr_arg1(instr.arg1);
                 use_instr_arg2(instr.arg2);
@@ -836,6 +901,7 @@ void display_instr()
             case call_v:
             case pusharg_v:
             case newtable_v:
+            case yield_v:
                 use_instr_arg1(instr.arg1);
                 break;
             default:
@@ -848,7 +914,7 @@ void display_instr()
     }
     
 
-    avmbinaryfile();
+    if (write_binary) write_avmbinaryfile();
 }
 
 void use_instr_result(vmarg result){
@@ -872,10 +938,10 @@ void use_instr_result(vmarg result){
                 printf("03_%u ", result.val);
                 break;
             case number_a:
-                printf("04_%u_[%f] ", result.val,numConsts[result.val]);
+                printf("04_%u_[%f] ", result.val,t_numConsts[result.val]);
                 break;
             case string_a:
-                 printf("05_%u_[\"%s\"] ", result.val,strdup(stringConsts[result.val]));
+                 printf("05_%u_[\"%s\"] ", result.val,strdup(t_stringConsts[result.val]));
                 break;
             case bool_a:
                 printf("06_%u ", result.val);
@@ -918,10 +984,10 @@ void use_instr_arg1(vmarg arg1){
                 printf("03_%u ", arg1.val);
                 break;
             case number_a:
-                printf("04_%u_[%f] ", arg1.val,numConsts[arg1.val]);
+                printf("04_%u_[%f] ", arg1.val,t_numConsts[arg1.val]);
                 break;
             case string_a:
-                 printf("05_%u_[\"%s\"] ", arg1.val,strdup(stringConsts[arg1.val]));
+                 printf("05_%u_[\"%s\"] ", arg1.val,strdup(t_stringConsts[arg1.val]));
                 break;
             case bool_a:
                 printf("06_%u ", arg1.val);
@@ -964,10 +1030,10 @@ void use_instr_arg2(vmarg arg2){
                 printf("03_%u ", arg2.val);
                 break;
             case number_a:
-                printf("04_%u_[%f] ", arg2.val,numConsts[arg2.val]);
+                printf("04_%u_[%f] ", arg2.val,t_numConsts[arg2.val]);
                 break;
             case string_a:
-                 printf("05_%u_[\"%s\"] ", arg2.val,strdup(stringConsts[arg2.val]));
+                 printf("05_%u_[\"%s\"] ", arg2.val,strdup(t_stringConsts[arg2.val]));
                 break;
             case bool_a:
                 printf("06_%u ", arg2.val);
@@ -27,6 +27,7 @@ extern void generate_PARAM(Quad *);
 extern void generate_GETRETVAL(Quad *);
 extern void generate_FUNCSTART(Quad *);
 extern void generate_RETURN(Quad *);
+extern void generate_YIELD(Quad *);
 extern void generate_FUNCEND(Quad *);
 
 extern char *vmopcode_name[];
@@ -58,7 +59,21 @@ typedef enum vmopcode
 	newtable_v,
 	tablegetelem_v,
 	tablesetelem_v,
-	nop_v
+	nop_v,
+	// operands proven numbers by the compiler and the verifier
+	add_nn_v,
+	sub_nn_v,
+	mul_nn_v,
+	div_nn_v,
+	mod_nn_v,
+	jeq_nn_v,
+	jne_nn_v,
+	jle_nn_v,
+	jge_nn_v,
+	jlt_nn_v,
+	jgt_nn_v,
+	// suspends the running coroutine
+	yield_v
 } vmopcode;
 
 typedef enum vmarg_t
@@ -77,13 +92,13 @@ typedef enum vmarg_t
 	empty_a=11
 } vmarg_t;
 
-double *numConsts;
-unsigned totalNumConsts;
-char **stringConsts;
-unsigned totalStringConsts;
+double *t_numConsts;
+unsigned t_totalNumConsts;
+char **t_stringConsts;
+unsigned t_totalStringConsts;
 unsigned totalNamedLibfuncs;
 // userfunc *userFuncs;
-unsigned int totalUserFuncs;
+unsigned int t_totalUserFuncs;
 struct instruction *instructions;
 unsigned int totalInstructions;
 unsigned int currInstruction;
@@ -138,6 +153,7 @@ void add_incomplete_jump(unsigned insrtNo, unsigned iaddress);
 void expand_instructions();
 void patch_incomplete_jumps(void);
 void generateCode(void);
+void reset_tcode(void);
 void display_instr();
 void use_instr_result(vmarg);
 void use_instr_arg1(vmarg);
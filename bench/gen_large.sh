@@ -0,0 +1,17 @@
+#!/bin/sh
+# Writes an Alpha program of about 5 * FUNCS * STMTS instructions to stdout,
+# for timing the loader: usage gen_large.sh [FUNCS] [STMTS]
+# Statements go into function bodies, the parser stack overflows on very long
+# top-level statement lists.
+FUNCS=${1:-20}
+STMTS=${2:-1500}
+awk -v funcs="$FUNCS" -v stmts="$STMTS" 'BEGIN {
+    print "x = 0;";
+    for (f = 0; f < funcs; f++) {
+        printf "function f%d() {\n", f;
+        for (i = 0; i < stmts; i++) printf "    x = x + %d; s%d = \"str%d\";\n", i, i % 50, f * stmts + i;
+        print "}";
+        printf "f%d();\n", f;
+    }
+    print "print(x, \"\\n\");";
+}'
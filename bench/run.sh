@@ -0,0 +1,109 @@
+#!/bin/sh
+# Runs the benchmark suite with the ./out and ./avm_exec of the current
+# directory: usage run.sh [-n RUNS] [-o RESULTS] [-b BASELINE] [-t PERCENT]
+# Every program in bench/programs is compiled with -O and run RUNS times (5 by
+# default), and sources from gen_large.sh of growing size time the compiler.
+# The median and 95th percentile time, the instructions executed (generated,
+# for the compiler) and the peak RSS of each go to RESULTS (bench/results.json)
+# and stdout. Against BASELINE (bench/baseline.json when it exists) a median
+# time or peak RSS more than PERCENT (10) percent higher, or more
+# instructions, is a regression, and the exit status is 1.
+RUNS=5
+RESULTS=bench/results.json
+BASELINE=bench/baseline.json
+PERCENT=10
+while getopts n:o:b:t: opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        o) RESULTS=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        t) PERCENT=$OPTARG ;;
+        *) echo "usage: run.sh [-n RUNS] [-o RESULTS] [-b BASELINE] [-t PERCENT]"; exit 2 ;;
+    esac
+done
+[ -x ./out ] && [ -x ./avm_exec ] || { echo "run.sh: build ./out and ./avm_exec first"; exit 2; }
+# no dot in the directory, out drops the dots of the source path when it names the binary
+TMP=$(mktemp -d /tmp/alpha_bench_XXXXXX)
+trap 'rm -rf "$TMP"' EXIT
+
+# median, 95th percentile (nearest rank) and maximum of the numbers in file $1
+stats() {
+    sort -n "$1" | awk '{ v[NR] = $1 } END { p = int(NR * 0.95 + 0.999); printf "%.3f %.3f %.3f\n", (NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2), v[p], v[NR] }'
+}
+
+# name median p95 instructions rss, a line of the results
+record() {
+    printf '    {"name": "%s", "median_ms": %s, "p95_ms": %s, "instructions": %s, "peak_rss_kb": %s}' "$1" "$2" "$3" "$4" "$5" >> "$TMP/results"
+    printf '%s\n' "$1 $2 $3 $4 $5" >> "$TMP/table"
+}
+
+for src in bench/programs/*.asc; do
+    name=$(basename "$src" .asc)
+    cp "$src" "$TMP/$name.asc"
+    ./out -O "$TMP/$name.asc" > /dev/null 2>&1 && [ -f "$TMP/$name.abc" ] || { echo "run.sh: cannot compile $src"; exit 2; }
+    : > "$TMP/ms"
+    : > "$TMP/rss"
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        ./avm_exec --time "$TMP/$name.abc" > "$TMP/stdout" 2> "$TMP/stderr" || { echo "run.sh: $name failed"; cat "$TMP/stderr"; exit 2; }
+        grep -q "ERROR" "$TMP/stdout" "$TMP/stderr" && { echo "run.sh: $name failed"; cat "$TMP/stdout" "$TMP/stderr"; exit 2; }
+        sed -n 's/^time: .* ran in \([0-9.]*\) ms, peak rss \([0-9]*\) KB$/\1 \2/p' "$TMP/stderr" > "$TMP/time"
+        cut -d' ' -f1 "$TMP/time" >> "$TMP/ms"
+        cut -d' ' -f2 "$TMP/time" >> "$TMP/rss"
+        i=$((i + 1))
+    done
+    ./avm_exec --profile-opcodes "$TMP/op.json" "$TMP/$name.abc" > /dev/null 2>&1
+    instructions=$(sed -n 's/^ *"instructions": \([0-9]*\),$/\1/p' "$TMP/op.json")
+    set -- $(stats "$TMP/ms")
+    median=$1 p95=$2
+    set -- $(stats "$TMP/rss")
+    [ -s "$TMP/results" ] && printf ',\n' >> "$TMP/results"
+    record "$name" "$median" "$p95" "${instructions:-0}" "${3%.*}"
+done
+
+# compile time, the peak RSS of the compiler is not measured
+for size in "5 500" "10 1000" "20 1500"; do
+    set -- $size
+    name="compile_${1}x$2"
+    sh bench/gen_large.sh "$1" "$2" > "$TMP/$name.asc"
+    : > "$TMP/ms"
+    i=0
+    while [ "$i" -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        ./out -O "$TMP/$name.asc" > /dev/null 2>&1 || { echo "run.sh: cannot compile $name"; exit 2; }
+        echo "$(($(date +%s%N) - start))" | awk '{ printf "%.3f\n", $1 / 1e6 }' >> "$TMP/ms"
+        i=$((i + 1))
+    done
+    instructions=$(./avm_exec --load-only "$TMP/$name.abc" 2>&1 | sed -n 's/^.*: \([0-9]*\) instructions loaded.*$/\1/p')
+    set -- $(stats "$TMP/ms")
+    printf ',\n' >> "$TMP/results"
+    record "$name" "$1" "$2" "${instructions:-0}" 0
+done
+
+{
+    printf '{\n  "runs": %s,\n  "benchmarks": [\n' "$RUNS"
+    cat "$TMP/results"
+    printf '\n  ]\n}\n'
+} > "$RESULTS"
+
+# the baseline as "name median instructions rss" lines, one benchmark a line as run.sh writes them
+[ -f "$BASELINE" ] && [ "$BASELINE" != "$RESULTS" ] && sed -n 's/^ *{"name": "\([^"]*\)", "median_ms": \([0-9.]*\), "p95_ms": [0-9.]*, "instructions": \([0-9]*\), "peak_rss_kb": \([0-9]*\)}.*$/\1 \2 \3 \4/p' "$BASELINE" > "$TMP/baseline"
+touch "$TMP/baseline"
+# the timings of another host mean nothing here, so no baseline is shipped
+[ -f "$BASELINE" ] || echo "no $BASELINE to compare with, make bench_baseline makes one for this host"
+awk -v percent="$PERCENT" -v baseline="$BASELINE" '
+    FILENAME == ARGV[1] { base[$1] = $2; baseInstr[$1] = $3; baseRss[$1] = $4; have = 1; next }
+    FNR == 1 { printf "%-16s %12s %12s %14s %12s  %s\n", "benchmark", "median ms", "p95 ms", "instructions", "peak rss KB", have ? "vs " baseline : "" }
+    {
+        note = ""
+        if ($1 in base) {
+            note = sprintf("%+.1f%%", base[$1] > 0 ? 100 * ($2 - base[$1]) / base[$1] : 0)
+            if (base[$1] > 0 && $2 > base[$1] * (1 + percent / 100)) { note = note " REGRESSION (time)"; bad++ }
+            if ($4 > baseInstr[$1]) { note = note " REGRESSION (instructions " baseInstr[$1] ")"; bad++ }
+            if (baseRss[$1] > 0 && $5 > baseRss[$1] * (1 + percent / 100)) { note = note " REGRESSION (rss " baseRss[$1] " KB)"; bad++ }
+        }
+        else if (have) note = "new"
+        printf "%-16s %12.3f %12.3f %14d %12d  %s\n", $1, $2, $3, $4, $5, note
+    }
+    END { if (bad) { printf "%d regression(s) against %s\n", bad, baseline; exit 1 } }
+' "$TMP/baseline" "$TMP/table"
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Times bench/parallel.asc with 1 to MAX threads (the online processors by
+# default), pinned to as many cores with taskset when it is installed, and
+# prints the speedup over one thread: usage scale.sh [MAX]
+MAX=${1:-$(getconf _NPROCESSORS_ONLN)}
+./out bench/parallel.asc > /dev/null 2>&1 || { echo "cannot compile bench/parallel.asc"; exit 1; }
+n=1
+while [ "$n" -le "$MAX" ]; do
+    pin=""
+    command -v taskset > /dev/null && pin="taskset -c 0-$((n - 1))"
+    start=$(date +%s%N)
+    # the thread in parallel_map runs chunks too, n - 1 workers keep n cores busy
+    ALPHA_THREADS=$((n > 1 ? n - 1 : 1)) $pin ./avm_exec bench/parallel.abc > /dev/null || exit 1
+    ms=$((($(date +%s%N) - start) / 1000000))
+    [ "$n" -eq 1 ] && base=$ms
+    awk -v n="$n" -v ms="$ms" -v base="$base" 'BEGIN { printf "%2d thread(s): %6d ms, speedup %.2f\n", n, ms, base / (ms > 0 ? ms : 1) }'
+    n=$((n + 1))
+done
+rm -f bench/parallel.abc
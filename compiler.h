@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * The compiler as a library (libalphac.a, parser.y built with -DALPHA_LIBRARY),
+ * for running sources without `out` and without writing a binary: the
+ * result is the image a mapped .abc holds, which avm_loadimage runs in place.
+ * Options are the globals `out` sets from its arguments (optimize_flag,
+ * profile_load). The listing the compiler prints is not silenced.
+ */
+
+// -O
+extern unsigned optimize_flag;
+
+// the compiled image of source, malloc'd, or NULL after a compile error
+char *alpha_compile(const char *source, unsigned *size);
@@ -5,6 +5,12 @@
 #include "./Structs/Stack.h"
 #include "./Structs/Quad.h"
 #include "./Structs/t_libAVM.h"
+#include "./Structs/Optimize.h"
+#include "./Structs/Profile.h"
+#include "./AVM/writer.h"
+#include "./AVM/cache.h"
+#include "./compiler.h"
+#include <setjmp.h>
 
 #define debug 0
 #define errors_halt 1
@@ -15,6 +21,7 @@ int alpha_yylex(void);
 extern int alpha_yylineno;
 extern char* alpha_yytext;
 extern FILE* alpha_yyin;
+void alpha_yyrestart(FILE *);
 Queue* global_elist;
 Queue* global_indexed_q;
 Queue* curr_elist = NULL;
@@ -29,6 +36,8 @@ SymbolTableRecord* dummy2;
 unsigned int loopcounter = 0;
 Stack *loopcounter_stack;
 unsigned int in_function = 0;
+// set while alpha_compile runs, errors jump back to it instead of exiting
+jmp_buf *compile_error = NULL;
 
 %}
 %define api.prefix {alpha_yy}
@@ -75,6 +84,7 @@ unsigned int in_function = 0;
 %token FOR 
 %token FUNCTION 
 %token RETURN 
+%token YIELD
 %token BREAK 
 %token CONTINUE 
 %token AND 
@@ -138,6 +148,7 @@ unsigned int in_function = 0;
 %type <expression> call
 %type <expression> objectdef
 %type <expression> returnstmt
+%type <expression> yieldstmt
 //%type <iop> lop
 //%type <iop> aop
 //%type <iop> bop
@@ -168,21 +179,23 @@ unsigned int in_function = 0;
 
 program:	stmt_star {printf("program ->  statements\n");};
 
-stmt: expr SEMI {printf("stmt ->  expr SEMI\n");$$ = NULL;}
-	| ifstmt {printf("stmt ->  ifstmst\n");$$ = $1;}
-	| whilestmt {printf("stmt ->  whilestmt\n");$$ = NULL;}
-	| forstmt {printf("stmt ->  forstmt\n");$$ = NULL;}
-	| returnstmt {printf("stmt ->  returnstmt\n");$$ = NULL;}
+stmt: expr SEMI {printf("stmt ->  expr SEMI\n");reset_temp();$$ = NULL;}
+	| ifstmt {printf("stmt ->  ifstmst\n");reset_temp();$$ = $1;}
+	| whilestmt {printf("stmt ->  whilestmt\n");reset_temp();$$ = NULL;}
+	| forstmt {printf("stmt ->  forstmt\n");reset_temp();$$ = NULL;}
+	| returnstmt {printf("stmt ->  returnstmt\n");reset_temp();$$ = NULL;}
+	| yieldstmt {printf("stmt ->  yieldstmt\n");reset_temp();$$ = NULL;}
 	| block {
 		printf("stmt ->  block\n");
+		reset_temp();
 		$$ = $1; // check
 	}
-	| funcdef {printf("stmt ->  funcdef\n");$$ = NULL;}
+	| funcdef {printf("stmt ->  funcdef\n");reset_temp();$$ = NULL;}
 	| SEMI {printf("stmt ->  SEMI\n");$$ = NULL;}
 	| CONTINUE SEMI {
 		printf("stmt ->  cont SEMI\n");
 		if (!loopcounter) alpha_yyerror("continue can only be used in loop");
-		$$ = (struct Loop*)malloc(sizeof(struct Loop));
+		$$ = (struct Loop*)ir_alloc(sizeof(struct Loop));
 		$$->contlist = Queue_init();
 		int *i = (int *)malloc(sizeof(int));
 		*i = nextQuad();
@@ -192,7 +205,7 @@ stmt: expr SEMI {printf("stmt ->  expr SEMI\n");$$ = NULL;}
 	}| BREAK SEMI {
 		printf("stmt ->  break SEMI\n");
 		if (!loopcounter) alpha_yyerror("break can only be used in loop");
-		$$ = (struct Loop*)malloc(sizeof(struct Loop));
+		$$ = (struct Loop*)ir_alloc(sizeof(struct Loop));
 		$$->breaklist = Queue_init();
 		int *i = (int *)malloc(sizeof(int));
 		*i = nextQuad();
@@ -525,7 +538,7 @@ lvalue:			ID {printf("lvalue -> ID = \n") ; /*scope lookup and decide what type
 				printf("lvalue ->  DCOLON ID\n");
 				dummy = lookupGlobal(alpha_yylval.stringValue,GLBL,alpha_yylineno,1);
 				if(dummy==NULL){
-						char *buffer = (char*)malloc(30+strlen(alpha_yylval.stringValue));
+						char *buffer = (char*)ir_alloc(30+strlen(alpha_yylval.stringValue));
 						sprintf(buffer, "Global variable %s not defined \n",alpha_yylval.stringValue);
                 				alpha_yyerror(buffer);
 				}
@@ -605,7 +618,7 @@ callsuffix:		normcall {printf("callsuffix ->  normcall\n");$$ = $1;}
 			|methodcall {printf("callsuffix ->  methodcall\n");$$ = $1;};
 
 normcall:		ANGL_O elist ANGL_C {printf("normcall ->  ( elist )\n");
-			af_t* norm = (af_t*)malloc(sizeof(af_t));
+			af_t* norm = (af_t*)ir_alloc(sizeof(af_t));
 			norm->elist = $elist;
 			norm->method = 0;
 			norm->name = NULL;
@@ -613,10 +626,10 @@ normcall:		ANGL_O elist ANGL_C {printf("normcall ->  ( elist )\n");
 };
 
 methodcall:		DOTDOT ID ANGL_O elist ANGL_C {printf("methodcall ->  .. ID ( elist )\n");
-		af_t* meth = (af_t*)malloc(sizeof(af_t));
+		af_t* meth = (af_t*)ir_alloc(sizeof(af_t));
 		meth->elist = $elist;
 		meth->method = 1;
-		meth->name = strdup($ID);
+		meth->name = ir_strdup($ID);
 		$$ = meth;
 };
 
@@ -696,7 +709,7 @@ indexedelem:		CURL_O expr{
 					Queue_enqueue(global_indexed_q,curr_indexed);
 
 				}
-				struct Pair* new_pair = (struct Pair*)malloc(sizeof(struct Pair));
+				struct Pair* new_pair = (struct Pair*)ir_alloc(sizeof(struct Pair));
 				new_pair->x = $2;
 				new_pair->y = $5;
 				printf("i(0)\n");	
@@ -722,6 +735,7 @@ funcdef: funcprefix funcargs funcbody{
 	functionLocalOffset = *((unsigned int*)Stack_pop(global_func_stack));
 	$$ = $1->sym;
 	emit(funcend,$1,NULL,NULL,0);
+	exit_temp_frame();
 	// $1->sym->offset = currscopeoffset();
 	// inccurrscopeoffset();
 };
@@ -732,17 +746,18 @@ funcprefix: FUNCTION funcname{
 	func->stype = programfunc_s;
 	Expr* funcpref = lvalue_expr(func);
 	emit(funcstart,funcpref,NULL,NULL,0);
-	unsigned* LocalOffset = (unsigned*)malloc(sizeof(unsigned));
+	unsigned* LocalOffset = (unsigned*)ir_alloc(sizeof(unsigned));
 	*LocalOffset = functionLocalOffset;
 	Stack_append(global_func_stack,LocalOffset);
 	enterscopespace();
 	resetformalargsoffset();
+	enter_temp_frame();
 	$$ = funcpref;
 };
 
 funcname: ID {
 				dummy=NULL;
-				//char *buffer = (char*)malloc(30+strlen(alpha_yylval.stringValue));
+				//char *buffer = (char*)ir_alloc(30+strlen(alpha_yylval.stringValue));
 				int sc = getScope();
 				$1;
 				printf("funcname -> ID:%s \n",alpha_yylval.stringValue);
@@ -774,7 +789,7 @@ funcname: ID {
 				char num[1024];
 				strcpy(funct_name,"$f_anon");
 				sprintf(num,"%d",anon_funct_count++);
-				char* name = strdup(strcat(funct_name,num));
+				char* name = ir_strdup(strcat(funct_name,num));
 				dummy=NULL;
 				dummy = insert(name,USRFUNC,getScope(),alpha_yylineno);
 				$$ = dummy;
@@ -782,12 +797,13 @@ funcname: ID {
 };
 
 funcargs: ANGL_O idlist ANGL_C{
+	$<expression>0->sym->totalformals = currscopeoffset();
 	enterscopespace();
 	resetfunctionlocalsoffset();
 };
 
 funcblockstart: {
-	int *i = (int *)malloc(sizeof(int));
+	int *i = (int *)ir_alloc(sizeof(int));
 	*i = loopcounter;
 	Stack_append(loopcounter_stack, i);
 	loopcounter = 0;
@@ -933,7 +949,7 @@ ifstmt:	ifprefix stmt {
 		patchlabel($elseprefix, nextQuad());
 		if ($4 && $2) {
 			printf("br1 && br2\n");
-			$$ = (struct Loop*)malloc(sizeof(struct Loop));
+			$$ = (struct Loop*)ir_alloc(sizeof(struct Loop));
 			$$->breaklist = Queue_merge($4->breaklist, $2->breaklist);
 			$$->contlist = Queue_merge($4->contlist, $2->contlist);
 		} else if ($4) {
@@ -1019,13 +1035,74 @@ returnstmt:
 		 emit(ret, NULL, NULL, $2, 0);
 	};
 
+// suspends the coroutine running the function, resume() returns the value
+yieldstmt:
+	YIELD SEMI {
+		if(in_function == 0) {
+			alpha_yyerror("yield outside function");
+		}
+		printf("yieldstmt ->  yield ; \n");
+		 emit(yield, NULL, NULL, NULL, 0);
+	}
+	|YIELD expr SEMI {
+		if(in_function == 0) {
+			alpha_yyerror("yield outside function");
+		}
+		printf("yieldstmt ->  yield expr ; \n");
+		 emit(yield, NULL, NULL, $2, 0);
+	};
+
 %%
 
 int alpha_yyerror (const char* yaccProvidedMessage){
   fprintf(stderr,"\033[0;31mError %s, line %u \033[0m\n",yaccProvidedMessage,alpha_yylineno);
+  if (compile_error) longjmp(*compile_error, 1);
   exit(EXIT_FAILURE);
 }
 
+// everything a previous compilation left behind, from the parser down to the target code
+void compiler_reset(void) {
+    global_elist = Queue_init();
+    global_indexed_q = Queue_init();
+    global_func_stack = Stack_init();
+    loopcounter_stack = Stack_init();
+    curr_elist = curr_indexed = NULL;
+    arg_scope = anon_funct_count = isLamda = loopcounter = in_function = 0;
+    func_for_args = NULL;
+    alpha_yylineno = 1;
+    ir_release();
+    reset_quads();
+    reset_tcode();
+    sym_init();
+}
+
+char *alpha_compile(const char *source, unsigned *size) {
+    jmp_buf error;
+    FILE *f = fopen(source, "r");
+    char *image = NULL;
+    if (!f) {
+      fprintf(stderr, "Cannot read file: %s\n", source);
+      return NULL;
+    }
+    compiler_reset();
+    alpha_yyrestart(f);
+    write_binary = 0;
+    compile_error = &error;
+    if (!setjmp(error)) {
+      yyparse();
+      file_name = strdup(source);
+      optimize_quads();
+      generateCode();
+      image = write_image(size);
+    }
+    compile_error = NULL;
+    write_binary = 1;
+    fclose(f);
+    ir_release();
+    return image;
+}
+
+#ifndef ALPHA_LIBRARY
 
 int main (int argc, char** argv) {
 		global_elist = Queue_init();
@@ -1033,23 +1110,50 @@ int main (int argc, char** argv) {
 		global_func_stack = Stack_init();
 		loopcounter_stack = Stack_init();
     sym_init();
-    if (argc > 1) {
-      if (!(alpha_yyin = fopen(argv[1], "r"))) {
-        fprintf(stderr, "Cannot read file: %s\n",argv[1]);
+    char *input = NULL, *cache_arg = NULL, *cache_dir = NULL, cache_key[ABC_CACHE_KEYLEN + 1], cache_flags[64];
+    for (int i = 1; i < argc; i++) {
+      if (!strcmp(argv[i], "-O")) optimize_flag = 1;
+      else if (!strcmp(argv[i], "--abc-v1")) abc_version = 1;
+      else if (!strcmp(argv[i], "--cache") && i + 1 < argc) cache_arg = argv[++i];
+      else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+        if (!profile_load(argv[++i])) {
+          fprintf(stderr, "Cannot read profile: %s\n", argv[i]);
+          return 1;
+        }
+      }
+      else input = argv[i];
+    }
+    if (profile_file && !optimize_flag) fprintf(stderr, "--profile has no effect without -O\n");
+    if (input) {
+      if (!(alpha_yyin = fopen(input, "r"))) {
+        fprintf(stderr, "Cannot read file: %s\n",input);
         yyerror("");
         return 1;
       }
     }
     else alpha_yyin= stdin;
+    // a cached binary of the same source, options and compiler is copied instead of compiling
+    if (input && (cache_dir = abc_cache_dir(cache_arg))) {
+      snprintf(cache_flags, sizeof(cache_flags), ABC_CACHE_FLAGS, optimize_flag, abc_version);
+      if (!abc_cache_key(cache_key, input, "/proc/self/exe", cache_flags, profile_file)) cache_dir = NULL;
+      else if (abc_cache_fetch(cache_dir, cache_key, binary_name(input))) {
+        abc_cache_count(cache_dir, 1);
+        fprintf(stdout, "==> cache hit %s: %s\n", cache_key, binary_name(input));
+        return 0;
+      }
+    }
     yyparse();
-    file_name = strdup(argv[1]);
+    file_name = strdup(input ? input : "stdin");
 		//printGSS();
+    optimize_quads();
     display();
     printQuads();
 	printf("============== Intermediate code Done ==============\n");
 	generateCode();
 		displaySymbolsWithOffset();
 	display_instr();
-	
+	if (cache_dir && abc_cache_store(cache_dir, cache_key, bin_file_name)) abc_cache_count(cache_dir, 0);
+	ir_release();
   return 0;
 }
+#endif
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs every program of tests_4h_5h/check with the ./out and ./avm_exec of the
+# current directory, compiled plain, with -O, and with -O and the profile of
+# the -O run and then of the plain one (a profile of any build of the source
+# applies): the four outputs, without the PC of the VM errors, have to be the
+# same and no line may start with FAIL. Every program has to print "done" at
+# the end, or the text of each of its lines "// expect: {text}", like the
+# errors it stops on, and nothing else with ERROR. Exits 1 when a program
+# fails.
+[ -x ./out ] && [ -x ./avm_exec ] || { echo "check.sh: build ./out and ./avm_exec first"; exit 2; }
+# no dot in the directory, out drops the dots of the source path when it names the binary
+TMP=$(mktemp -d /tmp/alpha_check_XXXXXX)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+# mode source binary output: compiles source with the flags of mode and runs it,
+# the PC of an error differs between the builds
+run() {
+    rm -f "$3"
+    ./out $1 "$2" > "$TMP/compile" 2>&1 && [ -f "$3" ] || { echo "ERROR: cannot compile" > "$4"; return; }
+    timeout 30 ./avm_exec $5 "$3" < /dev/null > "$TMP/raw" 2>&1 || echo "ERROR: avm_exec exited with $?" >> "$TMP/raw"
+    sed 's/ PC [0-9]*$//' "$TMP/raw" > "$4"
+}
+
+for src in tests_4h_5h/check/*.asc; do
+    name=$(basename "$src" .asc)
+    cp "$src" "$TMP/$name.asc"
+    run "" "$TMP/$name.asc" "$TMP/$name.abc" "$TMP/plain" "--profile $TMP/plain.profile"
+    run "-O" "$TMP/$name.asc" "$TMP/$name.abc" "$TMP/opt" "--profile $TMP/profile"
+    run "-O --profile $TMP/profile" "$TMP/$name.asc" "$TMP/$name.abc" "$TMP/pgo"
+    run "-O --profile $TMP/plain.profile" "$TMP/$name.asc" "$TMP/$name.abc" "$TMP/pgo.plain"
+    sed -n 's|^// expect: ||p' "$src" > "$TMP/expect"
+    [ -s "$TMP/expect" ] || echo done > "$TMP/expect"
+    missing=""
+    while read -r line; do
+        grep -qF "$line" "$TMP/plain" || missing="$line"
+    done < "$TMP/expect"
+    problem=""
+    if ! cmp -s "$TMP/plain" "$TMP/opt"; then problem="output differs with -O"
+    elif ! cmp -s "$TMP/plain" "$TMP/pgo"; then problem="output differs with -O --profile"
+    elif ! cmp -s "$TMP/plain" "$TMP/pgo.plain"; then problem="output differs with -O and the profile of the plain build"
+    elif grep -q "^FAIL" "$TMP/plain"; then problem="$(grep "^FAIL" "$TMP/plain")"
+    elif [ -n "$missing" ]; then problem="\"$missing\" not printed"
+    elif grep "ERROR" "$TMP/plain" | grep -qvF -f "$TMP/expect"; then problem="$(grep "ERROR" "$TMP/plain")"
+    fi
+    if [ -n "$problem" ]; then
+        echo "FAIL $name: $problem"
+        diff "$TMP/plain" "$TMP/opt" | head -20
+        diff "$TMP/plain" "$TMP/pgo" | head -20
+        diff "$TMP/plain" "$TMP/pgo.plain" | head -20
+        failed=$((failed + 1))
+    else echo "ok   $name"
+    fi
+done
+[ "$failed" -eq 0 ] || { echo "$failed program(s) failed"; exit 1; }